@@ -27,9 +27,9 @@
 #include <unistd.h>
 #include <errno.h>
 #include <libimobiledevice/libimobiledevice.h>
-#include <openssl/sha.h>
 
 #include "asr.h"
+#include "devwait.h"
 #include "idevicerestore.h"
 #include "common.h"
 
@@ -40,13 +40,23 @@
 #define ASR_FEC_SLICE_STRIDE 40
 #define ASR_PACKETS_PER_FEC 25
 #define ASR_PAYLOAD_PACKET_SIZE 1450
-#define ASR_CHECKSUM_CHUNK_SIZE 131072
+#define ASR_CHECKSUM_CHUNK_SIZE FSCACHE_BLOCK_SIZE
+
+struct asr_probe_args {
+	idevice_t device;
+	idevice_connection_t connection;
+};
+
+static int asr_probe_connect(void* userdata)
+{
+	struct asr_probe_args* args = (struct asr_probe_args*)userdata;
+	return (idevice_connect(args->device, ASR_PORT, &args->connection) == IDEVICE_E_SUCCESS) ? 0 : -1;
+}
 
 int asr_open_with_timeout(idevice_t device, asr_client_t* asr) {
-	int i = 0;
-	int attempts = 10;
+	unsigned int timeout = 20000;
+	struct asr_probe_args args = { device, NULL };
 	idevice_connection_t connection = NULL;
-	idevice_error_t device_error = IDEVICE_E_SUCCESS;
 
 	*asr = NULL;
 
@@ -55,20 +65,12 @@ int asr_open_with_timeout(idevice_t device, asr_client_t* asr) {
 	}
 
 	debug("Connecting to ASR\n");
-	for (i = 1; i <= attempts; i++) {
-		device_error = idevice_connect(device, ASR_PORT, &connection);
-		if (device_error == IDEVICE_E_SUCCESS) {
-			break;
-		}
-
-		if (i >= attempts) {
-			error("ERROR: Unable to connect to ASR client\n");
-			return -1;
-		}
-
-		sleep(2);
-		debug("Retrying connection...\n");
+	/* usbmuxd has no event for a service port becoming available */
+	if (device_wait_probe(NULL, asr_probe_connect, &args, timeout) < 0) {
+		error("ERROR: Unable to connect to ASR client\n");
+		return -1;
 	}
+	connection = args.connection;
 
 	asr_client_t asr_loc = (asr_client_t)malloc(sizeof(struct asr_client));
 	memset(asr_loc, '\0', sizeof(struct asr_client));
@@ -143,7 +145,7 @@ int asr_receive(asr_client_t asr, plist_t* data) {
 	*data = request;
 
 	debug("Received %d bytes:\n", size);
-	if (idevicerestore_debug)
+	if (idevicerestore_debug_enabled())
 		debug_plist(request);
 	free(buffer);
 	return 0;
@@ -318,84 +320,53 @@ int asr_handle_oob_data_request(asr_client_t asr, plist_t packet, FILE* file) {
 }
 
 int asr_send_payload(asr_client_t asr, const char* filesystem) {
-	char data[ASR_PAYLOAD_PACKET_SIZE];
-	FILE* file = NULL;
-	off_t i, length, bytes = 0;
+	fscache_t cache = asr->cache;
+	fscache_block_t block = NULL;
+	uint64_t index, count, length, bytes = 0;
+	uint32_t offset, size;
 	double progress = 0;
 
-	file = fopen(filesystem, "rb");
-	if (file == NULL) {
-		error("ERROR: Unable to open filesystem image %s: %s\n",
-		      filesystem, strerror(errno));
-		return -1;
-	}
-
-	fseeko(file, 0, SEEK_END);
-	length = ftello(file);
-	fseeko(file, 0, SEEK_SET);
-
-	int chunk = 0;
-	int add_checksum = 0;
-
-	SHA_CTX sha1;
-
-	if (asr->checksum_chunks) {
-		SHA1_Init(&sha1);
-	}
-
-	int size = 0;
-	for (i = length; i > 0; i -= size) {
-		size = ASR_PAYLOAD_PACKET_SIZE;
-		if (i < ASR_PAYLOAD_PACKET_SIZE) {
-			size = i;
-		}
-
-		if (add_checksum) {
-			add_checksum = 0;
+	// blocks and their checksums are shared with other streams of the same image
+	if (!cache) {
+		cache = fscache_acquire(filesystem);
+		if (!cache) {
+			return -1;
 		}
+	}
 
-		if (asr->checksum_chunks && ((chunk + size) >= ASR_CHECKSUM_CHUNK_SIZE)) {
-			// reduce packet size to match checksum chunk size
-			size -= ((chunk + size) - ASR_CHECKSUM_CHUNK_SIZE);
-			add_checksum = 1;
-		}
+	length = fscache_get_size(cache);
+	count = (length + FSCACHE_BLOCK_SIZE - 1) / FSCACHE_BLOCK_SIZE;
 
-		if (fread(data, 1, size, file) != (unsigned int) size) {
+	for (index = 0; index < count; index++) {
+		if (fscache_get_block(cache, index, &block) < 0) {
 			error("Error reading filesystem\n");
-			fclose(file);
-			return -1;
+			goto error_out;
 		}
 
-		if (asr_send_buffer(asr, data, size) < 0) {
-			error("ERROR: Unable to send filesystem payload\n");
-			fclose(file);
-			return -1;
+		for (offset = 0; offset < block->size; offset += size) {
+			size = block->size - offset;
+			if (size > ASR_PAYLOAD_PACKET_SIZE) {
+				size = ASR_PAYLOAD_PACKET_SIZE;
+			}
+			if (asr_send_buffer(asr, (const char*)block->data + offset, size) < 0) {
+				error("ERROR: Unable to send filesystem payload\n");
+				goto error_out;
+			}
 		}
 
+		// every checksum chunk is terminated with the sha1 of its data
 		if (asr->checksum_chunks) {
-			SHA1_Update(&sha1, data, size);
-			chunk += size;
-
-			if (add_checksum) {
-				// get sha1 of last chunk
-				SHA1_Final((unsigned char*)data, &sha1);
-
-				// send checksum
-				if (asr_send_buffer(asr, data, 20) < 0) {
-					error("ERROR: Unable to send chunk checksum\n");
-					fclose(file);
-					return -1;
-				}
-
-				// reset SHA1 context
-				SHA1_Init(&sha1);
-
-				// reset chunk byte counter
-				chunk = 0;
+			if (asr_send_buffer(asr, (const char*)fscache_block_sha1(cache, block), 20) < 0) {
+				error("ERROR: Unable to send chunk checksum\n");
+				goto error_out;
 			}
 		}
 
-		bytes += size;
+		bytes += block->size;
+		fscache_put_block(cache, block);
+		block = NULL;
+
+		fscache_drop_behind(cache, bytes);
 		progress = ((double)bytes / (double)length);
 		if (asr->progress_cb && ((int)(progress*100) > asr->lastprogress)) {
 			asr->progress_cb(progress, asr->progress_cb_data);
@@ -403,19 +374,15 @@ int asr_send_payload(asr_client_t asr, const char* filesystem) {
 		}
 	}
 
-	// if last chunk wasn't terminated with a checksum we do it here
-	if (asr->checksum_chunks && !add_checksum) {
-		// get sha1 of last chunk
-		SHA1_Final((unsigned char*)data, &sha1);
-
-		// send checksum
-		if (asr_send_buffer(asr, data, 20) < 0) {
-			error("ERROR: Unable to send chunk checksum\n");
-			fclose(file);
-			return -1;
-		}
+	if (cache != asr->cache) {
+		fscache_release(cache);
 	}
-
-	fclose(file);
 	return 0;
+
+error_out:
+	fscache_put_block(cache, block);
+	if (cache != asr->cache) {
+		fscache_release(cache);
+	}
+	return -1;
 }
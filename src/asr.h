@@ -30,6 +30,8 @@ extern "C" {
 
 #include <libimobiledevice/libimobiledevice.h>
 
+#include "fscache.h"
+
 typedef void (*asr_progress_cb_t)(double, void*);
 
 struct asr_client {
@@ -38,6 +40,7 @@ struct asr_client {
 	int lastprogress;
 	asr_progress_cb_t progress_cb;
 	void* progress_cb_data;
+	fscache_t cache;
 };
 typedef struct asr_client *asr_client_t;
 
@@ -33,6 +33,8 @@
 #include <time.h>
 
 #include "common.h"
+#include "thread.h"
+#include "logbuf.h"
 
 #define MAX_PRINT_LEN 64*1024
 
@@ -45,113 +47,194 @@ struct idevicerestore_mode_t idevicerestore_modes[] = {
 	{ -1,  NULL      }
 };
 
-int idevicerestore_debug = 0;
+/* process wide defaults, also used by threads not working for a client */
+static struct idevicerestore_log_t log_defaults;
 
-#define idevicerestore_err_buff_size 256
-static char idevicerestore_err_buff[idevicerestore_err_buff_size] = {0, };
+/* protects the err_buff of every log, any thread may fail at any time */
+static mutex_t log_error_mutex;
+static thread_once_t log_error_once = THREAD_ONCE_INIT;
 
-static FILE* info_stream = NULL;
-static FILE* error_stream = NULL;
-static FILE* debug_stream = NULL;
+static void log_error_init(void)
+{
+	mutex_init(&log_error_mutex);
+}
 
-static int info_disabled = 0;
-static int error_disabled = 0;
-static int debug_disabled = 0;
+/* the client the calling thread works for, threads started by it inherit it */
+struct idevicerestore_client_t* idevicerestore_get_current_client(void)
+{
+	return (struct idevicerestore_client_t*)thread_get_context();
+}
 
-static int info_index=0;
+void idevicerestore_set_current_client(struct idevicerestore_client_t* client)
+{
+	thread_set_context(client);
+}
+
+int idevicerestore_debug_enabled(void)
+{
+	struct idevicerestore_client_t* client = idevicerestore_get_current_client();
+	return (client && (client->flags & FLAG_DEBUG)) ? 1 : 0;
+}
 
+static struct idevicerestore_log_t* log_get_current(void)
+{
+	struct idevicerestore_client_t* client = idevicerestore_get_current_client();
+	return (client) ? &client->log : &log_defaults;
+}
+
+static FILE* log_get_stream(FILE* stream, int disabled, FILE* default_stream, int default_disabled, FILE* fallback)
+{
+	if (stream) {
+		return stream;
+	}
+	if (disabled || default_disabled) {
+		return NULL;
+	}
+	return (default_stream) ? default_stream : fallback;
+}
+
+static FILE* log_get_info_stream(struct idevicerestore_log_t* log)
+{
+	return log_get_stream(log->info_stream, log->info_disabled, log_defaults.info_stream, log_defaults.info_disabled, stdout);
+}
+
+/* lines are queued for the background writer in logbuf.c, formatting is
+ * skipped entirely when nothing would be printed */
 void info(const char* format, ...)
 {
-	if (info_disabled) return;
+	struct idevicerestore_log_t* log = log_get_current();
+	FILE* stream = log_get_info_stream(log);
+	if (!stream) return;
 
-	info_index++;
+	int index = __atomic_add_fetch(&log->info_index, 1, __ATOMIC_RELAXED);
 
-	char indexstr[1024];
+	char prefix[32];
 
 	char *tag="---->";
 
-	sprintf(indexstr,"%d%s",info_index,tag);
-
-	strcat(indexstr,format);
+	snprintf(prefix, sizeof(prefix), "%d%s", index, tag);
 
 	va_list vargs;
 	va_start(vargs, format);
-	vfprintf((info_stream) ? info_stream : stdout, indexstr, vargs);
+	logbuf_vprintf(stream, prefix, format, vargs);
 	va_end(vargs);
-
-	fflush(stdout);
 }
 
 void error(const char* format, ...)
 {
+	struct idevicerestore_log_t* log = log_get_current();
+	FILE* stream = log_get_stream(log->error_stream, log->error_disabled, log_defaults.error_stream, log_defaults.error_disabled, stderr);
+	char line[IDEVICERESTORE_ERR_BUFF_SIZE];
 	va_list vargs, vargs2;
 	va_start(vargs, format);
 	va_copy(vargs2, vargs);
-	vsnprintf(idevicerestore_err_buff, idevicerestore_err_buff_size, format, vargs);
+	int len = vsnprintf(line, sizeof(line), format, vargs);
 	va_end(vargs);
-	if (!error_disabled) {
-		vfprintf((error_stream) ? error_stream : stderr, format, vargs2);
+	thread_once(&log_error_once, log_error_init);
+	mutex_lock(&log_error_mutex);
+	memcpy(log->err_buff, line, sizeof(log->err_buff));
+	if (log != &log_defaults) {
+		/* keep idevicerestore_get_error() working for single restores */
+		memcpy(log_defaults.err_buff, line, sizeof(log_defaults.err_buff));
+	}
+	mutex_unlock(&log_error_mutex);
+	if (stream) {
+		if (len >= 0 && len < (int)sizeof(line)) {
+			logbuf_write(stream, line, len);
+		} else {
+			logbuf_vprintf(stream, NULL, format, vargs2);
+		}
 	}
 	va_end(vargs2);
-
-	fflush(stdout);
 }
 
 void debug(const char* format, ...)
 {
-	if (debug_disabled) return;
-	if (!idevicerestore_debug) {
+	if (!idevicerestore_debug_enabled()) {
 		return;
 	}
+	struct idevicerestore_log_t* log = log_get_current();
+	FILE* stream = log_get_stream(log->debug_stream, log->debug_disabled, log_defaults.debug_stream, log_defaults.debug_disabled, stderr);
+	if (!stream) return;
 	va_list vargs;
 	va_start(vargs, format);
-	vfprintf((debug_stream) ? debug_stream : stderr, format, vargs);
+	logbuf_vprintf(stream, NULL, format, vargs);
 	va_end(vargs);
-	
-	fflush(stdout);
 }
 
-void idevicerestore_set_info_stream(FILE* strm)
+/* everything logged so far is printed when this returns */
+void idevicerestore_flush_log(void)
+{
+	logbuf_flush();
+}
+
+static void log_set_stream(FILE** stream, int* disabled, FILE* strm)
 {
 	if (strm) {
-		info_disabled = 0;
-		info_stream = strm;
+		*disabled = 0;
+		*stream = strm;
 	} else {
-		info_disabled = 1;
+		*disabled = 1;
 	}
 }
 
+void idevicerestore_set_info_stream(FILE* strm)
+{
+	log_set_stream(&log_defaults.info_stream, &log_defaults.info_disabled, strm);
+}
+
 void idevicerestore_set_error_stream(FILE* strm)
 {
-	if (strm) {
-		error_disabled = 0;
-		error_stream = strm;
-	} else {
-		error_disabled = 1;
-	}
+	log_set_stream(&log_defaults.error_stream, &log_defaults.error_disabled, strm);
 }
 
 void idevicerestore_set_debug_stream(FILE* strm)
 {
-	if (strm) {
-		debug_disabled = 0;
-		debug_stream = strm;
-	} else {
-		debug_disabled = 1;
-	}
+	log_set_stream(&log_defaults.debug_stream, &log_defaults.debug_disabled, strm);
 }
 
-const char* idevicerestore_get_error(void)
+void idevicerestore_client_set_info_stream(struct idevicerestore_client_t* client, FILE* strm)
 {
-	if (idevicerestore_err_buff[0] == 0) {
-		return NULL;
-	} else {
+	log_set_stream(&client->log.info_stream, &client->log.info_disabled, strm);
+}
+
+void idevicerestore_client_set_error_stream(struct idevicerestore_client_t* client, FILE* strm)
+{
+	log_set_stream(&client->log.error_stream, &client->log.error_disabled, strm);
+}
+
+void idevicerestore_client_set_debug_stream(struct idevicerestore_client_t* client, FILE* strm)
+{
+	log_set_stream(&client->log.debug_stream, &client->log.debug_disabled, strm);
+}
+
+static const char* log_get_error(char* err_buff)
+{
+	const char* res = NULL;
+
+	thread_once(&log_error_once, log_error_init);
+	mutex_lock(&log_error_mutex);
+	if (err_buff[0] != 0) {
 		char* p = NULL;
-		while ((strlen(idevicerestore_err_buff) > 0) && (p = strrchr(idevicerestore_err_buff, '\n'))) {
+		while ((strlen(err_buff) > 0) && (p = strrchr(err_buff, '\n'))) {
 			p[0] = '\0';
 		}
-		return (const char*)idevicerestore_err_buff;
+		res = (const char*)err_buff;
 	}
+	mutex_unlock(&log_error_mutex);
+
+	return res;
+}
+
+/* last error of any restore in this process */
+const char* idevicerestore_get_error(void)
+{
+	return log_get_error(log_defaults.err_buff);
+}
+
+const char* idevicerestore_client_get_error(struct idevicerestore_client_t* client)
+{
+	return log_get_error(client->log.err_buff);
 }
 
 int write_file(const char* filename, const void* data, size_t size) {
@@ -219,6 +302,10 @@ int read_file(const char* filename, void** data, size_t* size) {
 void debug_plist(plist_t plist) {
 	uint32_t size = 0;
 	char* data = NULL;
+	/* serializing is the expensive part, only do it for output someone sees */
+	if (!idevicerestore_debug_enabled() || !log_get_info_stream(log_get_current())) {
+		return;
+	}
 	plist_to_xml(plist, &data, &size);
 	if (size <= MAX_PRINT_LEN)
 		info("%s:printing %i bytes plist:\n%s", __FILE__, size, data);
@@ -229,18 +316,18 @@ void debug_plist(plist_t plist) {
 
 void print_progress_bar(double progress) {
 #ifndef WIN32
-	if (info_disabled) return;
+	FILE* stream = log_get_info_stream(log_get_current());
+	if (!stream) return;
 	int i = 0;
+	char bar[51];
 	if(progress < 0) return;
 	if(progress > 100) progress = 100;
-	info("\r[");
 	for(i = 0; i < 50; i++) {
-		if(i < progress / 2) info("=");
-		else info(" ");
+		if(i < progress / 2) bar[i] = '=';
+		else bar[i] = ' ';
 	}
-	info("] %5.1f%%", progress);
-	if(progress == 100) info("\n");
-	fflush((info_stream) ? info_stream : stdout);
+	bar[50] = '\0';
+	info("\r[%s] %5.1f%%%s", bar, progress, (progress == 100) ? "\n" : "");
 #endif
 }
 
@@ -296,6 +383,9 @@ int mkdir_with_parents(const char *dir, int mode)
 
 void idevicerestore_progress(struct idevicerestore_client_t* client, int step, double progress)
 {
+	if (client) {
+		client->step = step;
+	}
 	if(client && client->progress_cb) {
 		client->progress_cb(step, progress, client->progress_cb_data);
 	} else {
@@ -59,6 +59,8 @@ struct dfu_client_t;
 struct normal_client_t;
 struct restore_client_t;
 struct recovery_client_t;
+struct restore_trace;
+struct phase_log;
 
 struct idevicerestore_mode_t {
 	int index;
@@ -75,6 +77,20 @@ struct idevicerestore_entry_t {
 	struct idevicerestore_entry* prev;
 };
 
+#define IDEVICERESTORE_ERR_BUFF_SIZE 256
+
+/* logging state of one restore, unset streams fall back to the process wide ones */
+struct idevicerestore_log_t {
+	FILE* info_stream;
+	FILE* error_stream;
+	FILE* debug_stream;
+	int info_disabled;
+	int error_disabled;
+	int debug_disabled;
+	int info_index;
+	char err_buff[IDEVICERESTORE_ERR_BUFF_SIZE];
+};
+
 struct idevicerestore_client_t {
 	int flags;
 	plist_t tss;
@@ -93,6 +109,10 @@ struct idevicerestore_client_t {
 	struct normal_client_t* normal;
 	struct restore_client_t* restore;
 	struct recovery_client_t* recovery;
+	struct personalize_pool* personalize;
+	struct filesystem_extraction* fs_extraction;
+	struct tss_future* tss_future;    /* initial TSS request still on its way, see tss_wait() */
+	struct tss_future* bbtss_prefetch;
 	irecv_device_t device;
 	struct idevicerestore_entry_t** entries;
 	struct idevicerestore_mode_t* mode;
@@ -103,11 +123,20 @@ struct idevicerestore_client_t {
 	char* cache_dir;
 	idevicerestore_progress_cb_t progress_cb;
 	void* progress_cb_data;
+	struct idevicerestore_log_t log;
+	int usb_bus;                     /* bus the device was last found on, 0 if unknown */
+	char usb_port_path[64];          /* its port path on that bus */
+	struct usbtopo_hub* usb_bulk_hub; /* hub a bulk transfer slot is held on, see usbtopo.h */
+	struct restore_trace* trace; /* restored session recording or replay, see trace.h */
+	struct phase_log* phases;    /* timing of the restore phases, see phase.h */
+	int step;                    /* last step reported to idevicerestore_progress() */
 };
 
 extern struct idevicerestore_mode_t idevicerestore_modes[];
 
-extern int idevicerestore_debug;
+struct idevicerestore_client_t* idevicerestore_get_current_client(void);
+void idevicerestore_set_current_client(struct idevicerestore_client_t* client);
+int idevicerestore_debug_enabled(void);
 
 void info(const char* format, ...);
 void error(const char* format, ...);
@@ -0,0 +1,244 @@
+/*
+ * devwait.c
+ * Waiting for device state changes with a deadline
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdlib.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+
+#include "devwait.h"
+
+/* back-off between two probes, an event cuts it short */
+#define DEVICE_PROBE_INTERVAL_MIN 50
+#define DEVICE_PROBE_INTERVAL_MAX 500
+
+uint64_t device_wait_now(void)
+{
+#ifdef WIN32
+	return (uint64_t)GetTickCount64();
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
+#endif
+}
+
+void device_wait_init(device_wait_t* wait)
+{
+	mutex_init(&wait->mutex);
+	cond_init(&wait->cond);
+	wait->signaled = 0;
+}
+
+void device_wait_destroy(device_wait_t* wait)
+{
+	cond_destroy(&wait->cond);
+	mutex_destroy(&wait->mutex);
+}
+
+void device_wait_signal(device_wait_t* wait)
+{
+	mutex_lock(&wait->mutex);
+	wait->signaled = 1;
+	cond_broadcast(&wait->cond);
+	mutex_unlock(&wait->mutex);
+}
+
+/* returns 0 when signaled before timeout_ms passed, -1 otherwise */
+int device_wait_for(device_wait_t* wait, unsigned int timeout_ms)
+{
+	uint64_t deadline = device_wait_now() + timeout_ms;
+	int res = -1;
+
+	mutex_lock(&wait->mutex);
+	while (!wait->signaled) {
+		uint64_t now = device_wait_now();
+		if (now >= deadline) {
+			break;
+		}
+		cond_wait_timeout(&wait->cond, &wait->mutex, (unsigned int)(deadline - now));
+	}
+	if (wait->signaled) {
+		wait->signaled = 0;
+		res = 0;
+	}
+	mutex_unlock(&wait->mutex);
+
+	return res;
+}
+
+/* calls probe until it succeeds or timeout_ms passed. wait may be NULL when
+ * no event source exists for the state in question. */
+int device_wait_probe(device_wait_t* wait, device_probe_cb_t probe, void* userdata, unsigned int timeout_ms)
+{
+	device_wait_t local;
+	uint64_t deadline = device_wait_now() + timeout_ms;
+	unsigned int interval = DEVICE_PROBE_INTERVAL_MIN;
+	int res = -1;
+
+	if (!wait) {
+		device_wait_init(&local);
+		wait = &local;
+	}
+
+	while (1) {
+		if (probe(userdata) == 0) {
+			res = 0;
+			break;
+		}
+		uint64_t now = device_wait_now();
+		if (now >= deadline) {
+			break;
+		}
+		if (interval > deadline - now) {
+			interval = (unsigned int)(deadline - now);
+		}
+		if (device_wait_for(wait, interval) < 0 && interval < DEVICE_PROBE_INTERVAL_MAX) {
+			interval *= 2;
+			if (interval > DEVICE_PROBE_INTERVAL_MAX) {
+				interval = DEVICE_PROBE_INTERVAL_MAX;
+			}
+		}
+	}
+
+	if (wait == &local) {
+		device_wait_destroy(&local);
+	}
+
+	return res;
+}
+
+/* libimobiledevice only takes one event callback per process, concurrent
+ * restores share it through this list */
+struct device_event_subscriber {
+	idevice_event_cb_t callback;
+	void* userdata;
+	void* context;	/* thread context of the subscriber, see thread_set_context() */
+	struct device_event_subscriber* next;
+};
+
+static struct device_event_subscriber* device_event_subscribers = NULL;
+static mutex_t device_event_mutex;     /* protects the list, held while dispatching */
+static mutex_t device_event_sub_mutex; /* serializes (un)subscribing with libimobiledevice */
+static thread_once_t device_event_once = THREAD_ONCE_INIT;
+
+static void device_event_init(void)
+{
+	mutex_init(&device_event_mutex);
+	mutex_init(&device_event_sub_mutex);
+}
+
+static void device_event_dispatch(const idevice_event_t* event, void* userdata)
+{
+	struct device_event_subscriber* sub;
+
+	mutex_lock(&device_event_mutex);
+	for (sub = device_event_subscribers; sub; sub = sub->next) {
+		thread_set_context(sub->context);
+		sub->callback(event, sub->userdata);
+	}
+	thread_set_context(NULL);
+	mutex_unlock(&device_event_mutex);
+}
+
+/* usbmuxd announces the devices already attached only to the first
+ * subscription of the process, later subscribers get them from here */
+static void device_event_replay_attached(struct device_event_subscriber* sub)
+{
+	char** devices = NULL;
+	int count = 0;
+	int i;
+
+	if (idevice_get_device_list(&devices, &count) != IDEVICE_E_SUCCESS) {
+		return;
+	}
+	mutex_lock(&device_event_mutex);
+	for (i = 0; i < count; i++) {
+		idevice_event_t event;
+		event.event = IDEVICE_DEVICE_ADD;
+		event.udid = devices[i];
+		event.conn_type = 1;
+		sub->callback(&event, sub->userdata);
+	}
+	mutex_unlock(&device_event_mutex);
+	idevice_device_list_free(devices);
+}
+
+int device_event_subscribe(idevice_event_cb_t callback, void* userdata)
+{
+	int res = 0;
+
+	thread_once(&device_event_once, device_event_init);
+
+	struct device_event_subscriber* sub = (struct device_event_subscriber*)malloc(sizeof(struct device_event_subscriber));
+	if (!sub) {
+		return -1;
+	}
+	sub->callback = callback;
+	sub->userdata = userdata;
+	sub->context = thread_get_context();
+
+	mutex_lock(&device_event_sub_mutex);
+	mutex_lock(&device_event_mutex);
+	int first = (device_event_subscribers == NULL);
+	sub->next = device_event_subscribers;
+	device_event_subscribers = sub;
+	mutex_unlock(&device_event_mutex);
+	if (first && idevice_event_subscribe(device_event_dispatch, NULL) != IDEVICE_E_SUCCESS) {
+		mutex_lock(&device_event_mutex);
+		device_event_subscribers = NULL;
+		mutex_unlock(&device_event_mutex);
+		free(sub);
+		res = -1;
+	} else if (!first) {
+		device_event_replay_attached(sub);
+	}
+	mutex_unlock(&device_event_sub_mutex);
+
+	return res;
+}
+
+/* the callback is not running anymore once this returns */
+void device_event_unsubscribe(idevice_event_cb_t callback, void* userdata)
+{
+	struct device_event_subscriber** prev;
+
+	thread_once(&device_event_once, device_event_init);
+
+	mutex_lock(&device_event_sub_mutex);
+	mutex_lock(&device_event_mutex);
+	for (prev = &device_event_subscribers; *prev; prev = &(*prev)->next) {
+		if ((*prev)->callback == callback && (*prev)->userdata == userdata) {
+			struct device_event_subscriber* sub = *prev;
+			*prev = sub->next;
+			free(sub);
+			break;
+		}
+	}
+	int last = (device_event_subscribers == NULL);
+	mutex_unlock(&device_event_mutex);
+	if (last) {
+		idevice_event_unsubscribe();
+	}
+	mutex_unlock(&device_event_sub_mutex);
+}
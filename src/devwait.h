@@ -0,0 +1,57 @@
+/*
+ * devwait.h
+ * Waiting for device state changes with a deadline
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_DEVWAIT_H
+#define IDEVICERESTORE_DEVWAIT_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <libimobiledevice/libimobiledevice.h>
+
+#include "thread.h"
+
+/* signaled from device event callbacks, waited on by the restore thread */
+typedef struct {
+	mutex_t mutex;
+	cond_t cond;
+	int signaled;
+} device_wait_t;
+
+/* returns 0 once the device is in the wanted state */
+typedef int (*device_probe_cb_t)(void* userdata);
+
+uint64_t device_wait_now(void);
+
+void device_wait_init(device_wait_t* wait);
+void device_wait_destroy(device_wait_t* wait);
+void device_wait_signal(device_wait_t* wait);
+int device_wait_for(device_wait_t* wait, unsigned int timeout_ms);
+int device_wait_probe(device_wait_t* wait, device_probe_cb_t probe, void* userdata, unsigned int timeout_ms);
+
+int device_event_subscribe(idevice_event_cb_t callback, void* userdata);
+void device_event_unsubscribe(idevice_event_cb_t callback, void* userdata);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
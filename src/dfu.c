@@ -30,6 +30,8 @@
 #include "dfu.h"
 #include "tss.h"
 #include "recovery.h"
+#include "personalize.h"
+#include "devwait.h"
 #include "idevicerestore.h"
 #include "common.h"
 
@@ -40,9 +42,20 @@ int dfu_progress_callback(irecv_client_t client, const irecv_event_t* event) {
 	return 0;
 }
 
+struct dfu_probe_args {
+	uint64_t ecid;
+	irecv_client_t client;
+};
+
+static int dfu_probe_open(void* userdata)
+{
+	struct dfu_probe_args* args = (struct dfu_probe_args*)userdata;
+	return (irecv_open_with_ecid(&args->client, args->ecid) == IRECV_E_SUCCESS) ? 0 : -1;
+}
+
 int dfu_client_new(struct idevicerestore_client_t* client) {
-	int i = 0;
-	int attempts = 10;
+	unsigned int timeout = 10000;
+	struct dfu_probe_args args = { client->ecid, NULL };
 	irecv_client_t dfu = NULL;
 
 	if (client->dfu == NULL) {
@@ -54,19 +67,11 @@ int dfu_client_new(struct idevicerestore_client_t* client) {
 		}
 	}
 
-	for (i = 1; i <= attempts; i++) {
-		if (irecv_open_with_ecid(&dfu, client->ecid) == IRECV_E_SUCCESS) {
-			break;
-		}
-
-		if (i >= attempts) {
-			error("ERROR: Unable to connect to device in DFU mode\n");
-			return -1;
-		}
-
-		sleep(1);
-		debug("Retrying connection...\n");
+	if (device_wait_probe(NULL, dfu_probe_open, &args, timeout) < 0) {
+		error("ERROR: Unable to connect to device in DFU mode\n");
+		return -1;
 	}
+	dfu = args.client;
 
 	irecv_event_subscribe(dfu, IRECV_PROGRESS, &dfu_progress_callback, NULL);
 	client->dfu->client = dfu;
@@ -159,28 +164,16 @@ int dfu_send_component(struct idevicerestore_client_t* client, plist_t build_ide
 		}
 	}
 
-	unsigned char* component_data = NULL;
-	unsigned int component_size = 0;
+	unsigned char* data = NULL;
+	uint32_t size = 0;
 
-	if (extract_component(client->ipsw, path, &component_data, &component_size) < 0) {
-		error("ERROR: Unable to extract component: %s\n", component);
+	if (get_personalized_component(client, component, path, &data, &size) < 0) {
 		free(path);
 		return -1;
 	}
 	free(path);
 	path = NULL;
 
-	unsigned char* data = NULL;
-	uint32_t size = 0;
-
-	if (personalize_component(component, component_data, component_size, client->tss, &data, &size) < 0) {
-		error("ERROR: Unable to get personalized component: %s\n", component);
-		free(component_data);
-		return -1;
-	}
-	free(component_data);
-	component_data = NULL;
-
 	if (!client->image4supported && client->build_major > 8 && !(client->flags & FLAG_CUSTOM) && !strcmp(component, "iBEC")) {
 		unsigned char* ticket = NULL;
 		unsigned int tsize = 0;
@@ -340,8 +333,14 @@ int dfu_enter_recovery(struct idevicerestore_client_t* client, plist_t build_ide
 	if (client->build_major > 8) {
 		/* reconnect */
 		dfu_client_free(client);
-		sleep(2);
-		dfu_client_new(client);
+		if (recovery_wait_for_disconnect(client, 2000) < 0) {
+			error("ERROR: Device did not reboot after receiving iBSS\n");
+			return -1;
+		}
+		if (dfu_client_new(client) < 0) {
+			error("ERROR: Unable to reconnect to DFU device\n");
+			return -1;
+		}
 
 		/* get nonce */
 		unsigned char* nonce = NULL;
@@ -382,6 +381,8 @@ int dfu_enter_recovery(struct idevicerestore_client_t* client, plist_t build_ide
 				return -1;
 			}
 			fixup_tss(client->tss);
+			personalize_pool_free(client->personalize);
+			client->personalize = personalize_pool_new(client->ipsw, build_identity, client->tss);
 		}
 
 		if (irecv_usb_set_configuration(client->dfu->client, 1) < 0) {
@@ -399,7 +400,11 @@ int dfu_enter_recovery(struct idevicerestore_client_t* client, plist_t build_ide
 
 	dfu_client_free(client);
 
-	sleep(7);
+	/* the device drops off the bus when it starts the iBEC */
+	if (recovery_wait_for_disconnect(client, 7000) < 0) {
+		error("ERROR: Device did not reboot into iBEC\n");
+		return -1;
+	}
 
 	// Reconnect to device, but this time make sure we're not still in DFU mode
 	if (recovery_client_new(client) < 0) {
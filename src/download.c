@@ -26,6 +26,69 @@
 
 #include "download.h"
 #include "common.h"
+#include "thread.h"
+
+/* connections, DNS lookups and TLS sessions shared by all transfers once
+ * download_share_init() was called */
+static CURLSH* download_share = NULL;
+static mutex_t download_share_mutex[CURL_LOCK_DATA_LAST];
+
+static void download_share_lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userptr)
+{
+	mutex_lock(&download_share_mutex[data]);
+}
+
+static void download_share_unlock(CURL* handle, curl_lock_data data, void* userptr)
+{
+	mutex_unlock(&download_share_mutex[data]);
+}
+
+int download_share_init(void)
+{
+	int i;
+
+	if (download_share) {
+		return 0;
+	}
+	download_share = curl_share_init();
+	if (!download_share) {
+		error("ERROR: could not initialize CURL share\n");
+		return -1;
+	}
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		mutex_init(&download_share_mutex[i]);
+	}
+	curl_share_setopt(download_share, CURLSHOPT_LOCKFUNC, download_share_lock);
+	curl_share_setopt(download_share, CURLSHOPT_UNLOCKFUNC, download_share_unlock);
+	curl_share_setopt(download_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+	curl_share_setopt(download_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+#if LIBCURL_VERSION_NUM >= 0x073900
+	curl_share_setopt(download_share, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+#endif
+
+	return 0;
+}
+
+void download_share_cleanup(void)
+{
+	int i;
+
+	if (!download_share) {
+		return;
+	}
+	curl_share_cleanup(download_share);
+	download_share = NULL;
+	for (i = 0; i < CURL_LOCK_DATA_LAST; i++) {
+		mutex_destroy(&download_share_mutex[i]);
+	}
+}
+
+void download_share_handle(CURL* handle)
+{
+	if (download_share) {
+		curl_easy_setopt(handle, CURLOPT_SHARE, download_share);
+	}
+}
 
 typedef struct {
 	int length;
@@ -57,7 +120,7 @@ int download_to_buffer(const char* url, char** buf, uint32_t* length)
 	response.content = malloc(1);
 	response.content[0] = '\0';
 
-	if (idevicerestore_debug)
+	if (idevicerestore_debug_enabled())
 		curl_easy_setopt(handle, CURLOPT_VERBOSE, 1);
 
 	/* disable SSL verification to allow download from untrusted https locations */
@@ -68,6 +131,7 @@ int download_to_buffer(const char* url, char** buf, uint32_t* length)
 	curl_easy_setopt(handle, CURLOPT_USERAGENT, USER_AGENT_STRING);
 	curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1);
 	curl_easy_setopt(handle, CURLOPT_URL, url);
+	download_share_handle(handle);
 
 	curl_easy_perform(handle);
 	curl_easy_cleanup(handle);
@@ -82,16 +146,15 @@ int download_to_buffer(const char* url, char** buf, uint32_t* length)
 	return res;
 }
 
-static int lastprogress = 0;
-
 static int download_progress(void *clientp, double dltotal, double dlnow, double ultotal, double ulnow)
 {
+	int* lastprogress = (int*)clientp;
 	double p = (dlnow / dltotal) * 100;
 
 	if (p < 100.0f) {
-		if ((int)p > lastprogress) {
+		if ((int)p > *lastprogress) {
 			info("downloading: %d%%\n", (int)p);
-			lastprogress = (int)p;
+			*lastprogress = (int)p;
 		}
 	}
 
@@ -113,9 +176,9 @@ int download_to_file(const char* url, const char* filename, int enable_progress)
 		return -1;
 	}
 
-	lastprogress = 0;
+	int lastprogress = 0;
 
-	if (idevicerestore_debug)
+	if (idevicerestore_debug_enabled())
 		curl_easy_setopt(handle, CURLOPT_VERBOSE, 1);
 
 	/* disable SSL verification to allow download from untrusted https locations */
@@ -124,13 +187,16 @@ int download_to_file(const char* url, const char* filename, int enable_progress)
 	curl_easy_setopt(handle, CURLOPT_WRITEFUNCTION, NULL);
 	curl_easy_setopt(handle, CURLOPT_WRITEDATA, f);
 
-	if (enable_progress > 0)
+	if (enable_progress > 0) {
 		curl_easy_setopt(handle, CURLOPT_PROGRESSFUNCTION, (curl_progress_callback)&download_progress);
+		curl_easy_setopt(handle, CURLOPT_PROGRESSDATA, &lastprogress);
+	}
 
 	curl_easy_setopt(handle, CURLOPT_NOPROGRESS, enable_progress > 0 ? 0: 1);
 	curl_easy_setopt(handle, CURLOPT_USERAGENT, USER_AGENT_STRING);
 	curl_easy_setopt(handle, CURLOPT_FOLLOWLOCATION, 1);
 	curl_easy_setopt(handle, CURLOPT_URL, url);
+	download_share_handle(handle);
 
 	curl_easy_perform(handle);
 	curl_easy_cleanup(handle);
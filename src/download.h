@@ -27,6 +27,11 @@ extern "C" {
 #endif
 
 #include <stdint.h>
+#include <curl/curl.h>
+
+int download_share_init(void);
+void download_share_cleanup(void);
+void download_share_handle(CURL* handle);
 
 int download_to_buffer(const char* url, char** buf, uint32_t* length);
 int download_to_file(const char* url, const char* filename, int enable_progress);
@@ -44,9 +44,23 @@
 #define FDR_PROXY_MSG 0x105
 #define FDR_PLIST_MSG 0xbbaa
 
-static uint64_t conn_port;
-static int ctrlprotoversion = 2;
-static int serial;
+/* proxied payloads are forwarded in chunks of up to this size */
+#define FDR_PROXY_BUFFER_SIZE 0x40000
+/* only bound how long it takes to notice the other direction ended, data
+ * is forwarded as soon as it arrives. the server side is woken up by
+ * shutting the socket down, the device side can't be and polls more often
+ * so closing the proxy doesn't stall the next FDR message */
+#define FDR_PROXY_POLL_TIMEOUT 500
+#define FDR_PROXY_DEVICE_POLL_TIMEOUT 20
+
+/* one proxied connection, relayed by a thread per direction */
+struct fdr_proxy {
+	fdr_client_t fdr;
+	int sockfd;
+	int stopping;
+	int res;
+	mutex_t mutex;
+};
 
 static int fdr_receive_plist(fdr_client_t fdr, plist_t* data);
 static int fdr_send_plist(fdr_client_t fdr, plist_t data);
@@ -56,16 +70,22 @@ static int fdr_handle_sync_cmd(fdr_client_t fdr);
 static int fdr_handle_plist_cmd(fdr_client_t fdr);
 static int fdr_handle_proxy_cmd(fdr_client_t fdr);
 
-int fdr_connect(idevice_t device, fdr_type_t type, fdr_client_t* fdr)
+/* FDR_CONN connections use the port and protocol announced on ctrl */
+static int fdr_connect_internal(idevice_t device, fdr_type_t type, fdr_client_t ctrl, fdr_client_t* fdr)
 {
 	int res = -1, i = 0;
 	int attempts = 10;
 	idevice_connection_t connection = NULL;
 	idevice_error_t device_error = IDEVICE_E_SUCCESS;
-	uint16_t port = (type == FDR_CONN ? conn_port : CTRL_PORT);
 
 	*fdr = NULL;
 
+	if (type == FDR_CONN && !ctrl) {
+		error("ERROR: FDR data connection requires a control connection\n");
+		return -1;
+	}
+	uint16_t port = (type == FDR_CONN ? (uint16_t)ctrl->conn_port : CTRL_PORT);
+
 	debug("Connecting to FDR client at port %u\n", port);
 
 	for (i = 1; i <= attempts; i++) {
@@ -91,6 +111,7 @@ int fdr_connect(idevice_t device, fdr_type_t type, fdr_client_t* fdr)
 	fdr_loc->connection = connection;
 	fdr_loc->device = device;
 	fdr_loc->type = type;
+	fdr_loc->ctrlprotoversion = (ctrl) ? ctrl->ctrlprotoversion : 2;
 
 	/* Do handshake */
 	if (type == FDR_CTRL)
@@ -108,6 +129,11 @@ int fdr_connect(idevice_t device, fdr_type_t type, fdr_client_t* fdr)
 	return 0;
 }
 
+int fdr_connect(idevice_t device, fdr_type_t type, fdr_client_t* fdr)
+{
+	return fdr_connect_internal(device, type, NULL, fdr);
+}
+
 void fdr_disconnect(fdr_client_t fdr)
 {
 	if (!fdr)
@@ -236,7 +262,7 @@ static int fdr_send_plist(fdr_client_t fdr, plist_t data)
 		return -1;
 
 	debug("FDR sending %d bytes:\n", len);
-	if (idevicerestore_debug)
+	if (idevicerestore_debug_enabled())
 		debug_plist(data);
 	device_error = idevice_connection_send(fdr->connection, (char *)&len, sizeof(len), &bytes);
 	if (device_error != IDEVICE_E_SUCCESS || bytes != sizeof(len)) {
@@ -266,12 +292,12 @@ static int fdr_ctrl_handshake(fdr_client_t fdr)
 
 	debug("About to do ctrl handshake\n");
 
-	ctrlprotoversion = 2;
+	fdr->ctrlprotoversion = 2;
 
 	device_error = idevice_connection_send(fdr->connection, CTRLCMD, len, &bytes);
 	if (device_error != IDEVICE_E_SUCCESS || bytes != len) {
 		debug("Hmm... lookes like the device doesn't like the newer protocol, using the old one\n");
-		ctrlprotoversion = 1;
+		fdr->ctrlprotoversion = 1;
 		len = sizeof(HELLOCTRLCMD);
 		device_error = idevice_connection_send(fdr->connection, HELLOCTRLCMD, len, &bytes);
 		if (device_error != IDEVICE_E_SUCCESS || bytes != len) {
@@ -280,10 +306,10 @@ static int fdr_ctrl_handshake(fdr_client_t fdr)
 		}
 	}
 
-	if (ctrlprotoversion == 2) {
+	if (fdr->ctrlprotoversion == 2) {
 		dict = plist_new_dict();
 		plist_dict_set_item(dict, "Command", plist_new_string(CTRLCMD));
-		plist_dict_set_item(dict, "CtrlProtoVersion", plist_new_uint(ctrlprotoversion));
+		plist_dict_set_item(dict, "CtrlProtoVersion", plist_new_uint(fdr->ctrlprotoversion));
 		res = fdr_send_plist(fdr, dict);
 		plist_free(dict);
 		if (res) {
@@ -295,11 +321,11 @@ static int fdr_ctrl_handshake(fdr_client_t fdr)
 			error("ERROR: FDR did not get Begin command reply.\n");
 			return -1;
 		}
-		if (idevicerestore_debug)
+		if (idevicerestore_debug_enabled())
 			debug_plist(dict);
 		node = plist_dict_get_item(dict, "ConnPort");
 		if (node && plist_get_node_type(node) == PLIST_UINT) {
-			plist_get_uint_val(node, &conn_port);
+			plist_get_uint_val(node, &fdr->conn_port);
 		} else {
 			error("ERROR: Could not get FDR ConnPort value\n");
 			return -1;
@@ -331,10 +357,10 @@ static int fdr_ctrl_handshake(fdr_client_t fdr)
 			return -1;
 		}
 
-		conn_port = le16toh(cport);
+		fdr->conn_port = le16toh(cport);
 	}
 
-	debug("Ctrl handshake done (ConnPort = %u)\n", conn_port);
+	debug("Ctrl handshake done (ConnPort = %u)\n", (unsigned int)fdr->conn_port);
 
 	return 0;
 }
@@ -351,7 +377,7 @@ static int fdr_sync_handshake(fdr_client_t fdr)
 		return -1;
 	}
 
-	if (ctrlprotoversion == 2) {
+	if (fdr->ctrlprotoversion == 2) {
 		if (fdr_receive_plist(fdr, &reply)) {
 			error("ERROR: FDR did not get HelloConn reply.\n");
 			return -1;
@@ -420,7 +446,7 @@ static int fdr_handle_sync_cmd(fdr_client_t fdr_ctrl)
 		return -1;
 	}
 	/* Open a new connection and wait for messages on it */
-	if (fdr_connect(fdr_ctrl->device, FDR_CONN, &fdr)) {
+	if (fdr_connect_internal(fdr_ctrl->device, FDR_CONN, fdr_ctrl, &fdr)) {
 		error("ERROR: Failed to connect to FDR port\n");
 		return -1;
 	}
@@ -477,6 +503,92 @@ static int fdr_handle_plist_cmd(fdr_client_t fdr)
 	return 1; /* should terminate thread */
 }
 
+static int fdr_proxy_stopping(struct fdr_proxy* proxy)
+{
+	mutex_lock(&proxy->mutex);
+	int stopping = proxy->stopping;
+	mutex_unlock(&proxy->mutex);
+	return stopping;
+}
+
+/* the direction that ends first decides the result */
+static void fdr_proxy_stop(struct fdr_proxy* proxy, int res)
+{
+	mutex_lock(&proxy->mutex);
+	if (!proxy->stopping) {
+		proxy->stopping = 1;
+		proxy->res = res;
+	}
+	mutex_unlock(&proxy->mutex);
+}
+
+static int fdr_proxy_send_socket(int sockfd, const char* data, uint32_t length)
+{
+	while (length > 0) {
+		int sent = socket_send(sockfd, (void*)data, length);
+		if (sent <= 0) {
+			return -1;
+		}
+		data += sent;
+		length -= sent;
+	}
+	return 0;
+}
+
+/* forwards what the server sends back to the device */
+static void* fdr_proxy_reply_thread(void* arg)
+{
+	struct fdr_proxy* proxy = (struct fdr_proxy*)arg;
+	idevice_error_t device_error = IDEVICE_E_SUCCESS;
+	uint32_t sent = 0, bytes = 0;
+
+	char* buf = (char*)malloc(FDR_PROXY_BUFFER_SIZE);
+	if (!buf) {
+		error("ERROR: Out of memory\n");
+		fdr_proxy_stop(proxy, -1);
+		return NULL;
+	}
+
+	while (!fdr_proxy_stopping(proxy)) {
+		int res = socket_receive_timeout(proxy->sockfd, buf, FDR_PROXY_BUFFER_SIZE, 0, FDR_PROXY_POLL_TIMEOUT);
+		if (res == 0) {
+			continue;
+		}
+		if (res == -EAGAIN) {
+			/* the server closed the connection */
+			fdr_proxy_stop(proxy, 1);
+			break;
+		}
+		if (res < 0) {
+			if (!fdr_proxy_stopping(proxy)) {
+				error("ERROR: FDR %p receiving proxy payload failed: %s\n", proxy->fdr, strerror(errno));
+			}
+			fdr_proxy_stop(proxy, -1);
+			break;
+		}
+
+		bytes = (uint32_t)res;
+		debug("FDR %p Received %u bytes reply data, sending to device\n", proxy->fdr, bytes);
+		while (bytes > 0) {
+			sent = 0;
+			device_error = idevice_connection_send(proxy->fdr->connection, buf + (res - bytes), bytes, &sent);
+			if (device_error != IDEVICE_E_SUCCESS || sent == 0) {
+				break;
+			}
+			bytes -= sent;
+		}
+		if (bytes > 0) {
+			error("ERROR: FDR %p unable to send data (%d). Sent %u of %u bytes.\n",
+			      proxy->fdr, device_error, res - bytes, res);
+			fdr_proxy_stop(proxy, -1);
+			break;
+		}
+	}
+	free(buf);
+
+	return NULL;
+}
+
 static int fdr_handle_proxy_cmd(fdr_client_t fdr)
 {
 	idevice_error_t device_error = IDEVICE_E_SUCCESS;
@@ -536,52 +648,55 @@ static int fdr_handle_proxy_cmd(fdr_client_t fdr)
 		return -1;
 	}
 
-	int res = 0, bytes_ret;
-	while (1) {
+	struct fdr_proxy proxy;
+	thread_t reply_thread = (thread_t)NULL;
+	proxy.fdr = fdr;
+	proxy.sockfd = sockfd;
+	proxy.stopping = 0;
+	proxy.res = 0;
+	mutex_init(&proxy.mutex);
+
+	/* replies go back to the device on their own thread, so neither side
+	 * waits for the other to time out before its data is forwarded */
+	if (thread_new(&reply_thread, fdr_proxy_reply_thread, &proxy) != 0) {
+		error("ERROR: FDR %p unable to start proxy reply thread\n", fdr);
+		mutex_destroy(&proxy.mutex);
+		socket_close(sockfd);
+		return -1;
+	}
+
+	char* payload = (char*)malloc(FDR_PROXY_BUFFER_SIZE);
+	if (!payload) {
+		error("ERROR: Out of memory\n");
+		fdr_proxy_stop(&proxy, -1);
+	}
+	while (payload && !fdr_proxy_stopping(&proxy)) {
 		bytes = 0;
-		device_error = idevice_connection_receive_timeout(fdr->connection, buf, sizeof(buf), &bytes, 100);
+		device_error = idevice_connection_receive_timeout(fdr->connection, payload, FDR_PROXY_BUFFER_SIZE, &bytes, FDR_PROXY_DEVICE_POLL_TIMEOUT);
 		if (device_error != IDEVICE_E_SUCCESS) {
 			error("ERROR: FDR %p Unable to receive proxy payload (%d)\n", fdr, device_error);
-			res = -1;
+			fdr_proxy_stop(&proxy, -1);
 			break;
-		} else if (!bytes) {
-			//debug("WARNING: Timeout waiting for proxy payload. %p\n", fdr);
 		}
-		if (bytes) {
-			debug("FDR %p got payload of %u bytes, now try to proxy it\n", fdr, bytes);
-			debug("Sending %u bytes of data\n", bytes);
-			sent = socket_send(sockfd, buf, bytes);
-			if (sent != bytes) {
-				error("ERROR: Sending proxy payload failed: %s\n", strerror(errno));
-				socket_close(sockfd);
-				res = -1;
-				break;
-			}
+		if (!bytes) {
+			continue;
 		}
-		bytes_ret = socket_receive_timeout(sockfd, buf, sizeof(buf), 0, 100);
-		if (bytes_ret < 0) {
-			if (errno)
-				error("ERROR: FDR %p receiving proxy payload failed: %s\n",
-				      fdr, strerror(errno));
-			else
-				res = 1; /* close connection if no data with no error */
+		debug("FDR %p got payload of %u bytes, now try to proxy it\n", fdr, bytes);
+		/* a blocking send keeps the device from outrunning the server */
+		if (fdr_proxy_send_socket(sockfd, payload, bytes) < 0) {
+			error("ERROR: Sending proxy payload failed: %s\n", strerror(errno));
+			fdr_proxy_stop(&proxy, -1);
 			break;
 		}
-
-		bytes = bytes_ret;
-		if (bytes) {
-			debug("FDR %p Received %u bytes reply data,%s sending to device\n",
-			      fdr, bytes, (bytes ? "" : " not"));
-
-			device_error = idevice_connection_send(fdr->connection, buf, bytes, &sent);
-			if (device_error != IDEVICE_E_SUCCESS || bytes != sent) {
-				error("ERROR: FDR %p unable to send data (%d). Sent %u of %u bytes.\n",
-				      fdr, device_error, sent, bytes);
-				res = -1;
-				break;
-			}
-		} else serial++;
 	}
+	free(payload);
+
+	/* wakes up the reply thread if it is still waiting for the server */
+	socket_shutdown(sockfd, SHUT_RDWR);
+	thread_join(reply_thread);
+	thread_free(reply_thread);
 	socket_close(sockfd);
-	return res;
+	mutex_destroy(&proxy.mutex);
+
+	return proxy.res;
 }
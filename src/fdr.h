@@ -38,6 +38,8 @@ struct fdr_client {
 	idevice_connection_t connection;
 	idevice_t device;
 	fdr_type_t type;
+	int ctrlprotoversion;
+	uint64_t conn_port;
 };
 typedef struct fdr_client *fdr_client_t;
 
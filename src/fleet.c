@@ -0,0 +1,392 @@
+/*
+ * fleet.c
+ * Concurrent restores of many devices in one process
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+
+#include "fleet.h"
+#include "ipsw.h"
+#include "common.h"
+#include "download.h"
+#include "thread.h"
+#include "metrics.h"
+
+enum {
+	FLEET_JOB_PENDING = 0,
+	FLEET_JOB_RUNNING,
+	FLEET_JOB_DONE
+};
+
+struct fleet {
+	struct fleet_job* jobs;
+	int num_jobs;
+	int bus_limit;
+	int flags;
+	char* cache_dir;
+	char* tss_url;
+	idevicerestore_progress_cb_t progress_cb;
+	mutex_t mutex;
+};
+
+static const char* fleet_step_names[RESTORE_NUM_STEPS] = {
+	"detect",
+	"prepare",
+	"upload filesystem",
+	"verify filesystem",
+	"flash firmware",
+	"flash baseband"
+};
+
+static void fleet_default_progress_cb(int step, double step_progress, void* userdata)
+{
+	struct fleet_job* job = (struct fleet_job*)userdata;
+	int percent = (int)(step_progress * 100.0);
+
+	/* every job reports, keep it to one line per 10% and step */
+	if (step == job->step && percent / 10 == job->percent / 10) {
+		return;
+	}
+	job->step = step;
+	job->percent = percent;
+	if (step >= 0 && step < RESTORE_NUM_STEPS) {
+		info("[%s] %s: %d%%\n", job->name, fleet_step_names[step], percent);
+	}
+}
+
+static char* fleet_next_token(char** p)
+{
+	char* start = *p + strspn(*p, " \t\r\n");
+	if (*start == '\0') {
+		*p = start;
+		return NULL;
+	}
+	char* end = start + strcspn(start, " \t\r\n");
+	if (*end != '\0') {
+		*end++ = '\0';
+	}
+	*p = end;
+	return start;
+}
+
+static int fleet_add_job(struct fleet* fleet, const char* device, const char* ipsw)
+{
+	struct fleet_job* jobs = (struct fleet_job*)realloc(fleet->jobs, sizeof(struct fleet_job) * (fleet->num_jobs + 1));
+	if (!jobs) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	fleet->jobs = jobs;
+
+	struct fleet_job* job = &fleet->jobs[fleet->num_jobs];
+	memset(job, '\0', sizeof(struct fleet_job));
+	job->step = -1;
+	job->result = -1;
+
+	/* UDIDs are 40 hex digits or contain a dash, anything shorter is an ECID */
+	if (strlen(device) >= 24 || strchr(device, '-')) {
+		job->udid = strdup(device);
+	} else {
+		char* tail = NULL;
+		job->ecid = strtoull(device, &tail, 16);
+		if ((tail && tail[0] != '\0') || job->ecid == 0) {
+			error("ERROR: Could not parse ECID from '%s'\n", device);
+			return -1;
+		}
+	}
+	job->name = strdup(device);
+	job->ipsw = strdup(ipsw);
+	fleet->num_jobs++;
+
+	return 0;
+}
+
+/* the job list has one "<ECID or UDID> <IPSW>" pair per line, # starts a comment */
+struct fleet* fleet_new(const char* joblist, int flags, const char* cache_dir)
+{
+	char line[2048];
+	int lineno = 0;
+
+	FILE* f = fopen(joblist, "r");
+	if (!f) {
+		error("ERROR: Unable to open job list %s: %s\n", joblist, strerror(errno));
+		return NULL;
+	}
+
+	struct fleet* fleet = (struct fleet*)malloc(sizeof(struct fleet));
+	if (!fleet) {
+		error("ERROR: Out of memory\n");
+		fclose(f);
+		return NULL;
+	}
+	memset(fleet, '\0', sizeof(struct fleet));
+	mutex_init(&fleet->mutex);
+	fleet->flags = flags;
+	fleet->cache_dir = (cache_dir) ? strdup(cache_dir) : NULL;
+	fleet->progress_cb = fleet_default_progress_cb;
+
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		char* comment = strchr(line, '#');
+		if (comment) {
+			*comment = '\0';
+		}
+		char* p = line;
+		char* device = fleet_next_token(&p);
+		if (!device) {
+			continue;
+		}
+		char* ipsw = fleet_next_token(&p);
+		if (!ipsw || fleet_next_token(&p)) {
+			error("ERROR: %s:%d: expected '<ECID or UDID> <IPSW>'\n", joblist, lineno);
+			fleet_free(fleet);
+			fclose(f);
+			return NULL;
+		}
+		if (fleet_add_job(fleet, device, ipsw) < 0) {
+			fleet_free(fleet);
+			fclose(f);
+			return NULL;
+		}
+	}
+	fclose(f);
+
+	if (fleet->num_jobs == 0) {
+		error("ERROR: No jobs in %s\n", joblist);
+		fleet_free(fleet);
+		return NULL;
+	}
+
+	return fleet;
+}
+
+void fleet_set_progress_callback(struct fleet* fleet, idevicerestore_progress_cb_t cbfunc)
+{
+	if (!fleet) {
+		return;
+	}
+	fleet->progress_cb = cbfunc;
+}
+
+void fleet_set_tss_url(struct fleet* fleet, const char* url)
+{
+	if (!fleet) {
+		return;
+	}
+	free(fleet->tss_url);
+	fleet->tss_url = (url) ? strdup(url) : NULL;
+}
+
+void fleet_set_bus_limit(struct fleet* fleet, int bus_limit)
+{
+	if (!fleet) {
+		return;
+	}
+	fleet->bus_limit = bus_limit;
+}
+
+/* picks the pending job on the USB bus with the fewest running restores, so
+ * the workers spread over the buses instead of piling up on one hub.
+ * called with the fleet mutex held. */
+static struct fleet_job* fleet_next_job(struct fleet* fleet)
+{
+	struct fleet_job* best = NULL;
+	int best_running = 0;
+	int i, j;
+
+	for (i = 0; i < fleet->num_jobs; i++) {
+		struct fleet_job* job = &fleet->jobs[i];
+		if (job->state != FLEET_JOB_PENDING) {
+			continue;
+		}
+		int running = 0;
+		if (job->location.bus) {
+			for (j = 0; j < fleet->num_jobs; j++) {
+				if (fleet->jobs[j].state == FLEET_JOB_RUNNING && fleet->jobs[j].location.bus == job->location.bus) {
+					running++;
+				}
+			}
+		}
+		if (!best || running < best_running) {
+			best = job;
+			best_running = running;
+		}
+		if (running == 0) {
+			break;
+		}
+	}
+	if (best) {
+		best->state = FLEET_JOB_RUNNING;
+		metrics_add(METRIC_QUEUE_DEPTH, "fleet_pending", -1);
+		metrics_add(METRIC_QUEUE_DEPTH, "fleet_running", 1);
+	}
+
+	return best;
+}
+
+static void* fleet_worker(void* arg)
+{
+	struct fleet* fleet = (struct fleet*)arg;
+
+	while (1) {
+		struct fleet_job* job = NULL;
+
+		mutex_lock(&fleet->mutex);
+		job = fleet_next_job(fleet);
+		mutex_unlock(&fleet->mutex);
+		if (!job) {
+			break;
+		}
+
+		info("[%s] Restoring %s\n", job->name, job->ipsw);
+		job->result = idevicerestore_start(job->client);
+		if (job->result == 0) {
+			info("[%s] Restore finished\n", job->name);
+		} else {
+			const char* err = idevicerestore_client_get_error(job->client);
+			error("[%s] Restore failed: %s", job->name, (err && *err) ? err : "unknown error\n");
+		}
+
+		mutex_lock(&fleet->mutex);
+		job->state = FLEET_JOB_DONE;
+		metrics_add(METRIC_QUEUE_DEPTH, "fleet_running", -1);
+		mutex_unlock(&fleet->mutex);
+	}
+
+	return NULL;
+}
+
+/* runs all jobs with at most workers restores at a time. the restores share
+ * the opened IPSWs, extracted components and build manifests, filesystem
+ * extractions and HTTP connections, bulk transfers are limited per USB hub.
+ * returns 0 if all of them succeeded. */
+int fleet_run(struct fleet* fleet, int workers)
+{
+	thread_t* threads = NULL;
+	int num_threads = 0;
+	int failed = 0;
+	int i;
+
+	if (!fleet) {
+		return -1;
+	}
+	if (workers <= 0) {
+		workers = FLEET_DEFAULT_WORKERS;
+	}
+	if (workers > fleet->num_jobs) {
+		workers = fleet->num_jobs;
+	}
+
+	for (i = 0; i < fleet->num_jobs; i++) {
+		struct fleet_job* job = &fleet->jobs[i];
+		job->client = idevicerestore_client_new();
+		if (!job->client) {
+			return -1;
+		}
+		idevicerestore_set_flags(job->client, fleet->flags);
+		idevicerestore_set_ipsw(job->client, job->ipsw);
+		if (job->udid) {
+			idevicerestore_set_udid(job->client, job->udid);
+		} else {
+			idevicerestore_set_ecid(job->client, job->ecid);
+		}
+		if (fleet->cache_dir) {
+			idevicerestore_set_cache_path(job->client, fleet->cache_dir);
+		}
+		if (fleet->tss_url) {
+			job->client->tss_url = strdup(fleet->tss_url);
+		}
+		if (fleet->progress_cb) {
+			idevicerestore_set_progress_callback(job->client, fleet->progress_cb, job);
+		}
+		if (usbtopo_locate(job->ecid, job->udid, &job->location) == 0) {
+			info("[%s] on USB bus %d port %s\n", job->name, job->location.bus, job->location.port_path);
+			job->client->usb_bus = job->location.bus;
+			strcpy(job->client->usb_port_path, job->location.port_path);
+		}
+	}
+
+	threads = (thread_t*)malloc(sizeof(thread_t) * workers);
+	if (!threads) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+
+	ipsw_cache_enable(FLEET_CACHE_SIZE);
+	download_share_init();
+	usbtopo_admission_enable(fleet->bus_limit);
+
+	info("Restoring %d devices, %d at a time\n", fleet->num_jobs, workers);
+	metrics_add(METRIC_QUEUE_DEPTH, "fleet_pending", fleet->num_jobs);
+	for (i = 0; i < workers; i++) {
+		if (thread_new(&threads[num_threads], fleet_worker, fleet) != 0) {
+			error("ERROR: Unable to start restore worker\n");
+			break;
+		}
+		num_threads++;
+	}
+	if (num_threads == 0) {
+		/* nothing else will pick the jobs up */
+		fleet_worker(fleet);
+	}
+	for (i = 0; i < num_threads; i++) {
+		thread_join(threads[i]);
+		thread_free(threads[i]);
+	}
+	free(threads);
+
+	usbtopo_admission_disable();
+	download_share_cleanup();
+	ipsw_cache_cleanup();
+
+	for (i = 0; i < fleet->num_jobs; i++) {
+		if (fleet->jobs[i].result != 0) {
+			failed++;
+		}
+	}
+	info("%d of %d restores succeeded\n", fleet->num_jobs - failed, fleet->num_jobs);
+
+	return (failed > 0) ? -1 : 0;
+}
+
+void fleet_free(struct fleet* fleet)
+{
+	int i;
+
+	if (!fleet) {
+		return;
+	}
+	for (i = 0; i < fleet->num_jobs; i++) {
+		idevicerestore_client_free(fleet->jobs[i].client);
+		free(fleet->jobs[i].udid);
+		free(fleet->jobs[i].ipsw);
+		free(fleet->jobs[i].name);
+	}
+	free(fleet->jobs);
+	free(fleet->cache_dir);
+	free(fleet->tss_url);
+	mutex_destroy(&fleet->mutex);
+	free(fleet);
+}
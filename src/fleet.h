@@ -0,0 +1,65 @@
+/*
+ * fleet.h
+ * Concurrent restores of many devices in one process
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef IDEVICERESTORE_FLEET_H
+#define IDEVICERESTORE_FLEET_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "idevicerestore.h"
+#include "usbtopo.h"
+
+/* restores running at the same time unless told otherwise */
+#define FLEET_DEFAULT_WORKERS 4
+/* memory the shared IPSW cache may use for extracted components */
+#define FLEET_CACHE_SIZE 0x20000000
+
+/* handed to the progress callback as userdata */
+struct fleet_job {
+	uint64_t ecid;
+	char* udid;
+	char* ipsw;
+	char* name;     /* ECID or UDID as given in the job list, for messages */
+	struct idevicerestore_client_t* client;
+	usb_location_t location;
+	int state;
+	int step;
+	int percent;
+	int result;
+};
+
+struct fleet;
+
+struct fleet* fleet_new(const char* joblist, int flags, const char* cache_dir);
+void fleet_set_progress_callback(struct fleet* fleet, idevicerestore_progress_cb_t cbfunc);
+void fleet_set_tss_url(struct fleet* fleet, const char* url);
+void fleet_set_bus_limit(struct fleet* fleet, int bus_limit);
+int fleet_run(struct fleet* fleet, int workers);
+void fleet_free(struct fleet* fleet);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
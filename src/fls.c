@@ -28,22 +28,29 @@
 #define offsetof(type, member)  __builtin_offsetof (type, member)
 #endif
 
-static void fls_parse_elements(fls_file* fls)
+static int fls_parse_elements(fls_file* fls)
 {
 	/* FIXME: the following code is not big endian safe */
 	if (!fls || !fls->data) {
-		return;
+		return -1;
 	}
 	uint32_t offset = 0;
 	fls->max_elements = 32;
 	fls->elements = (fls_element**)malloc(sizeof(fls_element*) * fls->max_elements);
+	if (!fls->elements) {
+		error("ERROR: %s: out of memory\n", __func__);
+		return -1;
+	}
 
-	fls_element* cur = NULL;
+	const fls_element* cur = NULL;
 	do {
-		void* p = fls->data + offset;
+		const unsigned char* p = (const unsigned char*)fls->data + offset;
 		uint32_t hdrsize = 0;
-		cur = (fls_element*)p;
-		if ((offset + cur->size) > fls->size) {
+		if (fls->size - offset < offsetof(fls_element, data)) {
+			break;
+		}
+		cur = (const fls_element*)p;
+		if (cur->size < offsetof(fls_element, data) || cur->size > fls->size - offset) {
 			break;
 		}
 		fls_element* ne;
@@ -51,6 +58,9 @@ static void fls_parse_elements(fls_file* fls)
 		case 0x0c:
 			{
 			hdrsize = offsetof(fls_0c_element, data);
+			if (cur->size < hdrsize) {
+				goto done;
+			}
 			fls_0c_element* xe = (fls_0c_element*)malloc(sizeof(fls_0c_element));
 			memset(xe, '\0', sizeof(fls_0c_element));
 			memcpy((void*)xe, p, hdrsize);
@@ -62,6 +72,9 @@ static void fls_parse_elements(fls_file* fls)
 		case 0x10:
 			{
 			hdrsize = offsetof(fls_10_element, data);
+			if (cur->size < hdrsize) {
+				goto done;
+			}
 			fls_10_element* xe = (fls_10_element*)malloc(sizeof(fls_10_element));
 			memset(xe, '\0', sizeof(fls_10_element));
 			memcpy((void*)xe, p, hdrsize);
@@ -72,6 +85,9 @@ static void fls_parse_elements(fls_file* fls)
 		case 0x14:
 			{
 			hdrsize = offsetof(fls_14_element, data);
+			if (cur->size < hdrsize) {
+				goto done;
+			}
 			fls_14_element* xe = (fls_14_element*)malloc(sizeof(fls_14_element));
 			memset(xe, '\0', sizeof(fls_14_element));
 			memcpy((void*)xe, p, hdrsize);
@@ -95,23 +111,28 @@ static void fls_parse_elements(fls_file* fls)
 		fls->elements[fls->num_elements++] = ne;
 		offset += cur->size;
 	} while (offset < fls->size);
+done:
 	if (offset != fls->size) {
 		error("ERROR: %s: error parsing elements\n", __func__);
-		return;
+		return -1;
 	}
+	return 0;
 }
 
-fls_file* fls_parse(unsigned char* data, unsigned int size)
+fls_file* fls_parse(const unsigned char* data, unsigned int size)
 {
 	fls_file* fls = (fls_file*)malloc(sizeof(fls_file));
 	if (!fls) {
 		return NULL;
 	}
 	memset(fls, '\0', sizeof(fls_file));
-	fls->data = malloc(size);
+	/* the input buffer is borrowed, element data points right into it */
+	fls->data = data;
 	fls->size = size;
-	memcpy(fls->data, data, size);
-	fls_parse_elements(fls);
+	if (fls_parse_elements(fls) < 0) {
+		fls_free(fls);
+		return NULL;
+	}
 	return fls;
 }
 
@@ -123,11 +144,8 @@ void fls_free(fls_file* fls)
 			for (i = fls->num_elements-1; i >=0; i--) {
 				free(fls->elements[i]);
 			}
-			free(fls->elements);
-		}
-		if (fls->data) {
-			free(fls->data);
 		}
+		free(fls->elements);
 		free(fls);
 	}
 }
@@ -144,6 +162,11 @@ int fls_update_sig_blob(fls_file* fls, const unsigned char* sigdata, unsigned in
 		return -1;
 	}
 
+	uint32_t bodysize = fls->c_element->size - offsetof(fls_0c_element, data);
+	if (!fls->c_element->data || bodysize < 0x18) {
+		error("ERROR: %s: fls_0c_element too small\n", __func__);
+		return -1;
+	}
 	uint32_t datasize = *(uint32_t*)(fls->c_element->data + 0x10);
 	if (datasize != fls->c_element->data_size) {
 		error("ERROR: %s: data size mismatch (0x%x != 0x%x)\n", __func__, datasize, fls->c_element->data_size);
@@ -154,94 +177,22 @@ int fls_update_sig_blob(fls_file* fls, const unsigned char* sigdata, unsigned in
 		error("ERROR: %s: signature offset greater than data size (0x%x > 0x%x)\n", __func__, sigoffset, datasize);
 		return -1;
 	}
-
 	uint32_t oldsiglen = datasize - sigoffset;
-	uint32_t newsize = fls->size - oldsiglen + siglen;
-
-	unsigned int i;
-	uint32_t offset = 0;
-	void* newdata = malloc(newsize);
-	if (!newdata) {
-		error("ERROR: %s: out of memory\n", __func__);
+	if (oldsiglen > bodysize) {
+		error("ERROR: %s: signature larger than element data (0x%x > 0x%x)\n", __func__, oldsiglen, bodysize);
 		return -1;
 	}
-	uint32_t hdrsize = 0;
-	uint32_t firstpartlen = 0;
-	for (i = 0; i < fls->num_elements; i++) {
-		switch (fls->elements[i]->type) {
-		case 0x0c:
-			hdrsize = offsetof(fls_0c_element, data);
-			// update offset
-			((fls_0c_element*)fls->elements[i])->offset = offset+hdrsize;
-			// copy first part of data
-			firstpartlen = fls->elements[i]->size - hdrsize - oldsiglen;
-			memcpy(newdata+offset+hdrsize, ((fls_0c_element*)fls->elements[i])->data, firstpartlen);
-			// copy new signature data
-			memcpy(newdata+offset+hdrsize+firstpartlen, sigdata, siglen);
-			((fls_0c_element*)fls->elements[i])->data = newdata+offset+hdrsize;
-			fls->elements[i]->size -= oldsiglen;
-			fls->elements[i]->size += siglen;
-			((fls_0c_element*)fls->elements[i])->data_size -= oldsiglen;
-			((fls_0c_element*)fls->elements[i])->data_size += siglen;
-			memcpy(newdata+offset+hdrsize+0x10, &(((fls_0c_element*)fls->elements[i])->data_size), 4);
-			// copy header
-			memcpy(newdata+offset, fls->elements[i], hdrsize);
-			break;
-		case 0x10:
-			hdrsize = offsetof(fls_10_element, data);
-			// update offset
-			((fls_10_element*)fls->elements[i])->offset = offset+hdrsize;
-			// copy header
-			memcpy(newdata+offset, fls->elements[i], hdrsize);
-			// copy data
-			if (fls->elements[i]->size > hdrsize) {
-				memcpy(newdata+offset+hdrsize, ((fls_10_element*)fls->elements[i])->data, fls->elements[i]->size - hdrsize);
-				((fls_10_element*)fls->elements[i])->data = newdata+offset+hdrsize;
-			} else {
-				((fls_10_element*)fls->elements[i])->data = NULL;
-			}
-			break;
-		case 0x14:
-			hdrsize = offsetof(fls_14_element, data);
-			// update offset
-			((fls_14_element*)fls->elements[i])->offset = offset+hdrsize;
-			// copy header
-			memcpy(newdata+offset, fls->elements[i], hdrsize);
-			// copy data
-			if (fls->elements[i]->size > hdrsize) {
-				memcpy(newdata+offset+hdrsize, ((fls_14_element*)fls->elements[i])->data, fls->elements[i]->size - hdrsize);
-				((fls_14_element*)fls->elements[i])->data = newdata+offset+hdrsize;
-			} else {
-				((fls_14_element*)fls->elements[i])->data = NULL;
-			}
-			break;
-		default:
-			hdrsize = offsetof(fls_element, data);
-			// copy header
-			memcpy(newdata+offset, fls->elements[i], hdrsize);
-			// copy data
-			if (fls->elements[i]->size > hdrsize) {
-				memcpy(newdata+offset+hdrsize, fls->elements[i]->data, fls->elements[i]->size - hdrsize);
-				fls->elements[i]->data = newdata+offset+hdrsize;
-			} else {
-				fls->elements[i]->data = NULL;
-			}
-			break;
-		}
-		offset += fls->elements[i]->size;
-	}
-	if (fls->data) {
-		free(fls->data);
-	}
-	fls->data = newdata;
-	fls->size = newsize;
+
+	/* only record the edit, the new file is laid out by fls_write() */
+	fls->sig = sigdata;
+	fls->sig_size = siglen;
+	fls->sig_oldsize = oldsiglen;
 
 	return 0;
 }
 
 int fls_insert_ticket(fls_file* fls, const unsigned char* data, unsigned int size)
 {
-	/* FIXME: the code in this function is not big endian safe */
 	if (!fls || !fls->num_elements) {
 		error("ERROR: %s: no data\n", __func__);
 		return -1;
@@ -251,87 +202,102 @@ int fls_insert_ticket(fls_file* fls, const unsigned char* data, unsigned int siz
 		return -1;
 	}
 
+	/* only record the edit, the new file is laid out by fls_write() */
+	fls->ticket = data;
+	fls->ticket_size = size;
+
+	return 0;
+}
+
+int fls_write(fls_file* fls, unsigned char** data, unsigned int* size)
+{
+	/* FIXME: the code in this function is not big endian safe */
+	if (!fls || !fls->num_elements || !data || !size) {
+		error("ERROR: %s: no data\n", __func__);
+		return -1;
+	}
+
 	uint32_t padding = 0;
-	if (size%4 != 0) {
-		padding = 4-(size%4);
+	if (fls->ticket_size % 4 != 0) {
+		padding = 4 - (fls->ticket_size % 4);
 	}
-	uint32_t newsize = fls->size + size + padding;
-	unsigned int i;
-	uint32_t offset = 0;
-	void* newdata = malloc(newsize);
+	uint32_t ticketlen = (fls->ticket) ? fls->ticket_size + padding : 0;
+	uint32_t sigdelta = (fls->sig) ? fls->sig_size - fls->sig_oldsize : 0;
+
+	/* one pass over the element table: every size and offset is known up front */
+	uint32_t newsize = fls->size + sigdelta + ticketlen;
+	unsigned char* newdata = (unsigned char*)malloc(newsize);
 	if (!newdata) {
 		error("ERROR: %s: out of memory\n", __func__);
 		return -1;
 	}
+
+	unsigned int i;
+	uint32_t offset = 0;
 	uint32_t hdrsize = 0;
+	uint32_t bodysize = 0;
 	for (i = 0; i < fls->num_elements; i++) {
-		switch (fls->elements[i]->type) {
+		const fls_element* el = fls->elements[i];
+		switch (el->type) {
 		case 0x0c:
+			{
+			fls_0c_element xe;
 			hdrsize = offsetof(fls_0c_element, data);
-			// update offset
-			((fls_0c_element*)fls->elements[i])->offset = offset+hdrsize;
-			// copy ticket data
-			memcpy(newdata+offset+hdrsize, data, size);
-			if (padding > 0) {
-				// padding
-				memset(newdata+offset+hdrsize+size, '\xFF', padding);
+			memcpy(&xe, el, hdrsize);
+			bodysize = el->size - hdrsize;
+			unsigned char* p = newdata + offset + hdrsize;
+			if (fls->ticket) {
+				// ticket goes in front of the element data, padded to 4 bytes
+				memcpy(p, fls->ticket, fls->ticket_size);
+				if (padding > 0) {
+					memset(p + fls->ticket_size, '\xFF', padding);
+				}
+				p += ticketlen;
+			}
+			if (fls->sig) {
+				// keep everything up to the old signature, then the new one
+				uint32_t firstpartlen = bodysize - fls->sig_oldsize;
+				memcpy(p, ((const fls_0c_element*)el)->data, firstpartlen);
+				memcpy(p + firstpartlen, fls->sig, fls->sig_size);
+				xe.data_size += sigdelta;
+				memcpy(p + 0x10, &xe.data_size, 4);
+			} else if (bodysize > 0) {
+				memcpy(p, ((const fls_0c_element*)el)->data, bodysize);
+			}
+			xe.size += sigdelta + ticketlen;
+			xe.data_size += ticketlen;
+			xe.offset = offset + hdrsize;
+			memcpy(newdata + offset, &xe, hdrsize);
+			offset += xe.size;
 			}
-			// copy remaining data
-			memcpy(newdata+offset+hdrsize+size+padding, ((fls_0c_element*)fls->elements[i])->data, fls->elements[i]->size);
-			((fls_0c_element*)fls->elements[i])->data = newdata+offset+hdrsize;
-			fls->elements[i]->size += (size + padding);
-			((fls_0c_element*)fls->elements[i])->data_size += (size + padding);
-			// copy header
-			memcpy(newdata+offset, fls->elements[i], hdrsize);
 			break;
 		case 0x10:
+		case 0x14:
+			{
+			fls_10_element xe;
 			hdrsize = offsetof(fls_10_element, data);
-			// update offset
-			((fls_10_element*)fls->elements[i])->offset = offset+hdrsize;
-			// copy header
-			memcpy(newdata+offset, fls->elements[i], hdrsize);
-			// copy data
-			if (fls->elements[i]->size > hdrsize) {
-				memcpy(newdata+offset+hdrsize, ((fls_10_element*)fls->elements[i])->data, fls->elements[i]->size - hdrsize);
-				((fls_10_element*)fls->elements[i])->data = newdata+offset+hdrsize;
-			} else {
-				((fls_10_element*)fls->elements[i])->data = NULL;
+			memcpy(&xe, el, hdrsize);
+			xe.offset = offset + hdrsize;
+			memcpy(newdata + offset, &xe, hdrsize);
+			if (el->size > hdrsize) {
+				memcpy(newdata + offset + hdrsize, ((const fls_10_element*)el)->data, el->size - hdrsize);
 			}
-			break;
-		case 0x14:
-			hdrsize = offsetof(fls_14_element, data);
-			// update offset
-			((fls_14_element*)fls->elements[i])->offset = offset+hdrsize;
-			// copy header
-			memcpy(newdata+offset, fls->elements[i], hdrsize);
-			// copy data
-			if (fls->elements[i]->size > hdrsize) {
-				memcpy(newdata+offset+hdrsize, ((fls_14_element*)fls->elements[i])->data, fls->elements[i]->size - hdrsize);
-				((fls_14_element*)fls->elements[i])->data = newdata+offset+hdrsize;
-			} else {
-				((fls_14_element*)fls->elements[i])->data = NULL;
+			offset += el->size;
 			}
 			break;
 		default:
 			hdrsize = offsetof(fls_element, data);
-			// copy header
-			memcpy(newdata+offset, fls->elements[i], hdrsize);
-			// copy data
-			if (fls->elements[i]->size > hdrsize) {
-				memcpy(newdata+offset+hdrsize, fls->elements[i]->data, fls->elements[i]->size - hdrsize);
-				fls->elements[i]->data = newdata+offset+hdrsize;
-			} else {
-				fls->elements[i]->data = NULL;
+			memcpy(newdata + offset, el, hdrsize);
+			if (el->size > hdrsize) {
+				memcpy(newdata + offset + hdrsize, el->data, el->size - hdrsize);
 			}
+			offset += el->size;
 			break;
 		}
-		offset += fls->elements[i]->size;
 	}
-	if (fls->data) {
-		free(fls->data);
-	}
-	fls->data = newdata;
-	fls->size = newsize;
+
+	*data = newdata;
+	*size = newsize;
 
 	return 0;
 }
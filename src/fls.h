@@ -73,13 +73,20 @@ typedef struct {
 	unsigned int max_elements;
 	fls_element** elements;
 	const fls_0c_element* c_element;
-	void* data;
+	const void* data; // borrowed from the caller of fls_parse()
 	uint32_t size;
+	// pending edits, applied by fls_write()
+	const unsigned char* sig;
+	uint32_t sig_size;
+	uint32_t sig_oldsize;
+	const unsigned char* ticket;
+	uint32_t ticket_size;
 } fls_file;
 
-fls_file* fls_parse(unsigned char* data, unsigned int size);
+fls_file* fls_parse(const unsigned char* data, unsigned int size);
 void fls_free(fls_file* fls);
 int fls_update_sig_blob(fls_file* fls, const unsigned char* data, unsigned int size);
 int fls_insert_ticket(fls_file* fls, const unsigned char* data, unsigned int size);
+int fls_write(fls_file* fls, unsigned char** data, unsigned int* size);
 
 #endif
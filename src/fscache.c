@@ -0,0 +1,466 @@
+/*
+ * fscache.c
+ * Page cache policy for large filesystem images
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#ifdef HAVE_SYNC_FILE_RANGE
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <openssl/sha.h>
+
+#include "fscache.h"
+#include "thread.h"
+#include "common.h"
+#include "metrics.h"
+
+#ifndef HAVE_POSIX_FADVISE
+#define POSIX_FADV_SEQUENTIAL 0
+#define POSIX_FADV_WILLNEED 0
+#define POSIX_FADV_DONTNEED 0
+#endif
+
+struct fscache {
+	char* path;
+	FILE* file;
+	int fd;
+	uint64_t size;
+	uint64_t dropped;
+	uint64_t readahead; /* end of the range already advised WILLNEED */
+	int refs;
+	mutex_t lock;   /* protects the slots, never held while reading or hashing */
+	cond_t cond;    /* signaled when a slot stops loading */
+#ifdef WIN32
+	mutex_t io_lock; /* no pread(), the shared FILE position needs a lock */
+#endif
+	struct fscache_block* slots[FSCACHE_BLOCK_SLOTS];
+	struct fscache* next;
+};
+
+static struct fscache* fscache_list = NULL;
+static mutex_t fscache_mutex;
+static thread_once_t fscache_once = THREAD_ONCE_INIT;
+
+static void fscache_init(void)
+{
+	mutex_init(&fscache_mutex);
+}
+
+static void fscache_advise(int fd, uint64_t offset, uint64_t length, int advice)
+{
+#ifdef HAVE_POSIX_FADVISE
+	if (fd >= 0) {
+		posix_fadvise(fd, (off_t)offset, (off_t)length, advice);
+	}
+#endif
+}
+
+void fscache_writer_init(fscache_writer_t* writer, FILE* file, uint64_t size)
+{
+	memset(writer, '\0', sizeof(fscache_writer_t));
+	writer->file = file;
+	writer->fd = -1;
+	writer->size = size;
+
+	if (size < FSCACHE_MIN_SIZE) {
+		return;
+	}
+	writer->fd = fileno(file);
+
+#ifdef HAVE_POSIX_FALLOCATE
+	/* reserve the blocks up front so the image ends up mostly contiguous */
+	int res = posix_fallocate(writer->fd, 0, (off_t)size);
+	if (res != 0) {
+		debug("DEBUG: %s: posix_fallocate failed: %s\n", __func__, strerror(res));
+	}
+#endif
+}
+
+void fscache_writer_update(fscache_writer_t* writer, uint64_t written)
+{
+	if (writer->fd < 0 || written - writer->submitted < FSCACHE_WINDOW_SIZE) {
+		return;
+	}
+	fflush(writer->file);
+
+#ifdef HAVE_SYNC_FILE_RANGE
+	/* start writeback of the current window without waiting for it */
+	sync_file_range(writer->fd, (off_t)writer->submitted, (off_t)(written - writer->submitted), SYNC_FILE_RANGE_WRITE);
+
+	/* the previous window should be on disk by now, wait for it and drop it */
+	if (writer->submitted > writer->released) {
+		sync_file_range(writer->fd, (off_t)writer->released, (off_t)(writer->submitted - writer->released), SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+		fscache_advise(writer->fd, writer->released, writer->submitted - writer->released, POSIX_FADV_DONTNEED);
+		writer->released = writer->submitted;
+	}
+#endif
+	writer->submitted = written;
+}
+
+void fscache_writer_finish(fscache_writer_t* writer)
+{
+	if (writer->fd < 0) {
+		return;
+	}
+	fflush(writer->file);
+
+#ifdef HAVE_SYNC_FILE_RANGE
+	sync_file_range(writer->fd, (off_t)writer->released, 0, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#elif !defined(WIN32)
+	fsync(writer->fd);
+#endif
+	/* the tail stays cached, the restore streams the image right away */
+	writer->released = writer->size;
+	writer->fd = -1;
+}
+
+fscache_t fscache_acquire(const char* path)
+{
+	struct fscache* cache = NULL;
+
+	if (!path) {
+		return NULL;
+	}
+
+	thread_once(&fscache_once, fscache_init);
+
+	mutex_lock(&fscache_mutex);
+	for (cache = fscache_list; cache; cache = cache->next) {
+		if (!strcmp(cache->path, path)) {
+			break;
+		}
+	}
+	if (cache) {
+		cache->refs++;
+		mutex_unlock(&fscache_mutex);
+		return cache;
+	}
+
+	cache = (struct fscache*)malloc(sizeof(struct fscache));
+	if (!cache) {
+		mutex_unlock(&fscache_mutex);
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	memset(cache, '\0', sizeof(struct fscache));
+	cache->fd = -1;
+
+	cache->file = fopen(path, "rb");
+	if (!cache->file) {
+		mutex_unlock(&fscache_mutex);
+		error("ERROR: Unable to open filesystem image %s: %s\n", path, strerror(errno));
+		free(cache);
+		return NULL;
+	}
+	fseeko(cache->file, 0, SEEK_END);
+	cache->size = ftello(cache->file);
+	fseeko(cache->file, 0, SEEK_SET);
+
+	cache->path = strdup(path);
+	cache->refs = 1;
+	mutex_init(&cache->lock);
+	cond_init(&cache->cond);
+#ifdef WIN32
+	mutex_init(&cache->io_lock);
+#endif
+
+	/* paged in a window at a time ahead of the readers, see fscache_read_ahead() */
+	cache->fd = fileno(cache->file);
+	fscache_advise(cache->fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	cache->next = fscache_list;
+	fscache_list = cache;
+	mutex_unlock(&fscache_mutex);
+
+	return cache;
+}
+
+void fscache_release(fscache_t cache)
+{
+	struct fscache** pp = NULL;
+	int i;
+
+	if (!cache) {
+		return;
+	}
+
+	mutex_lock(&fscache_mutex);
+	if (--cache->refs > 0) {
+		mutex_unlock(&fscache_mutex);
+		return;
+	}
+	for (pp = &fscache_list; *pp; pp = &(*pp)->next) {
+		if (*pp == cache) {
+			*pp = cache->next;
+			break;
+		}
+	}
+	mutex_unlock(&fscache_mutex);
+
+	for (i = 0; i < FSCACHE_BLOCK_SLOTS; i++) {
+		if (cache->slots[i]) {
+			free(cache->slots[i]->data);
+			free(cache->slots[i]);
+		}
+	}
+
+	/* last stream is done, hand the pages back */
+	fscache_advise(cache->fd, 0, 0, POSIX_FADV_DONTNEED);
+	fclose(cache->file);
+	cond_destroy(&cache->cond);
+	mutex_destroy(&cache->lock);
+#ifdef WIN32
+	mutex_destroy(&cache->io_lock);
+#endif
+	free(cache->path);
+	free(cache);
+}
+
+uint64_t fscache_get_size(fscache_t cache)
+{
+	return (cache) ? cache->size : 0;
+}
+
+void fscache_drop_behind(fscache_t cache, uint64_t offset)
+{
+	if (!cache || cache->fd < 0) {
+		return;
+	}
+
+	mutex_lock(&fscache_mutex);
+	/* other streams may still need these pages, and a stream that started
+	 * after an earlier one finished may still be behind what was dropped */
+	if (cache->refs == 1 && offset > cache->dropped && offset - cache->dropped >= FSCACHE_WINDOW_SIZE) {
+		fscache_advise(cache->fd, cache->dropped, offset - cache->dropped, POSIX_FADV_DONTNEED);
+		cache->dropped = offset;
+	}
+	mutex_unlock(&fscache_mutex);
+}
+
+/* asks for the data ahead of offset to be read in the background, a window
+ * at a time so the whole image never competes with the rest of the page
+ * cache. called with the cache lock held. */
+static void fscache_read_ahead(fscache_t cache, uint64_t offset)
+{
+	uint64_t start = offset;
+	uint64_t end = offset + FSCACHE_READAHEAD_SIZE;
+
+	if (end > cache->size) {
+		end = cache->size;
+	}
+	if (end <= cache->readahead) {
+		/* a stream ahead of this one asked for it already */
+		return;
+	}
+	if (cache->readahead > start) {
+		start = cache->readahead;
+	}
+	if (end - start < FSCACHE_WINDOW_SIZE && end < cache->size) {
+		return;
+	}
+	fscache_advise(cache->fd, start, end - start, POSIX_FADV_WILLNEED);
+	cache->readahead = end;
+}
+
+/* reads a block into a slot reserved by the caller, without the cache lock */
+static int fscache_load_block(fscache_t cache, struct fscache_block* block, uint64_t index)
+{
+	uint64_t offset = index * FSCACHE_BLOCK_SIZE;
+	uint32_t size = FSCACHE_BLOCK_SIZE;
+	int res = 0;
+
+	if (offset >= cache->size) {
+		return -1;
+	}
+	if (cache->size - offset < size) {
+		size = (uint32_t)(cache->size - offset);
+	}
+
+	if (!block->data) {
+		block->data = (unsigned char*)malloc(FSCACHE_BLOCK_SIZE);
+		if (!block->data) {
+			error("ERROR: Out of memory\n");
+			return -1;
+		}
+	}
+
+#ifdef WIN32
+	mutex_lock(&cache->io_lock);
+	if (fseeko(cache->file, offset, SEEK_SET) < 0 || fread(block->data, 1, size, cache->file) != size) {
+		res = -1;
+	}
+	mutex_unlock(&cache->io_lock);
+#else
+	uint32_t done = 0;
+	while (done < size) {
+		ssize_t r = pread(cache->fd, block->data + done, size - done, (off_t)(offset + done));
+		if (r < 0 && errno == EINTR) {
+			continue;
+		}
+		if (r <= 0) {
+			res = -1;
+			break;
+		}
+		done += (uint32_t)r;
+	}
+#endif
+	if (res < 0) {
+		error("ERROR: Unable to read filesystem image at offset %llu: %s\n", (unsigned long long)offset, strerror(errno));
+		return -1;
+	}
+
+	block->size = size;
+	block->has_sha1 = 0;
+	return 0;
+}
+
+int fscache_get_block(fscache_t cache, uint64_t index, fscache_block_t* block)
+{
+	struct fscache_block* blk = NULL;
+	int slot = (int)(index % FSCACHE_BLOCK_SLOTS);
+
+	if (!cache || !block) {
+		return -1;
+	}
+	*block = NULL;
+
+	mutex_lock(&cache->lock);
+	while (1) {
+		blk = cache->slots[slot];
+		if (!blk || blk->index != index || blk->state == FSCACHE_BLOCK_EMPTY) {
+			break;
+		}
+		if (blk->state == FSCACHE_BLOCK_READY) {
+			/* another stream already read this one */
+			blk->refs++;
+			mutex_unlock(&cache->lock);
+			metrics_cache_lookup("filesystem", 1);
+			*block = blk;
+			return 0;
+		}
+		/* another stream is reading it right now */
+		cond_wait(&cache->cond, &cache->lock);
+	}
+	metrics_cache_lookup("filesystem", 0);
+
+	if (!blk) {
+		blk = (struct fscache_block*)malloc(sizeof(struct fscache_block));
+		if (!blk) {
+			mutex_unlock(&cache->lock);
+			error("ERROR: Out of memory\n");
+			return -1;
+		}
+		memset(blk, '\0', sizeof(struct fscache_block));
+		blk->cached = 1;
+		cache->slots[slot] = blk;
+	} else if (blk->refs > 0 || blk->state == FSCACHE_BLOCK_LOADING) {
+		/* slot is busy with a block a slower stream still holds */
+		blk = (struct fscache_block*)malloc(sizeof(struct fscache_block));
+		if (!blk) {
+			mutex_unlock(&cache->lock);
+			error("ERROR: Out of memory\n");
+			return -1;
+		}
+		memset(blk, '\0', sizeof(struct fscache_block));
+	}
+
+	/* reserve the slot, readers of the same index wait for it */
+	blk->index = index;
+	blk->state = FSCACHE_BLOCK_LOADING;
+	blk->refs = 1;
+	fscache_read_ahead(cache, index * FSCACHE_BLOCK_SIZE);
+	mutex_unlock(&cache->lock);
+
+	int res = fscache_load_block(cache, blk, index);
+
+	mutex_lock(&cache->lock);
+	if (res < 0) {
+		blk->state = FSCACHE_BLOCK_EMPTY;
+		blk->size = 0;
+		blk->refs = 0;
+		if (!blk->cached) {
+			free(blk->data);
+			free(blk);
+		}
+		blk = NULL;
+	} else {
+		blk->state = FSCACHE_BLOCK_READY;
+	}
+	cond_broadcast(&cache->cond);
+	mutex_unlock(&cache->lock);
+
+	if (!blk) {
+		return -1;
+	}
+	*block = blk;
+	return 0;
+}
+
+void fscache_put_block(fscache_t cache, fscache_block_t block)
+{
+	if (!cache || !block) {
+		return;
+	}
+
+	mutex_lock(&cache->lock);
+	block->refs--;
+	if (!block->cached && block->refs <= 0) {
+		free(block->data);
+		free(block);
+	}
+	mutex_unlock(&cache->lock);
+}
+
+const unsigned char* fscache_block_sha1(fscache_t cache, fscache_block_t block)
+{
+	SHA_CTX sha1;
+	unsigned char digest[20];
+
+	mutex_lock(&cache->lock);
+	int has_sha1 = block->has_sha1;
+	mutex_unlock(&cache->lock);
+	if (has_sha1) {
+		return block->sha1;
+	}
+
+	/* the data doesn't change while we hold a reference, so this is done
+	 * without the lock. two streams may hash the same block at worst. */
+	SHA1_Init(&sha1);
+	SHA1_Update(&sha1, block->data, block->size);
+	SHA1_Final(digest, &sha1);
+
+	mutex_lock(&cache->lock);
+	if (!block->has_sha1) {
+		memcpy(block->sha1, digest, sizeof(digest));
+		block->has_sha1 = 1;
+	}
+	mutex_unlock(&cache->lock);
+
+	return block->sha1;
+}
@@ -0,0 +1,87 @@
+/*
+ * fscache.h
+ * Page cache policy for large filesystem images
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_FSCACHE_H
+#define IDEVICERESTORE_FSCACHE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdint.h>
+
+/* files smaller than this are left to the default page cache behavior */
+#define FSCACHE_MIN_SIZE 0x4000000
+/* write-behind and drop-behind granularity */
+#define FSCACHE_WINDOW_SIZE 0x800000
+/* how far ahead of the readers the image is paged in */
+#define FSCACHE_READAHEAD_SIZE (4 * FSCACHE_WINDOW_SIZE)
+/* shared read block size, matches the ASR checksum chunk size */
+#define FSCACHE_BLOCK_SIZE 0x20000
+/* number of blocks kept around for concurrent readers */
+#define FSCACHE_BLOCK_SLOTS 256
+
+typedef struct {
+	FILE* file;
+	int fd;
+	uint64_t size;
+	uint64_t submitted;
+	uint64_t released;
+} fscache_writer_t;
+
+void fscache_writer_init(fscache_writer_t* writer, FILE* file, uint64_t size);
+void fscache_writer_update(fscache_writer_t* writer, uint64_t written);
+void fscache_writer_finish(fscache_writer_t* writer);
+
+enum {
+	FSCACHE_BLOCK_EMPTY = 0,
+	FSCACHE_BLOCK_LOADING,
+	FSCACHE_BLOCK_READY
+};
+
+struct fscache_block {
+	uint64_t index;
+	uint32_t size;
+	int state;
+	int refs;
+	int cached;
+	int has_sha1;
+	unsigned char sha1[20];
+	unsigned char* data;
+};
+typedef struct fscache_block *fscache_block_t;
+
+struct fscache;
+typedef struct fscache *fscache_t;
+
+fscache_t fscache_acquire(const char* path);
+void fscache_release(fscache_t cache);
+uint64_t fscache_get_size(fscache_t cache);
+void fscache_drop_behind(fscache_t cache, uint64_t offset);
+
+int fscache_get_block(fscache_t cache, uint64_t index, fscache_block_t* block);
+void fscache_put_block(fscache_t cache, fscache_block_t block);
+const unsigned char* fscache_block_sha1(fscache_t cache, fscache_block_t block);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -47,11 +47,19 @@
 #include "restore.h"
 #include "download.h"
 #include "recovery.h"
+#include "personalize.h"
+#include "fleet.h"
+#include "usbtopo.h"
+#include "trace.h"
+#include "replay.h"
+#include "phase.h"
+#include "metrics.h"
 #include "idevicerestore.h"
 
 #include "limera1n.h"
 
 #include "locking.h"
+#include "thread.h"
 
 #define VERSION_XML "version.xml"
 
@@ -71,12 +79,22 @@ static struct option longopts[] = {
 	{ "pwn",     no_argument,       NULL, 'p' },
 	{ "no-action", no_argument,     NULL, 'n' },
 	{ "cache-path", required_argument, NULL, 'C' },
+	{ "fleet",   required_argument, NULL, 'F' },
+	{ "jobs",    required_argument, NULL, 'j' },
+	{ "bus-limit", required_argument, NULL, 'B' },
+	{ "usb-topology", required_argument, NULL, 'T' },
+	{ "record",  required_argument, NULL, 'R' },
+	{ "replay",  required_argument, NULL, 'Y' },
+	{ "timing",  required_argument, NULL, 'P' },
+	{ "metrics", required_argument, NULL, 'M' },
 	{ NULL, 0, NULL, 0 }
 };
 
 void usage(int argc, char* argv[]) {
 	char* name = strrchr(argv[0], '/');
 	printf("Usage: %s [OPTIONS] FILE\n", (name ? name + 1 : argv[0]));
+	printf("       %s [OPTIONS] --fleet JOBLIST\n", (name ? name + 1 : argv[0]));
+	printf("       %s [OPTIONS] --replay TRACE [FILE]\n", (name ? name + 1 : argv[0]));
 	printf("Restore IPSW firmware FILE to an iOS device.\n\n");
 	printf("  -i, --ecid ECID\ttarget specific device by its hexadecimal ECID\n");
 	printf("                 \te.g. 0xaabb123456 or 00000012AABBCCDD\n");
@@ -99,12 +117,281 @@ void usage(int argc, char* argv[]) {
 	printf("                 \tthe on demand ipsw download is performed before exiting.\n");
 	printf("  -C, --cache-path DIR\tUse specified directory for caching extracted\n");
 	printf("                      \tor other reused files.\n");
+	printf("  -F, --fleet JOBLIST\trestore several devices concurrently. JOBLIST has one\n");
+	printf("                     \t'<ECID or UDID> <IPSW>' pair per line.\n");
+	printf("  -j, --jobs NUM\t\tnumber of concurrent restores with --fleet (default %d)\n", FLEET_DEFAULT_WORKERS);
+	printf("  -B, --bus-limit NUM\tnumber of devices per USB hub receiving the filesystem,\n");
+	printf("                     \tramdisk or kernelcache at a time with --fleet (default %d)\n", USBTOPO_DEFAULT_BUS_LIMIT);
+	printf("  -T, --usb-topology FILE\tread device locations from FILE instead of sysfs.\n");
+	printf("                         \tFILE has one '<ECID or UDID> <bus> <port path>' per line.\n");
+	printf("  -R, --record FILE\trecord the messages exchanged with restored to FILE\n");
+	printf("  -Y, --replay FILE\tanswer the requests recorded in FILE again without a\n");
+	printf("                   \tdevice and report how long each data type took. The\n");
+	printf("                   \tFILE argument is optional and overrides the IPSW recorded.\n");
+	printf("  -P, --timing PREFIX\twrite wall and CPU time, I/O and peak memory of each\n");
+	printf("                     \trestore phase to PREFIX.json and a Chrome trace to\n");
+	printf("                     \tPREFIX.trace.json\n");
+	printf("  -M, --metrics ADDR\tserve restore counts, ASR throughput, TSS latency, cache\n");
+	printf("                    \thit rates and queue depths for Prometheus on ADDR, a TCP\n");
+	printf("                    \tport on localhost or the path of a unix socket\n");
 	printf("\n");
 	printf("Homepage: <" PACKAGE_URL ">\n");
 }
 #endif
 
-static int idevicerestore_keep_pers = 0;
+struct filesystem_extraction {
+	thread_t thread;
+	char* ipsw;
+	char* fsname;
+	char* target;   /* file the filesystem is extracted to */
+	char* rename_to; /* cache path to move it to when complete, if any */
+	char* filesystem;
+	int result;
+	int done;
+	int cancel;     /* set when the last restore using it gives up, see ipsw.c */
+	int refs;       /* restores sharing this extraction */
+	mutex_t mutex;
+	cond_t cond;
+	struct filesystem_extraction* next;
+};
+
+/* extractions into the cache directory, concurrent restores of the same IPSW attach to them */
+static struct filesystem_extraction* filesystem_extractions = NULL;
+static mutex_t filesystem_extractions_mutex;
+static thread_once_t filesystem_extractions_once = THREAD_ONCE_INIT;
+
+static void filesystem_extractions_init(void)
+{
+	mutex_init(&filesystem_extractions_mutex);
+}
+
+static void* filesystem_extraction_thread(void* arg)
+{
+	struct filesystem_extraction* fsx = (struct filesystem_extraction*)arg;
+	int result = 0;
+
+	/* other restores attach to this, it must not log or record phases into
+	 * the one that started it, which may be gone before we are done. each
+	 * restore times its own wait for the result instead. */
+	thread_set_context(NULL);
+
+	/* no progress bar, it would run right through the device mode transitions */
+	if (ipsw_extract_to_file_cancelable(fsx->ipsw, fsx->fsname, fsx->target, &fsx->cancel) < 0) {
+		if (!__atomic_load_n(&fsx->cancel, __ATOMIC_ACQUIRE)) {
+			error("ERROR: Unable to extract filesystem from IPSW\n");
+		}
+		if (fsx->rename_to) {
+			/* a partial <fsname>.extract would keep others from using the cache */
+			remove(fsx->target);
+		}
+		result = -1;
+	} else if (fsx->rename_to) {
+		// rename <fsname>.extract to <fsname>
+		remove(fsx->rename_to);
+		rename(fsx->target, fsx->rename_to);
+		fsx->filesystem = fsx->rename_to;
+	} else {
+		fsx->filesystem = fsx->target;
+	}
+	if (result == 0) {
+		debug("DEBUG: Filesystem extracted to %s\n", fsx->filesystem);
+	}
+
+	mutex_lock(&fsx->mutex);
+	fsx->result = result;
+	fsx->done = 1;
+	cond_broadcast(&fsx->cond);
+	mutex_unlock(&fsx->mutex);
+
+	return NULL;
+}
+
+static int filesystem_extraction_start(struct idevicerestore_client_t* client, const char* fsname, const char* target, const char* rename_to)
+{
+	struct filesystem_extraction* fsx = (struct filesystem_extraction*)malloc(sizeof(struct filesystem_extraction));
+	if (!fsx) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	memset(fsx, '\0', sizeof(struct filesystem_extraction));
+	fsx->ipsw = strdup(client->ipsw);
+	fsx->fsname = strdup(fsname);
+	fsx->target = strdup(target);
+	fsx->rename_to = (rename_to) ? strdup(rename_to) : NULL;
+	fsx->result = -1;
+	fsx->refs = 1;
+	mutex_init(&fsx->mutex);
+	cond_init(&fsx->cond);
+
+	if (thread_new(&fsx->thread, filesystem_extraction_thread, fsx) != 0) {
+		error("ERROR: Unable to start filesystem extraction thread\n");
+		mutex_destroy(&fsx->mutex);
+		cond_destroy(&fsx->cond);
+		free(fsx->ipsw);
+		free(fsx->fsname);
+		free(fsx->target);
+		free(fsx->rename_to);
+		free(fsx);
+		return -1;
+	}
+	if (fsx->rename_to) {
+		fsx->next = filesystem_extractions;
+		filesystem_extractions = fsx;
+	}
+	client->fs_extraction = fsx;
+
+	return 0;
+}
+
+/* starts extracting fsname to the cache path tmpf, or attaches to a restore
+ * in this process that is already doing so */
+static int filesystem_extraction_setup(struct idevicerestore_client_t* client, const char* fsname, const char* tmpf, char** filesystem, int* delete_fs)
+{
+	struct filesystem_extraction* fsx = NULL;
+	int res = 0;
+
+	thread_once(&filesystem_extractions_once, filesystem_extractions_init);
+	mutex_lock(&filesystem_extractions_mutex);
+	for (fsx = filesystem_extractions; fsx; fsx = fsx->next) {
+		if (strcmp(fsx->rename_to, tmpf) != 0) {
+			continue;
+		}
+		mutex_lock(&fsx->mutex);
+		int failed = (fsx->done && fsx->result < 0);
+		mutex_unlock(&fsx->mutex);
+		if (!failed) {
+			fsx->refs++;
+			break;
+		}
+	}
+	if (fsx) {
+		mutex_unlock(&filesystem_extractions_mutex);
+		info("Sharing filesystem extraction with another restore\n");
+		client->fs_extraction = fsx;
+		*filesystem = strdup(tmpf);
+		return 0;
+	}
+
+	char extfn[1024];
+	strcpy(extfn, tmpf);
+	strcat(extfn, ".extract");
+	char lockfn[1024];
+	strcpy(lockfn, tmpf);
+	strcat(lockfn, ".lock");
+	lock_info_t li;
+
+	lock_file(lockfn, &li);
+	FILE* extf = NULL;
+	if (access(extfn, F_OK) != 0) {
+		extf = fopen(extfn, "w");
+	}
+	unlock_file(&li);
+	if (!extf) {
+		// use temp filename
+		*filesystem = tempnam(NULL, "ipsw_");
+		if (!*filesystem) {
+			error("WARNING: Could not get temporary filename, using '%s' in current directory\n", fsname);
+			*filesystem = strdup(fsname);
+		}
+		*delete_fs = 1;
+	} else {
+		// use <fsname>.extract as filename
+		*filesystem = strdup(extfn);
+		fclose(extf);
+	}
+	remove(lockfn);
+
+	// Extract filesystem from IPSW while the device goes through its mode changes
+	info("Extracting filesystem from IPSW in background\n");
+	res = filesystem_extraction_start(client, fsname, *filesystem, (strstr(*filesystem, ".extract")) ? tmpf : NULL);
+	mutex_unlock(&filesystem_extractions_mutex);
+
+	return res;
+}
+
+int filesystem_extraction_wait(struct idevicerestore_client_t* client, const char** filesystem)
+{
+	struct filesystem_extraction* fsx = client->fs_extraction;
+	if (!fsx) {
+		return 0;
+	}
+	mutex_lock(&fsx->mutex);
+	if (!fsx->done) {
+		info("Waiting for filesystem extraction to finish...\n");
+		while (!fsx->done) {
+			cond_wait(&fsx->cond, &fsx->mutex);
+		}
+	}
+	mutex_unlock(&fsx->mutex);
+	if (fsx->result < 0) {
+		return -1;
+	}
+	if (filesystem) {
+		*filesystem = fsx->filesystem;
+	}
+	return 0;
+}
+
+static void filesystem_extraction_free(struct idevicerestore_client_t* client)
+{
+	struct filesystem_extraction* fsx = client->fs_extraction;
+	struct filesystem_extraction** pp = NULL;
+	if (!fsx) {
+		return;
+	}
+	client->fs_extraction = NULL;
+
+	mutex_lock(&filesystem_extractions_mutex);
+	if (--fsx->refs > 0) {
+		mutex_unlock(&filesystem_extractions_mutex);
+		return;
+	}
+	for (pp = &filesystem_extractions; *pp; pp = &(*pp)->next) {
+		if (*pp == fsx) {
+			*pp = fsx->next;
+			break;
+		}
+	}
+	mutex_unlock(&filesystem_extractions_mutex);
+
+	/* nobody is going to use it anymore, don't let the exit wait for it */
+	__atomic_store_n(&fsx->cancel, 1, __ATOMIC_RELEASE);
+	thread_join(fsx->thread);
+	thread_free(fsx->thread);
+	mutex_destroy(&fsx->mutex);
+	cond_destroy(&fsx->cond);
+	free(fsx->ipsw);
+	free(fsx->fsname);
+	free(fsx->target);
+	free(fsx->rename_to);
+	free(fsx);
+}
+
+/* waits for the initial TSS request sent by idevicerestore_start(), if it
+ * is still on its way, and starts personalizing once the tickets are known.
+ * called right before something needs client->tss. */
+static int tss_wait(struct idevicerestore_client_t* client, plist_t build_identity)
+{
+	if (!client->tss_future) {
+		return 0;
+	}
+	client->tss = tss_future_get(client->tss_future);
+	tss_future_free(client->tss_future);
+	client->tss_future = NULL;
+	if (!client->tss) {
+		error("ERROR: Unable to get SHSH blobs for this device\n");
+		return -1;
+	}
+	info("Received SHSH blobs\n");
+
+	if (!(client->flags & FLAG_SHSHONLY)) {
+		fixup_tss(client->tss);
+		/* personalize everything we will send while the device is busy */
+		personalize_pool_free(client->personalize);
+		client->personalize = personalize_pool_new(client->ipsw, build_identity, client->tss);
+	}
+	return 0;
+}
 
 static int load_version_data(struct idevicerestore_client_t* client)
 {
@@ -171,14 +458,11 @@ static int load_version_data(struct idevicerestore_client_t* client)
 	return 0;
 }
 
-int idevicerestore_start(struct idevicerestore_client_t* client)
+static int idevicerestore_run(struct idevicerestore_client_t* client)
 {
 	int tss_enabled = 0;
 	int result = 0;
-
-	if (!client) {
-		return -1;
-	}
+	struct phase* phase = NULL;
 
 	if ((client->flags & FLAG_LATEST) && (client->flags & FLAG_CUSTOM)) {
 		error("ERROR: FLAG_LATEST cannot be used with FLAG_CUSTOM.\n");
@@ -193,13 +477,14 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	if (client->flags & FLAG_DEBUG) {
 		idevice_set_debug_level(1);
 		irecv_set_debug_level(1);
-		idevicerestore_debug = 1;
 	}
 
 	idevicerestore_progress(client, RESTORE_STEP_DETECT, 0.0);
 
 	// update version data (from cache, or apple if too old)
+	phase = phase_begin("version data");
 	load_version_data(client);
+	phase_end(phase);
 
 	// check which mode the device is currently in so we know where to start
 	if (check_mode(client) < 0) {
@@ -280,9 +565,12 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 		}
 		dfu_client_free(client);
 
-		sleep(1);
-
 		free(wtftmp);
+		if (recovery_wait_for_disconnect(client, 1000) < 0) {
+			error("ERROR: Device did not leave WTF mode\n");
+			return -1;
+		}
+
 		client->mode = &idevicerestore_modes[MODE_DFU];
 	}
 
@@ -360,19 +648,23 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 
 	// extract buildmanifest
 	plist_t buildmanifest = NULL;
+	phase = phase_begin("build manifest");
 	if (client->flags & FLAG_CUSTOM) {
 		info("Extracting Restore.plist from IPSW\n");
 		if (ipsw_extract_restore_plist(client->ipsw, &buildmanifest) < 0) {
+			phase_end(phase);
 			error("ERROR: Unable to extract Restore.plist from %s. Firmware file might be corrupt.\n", client->ipsw);
 			return -1;
 		}
 	} else {
 		info("Extracting BuildManifest from IPSW\n");
 		if (ipsw_extract_build_manifest(client->ipsw, &buildmanifest, &tss_enabled) < 0) {
+			phase_end(phase);
 			error("ERROR: Unable to extract BuildManifest from %s. Firmware file might be corrupt.\n", client->ipsw);
 			return -1;
 		}
 	}
+	phase_end(phase);
 	idevicerestore_progress(client, RESTORE_STEP_DETECT, 0.8);
 
 	/* check if device type is supported by the given build manifest */
@@ -430,14 +722,20 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 				return -1;
 			}
 
-			char *tok = strtok(fmanifest, "\r\n");
+			/* split into lines, strtok() is not reentrant */
+			char *tok = fmanifest;
 			int fc = 0;
-			while (tok) {
-				files[fc++] = strdup(tok);
-				if (fc >= 16) {
+			while (fc < 16) {
+				tok += strspn(tok, "\r\n");
+				if (*tok == '\0') {
 					break;
 				}
-				tok = strtok(NULL, "\r\n");
+				size_t toklen = strcspn(tok, "\r\n");
+				files[fc] = (char*)malloc(toklen + 1);
+				memcpy(files[fc], tok, toklen);
+				files[fc][toklen] = '\0';
+				fc++;
+				tok += toklen;
 			}
 			free(fmanifest);
 
@@ -569,6 +867,57 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 
 	idevicerestore_progress(client, RESTORE_STEP_PREPARE, 0.0);
 
+	/* retrieve shsh blobs if required */
+	tss_future_free(client->tss_future);
+	client->tss_future = NULL;
+	if (tss_enabled) {
+		debug("Getting device's ECID for TSS request\n");
+		/* fetch the device's ECID for the TSS request */
+		if (get_ecid(client, &client->ecid) < 0) {
+			error("ERROR: Unable to find device ECID\n");
+			return -1;
+		}
+		info("Found ECID " FMT_qu "\n", (long long unsigned int)client->ecid);
+
+		if (client->build_major > 8) {
+			unsigned char* nonce = NULL;
+			int nonce_size = 0;
+			if (get_ap_nonce(client, &nonce, &nonce_size) < 0) {
+				/* the first nonce request with older firmware releases can fail and it's OK */
+				info("NOTE: Unable to get nonce from device\n");
+			}
+
+			if (!client->nonce || (nonce_size != client->nonce_size) || (memcmp(nonce, client->nonce, nonce_size) != 0)) {
+				if (client->nonce) {
+					free(client->nonce);
+				}
+				client->nonce = nonce;
+				client->nonce_size = nonce_size;
+			} else {
+				free(nonce);
+			}
+		}
+
+		/* the round trip to the TSS server overlaps with the filesystem setup
+		 * and the mode transitions below, see tss_wait() */
+		plist_t tss_request = NULL;
+		if (get_tss_request(client, build_identity, &tss_request, &client->tss) < 0) {
+			error("ERROR: Unable to get SHSH blobs for this device\n");
+			return -1;
+		}
+		if (tss_request) {
+			client->tss_future = tss_request_send_async(tss_request, client->tss_url);
+			if (!client->tss_future) {
+				error("ERROR: Unable to get SHSH blobs for this device\n");
+				return -1;
+			}
+		}
+		/* the baseband ticket is fetched while the device reboots into restore mode */
+		if (!(client->flags & FLAG_SHSHONLY) && restore_prefetch_baseband_tss(client, build_identity) < 0) {
+			debug("DEBUG: Could not request Baseband SHSH blobs from preflight info\n");
+		}
+	}
+
 	// Get filesystem name from build identity
 	char* fsname = NULL;
 	if (build_identity_get_component_path(build_identity, "OS", &fsname) < 0) {
@@ -616,96 +965,23 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	}
 
 	if (!filesystem && !(client->flags & FLAG_SHSHONLY)) {
-		char extfn[1024];
-		strcpy(extfn, tmpf);
-		strcat(extfn, ".extract");
-		char lockfn[1024];
-		strcpy(lockfn, tmpf);
-		strcat(lockfn, ".lock");
-		lock_info_t li;
-
-		lock_file(lockfn, &li);
-		FILE* extf = NULL;
-		if (access(extfn, F_OK) != 0) {
-			extf = fopen(extfn, "w");
-		}
-		unlock_file(&li);
-		if (!extf) {
-			// use temp filename
-			filesystem = tempnam(NULL, "ipsw_");
-			if (!filesystem) {
-				error("WARNING: Could not get temporary filename, using '%s' in current directory\n", fsname);
-				filesystem = strdup(fsname);
-			}
-			delete_fs = 1;
-		} else {
-			// use <fsname>.extract as filename
-			filesystem = strdup(extfn);
-			fclose(extf);
-		}
-		remove(lockfn);
-
-		// Extract filesystem from IPSW
-		info("Extracting filesystem from IPSW\n");
-		if (ipsw_extract_to_file_with_progress(client->ipsw, fsname, filesystem, 1) < 0) {
-			error("ERROR: Unable to extract filesystem from IPSW\n");
-			if (client->tss)
-				plist_free(client->tss);
+		if (filesystem_extraction_setup(client, fsname, tmpf, &filesystem, &delete_fs) < 0) {
 			plist_free(buildmanifest);
 			return -1;
 		}
-
-		if (strstr(filesystem, ".extract")) {
-			// rename <fsname>.extract to <fsname>
-			remove(tmpf);
-			rename(filesystem, tmpf);
-			free(filesystem);
-			filesystem = strdup(tmpf); 
-		}
 	}
 
 	idevicerestore_progress(client, RESTORE_STEP_PREPARE, 0.2);
 
-	/* retrieve shsh blobs if required */
-	if (tss_enabled) {
-		debug("Getting device's ECID for TSS request\n");
-		/* fetch the device's ECID for the TSS request */
-		if (get_ecid(client, &client->ecid) < 0) {
-			error("ERROR: Unable to find device ECID\n");
-			return -1;
-		}
-		info("Found ECID " FMT_qu "\n", (long long unsigned int)client->ecid);
-
-		if (client->build_major > 8) {
-			unsigned char* nonce = NULL;
-			int nonce_size = 0;
-			if (get_ap_nonce(client, &nonce, &nonce_size) < 0) {
-				/* the first nonce request with older firmware releases can fail and it's OK */
-				info("NOTE: Unable to get nonce from device\n");
-			}
-
-			if (!client->nonce || (nonce_size != client->nonce_size) || (memcmp(nonce, client->nonce, nonce_size) != 0)) {
-				if (client->nonce) {
-					free(client->nonce);
-				}
-				client->nonce = nonce;
-				client->nonce_size = nonce_size;
-			} else {
-				free(nonce);
-			}
-		}
-
-		if (get_tss_response(client, build_identity, &client->tss) < 0) {
-			error("ERROR: Unable to get SHSH blobs for this device\n");
-			return -1;
-		}
-	}
-
 	if (client->flags & FLAG_SHSHONLY) {
 		if (!tss_enabled) {
 			info("This device does not require a TSS record\n");
 			return 0;
 		}
+		if (tss_wait(client, build_identity) < 0) {
+			plist_free(buildmanifest);
+			return -1;
+		}
 		if (!client->tss) {
 			error("ERROR: could not fetch TSS record\n");
 			plist_free(buildmanifest);
@@ -744,7 +1020,7 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	}
 
 	/* verify if we have tss records if required */
-	if ((tss_enabled) && (client->tss == NULL)) {
+	if ((tss_enabled) && (client->tss == NULL) && !client->tss_future) {
 		error("ERROR: Unable to proceed without a TSS record.\n");
 		plist_free(buildmanifest);
 		return -1;
@@ -753,13 +1029,21 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	if ((tss_enabled) && client->tss) {
 		/* fix empty dicts */
 		fixup_tss(client->tss);
+
+		/* personalize everything we will send while the device is busy */
+		personalize_pool_free(client->personalize);
+		client->personalize = personalize_pool_new(client->ipsw, build_identity, client->tss);
 	}
+	/* otherwise the pool is started by tss_wait() once the request is back */
 	idevicerestore_progress(client, RESTORE_STEP_PREPARE, 0.25);
 
 	// if the device is in normal mode, place device into recovery mode
 	if (client->mode->index == MODE_NORMAL) {
 		info("Entering recovery mode...\n");
-		if (normal_enter_recovery(client) < 0) {
+		phase = phase_begin("normal to recovery");
+		int res = normal_enter_recovery(client);
+		phase_end(phase);
+		if (res < 0) {
 			error("ERROR: Unable to place device into recovery mode from %s mode\n", client->mode->string);
 			if (client->tss)
 				plist_free(client->tss);
@@ -777,6 +1061,7 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 		if ((client->flags & FLAG_CUSTOM) && limera1n_is_supported(client->device)) {
 			info("connecting to DFU\n");
 			if (dfu_client_new(client) < 0) {
+				filesystem_extraction_free(client);
 				if (delete_fs && filesystem)
 					unlink(filesystem);
 				return -1;
@@ -786,6 +1071,7 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 			if (limera1n_exploit(client->device, &client->dfu->client) != 0) {
 				error("ERROR: limera1n exploit failed\n");
 				dfu_client_free(client);
+				filesystem_extraction_free(client);
 				if (delete_fs && filesystem)
 					unlink(filesystem);
 				return -1;
@@ -793,11 +1079,21 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 			dfu_client_free(client);
 			info("exploited\n");
 		}
-		if (dfu_enter_recovery(client, build_identity) < 0) {
+		if (tss_wait(client, build_identity) < 0) {
+			filesystem_extraction_free(client);
+			if (delete_fs && filesystem)
+				unlink(filesystem);
+			return -1;
+		}
+		phase = phase_begin("DFU to recovery");
+		int res = dfu_enter_recovery(client, build_identity);
+		phase_end(phase);
+		if (res < 0) {
 			error("ERROR: Unable to place device into recovery mode from %s mode\n", client->mode->string);
 			plist_free(buildmanifest);
 			if (client->tss)
 				plist_free(client->tss);
+			filesystem_extraction_free(client);
 			if (delete_fs && filesystem)
 				unlink(filesystem);
 			return -2;
@@ -807,6 +1103,12 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	if (client->mode->index == MODE_DFU) {
 		client->mode = &idevicerestore_modes[MODE_RECOVERY];
 	} else {
+		if (tss_wait(client, build_identity) < 0) {
+			filesystem_extraction_free(client);
+			if (delete_fs && filesystem)
+				unlink(filesystem);
+			return -1;
+		}
 		if ((client->build_major > 8) && !(client->flags & FLAG_CUSTOM)) {
 			if (!client->image4supported) {
 				/* send ApTicket */
@@ -817,20 +1119,39 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 		}
 
 		/* now we load the iBEC */
+		phase = phase_begin("recovery to iBEC");
 		if (recovery_send_ibec(client, build_identity) < 0) {
+			phase_end(phase);
 			error("ERROR: Unable to send iBEC\n");
+			filesystem_extraction_free(client);
 			if (delete_fs && filesystem)
 				unlink(filesystem);
 			return -2;
 		}
 		recovery_client_free(client);
-	
-		/* this must be long enough to allow the device to run the iBEC */
-		/* FIXME: Probably better to detect if the device is back then */
-		sleep(7);
+
+		/* the device drops off the bus when it starts the iBEC, the next
+		 * connection attempt then waits for it to come back */
+		if (recovery_wait_for_disconnect(client, 7000) < 0) {
+			phase_end(phase);
+			error("ERROR: Device did not reboot into iBEC\n");
+			filesystem_extraction_free(client);
+			if (delete_fs && filesystem)
+				unlink(filesystem);
+			return -2;
+		}
+		phase_end(phase);
 	}
 	idevicerestore_progress(client, RESTORE_STEP_PREPARE, 0.5);
 
+	/* a device that was in restore mode already skipped all of the above */
+	if (tss_wait(client, build_identity) < 0) {
+		filesystem_extraction_free(client);
+		if (delete_fs && filesystem)
+			unlink(filesystem);
+		return -1;
+	}
+
 	if (!client->image4supported && (client->build_major > 8)) {
 		// we need another tss request with nonce.
 		unsigned char* nonce = NULL;
@@ -839,6 +1160,7 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 		if (get_ap_nonce(client, &nonce, &nonce_size) < 0) {
 			error("ERROR: Unable to get nonce from device!\n");
 			recovery_send_reset(client);
+			filesystem_extraction_free(client);
 			if (delete_fs && filesystem)
 				unlink(filesystem);
 			return -2;
@@ -860,17 +1182,21 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 			plist_free(client->tss);
 			if (get_tss_response(client, build_identity, &client->tss) < 0) {
 				error("ERROR: Unable to get SHSH blobs for this device\n");
+				filesystem_extraction_free(client);
 				if (delete_fs && filesystem)
 					unlink(filesystem);
 				return -1;
 			}
 			if (!client->tss) {
 				error("ERROR: can't continue without TSS\n");
+				filesystem_extraction_free(client);
 				if (delete_fs && filesystem)
 					unlink(filesystem);
 				return -1;
 			}
 			fixup_tss(client->tss);
+			personalize_pool_free(client->personalize);
+			client->personalize = personalize_pool_new(client->ipsw, build_identity, client->tss);
 		}
 	}
 	idevicerestore_progress(client, RESTORE_STEP_PREPARE, 0.7);
@@ -879,15 +1205,20 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	if (client->mode->index == MODE_RECOVERY) {
 		if (client->srnm == NULL) {
 			error("ERROR: could not retrieve device serial number. Can't continue.\n");
+			filesystem_extraction_free(client);
 			if (delete_fs && filesystem)
 				unlink(filesystem);
 			return -1;
 		}
-		if (recovery_enter_restore(client, build_identity) < 0) {
+		phase = phase_begin("recovery to restore");
+		int res = recovery_enter_restore(client, build_identity);
+		phase_end(phase);
+		if (res < 0) {
 			error("ERROR: Unable to place device into restore mode\n");
 			plist_free(buildmanifest);
 			if (client->tss)
 				plist_free(client->tss);
+			filesystem_extraction_free(client);
 			if (delete_fs && filesystem)
 				unlink(filesystem);
 			return -2;
@@ -899,9 +1230,12 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	// device is finally in restore mode, let's do this
 	if (client->mode->index == MODE_RESTORE) {
 		info("About to restore device... \n");
+		phase = phase_begin("restore");
 		result = restore_device(client, build_identity, filesystem);
+		phase_end(phase);
 		if (result < 0) {
 			error("ERROR: Unable to restore device\n");
+			filesystem_extraction_free(client);
 			if (delete_fs && filesystem)
 				unlink(filesystem);
 			return result;
@@ -909,6 +1243,9 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	}
 
 	info("Cleaning up...\n");
+	personalize_pool_free(client->personalize);
+	client->personalize = NULL;
+	filesystem_extraction_free(client);
 	if (delete_fs && filesystem)
 		unlink(filesystem);
 
@@ -940,6 +1277,33 @@ int idevicerestore_start(struct idevicerestore_client_t* client)
 	return result;
 }
 
+int idevicerestore_start(struct idevicerestore_client_t* client)
+{
+	if (!client) {
+		return -1;
+	}
+
+	/* everything logged while restoring, on any thread, goes to this client */
+	struct idevicerestore_client_t* previous = idevicerestore_get_current_client();
+	idevicerestore_set_current_client(client);
+	metrics_add(METRIC_RESTORES_STARTED, NULL, 1);
+	double start = metrics_time();
+	client->step = RESTORE_STEP_DETECT;
+	int result = idevicerestore_run(client);
+	if (result == 0) {
+		metrics_add(METRIC_RESTORES_SUCCEEDED, NULL, 1);
+	} else {
+		metrics_add(METRIC_RESTORES_FAILED, metrics_step_name(client->step), 1);
+	}
+	metrics_observe(METRIC_RESTORE_DURATION, (result == 0) ? "success" : "failure", metrics_time() - start);
+	idevicerestore_set_current_client(previous);
+
+	/* the caller may close the client's streams once we return */
+	idevicerestore_flush_log();
+
+	return result;
+}
+
 struct idevicerestore_client_t* idevicerestore_client_new(void)
 {
 	struct idevicerestore_client_t* client = (struct idevicerestore_client_t*) malloc(sizeof(struct idevicerestore_client_t));
@@ -957,6 +1321,12 @@ void idevicerestore_client_free(struct idevicerestore_client_t* client)
 		return;
 	}
 
+	personalize_pool_free(client->personalize);
+	filesystem_extraction_free(client);
+	tss_future_free(client->tss_future);
+	tss_future_free(client->bbtss_prefetch);
+	trace_close(client->trace);
+	phase_log_free(client->phases);
 	if (client->tss_url) {
 		free(client->tss_url);
 	}
@@ -1056,6 +1426,13 @@ int main(int argc, char* argv[]) {
 	int opt = 0;
 	int optindex = 0;
 	char* ipsw = NULL;
+	char* joblist = NULL;
+	int workers = 0;
+	int bus_limit = 0;
+	char* record = NULL;
+	char* replay = NULL;
+	char* timing = NULL;
+	char* metrics = NULL;
 	int result = 0;
 
 	struct idevicerestore_client_t* client = idevicerestore_client_new();
@@ -1064,7 +1441,7 @@ int main(int argc, char* argv[]) {
 		return -1;
 	}
 
-	while ((opt = getopt_long(argc, argv, "dhcesxtpli:u:nC:k", longopts, &optindex)) > 0) {
+	while ((opt = getopt_long(argc, argv, "dhcesxtpli:u:nC:kF:j:B:T:R:Y:P:M:", longopts, &optindex)) > 0) {
 		switch (opt) {
 		case 'h':
 			usage(argc, argv);
@@ -1117,7 +1494,7 @@ int main(int argc, char* argv[]) {
 			break;
 
 		case 'k':
-			idevicerestore_keep_pers = 1;
+			client->flags |= FLAG_KEEP_PERS;
 			break;
 
 		case 'p':
@@ -1132,12 +1509,100 @@ int main(int argc, char* argv[]) {
 			client->cache_dir = strdup(optarg);
 			break;
 
+		case 'F':
+			joblist = optarg;
+			break;
+
+		case 'j':
+			workers = atoi(optarg);
+			if (workers <= 0) {
+				error("ERROR: Invalid number of jobs '%s'\n", optarg);
+				return -1;
+			}
+			break;
+
+		case 'B':
+			bus_limit = atoi(optarg);
+			if (bus_limit <= 0) {
+				error("ERROR: Invalid bus limit '%s'\n", optarg);
+				return -1;
+			}
+			break;
+
+		case 'T':
+			if (usbtopo_load(optarg) < 0) {
+				return -1;
+			}
+			break;
+
+		case 'R':
+			record = optarg;
+			break;
+
+		case 'Y':
+			replay = optarg;
+			break;
+
+		case 'P':
+			timing = optarg;
+			break;
+
+		case 'M':
+			metrics = optarg;
+			break;
+
 		default:
 			usage(argc, argv);
 			return -1;
 		}
 	}
 
+	if (joblist) {
+		if ((argc-optind) != 0 || (client->flags & (FLAG_PWN | FLAG_LATEST)) || client->ecid || client->udid || record || replay || timing) {
+			error("ERROR: --fleet takes the devices and IPSWs from the job list only.\n");
+			return -1;
+		}
+		struct fleet* fleet = fleet_new(joblist, client->flags, client->cache_dir);
+		if (!fleet) {
+			return -1;
+		}
+		if (client->tss_url) {
+			fleet_set_tss_url(fleet, client->tss_url);
+		}
+		fleet_set_bus_limit(fleet, bus_limit);
+		if (metrics && metrics_serve(metrics) < 0) {
+			fleet_free(fleet);
+			return -1;
+		}
+		curl_global_init(CURL_GLOBAL_ALL);
+		result = fleet_run(fleet, workers);
+		metrics_stop();
+		fleet_free(fleet);
+		usbtopo_unload();
+		idevicerestore_client_free(client);
+		curl_global_cleanup();
+		return result;
+	}
+
+	if (replay) {
+		if ((argc-optind) > 1 || record || metrics || (client->flags & (FLAG_PWN | FLAG_LATEST | FLAG_SHSHONLY))) {
+			error("ERROR: --replay only takes an optional IPSW to replay against.\n");
+			return -1;
+		}
+		if ((argc-optind) == 1) {
+			client->ipsw = strdup(argv[optind]);
+		}
+		if (timing) {
+			client->phases = phase_log_new();
+		}
+		result = replay_run(client, replay);
+		if (client->phases) {
+			phase_log_write(client->phases, timing);
+		}
+		idevicerestore_client_free(client);
+		return result;
+	}
+
 	if (((argc-optind) == 1) || (client->flags & FLAG_PWN) || (client->flags & FLAG_LATEST)) {
 		argc -= optind;
 		argv += optind;
@@ -1157,10 +1622,31 @@ int main(int argc, char* argv[]) {
 		client->ipsw = strdup(ipsw);
 	}
 
+	if (record) {
+		client->trace = trace_create(record);
+		if (!client->trace) {
+			return -1;
+		}
+	}
+
+	if (timing) {
+		client->phases = phase_log_new();
+	}
+
+	if (metrics && metrics_serve(metrics) < 0) {
+		return -1;
+	}
+
 	curl_global_init(CURL_GLOBAL_ALL);
 
 	result = idevicerestore_start(client);
 
+	metrics_stop();
+
+	if (client->phases) {
+		phase_log_write(client->phases, timing);
+	}
+
 	idevicerestore_client_free(client);
 
 	curl_global_cleanup();
@@ -1463,9 +1949,9 @@ plist_t build_manifest_get_build_identity_for_model(plist_t build_manifest, cons
 	return build_manifest_get_build_identity_for_model_with_restore_behavior(build_manifest, hardware_model, NULL);
 }
 
-int get_tss_response(struct idevicerestore_client_t* client, plist_t build_identity, plist_t* tss) {
+int get_tss_request(struct idevicerestore_client_t* client, plist_t build_identity, plist_t* tss_request, plist_t* tss) {
 	plist_t request = NULL;
-	plist_t response = NULL;
+	*tss_request = NULL;
 	*tss = NULL;
 
 	if ((client->build_major <= 8) || (client->flags & FLAG_CUSTOM)) {
@@ -1521,6 +2007,7 @@ int get_tss_response(struct idevicerestore_client_t* client, plist_t build_ident
 		} else {
 			error("No version found?!\n");
 		}
+		metrics_cache_lookup("tss", (*tss != NULL));
 	}
 
 	if (*tss) {
@@ -1598,10 +2085,10 @@ int get_tss_response(struct idevicerestore_client_t* client, plist_t build_ident
 	}
 
 	if (client->mode->index == MODE_NORMAL) {
-		/* normal mode; request baseband ticket aswell */
+		/* normal mode; the restore requests the baseband ticket separately, only save it with the SHSH blobs */
 		plist_t pinfo = NULL;
 		normal_get_preflight_info(client, &pinfo);
-		if (pinfo) {
+		if (pinfo && (client->flags & FLAG_SHSHONLY)) {
 			plist_t node;
 			node = plist_dict_get_item(pinfo, "Nonce");
 			if (node) {
@@ -1626,19 +2113,35 @@ int get_tss_response(struct idevicerestore_client_t* client, plist_t build_ident
 		client->preflight_info = pinfo;
 	}
 
+	plist_free(parameters);
+
+	*tss_request = request;
+
+	return 0;
+}
+
+int get_tss_response(struct idevicerestore_client_t* client, plist_t build_identity, plist_t* tss) {
+	plist_t request = NULL;
+	plist_t response = NULL;
+
+	if (get_tss_request(client, build_identity, &request, tss) < 0) {
+		return -1;
+	}
+	if (*tss) {
+		return 0;
+	}
+
 	/* send request and grab response */
 	response = tss_request_send(request, client->tss_url);
 	if (response == NULL) {
 		info("ERROR: Unable to send TSS request\n");
 		plist_free(request);
-		plist_free(parameters);
 		return -1;
 	}
 
 	info("Received SHSH blobs\n");
 
 	plist_free(request);
-	plist_free(parameters);
 
 	*tss = response;
 
@@ -1717,15 +2220,19 @@ int personalize_component(const char *component_name, const unsigned char* compo
 
 	if (tss_response && tss_response_get_ap_img4_ticket(tss_response, &component_blob, &component_blob_size) == 0) {
 		/* stitch ApImg4Ticket into IMG4 file */
-		img4_stitch_component(component_name, component_data, component_size, component_blob, component_blob_size, &stitched_component, &stitched_component_size);
+		if (img4_stitch_component(component_name, component_data, component_size, component_blob, component_blob_size, &stitched_component, &stitched_component_size) < 0) {
+			error("ERROR: Unable to stitch %s IMG4 component\n", component_name);
+			free(component_blob);
+			return -1;
+		}
 	} else {
 		/* try to get blob for current component from tss response */
-		if (tss_response && tss_response_get_blob_by_entry(tss_response, component_name, &component_blob) < 0) {
+		if (tss_response && tss_response_get_blob_by_entry(tss_response, component_name, &component_blob, &component_blob_size) < 0) {
 			debug("NOTE: No SHSH blob found for component %s\n", component_name);
 		}
 
 		if (component_blob != NULL) {
-			if (img3_stitch_component(component_name, component_data, component_size, component_blob, 64, &stitched_component, &stitched_component_size) < 0) {
+			if (img3_stitch_component(component_name, component_data, component_size, component_blob, component_blob_size, &stitched_component, &stitched_component_size) < 0) {
 				error("ERROR: Unable to replace %s IMG3 signature\n", component_name);
 				free(component_blob);
 				return -1;
@@ -1741,15 +2248,40 @@ int personalize_component(const char *component_name, const unsigned char* compo
 	}
 	free(component_blob);
 
-	if (idevicerestore_keep_pers) {
-		write_file(component_name, stitched_component, stitched_component_size);
-	}
-
 	*personalized_component = stitched_component;
 	*personalized_component_size = stitched_component_size;
 	return 0;
 }
 
+int get_personalized_component(struct idevicerestore_client_t* client, const char* component, const char* path, unsigned char** data, unsigned int* size)
+{
+	unsigned char* component_data = NULL;
+	unsigned int component_size = 0;
+
+	/* pick up the result if the personalization pool already did the work */
+	if (personalize_pool_take(client->personalize, client->tss, component, path, data, size) == 0) {
+		debug("DEBUG: Using %s personalized in background\n", component);
+	} else {
+		if (extract_component(client->ipsw, path, &component_data, &component_size) < 0) {
+			error("ERROR: Unable to extract component: %s\n", component);
+			return -1;
+		}
+
+		int ret = personalize_component(component, component_data, component_size, client->tss, data, size);
+		free(component_data);
+		if (ret < 0) {
+			error("ERROR: Unable to get personalized component: %s\n", component);
+			return -1;
+		}
+	}
+
+	if (client->flags & FLAG_KEEP_PERS) {
+		write_file(component, *data, *size);
+	}
+
+	return 0;
+}
+
 int build_manifest_check_compatibility(plist_t build_manifest, const char* product) {
 	int res = -1;
 	plist_t node = plist_dict_get_item(build_manifest, "SupportedProductTypes");
@@ -42,6 +42,7 @@ extern "C" {
 #define FLAG_NOACTION        1 << 6
 #define FLAG_SHSHONLY        1 << 7
 #define FLAG_LATEST          1 << 8
+#define FLAG_KEEP_PERS       1 << 9
 
 struct idevicerestore_client_t;
 
@@ -69,9 +70,14 @@ void idevicerestore_set_progress_callback(struct idevicerestore_client_t* client
 void idevicerestore_set_info_stream(FILE* strm);
 void idevicerestore_set_error_stream(FILE* strm);
 void idevicerestore_set_debug_stream(FILE* strm);
+void idevicerestore_client_set_info_stream(struct idevicerestore_client_t* client, FILE* strm);
+void idevicerestore_client_set_error_stream(struct idevicerestore_client_t* client, FILE* strm);
+void idevicerestore_client_set_debug_stream(struct idevicerestore_client_t* client, FILE* strm);
+void idevicerestore_flush_log(void);
 
 int idevicerestore_start(struct idevicerestore_client_t* client);
 const char* idevicerestore_get_error(void);
+const char* idevicerestore_client_get_error(struct idevicerestore_client_t* client);
 
 void usage(int argc, char* argv[]);
 int check_mode(struct idevicerestore_client_t* client);
@@ -80,6 +86,7 @@ int get_ecid(struct idevicerestore_client_t* client, uint64_t* ecid);
 int is_image4_supported(struct idevicerestore_client_t* client);
 int get_ap_nonce(struct idevicerestore_client_t* client, unsigned char** nonce, int* nonce_size);
 int get_sep_nonce(struct idevicerestore_client_t* client, unsigned char** nonce, int* nonce_size);
+int get_tss_request(struct idevicerestore_client_t* client, plist_t build_identity, plist_t* tss_request, plist_t* tss);
 int get_tss_response(struct idevicerestore_client_t* client, plist_t build_identity, plist_t* tss);
 void fixup_tss(plist_t tss);
 int build_manifest_get_identity_count(plist_t build_manifest);
@@ -95,6 +102,8 @@ int build_identity_get_component_path(plist_t build_identity, const char* compon
 int ipsw_extract_filesystem(const char* ipsw, plist_t build_identity, char** filesystem);
 int extract_component(const char* ipsw, const char* path, unsigned char** component_data, unsigned int* component_size);
 int personalize_component(const char *component, const unsigned char* component_data, unsigned int component_size, plist_t tss_response, unsigned char** personalized_component, unsigned int* personalized_component_size);
+int filesystem_extraction_wait(struct idevicerestore_client_t* client, const char** filesystem);
+int get_personalized_component(struct idevicerestore_client_t* client, const char* component, const char* path, unsigned char** data, unsigned int* size);
 
 const char* get_component_name(const char* filename, plist_t build_identity, char **ret_value);
 
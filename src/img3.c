@@ -24,331 +24,137 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
 
 #include "img3.h"
 #include "common.h"
 #include "idevicerestore.h"
 
-static void img3_free(img3_file* image);
-static img3_element* img3_parse_element(const unsigned char* data);
-static void img3_free_element(img3_element* element);
+static int img3_parse_element(const unsigned char* data, unsigned int size, img3_element* element) {
+	const img3_element_header* header = (const img3_element_header*) data;
 
-static img3_file* img3_parse_file(const unsigned char* data, unsigned int size) {
+	if (size < sizeof(img3_element_header) || header->full_size < sizeof(img3_element_header) || header->full_size > size) {
+		return -1;
+	}
+	element->type = (img3_element_type) header->signature;
+	element->data = data;
+	element->size = header->full_size;
+
+	return 0;
+}
+
+static int img3_parse_file(const unsigned char* data, unsigned int size, img3_file* image) {
 	unsigned int data_offset = 0;
-	img3_element* element;
-	img3_header* header = (img3_header*) data;
-	if (header->signature != kImg3Container) {
+	img3_element element;
+	const img3_header* header = (const img3_header*) data;
+
+	if (size < sizeof(img3_header) || header->signature != kImg3Container) {
 		error("ERROR: Invalid IMG3 file\n");
-		return NULL;
+		return -1;
 	}
 
-	img3_file* image = (img3_file*) malloc(sizeof(img3_file));
-	if (image == NULL) {
-		error("ERROR: Unable to allocate memory for IMG3 file\n");
-		return NULL;
-	}
 	memset(image, '\0', sizeof(img3_file));
+	image->header = header;
 	image->idx_ecid_element = -1;
 	image->idx_shsh_element = -1;
 	image->idx_cert_element = -1;
-
-	image->header = (img3_header*) malloc(sizeof(img3_header));
-	if (image->header == NULL) {
-		error("ERROR: Unable to allocate memory for IMG3 header\n");
-		img3_free(image);
-		return NULL;
-	}
-	memcpy(image->header, data, sizeof(img3_header));
 	data_offset += sizeof(img3_header);
 
-	img3_element_header* current = NULL;
 	while (data_offset < size) {
-		current = (img3_element_header*) &data[data_offset];
-		switch (current->signature) {
+		if (img3_parse_element(&data[data_offset], size - data_offset, &element) < 0) {
+			error("ERROR: Unable to parse IMG3 element at offset %u\n", data_offset);
+			return -1;
+		}
+		switch (element.type) {
 		case kTypeElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse TYPE element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed TYPE element\n");
-			break;
-
 		case kDataElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse DATA element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed DATA element\n");
-			break;
-
 		case kVersElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse VERS element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed VERS element\n");
-			break;
-
 		case kSepoElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse SEPO element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed SEPO element\n");
-			break;
-
 		case kBordElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse BORD element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed BORD element\n");
-			break;
-
 		case kChipElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse CHIP element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed CHIP element\n");
-			break;
-
 		case kKbagElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse first KBAG element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed KBAG element\n");
+		case kUnknElement:
 			break;
-
 		case kEcidElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse ECID element\n");
-				img3_free(image);
-				return NULL;
-			}
 			image->idx_ecid_element = image->num_elements;
-			image->elements[image->num_elements++] = element;
-			debug("Parsed ECID element\n");
 			break;
-
 		case kShshElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse SHSH element\n");
-				img3_free(image);
-				return NULL;
-			}
 			image->idx_shsh_element = image->num_elements;
-			image->elements[image->num_elements++] = element;
-			debug("Parsed SHSH element\n");
 			break;
-
 		case kCertElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse CERT element\n");
-				img3_free(image);
-				return NULL;
-			}
 			image->idx_cert_element = image->num_elements;
-			image->elements[image->num_elements++] = element;
-			debug("Parsed CERT element\n");
 			break;
-
-		case kUnknElement:
-			element = img3_parse_element(&data[data_offset]);
-			if (element == NULL) {
-				error("ERROR: Unable to parse UNKN element\n");
-				img3_free(image);
-				return NULL;
-			}
-			image->elements[image->num_elements++] = element;
-			debug("Parsed UNKN element\n");
-			break;
-
 		default:
-			error("ERROR: Unknown IMG3 element type %08x\n", current->signature);
-			img3_free(image);
-			return NULL;
+			error("ERROR: Unknown IMG3 element type %08x\n", element.type);
+			return -1;
+		}
+		if (image->num_elements >= IMG3_MAX_ELEMENTS - 3) {
+			error("ERROR: Too many IMG3 elements\n");
+			return -1;
 		}
-		data_offset += current->full_size;
+		debug("Parsed %c%c%c%c element\n", (element.type >> 24) & 0xFF, (element.type >> 16) & 0xFF, (element.type >> 8) & 0xFF, element.type & 0xFF);
+		image->elements[image->num_elements++] = element;
+		data_offset += element.size;
 	}
 
-	return image;
+	return 0;
 }
 
-static img3_element* img3_parse_element(const unsigned char* data) {
-	img3_element_header* element_header = (img3_element_header*) data;
-	img3_element* element = (img3_element*) malloc(sizeof(img3_element));
-	if (element == NULL) {
-		error("ERROR: Unable to allocate memory for IMG3 element\n");
-		return NULL;
-	}
-	memset(element, '\0', sizeof(img3_element));
+static int img3_insert_element(img3_file* image, int index, const img3_element* element) {
+	memmove(&image->elements[index+1], &image->elements[index], (image->num_elements - index) * sizeof(img3_element));
+	image->elements[index] = *element;
+	image->num_elements++;
 
-	element->data = (unsigned char*) malloc(element_header->full_size);
-	if (element->data == NULL) {
-		error("ERROR: Unable to allocate memory for IMG3 element data\n");
-		free(element);
-		return NULL;
-	}
-	memcpy(element->data, data, element_header->full_size);
-	element->header = (img3_element_header*) element->data;
-	element->type = (img3_element_type) element->header->signature;
+	if (image->idx_ecid_element >= index) image->idx_ecid_element++;
+	if (image->idx_shsh_element >= index) image->idx_shsh_element++;
+	if (image->idx_cert_element >= index) image->idx_cert_element++;
 
-	return element;
+	return index;
 }
 
-static void img3_free(img3_file* image) {
-	if (image != NULL) {
-		if (image->header != NULL) {
-			free(image->header);
-		}
+static int img3_replace_signature(img3_file* image, const unsigned char* signature, unsigned int size) {
+	unsigned int offset = 0;
+	img3_element ecid, shsh, cert;
 
-		int i;
-		for (i = 0; i < image->num_elements; i++) {
-			img3_free_element(image->elements[i]);
-			image->elements[i] = NULL;
-		}
-		free(image);
-		image = NULL;
-	}
-}
+	// every element has to fit in what is left of the blob
 
-static void img3_free_element(img3_element* element) {
-	if (element != NULL) {
-		if (element->data != NULL) {
-			free(element->data);
-			element->data = NULL;
-		}
-		free(element);
-		element = NULL;
-	}
-}
-
-static int img3_replace_signature(img3_file* image, const unsigned char* signature) {
-	int i, oldidx;
-	int offset = 0;
-	img3_element* ecid = img3_parse_element(&signature[offset]);
-	if (ecid == NULL || ecid->type != kEcidElement) {
+	if (img3_parse_element(&signature[offset], size - offset, &ecid) < 0 || ecid.type != kEcidElement) {
 		error("ERROR: Unable to find ECID element in signature\n");
 		return -1;
 	}
-	offset += ecid->header->full_size;
+	offset += ecid.size;
 
-	img3_element* shsh = img3_parse_element(&signature[offset]);
-	if (shsh == NULL || shsh->type != kShshElement) {
+	if (img3_parse_element(&signature[offset], size - offset, &shsh) < 0 || shsh.type != kShshElement) {
 		error("ERROR: Unable to find SHSH element in signature\n");
 		return -1;
 	}
-	offset += shsh->header->full_size;
+	offset += shsh.size;
 
-	img3_element* cert = img3_parse_element(&signature[offset]);
-	if (cert == NULL || cert->type != kCertElement) {
+	if (img3_parse_element(&signature[offset], size - offset, &cert) < 0 || cert.type != kCertElement) {
 		error("ERROR: Unable to find CERT element in signature\n");
 		return -1;
 	}
-	offset += cert->header->full_size;
 
 	if (image->idx_ecid_element >= 0) {
-		img3_free_element(image->elements[image->idx_ecid_element]);
 		image->elements[image->idx_ecid_element] = ecid;
 	} else {
-		if (image->idx_shsh_element >= 0) {
-			// move elements by 1
-			oldidx = image->idx_shsh_element;
-			for (i = image->num_elements-1; i >= oldidx; i--) {
-				image->elements[i+1] = image->elements[i];
-				switch (image->elements[i+1]->type) {
-				case kShshElement:
-					image->idx_shsh_element = i+1;
-					break;
-				case kCertElement:
-					image->idx_cert_element = i+1;
-					break;
-				case kEcidElement:
-					image->idx_ecid_element = i+1;
-					break;
-				default:
-					break;
-				}
-			}
-			image->elements[oldidx] = ecid;
-			image->idx_ecid_element = oldidx;
-			image->num_elements++;
-		} else {
-			// append if not found
-			image->elements[image->num_elements] = ecid;
-			image->idx_ecid_element = image->num_elements;
-			image->num_elements++;
-		}
+		// goes in front of SHSH, or at the end if not found
+		int idx = (image->idx_shsh_element >= 0) ? image->idx_shsh_element : image->num_elements;
+		image->idx_ecid_element = img3_insert_element(image, idx, &ecid);
 	}
 
 	if (image->idx_shsh_element >= 0) {
-		img3_free_element(image->elements[image->idx_shsh_element]);
 		image->elements[image->idx_shsh_element] = shsh;
 	} else {
-		if (image->idx_cert_element >= 0) {
-			// move elements by 1
-			oldidx = image->idx_cert_element;
-			for (i = image->num_elements-1; i >= oldidx; i--) {
-				image->elements[i+1] = image->elements[i];
-				switch (image->elements[i+1]->type) {
-				case kShshElement:
-					image->idx_shsh_element = i+1;
-					break;
-				case kCertElement:
-					image->idx_cert_element = i+1;
-					break;
-				case kEcidElement:
-					image->idx_ecid_element = i+1;
-					break;
-				default:
-					break;
-				}
-			}
-			image->elements[oldidx] = shsh;
-			image->idx_shsh_element = oldidx;
-			image->num_elements++;
-		} else {
-			// append if not found
-			image->elements[image->num_elements] = shsh;
-			image->idx_shsh_element = image->num_elements;
-			image->num_elements++;
-		}
+		// goes in front of CERT, or at the end if not found
+		int idx = (image->idx_cert_element >= 0) ? image->idx_cert_element : image->num_elements;
+		image->idx_shsh_element = img3_insert_element(image, idx, &shsh);
 	}
 
 	if (image->idx_cert_element >= 0) {
-		img3_free_element(image->elements[image->idx_cert_element]);
 		image->elements[image->idx_cert_element] = cert;
 	} else {
-		// append if not found
-		image->elements[image->num_elements] = cert;
-		image->idx_cert_element = image->num_elements;
-		image->num_elements++;
+		image->idx_cert_element = img3_insert_element(image, image->num_elements, &cert);
 	}
 
 	return 0;
@@ -356,12 +162,12 @@ static int img3_replace_signature(img3_file* image, const unsigned char* signatu
 
 static int img3_get_data(img3_file* image, unsigned char** pdata, unsigned int* psize) {
 	int i;
-	int offset = 0;
-	int size = sizeof(img3_header);
+	unsigned int offset = 0;
+	unsigned int size = sizeof(img3_header);
 
 	// Add up the size of the image first so we can allocate our memory
 	for (i = 0; i < image->num_elements; i++) {
-		size += image->elements[i]->header->full_size;
+		size += image->elements[i].size;
 	}
 
 	info("reconstructed size: %d\n", size);
@@ -382,11 +188,11 @@ static int img3_get_data(img3_file* image, unsigned char** pdata, unsigned int*
 
 	// Copy each section over to the new buffer
 	for (i = 0; i < image->num_elements; i++) {
-		memcpy(&data[offset], image->elements[i]->data, image->elements[i]->header->full_size);
-		if (image->elements[i]->type == kShshElement) {
+		memcpy(&data[offset], image->elements[i].data, image->elements[i].size);
+		if (image->elements[i].type == kShshElement) {
 			header->shsh_offset = offset - sizeof(img3_header);
 		}
-		offset += image->elements[i]->header->full_size;
+		offset += image->elements[i].size;
 	}
 
 	if (offset != size) {
@@ -401,10 +207,9 @@ static int img3_get_data(img3_file* image, unsigned char** pdata, unsigned int*
 	*psize = size;
 	return 0;
 }
-
 int img3_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img3_data, unsigned int *img3_size)
 {
-	img3_file *img3 = NULL;
+	img3_file img3;
 	unsigned char* outbuf = NULL;
 	unsigned int outsize = 0;
 
@@ -415,35 +220,23 @@ int img3_stitch_component(const char* component_name, const unsigned char* compo
 	info("Personalizing IMG3 component %s...\n", component_name);
 	
 	/* parse current component as img3 */
-	img3 = img3_parse_file(component_data, component_size);
-	if (img3 == NULL) {
+	if (img3_parse_file(component_data, component_size, &img3) < 0) {
 		error("ERROR: Unable to parse %s IMG3 file\n", component_name);
 		return -1;
 	}
 
-	if (((img3_element_header*)blob)->full_size != blob_size) {
-		error("ERROR: Invalid blob passed for %s IMG3: The size %d embedded in the blob does not match the passed size of %d\n", component_name, ((img3_element_header*)blob)->full_size, blob_size, component_name);
-		img3_free(img3);
-		return -1;
-	}
-
 	/* personalize the component using the blob */
-	if (img3_replace_signature(img3, blob) < 0) {
+	if (img3_replace_signature(&img3, blob, blob_size) < 0) {
 		error("ERROR: Unable to replace %s IMG3 signature\n", component_name);
-		img3_free(img3);
 		return -1;
 	}
 
 	/* get the img3 file as data */
-	if (img3_get_data(img3, &outbuf, &outsize) < 0) {
+	if (img3_get_data(&img3, &outbuf, &outsize) < 0) {
 		error("ERROR: Unable to reconstruct %s IMG3\n", component_name);
-		img3_free(img3);
 		return -1;
 	}
 
-	/* cleanup */
-	img3_free(img3);
-
 	*img3_data = outbuf;
 	*img3_size = outsize;
 
@@ -65,34 +65,21 @@ typedef struct {
 	unsigned int data_size;
 } img3_element_header;
 
+#define IMG3_MAX_ELEMENTS 16
+
 typedef struct {
-	img3_element_header* header;
 	img3_element_type type;
-	unsigned char* data;
+	const unsigned char* data;
+	unsigned int size;
 } img3_element;
 
 typedef struct {
-	unsigned char* data;
-	img3_header* header;
+	const img3_header* header;
 	int num_elements;
-	img3_element* elements[16];
+	img3_element elements[IMG3_MAX_ELEMENTS];
 	int idx_ecid_element;
 	int idx_shsh_element;
 	int idx_cert_element;
-/*	img3_element* type_element;
-	img3_element* data_element;
-	img3_element* vers_element;
-	img3_element* sepo_element;
-	img3_element* bord_element;
-	img3_element* sepo2_element;
-	img3_element* chip_element;
-	img3_element* bord2_element;
-	img3_element* kbag1_element;
-	img3_element* kbag2_element;
-	img3_element* ecid_element;
-	img3_element* shsh_element;
-	img3_element* cert_element;
-	img3_element* unkn_element;*/
 } img3_file;
 
 int img3_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img3_data, unsigned int *img3_size);
@@ -29,17 +29,17 @@
 #define ASN1_SEQUENCE 0x10
 #define ASN1_CONTEXT_SPECIFIC 0x80
 #define ASN1_IA5_STRING 0x16
+#define ASN1_OCTET_STRING 0x04
 
 #define IMG4_MAGIC "IMG4"
 #define IMG4_MAGIC_SIZE 4
 
-static unsigned char* asn1_create_element_header(unsigned char type, unsigned int size, unsigned char** data, unsigned int *data_size)
+static unsigned int asn1_write_element_header(unsigned char type, unsigned int size, unsigned char* buf)
 {
-	unsigned char buf[6];
 	unsigned int off = 0;
 
-	if (!type || size == 0 || !data || !data_size) {
-		return NULL;
+	if (!type || size == 0 || !buf) {
+		return 0;
 	}
 
 	buf[off++] = type;
@@ -72,158 +72,259 @@ static unsigned char* asn1_create_element_header(unsigned char type, unsigned in
 		buf[off++] = size & 0xFF;
 	}
 
-	*data = malloc(off);
-	memcpy(*data, buf, off);
-	*data_size = off;
+	return off;
+}
 
-	return *data;
+void asn1_cursor_init(struct asn1_cursor* cursor, const unsigned char* data, unsigned int size)
+{
+	cursor->data = data;
+	cursor->size = (data) ? size : 0;
+	cursor->off = 0;
 }
 
-static unsigned int asn1_get_element(const unsigned char* data, unsigned char* type, unsigned char* size)
+int asn1_cursor_next(struct asn1_cursor* cursor, struct asn1_element* element)
 {
-	unsigned int off = 0;
+	unsigned int off = cursor->off;
+	unsigned int len = 0;
+	unsigned int i;
 
-	if (!data)
-		return 0;
+	if (off >= cursor->size) {
+		return -1;
+	}
+	element->header = cursor->data + off;
+	element->type = cursor->data[off++];
 
-	if (type)
-		*type = data[off++];
-	if (size)
-		*size = data[off++];
+	// skip high tag number form
+	if ((element->type & 0x1F) == 0x1F) {
+		do {
+			if (off >= cursor->size) {
+				return -1;
+			}
+		} while (cursor->data[off++] & 0x80);
+	}
 
-	return off;
+	if (off >= cursor->size) {
+		return -1;
+	}
+	len = cursor->data[off++];
+	if (len & 0x80) {
+		unsigned int num = len & 0x7F;
+		// indefinite length is not allowed in DER, and we don't handle > 4GB
+		if (num == 0 || num > 4 || num > cursor->size - off) {
+			return -1;
+		}
+		len = 0;
+		for (i = 0; i < num; i++) {
+			len = (len << 8) | cursor->data[off++];
+		}
+	}
+	if (len > cursor->size - off) {
+		return -1;
+	}
+
+	element->header_size = off - cursor->off;
+	element->value = cursor->data + off;
+	element->size = len;
+	cursor->off = off + len;
+
+	return 0;
 }
 
-static const unsigned char *asn1_find_element(unsigned int index, unsigned char type, const unsigned char* data)
+void asn1_cursor_enter(struct asn1_cursor* cursor, const struct asn1_element* element)
 {
-	unsigned char el_type = 0;
-	unsigned char el_size = 0;
-	unsigned int off = 0;
+	asn1_cursor_init(cursor, element->value, element->size);
+}
+
+static int asn1_cursor_next_type(struct asn1_cursor* cursor, unsigned char type, struct asn1_element* element)
+{
+	if (asn1_cursor_next(cursor, element) < 0 || element->type != type) {
+		return -1;
+	}
+	return 0;
+}
 
-	// verify data integrity
-	if (data[off++] != (ASN1_CONSTRUCTED | ASN1_SEQUENCE))
-		return NULL;
-
-	// check data size
-	switch (data[off++]) {
-	case 0x84:
-		off += 4;
-		break;
-	case 0x83:
-		off += 3;
-		break;
-	case 0x82:
-		off += 2;
-		break;
-	case 0x81:
-		off += 1;
-		break;
-	default:
-		break;
-	}
-
-	// find the element we are searching
-	for (int i = 0; i <= index; i++) {
-		off += asn1_get_element(&data[off], &el_type, &el_size);
-		if (i == index)
-			break;
-		off += el_size;
-	}
-
-	// check element type
-	if (el_type != type)
-		return NULL;
-
-	return &data[off];
+static int img4_parse_im4p(const struct asn1_element* im4p, struct img4_info* img4info)
+{
+	struct asn1_cursor cursor;
+	struct asn1_element magic;
+
+	asn1_cursor_enter(&cursor, im4p);
+	if (asn1_cursor_next_type(&cursor, ASN1_IA5_STRING, &magic) < 0 || magic.size != 4 || memcmp(magic.value, "IM4P", 4) != 0) {
+		return -1;
+	}
+	if (asn1_cursor_next_type(&cursor, ASN1_IA5_STRING, &img4info->type) < 0) {
+		return -1;
+	}
+	if (asn1_cursor_next_type(&cursor, ASN1_IA5_STRING, &img4info->description) < 0) {
+		return -1;
+	}
+	if (asn1_cursor_next_type(&cursor, ASN1_OCTET_STRING, &img4info->payload) < 0) {
+		return -1;
+	}
+	img4info->im4p = *im4p;
+
+	return 0;
 }
 
-int img4_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img4_data, unsigned int *img4_size)
+int img4_parse(const unsigned char* data, unsigned int size, struct img4_info* img4info)
 {
-	unsigned char* magic_header = NULL;
+	struct asn1_cursor cursor;
+	struct asn1_element outer;
+	struct asn1_element magic;
+	struct asn1_element element;
+
+	if (!data || !img4info) {
+		return -1;
+	}
+	memset(img4info, '\0', sizeof(struct img4_info));
+
+	asn1_cursor_init(&cursor, data, size);
+	if (asn1_cursor_next_type(&cursor, ASN1_SEQUENCE|ASN1_CONSTRUCTED, &outer) < 0) {
+		return -1;
+	}
+
+	asn1_cursor_enter(&cursor, &outer);
+	if (asn1_cursor_next_type(&cursor, ASN1_IA5_STRING, &magic) < 0 || magic.size != 4) {
+		return -1;
+	}
+
+	// plain IM4P payload file
+	if (memcmp(magic.value, "IM4P", 4) == 0) {
+		return img4_parse_im4p(&outer, img4info);
+	}
+
+	if (memcmp(magic.value, IMG4_MAGIC, IMG4_MAGIC_SIZE) != 0) {
+		return -1;
+	}
+
+	// IMG4 container: IM4P payload, [0] IM4M manifest, [1] IM4R restore info
+	if (asn1_cursor_next_type(&cursor, ASN1_SEQUENCE|ASN1_CONSTRUCTED, &element) < 0 || img4_parse_im4p(&element, img4info) < 0) {
+		return -1;
+	}
+	while (asn1_cursor_next(&cursor, &element) == 0) {
+		if (element.type == (ASN1_CONTEXT_SPECIFIC|ASN1_CONSTRUCTED)) {
+			struct asn1_cursor inner;
+			asn1_cursor_enter(&inner, &element);
+			if (asn1_cursor_next_type(&inner, ASN1_SEQUENCE|ASN1_CONSTRUCTED, &img4info->manifest) < 0) {
+				return -1;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void img4_stitch_add(struct img4_stitch* stitch, const unsigned char* data, unsigned int size)
+{
+	if (size == 0) {
+		return;
+	}
+	stitch->iov[stitch->count].data = data;
+	stitch->iov[stitch->count].size = size;
+	stitch->count++;
+	stitch->size += size;
+}
+
+int img4_stitch_component_iov(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, struct img4_stitch* stitch)
+{
+	unsigned char magic_header[8];
 	unsigned int magic_header_size = 0;
-	unsigned char* blob_header = NULL;
 	unsigned int blob_header_size = 0;
-	unsigned char* img4header = NULL;
 	unsigned int img4header_size = 0;
 	unsigned int content_size;
-	unsigned char* outbuf;
-	unsigned char* p;
+	unsigned int tag_offset = 0;
+	const char* new_tag = NULL;
+	struct img4_info img4info;
 
-	if (!component_name || !component_data || component_size == 0 || !blob || blob_size == 0 || !img4_data || !img4_size) {
+	if (!component_name || !component_data || component_size == 0 || !blob || blob_size == 0 || !stitch) {
 		return -1;
 	}
+	memset(stitch, '\0', sizeof(struct img4_stitch));
 
 	info("Personalizing IMG4 component %s...\n", component_name);
 	/* first we need check if we have to change the tag for the given component */
-	const void *tag = asn1_find_element(1, ASN1_IA5_STRING, component_data);
-	if (tag) {
+	if (img4_parse(component_data, component_size, &img4info) < 0 || img4info.manifest.value) {
+		error("ERROR: %s is not a valid IM4P payload\n", component_name);
+		return -1;
+	}
+	if (img4info.type.size == 4) {
 		debug("Tag found\n");
 		if (strcmp(component_name, "RestoreKernelCache") == 0) {
-			memcpy((void*)tag, "rkrn", 4);
+			new_tag = "rkrn";
 		} else if (strcmp(component_name, "RestoreDeviceTree") == 0) {
-			memcpy((void*)tag, "rdtr", 4);
+			new_tag = "rdtr";
 		} else if (strcmp(component_name, "RestoreSEP") == 0) {
-			memcpy((void*)tag, "rsep", 4);
+			new_tag = "rsep";
 		} else if (strcmp(component_name, "RestoreLogo") == 0) {
-			memcpy((void*)tag, "rlgo", 4);
+			new_tag = "rlgo";
 		} else if (strcmp(component_name, "RestoreTrustCache") == 0) {
-			memcpy((void*)tag, "rtsc", 4);
+			new_tag = "rtsc";
 		}
+		tag_offset = img4info.type.value - component_data;
 	}
 
 	// create element header for the "IMG4" magic
-	asn1_create_element_header(ASN1_IA5_STRING, IMG4_MAGIC_SIZE, &magic_header, &magic_header_size);
+	magic_header_size = asn1_write_element_header(ASN1_IA5_STRING, IMG4_MAGIC_SIZE, magic_header);
 	// create element header for the blob (ApImg4Ticket)
-	asn1_create_element_header(ASN1_CONTEXT_SPECIFIC|ASN1_CONSTRUCTED, blob_size, &blob_header, &blob_header_size);
+	blob_header_size = asn1_write_element_header(ASN1_CONTEXT_SPECIFIC|ASN1_CONSTRUCTED, blob_size, stitch->blob_header);
 
 	// calculate the size for the final IMG4 file (asn1 sequence)
 	content_size = magic_header_size + IMG4_MAGIC_SIZE + component_size + blob_header_size + blob_size;
 
-	// create element header for the final IMG4 asn1 blob
-	asn1_create_element_header(ASN1_SEQUENCE|ASN1_CONSTRUCTED, content_size, &img4header, &img4header_size);
+	// the IMG4 sequence header, the magic header and the magic form one prefix
+	img4header_size = asn1_write_element_header(ASN1_SEQUENCE|ASN1_CONSTRUCTED, content_size, stitch->prefix);
+	memcpy(stitch->prefix + img4header_size, magic_header, magic_header_size);
+	memcpy(stitch->prefix + img4header_size + magic_header_size, IMG4_MAGIC, IMG4_MAGIC_SIZE);
 
-	outbuf = (unsigned char*)malloc(img4header_size + content_size);
-	if (!outbuf) {
-		if (magic_header) {
-			free(magic_header);
-		}
-		if (blob_header) {
-			free(blob_header);
-		}
-		if (img4header) {
-			free(img4header);
-		}
-		error("ERROR: out of memory when personalizing IMG4 component %s\n", component_name);
-		return -1;
+	// now put everything together, leaving the component itself untouched
+	img4_stitch_add(stitch, stitch->prefix, img4header_size + magic_header_size + IMG4_MAGIC_SIZE);
+	if (new_tag) {
+		memcpy(stitch->tag, new_tag, 4);
+		img4_stitch_add(stitch, component_data, tag_offset);
+		img4_stitch_add(stitch, stitch->tag, 4);
+		img4_stitch_add(stitch, component_data + tag_offset + 4, component_size - tag_offset - 4);
+	} else {
+		img4_stitch_add(stitch, component_data, component_size);
 	}
-	p = outbuf;
+	img4_stitch_add(stitch, stitch->blob_header, blob_header_size);
+	img4_stitch_add(stitch, blob, blob_size);
+
+	return 0;
+}
 
-	// now put everything together
-	memcpy(p, img4header, img4header_size);
-	p += img4header_size;
-	memcpy(p, magic_header, magic_header_size);
-	p += magic_header_size;
-	memcpy(p, IMG4_MAGIC, IMG4_MAGIC_SIZE);
-	p += IMG4_MAGIC_SIZE;
-	memcpy(p, component_data, component_size);
-	p += component_size;
-	memcpy(p, blob_header, blob_header_size);
-	p += blob_header_size;
-	memcpy(p, blob, blob_size);
-	p += blob_size;
+void img4_stitch_copy(const struct img4_stitch* stitch, unsigned char* outbuf)
+{
+	unsigned int i;
+	unsigned char* p = outbuf;
 
-	*img4_data = outbuf;
-	*img4_size = (p - outbuf);
+	for (i = 0; i < stitch->count; i++) {
+		memcpy(p, stitch->iov[i].data, stitch->iov[i].size);
+		p += stitch->iov[i].size;
+	}
+}
+
+int img4_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img4_data, unsigned int *img4_size)
+{
+	struct img4_stitch stitch;
+	unsigned char* outbuf;
 
-	if (magic_header) {
-		free(magic_header);
+	if (!img4_data || !img4_size) {
+		return -1;
 	}
-	if (blob_header) {
-		free(blob_header);
+
+	if (img4_stitch_component_iov(component_name, component_data, component_size, blob, blob_size, &stitch) < 0) {
+		return -1;
 	}
-	if (img4header) {
-		free(img4header);
+
+	outbuf = (unsigned char*)malloc(stitch.size);
+	if (!outbuf) {
+		error("ERROR: out of memory when personalizing IMG4 component %s\n", component_name);
+		return -1;
 	}
+	img4_stitch_copy(&stitch, outbuf);
+
+	*img4_data = outbuf;
+	*img4_size = stitch.size;
 
 	return 0;
 }
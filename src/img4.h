@@ -26,6 +26,55 @@
 extern "C" {
 #endif
 
+#define IMG4_STITCH_MAX_IOV 6
+
+struct asn1_element {
+	unsigned char type;
+	const unsigned char* header;
+	unsigned int header_size;
+	const unsigned char* value;
+	unsigned int size;
+};
+
+/* bounds checked DER reader over a borrowed buffer */
+struct asn1_cursor {
+	const unsigned char* data;
+	unsigned int size;
+	unsigned int off;
+};
+
+void asn1_cursor_init(struct asn1_cursor* cursor, const unsigned char* data, unsigned int size);
+int asn1_cursor_next(struct asn1_cursor* cursor, struct asn1_element* element);
+void asn1_cursor_enter(struct asn1_cursor* cursor, const struct asn1_element* element);
+
+struct img4_info {
+	struct asn1_element im4p;
+	struct asn1_element type;
+	struct asn1_element description;
+	struct asn1_element payload;
+	struct asn1_element manifest;
+};
+
+int img4_parse(const unsigned char* data, unsigned int size, struct img4_info* img4info);
+
+struct img4_iov {
+	const unsigned char* data;
+	unsigned int size;
+};
+
+/* a personalized IMG4 described as slices of the original buffers;
+ * the slices point into the struct itself, so it must not be copied */
+struct img4_stitch {
+	unsigned char prefix[16];
+	unsigned char tag[4];
+	unsigned char blob_header[8];
+	struct img4_iov iov[IMG4_STITCH_MAX_IOV];
+	unsigned int count;
+	unsigned int size;
+};
+
+int img4_stitch_component_iov(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, struct img4_stitch* stitch);
+void img4_stitch_copy(const struct img4_stitch* stitch, unsigned char* outbuf);
 int img4_stitch_component(const char* component_name, const unsigned char* component_data, unsigned int component_size, const unsigned char* blob, unsigned int blob_size, unsigned char** img4_data, unsigned int *img4_size);
 
 #ifdef __cplusplus
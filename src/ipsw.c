@@ -28,27 +28,229 @@
 #include <openssl/sha.h>
 
 #include "ipsw.h"
+#include "thread.h"
 #include "locking.h"
+#include "fscache.h"
 #include "download.h"
 #include "common.h"
 #include "idevicerestore.h"
+#include "metrics.h"
 
 #define BUFSIZE 0x100000
 
-typedef struct {
+typedef struct ipsw_archive {
 	struct zip* zip;
+	char* path;
+	struct ipsw_archive* next;
 } ipsw_archive;
 
+struct ipsw_cached_file {
+	char* ipsw;
+	char* name;
+	unsigned char* data;
+	unsigned int size;
+	struct ipsw_cached_file* next;
+};
+
+struct ipsw_cached_manifest {
+	char* ipsw;
+	plist_t manifest;
+	int tss_enabled;
+	struct ipsw_cached_manifest* next;
+};
+
+/* shared between all restores in this process once ipsw_cache_enable() was called:
+ * opened archives, so the central directory is parsed once per concurrent reader
+ * instead of once per extraction, and small files and parsed build manifests */
+static struct {
+	int enabled;
+	uint64_t max_bytes;
+	uint64_t bytes;
+	int idle_count;
+	ipsw_archive* idle;
+	struct ipsw_cached_file* files;   /* most recently used first */
+	struct ipsw_cached_manifest* manifests;
+	mutex_t mutex;
+} ipsw_cache;
+
 ipsw_archive* ipsw_open(const char* ipsw);
 void ipsw_close(ipsw_archive* archive);
 
+void ipsw_cache_enable(uint64_t max_bytes)
+{
+	if (ipsw_cache.enabled) {
+		return;
+	}
+	memset(&ipsw_cache, '\0', sizeof(ipsw_cache));
+	mutex_init(&ipsw_cache.mutex);
+	ipsw_cache.max_bytes = max_bytes;
+	ipsw_cache.enabled = 1;
+}
+
+void ipsw_cache_cleanup(void)
+{
+	if (!ipsw_cache.enabled) {
+		return;
+	}
+	ipsw_cache.enabled = 0;
+	while (ipsw_cache.idle) {
+		ipsw_archive* archive = ipsw_cache.idle;
+		ipsw_cache.idle = archive->next;
+		ipsw_close(archive);
+	}
+	while (ipsw_cache.files) {
+		struct ipsw_cached_file* file = ipsw_cache.files;
+		ipsw_cache.files = file->next;
+		free(file->ipsw);
+		free(file->name);
+		free(file->data);
+		free(file);
+	}
+	while (ipsw_cache.manifests) {
+		struct ipsw_cached_manifest* entry = ipsw_cache.manifests;
+		ipsw_cache.manifests = entry->next;
+		free(entry->ipsw);
+		plist_free(entry->manifest);
+		free(entry);
+	}
+	mutex_destroy(&ipsw_cache.mutex);
+}
+
+/* called with the cache mutex held */
+static struct ipsw_cached_file** ipsw_cache_find_file(const char* ipsw, const char* infile)
+{
+	struct ipsw_cached_file** pp = NULL;
+
+	for (pp = &ipsw_cache.files; *pp; pp = &(*pp)->next) {
+		if (!strcmp((*pp)->name, infile) && !strcmp((*pp)->ipsw, ipsw)) {
+			return pp;
+		}
+	}
+	return NULL;
+}
+
+static int ipsw_cache_get_file(const char* ipsw, const char* infile, unsigned char** pbuffer, unsigned int* psize)
+{
+	struct ipsw_cached_file* file = NULL;
+	struct ipsw_cached_file** pp = NULL;
+	int res = -1;
+
+	if (!ipsw_cache.enabled) {
+		return -1;
+	}
+
+	mutex_lock(&ipsw_cache.mutex);
+	pp = ipsw_cache_find_file(ipsw, infile);
+	if (pp) {
+		/* move it to the front, eviction starts at the back */
+		file = *pp;
+		*pp = file->next;
+		file->next = ipsw_cache.files;
+		ipsw_cache.files = file;
+	}
+	if (file) {
+		/* callers own and may modify what they get */
+		unsigned char* buffer = (unsigned char*)malloc(file->size + 1);
+		if (buffer) {
+			memcpy(buffer, file->data, file->size + 1);
+			*pbuffer = buffer;
+			*psize = file->size;
+			res = 0;
+		}
+	}
+	mutex_unlock(&ipsw_cache.mutex);
+	metrics_cache_lookup("ipsw", (res == 0));
+
+	return res;
+}
+
+static void ipsw_cache_add_file(const char* ipsw, const char* infile, const unsigned char* buffer, unsigned int size)
+{
+	struct ipsw_cached_file* file = NULL;
+	struct ipsw_cached_file** pp = NULL;
+
+	if (!ipsw_cache.enabled || size > IPSW_CACHE_MAX_FILE_SIZE || size > ipsw_cache.max_bytes) {
+		return;
+	}
+
+	file = (struct ipsw_cached_file*)malloc(sizeof(struct ipsw_cached_file));
+	if (!file) {
+		return;
+	}
+	file->ipsw = strdup(ipsw);
+	file->name = strdup(infile);
+	file->data = (unsigned char*)malloc(size + 1);
+	if (!file->ipsw || !file->name || !file->data) {
+		free(file->ipsw);
+		free(file->name);
+		free(file->data);
+		free(file);
+		return;
+	}
+	memcpy(file->data, buffer, size + 1);
+	file->size = size;
+
+	mutex_lock(&ipsw_cache.mutex);
+	if (ipsw_cache_find_file(ipsw, infile)) {
+		/* another restore missed at the same time and was quicker */
+		mutex_unlock(&ipsw_cache.mutex);
+		free(file->ipsw);
+		free(file->name);
+		free(file->data);
+		free(file);
+		return;
+	}
+	file->next = ipsw_cache.files;
+	ipsw_cache.files = file;
+	ipsw_cache.bytes += size;
+	/* evict the least recently used entries until we are within budget again */
+	pp = &ipsw_cache.files;
+	uint64_t kept = 0;
+	while (*pp) {
+		struct ipsw_cached_file* entry = *pp;
+		if (kept + entry->size > ipsw_cache.max_bytes) {
+			*pp = entry->next;
+			ipsw_cache.bytes -= entry->size;
+			free(entry->ipsw);
+			free(entry->name);
+			free(entry->data);
+			free(entry);
+			continue;
+		}
+		kept += entry->size;
+		pp = &entry->next;
+	}
+	mutex_unlock(&ipsw_cache.mutex);
+}
+
 ipsw_archive* ipsw_open(const char* ipsw) {
 	int err = 0;
-	ipsw_archive* archive = (ipsw_archive*) malloc(sizeof(ipsw_archive));
+	ipsw_archive* archive = NULL;
+
+	if (ipsw_cache.enabled) {
+		ipsw_archive** pp = NULL;
+		mutex_lock(&ipsw_cache.mutex);
+		for (pp = &ipsw_cache.idle; *pp; pp = &(*pp)->next) {
+			if (!strcmp((*pp)->path, ipsw)) {
+				archive = *pp;
+				*pp = archive->next;
+				ipsw_cache.idle_count--;
+				break;
+			}
+		}
+		mutex_unlock(&ipsw_cache.mutex);
+		if (archive) {
+			archive->next = NULL;
+			return archive;
+		}
+	}
+
+	archive = (ipsw_archive*) malloc(sizeof(ipsw_archive));
 	if (archive == NULL) {
 		error("ERROR: Out of memory\n");
 		return NULL;
 	}
+	memset(archive, '\0', sizeof(ipsw_archive));
 
 	archive->zip = zip_open(ipsw, 0, &err);
 	if (archive->zip == NULL) {
@@ -56,6 +258,7 @@ ipsw_archive* ipsw_open(const char* ipsw) {
 		free(archive);
 		return NULL;
 	}
+	archive->path = strdup(ipsw);
 
 	return archive;
 }
@@ -86,7 +289,8 @@ int ipsw_get_file_size(const char* ipsw, const char* infile, off_t* size) {
 	return 0;
 }
 
-int ipsw_extract_to_file_with_progress(const char* ipsw, const char* infile, const char* outfile, int print_progress)
+/* cancel may point to a flag another thread sets to stop the extraction */
+static int ipsw_extract_to_file_internal(const char* ipsw, const char* infile, const char* outfile, int print_progress, const int* cancel)
 {
 	int ret = 0;
 	ipsw_archive* archive = ipsw_open(ipsw);
@@ -127,10 +331,18 @@ int ipsw_extract_to_file_with_progress(const char* ipsw, const char* infile, con
 		return -1;
 	}
 
+	fscache_writer_t writer;
+	fscache_writer_init(&writer, fd, zstat.size);
+
 	off_t i, bytes = 0;
 	int count, size = BUFSIZE;
 	double progress;
 	for(i = zstat.size; i > 0; i -= count) {
+		if (cancel && __atomic_load_n(cancel, __ATOMIC_ACQUIRE)) {
+			debug("DEBUG: %s: extraction of %s cancelled\n", __func__, infile);
+			ret = -1;
+			break;
+		}
 		if (i < BUFSIZE)
 			size = i;
 		count = zip_fread(zfile, buffer, size);
@@ -146,11 +358,15 @@ int ipsw_extract_to_file_with_progress(const char* ipsw, const char* infile, con
 		}
 
 		bytes += size;
+		fscache_writer_update(&writer, bytes);
 		if (print_progress) {
 			progress = ((double)bytes / (double)zstat.size) * 100.0;
 			// print_progress_bar(progress);
 		}
 	}
+	if (ret == 0) {
+		fscache_writer_finish(&writer);
+	}
 
 	fclose(fd);
 	zip_fclose(zfile);
@@ -159,6 +375,16 @@ int ipsw_extract_to_file_with_progress(const char* ipsw, const char* infile, con
 	return ret;
 }
 
+int ipsw_extract_to_file_with_progress(const char* ipsw, const char* infile, const char* outfile, int print_progress)
+{
+	return ipsw_extract_to_file_internal(ipsw, infile, outfile, print_progress, NULL);
+}
+
+int ipsw_extract_to_file_cancelable(const char* ipsw, const char* infile, const char* outfile, const int* cancel)
+{
+	return ipsw_extract_to_file_internal(ipsw, infile, outfile, 0, cancel);
+}
+
 int ipsw_extract_to_file(const char* ipsw, const char* infile, const char* outfile)
 {
 	return ipsw_extract_to_file_with_progress(ipsw, infile, outfile, 0);
@@ -183,6 +409,10 @@ int ipsw_file_exists(const char* ipsw, const char* infile)
 }
 
 int ipsw_extract_to_memory(const char* ipsw, const char* infile, unsigned char** pbuffer, unsigned int* psize) {
+	if (ipsw_cache_get_file(ipsw, infile, pbuffer, psize) == 0) {
+		return 0;
+	}
+
 	ipsw_archive* archive = ipsw_open(ipsw);
 	if (archive == NULL || archive->zip == NULL) {
 		error("ERROR: Invalid archive\n");
@@ -228,22 +458,88 @@ int ipsw_extract_to_memory(const char* ipsw, const char* infile, unsigned char**
 	zip_fclose(zfile);
 	ipsw_close(archive);
 
+	ipsw_cache_add_file(ipsw, infile, buffer, size);
+
 	*pbuffer = buffer;
 	*psize = size;
 	return 0;
 }
 
+static int ipsw_cache_get_manifest(const char* ipsw, plist_t* buildmanifest, int* tss_enabled)
+{
+	struct ipsw_cached_manifest* entry = NULL;
+
+	if (!ipsw_cache.enabled) {
+		return -1;
+	}
+
+	mutex_lock(&ipsw_cache.mutex);
+	for (entry = ipsw_cache.manifests; entry; entry = entry->next) {
+		if (!strcmp(entry->ipsw, ipsw)) {
+			*buildmanifest = plist_copy(entry->manifest);
+			*tss_enabled = entry->tss_enabled;
+			break;
+		}
+	}
+	mutex_unlock(&ipsw_cache.mutex);
+	metrics_cache_lookup("ipsw", (entry != NULL));
+
+	return (entry) ? 0 : -1;
+}
+
+static void ipsw_cache_add_manifest(const char* ipsw, plist_t buildmanifest, int tss_enabled)
+{
+	struct ipsw_cached_manifest* entry = NULL;
+
+	if (!ipsw_cache.enabled || !buildmanifest) {
+		return;
+	}
+
+	entry = (struct ipsw_cached_manifest*)malloc(sizeof(struct ipsw_cached_manifest));
+	if (!entry) {
+		return;
+	}
+	entry->ipsw = strdup(ipsw);
+	entry->manifest = plist_copy(buildmanifest);
+	entry->tss_enabled = tss_enabled;
+
+	mutex_lock(&ipsw_cache.mutex);
+	struct ipsw_cached_manifest* existing = NULL;
+	for (existing = ipsw_cache.manifests; existing; existing = existing->next) {
+		if (!strcmp(existing->ipsw, ipsw)) {
+			break;
+		}
+	}
+	if (!existing) {
+		entry->next = ipsw_cache.manifests;
+		ipsw_cache.manifests = entry;
+		entry = NULL;
+	}
+	mutex_unlock(&ipsw_cache.mutex);
+
+	if (entry) {
+		free(entry->ipsw);
+		plist_free(entry->manifest);
+		free(entry);
+	}
+}
+
 int ipsw_extract_build_manifest(const char* ipsw, plist_t* buildmanifest, int *tss_enabled) {
 	unsigned int size = 0;
 	unsigned char* data = NULL;
 
 	*tss_enabled = 0;
 
+	if (ipsw_cache_get_manifest(ipsw, buildmanifest, tss_enabled) == 0) {
+		return 0;
+	}
+
 	/* older devices don't require personalized firmwares and use a BuildManifesto.plist */
 	if (ipsw_file_exists(ipsw, "BuildManifesto.plist") == 0) {
 		if (ipsw_extract_to_memory(ipsw, "BuildManifesto.plist", &data, &size) == 0) {
 			plist_from_xml((char*)data, size, buildmanifest);
 			free(data);
+			ipsw_cache_add_manifest(ipsw, *buildmanifest, *tss_enabled);
 			return 0;
 		}
 	}
@@ -256,6 +552,7 @@ int ipsw_extract_build_manifest(const char* ipsw, plist_t* buildmanifest, int *t
 		*tss_enabled = 1;
 		plist_from_xml((char*)data, size, buildmanifest);
 		free(data);
+		ipsw_cache_add_manifest(ipsw, *buildmanifest, *tss_enabled);
 		return 0;
 	}
 
@@ -276,11 +573,27 @@ int ipsw_extract_restore_plist(const char* ipsw, plist_t* restore_plist) {
 }
 
 void ipsw_close(ipsw_archive* archive) {
-	if (archive != NULL) {
-		zip_unchange_all(archive->zip);
-		zip_close(archive->zip);
-		free(archive);
+	if (archive == NULL) {
+		return;
+	}
+	zip_unchange_all(archive->zip);
+	if (ipsw_cache.enabled && archive->path) {
+		/* keep it around for the next extraction from the same IPSW */
+		mutex_lock(&ipsw_cache.mutex);
+		if (ipsw_cache.enabled && ipsw_cache.idle_count < IPSW_CACHE_MAX_IDLE) {
+			archive->next = ipsw_cache.idle;
+			ipsw_cache.idle = archive;
+			ipsw_cache.idle_count++;
+			archive = NULL;
+		}
+		mutex_unlock(&ipsw_cache.mutex);
+		if (!archive) {
+			return;
+		}
 	}
+	zip_close(archive->zip);
+	free(archive->path);
+	free(archive);
 }
 
 int ipsw_get_latest_fw(plist_t version_data, const char* product, char** fwurl, unsigned char* sha1buf)
@@ -32,6 +32,11 @@ extern "C" {
 #include <stdint.h>
 #include <plist/plist.h>
 
+/* files larger than this are never kept by the IPSW cache */
+#define IPSW_CACHE_MAX_FILE_SIZE 0x4000000
+/* opened archives kept around by the IPSW cache */
+#define IPSW_CACHE_MAX_IDLE 16
+
 typedef struct {
 	int index;
 	char* name;
@@ -39,9 +44,13 @@ typedef struct {
 	unsigned char* data;
 } ipsw_file;
 
+void ipsw_cache_enable(uint64_t max_bytes);
+void ipsw_cache_cleanup(void);
+
 int ipsw_get_file_size(const char* ipsw, const char* infile, off_t* size);
 int ipsw_extract_to_file(const char* ipsw, const char* infile, const char* outfile);
 int ipsw_extract_to_file_with_progress(const char* ipsw, const char* infile, const char* outfile, int print_progress);
+int ipsw_extract_to_file_cancelable(const char* ipsw, const char* infile, const char* outfile, const int* cancel);
 int ipsw_extract_to_memory(const char* ipsw, const char* infile, unsigned char** pbuffer, unsigned int* psize);
 int ipsw_extract_build_manifest(const char* ipsw, plist_t* buildmanifest, int *tss_enabled);
 int ipsw_extract_restore_plist(const char* ipsw, plist_t* restore_plist);
@@ -0,0 +1,296 @@
+/*
+ * logbuf.c
+ * Log lines queued for a background writer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "logbuf.h"
+#include "thread.h"
+
+/* how long the writer sleeps when nothing is queued, a log call wakes it early */
+#define LOGBUF_IDLE_MS 50
+/* streams the writer flushes after printing what was queued */
+#define LOGBUF_MAX_STREAMS 8
+
+/* the queue is a bounded ring in which every slot carries a sequence number:
+ * pos while free for the writer claiming position pos, pos + 1 once the line
+ * is in it. claiming a slot is a single compare and swap, so threads logging
+ * at the same time only contend on the head counter. */
+struct logbuf_slot {
+	uint32_t seq;
+	FILE* stream;
+	char* heap;	/* lines longer than text */
+	size_t len;
+	char text[LOGBUF_SLOT_SIZE];
+};
+
+static struct logbuf_slot logbuf_slots[LOGBUF_SLOTS];
+static uint32_t logbuf_head;	/* next position to claim */
+static uint32_t logbuf_tail;	/* next position to print, only moved by the writer */
+static int logbuf_sleeping;	/* writer waits for logbuf_cond */
+static int logbuf_running;
+static int logbuf_stopping;
+static thread_t logbuf_thread;
+static mutex_t logbuf_mutex;
+static cond_t logbuf_cond;	/* wakes the writer */
+static cond_t logbuf_done_cond;	/* signaled by the writer after printing */
+static thread_once_t logbuf_once = THREAD_ONCE_INIT;
+
+static void logbuf_flush_streams(FILE** streams, int* num_streams)
+{
+	int i;
+	for (i = 0; i < *num_streams; i++) {
+		fflush(streams[i]);
+	}
+	*num_streams = 0;
+}
+
+static int logbuf_drain(void)
+{
+	FILE* streams[LOGBUF_MAX_STREAMS];
+	int num_streams = 0;
+	int count = 0;
+	int i;
+
+	while (1) {
+		uint32_t pos = __atomic_load_n(&logbuf_tail, __ATOMIC_RELAXED);
+		struct logbuf_slot* slot = &logbuf_slots[pos & (LOGBUF_SLOTS - 1)];
+		if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != pos + 1) {
+			break;
+		}
+		fwrite((slot->heap) ? slot->heap : slot->text, 1, slot->len, slot->stream);
+		for (i = 0; i < num_streams; i++) {
+			if (streams[i] == slot->stream) {
+				break;
+			}
+		}
+		if (i == num_streams) {
+			if (num_streams == LOGBUF_MAX_STREAMS) {
+				logbuf_flush_streams(streams, &num_streams);
+			}
+			streams[num_streams++] = slot->stream;
+		}
+		free(slot->heap);
+		slot->heap = NULL;
+		__atomic_store_n(&slot->seq, pos + LOGBUF_SLOTS, __ATOMIC_RELEASE);
+		__atomic_store_n(&logbuf_tail, pos + 1, __ATOMIC_RELEASE);
+		count++;
+	}
+	logbuf_flush_streams(streams, &num_streams);
+
+	return count;
+}
+
+static void* logbuf_writer(void* arg)
+{
+	/* serves every restore in the process and outlives them */
+	thread_set_context(NULL);
+
+	while (1) {
+		if (logbuf_drain() > 0) {
+			mutex_lock(&logbuf_mutex);
+			cond_broadcast(&logbuf_done_cond);
+			mutex_unlock(&logbuf_mutex);
+			continue;
+		}
+		mutex_lock(&logbuf_mutex);
+		if (logbuf_stopping && __atomic_load_n(&logbuf_head, __ATOMIC_ACQUIRE) == logbuf_tail) {
+			mutex_unlock(&logbuf_mutex);
+			break;
+		}
+		__atomic_store_n(&logbuf_sleeping, 1, __ATOMIC_RELEASE);
+		/* a line committed right before sleeping is picked up after the timeout */
+		cond_wait_timeout(&logbuf_cond, &logbuf_mutex, LOGBUF_IDLE_MS);
+		__atomic_store_n(&logbuf_sleeping, 0, __ATOMIC_RELEASE);
+		mutex_unlock(&logbuf_mutex);
+	}
+
+	return NULL;
+}
+
+static void logbuf_shutdown(void)
+{
+	if (!logbuf_running) {
+		return;
+	}
+	mutex_lock(&logbuf_mutex);
+	logbuf_stopping = 1;
+	cond_signal(&logbuf_cond);
+	mutex_unlock(&logbuf_mutex);
+	thread_join(logbuf_thread);
+	thread_free(logbuf_thread);
+	__atomic_store_n(&logbuf_running, 0, __ATOMIC_RELEASE);
+	/* lines claimed while stopping */
+	logbuf_drain();
+}
+
+static void logbuf_init(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < LOGBUF_SLOTS; i++) {
+		logbuf_slots[i].seq = i;
+	}
+	mutex_init(&logbuf_mutex);
+	cond_init(&logbuf_cond);
+	cond_init(&logbuf_done_cond);
+	if (thread_new(&logbuf_thread, logbuf_writer, NULL) != 0) {
+		return;
+	}
+	logbuf_running = 1;
+	atexit(logbuf_shutdown);
+}
+
+static void logbuf_wake_writer(void)
+{
+	mutex_lock(&logbuf_mutex);
+	cond_signal(&logbuf_cond);
+	mutex_unlock(&logbuf_mutex);
+}
+
+/* returns a slot to fill and commit, or NULL when lines have to be printed
+ * right away because there is no writer thread */
+static struct logbuf_slot* logbuf_claim(uint32_t* pos_out)
+{
+	thread_once(&logbuf_once, logbuf_init);
+
+	uint32_t pos = __atomic_load_n(&logbuf_head, __ATOMIC_RELAXED);
+	while (__atomic_load_n(&logbuf_running, __ATOMIC_ACQUIRE)) {
+		struct logbuf_slot* slot = &logbuf_slots[pos & (LOGBUF_SLOTS - 1)];
+		int32_t diff = (int32_t)(__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) - pos);
+		if (diff == 0) {
+			if (__atomic_compare_exchange_n(&logbuf_head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				*pos_out = pos;
+				return slot;
+			}
+		} else if (diff < 0) {
+			/* full, wait for the writer rather than reordering lines */
+			mutex_lock(&logbuf_mutex);
+			cond_signal(&logbuf_cond);
+			cond_wait_timeout(&logbuf_done_cond, &logbuf_mutex, LOGBUF_IDLE_MS);
+			mutex_unlock(&logbuf_mutex);
+			pos = __atomic_load_n(&logbuf_head, __ATOMIC_RELAXED);
+		} else {
+			pos = __atomic_load_n(&logbuf_head, __ATOMIC_RELAXED);
+		}
+	}
+
+	return NULL;
+}
+
+static void logbuf_commit(struct logbuf_slot* slot, uint32_t pos)
+{
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+	if (__atomic_load_n(&logbuf_sleeping, __ATOMIC_ACQUIRE)) {
+		logbuf_wake_writer();
+	}
+}
+
+void logbuf_write(FILE* stream, const char* text, size_t len)
+{
+	uint32_t pos = 0;
+
+	struct logbuf_slot* slot = logbuf_claim(&pos);
+	if (!slot) {
+		fwrite(text, 1, len, stream);
+		fflush(stream);
+		return;
+	}
+
+	slot->stream = stream;
+	if (len >= LOGBUF_SLOT_SIZE) {
+		slot->heap = (char*)malloc(len);
+	}
+	if (slot->heap) {
+		memcpy(slot->heap, text, len);
+	} else {
+		if (len >= LOGBUF_SLOT_SIZE) {
+			len = LOGBUF_SLOT_SIZE - 1;
+		}
+		memcpy(slot->text, text, len);
+	}
+	slot->len = len;
+	logbuf_commit(slot, pos);
+}
+
+/* formats straight into the queued slot, the writer only does the I/O */
+void logbuf_vprintf(FILE* stream, const char* prefix, const char* format, va_list args)
+{
+	uint32_t pos = 0;
+	va_list args2;
+
+	struct logbuf_slot* slot = logbuf_claim(&pos);
+	if (!slot) {
+		if (prefix) {
+			fputs(prefix, stream);
+		}
+		vfprintf(stream, format, args);
+		fflush(stream);
+		return;
+	}
+
+	slot->stream = stream;
+	size_t plen = 0;
+	if (prefix) {
+		plen = strlen(prefix);
+		if (plen >= LOGBUF_SLOT_SIZE) {
+			plen = LOGBUF_SLOT_SIZE - 1;
+		}
+		memcpy(slot->text, prefix, plen);
+	}
+	va_copy(args2, args);
+	int len = vsnprintf(slot->text + plen, LOGBUF_SLOT_SIZE - plen, format, args);
+	if (len < 0) {
+		len = 0;
+	}
+	if (plen + len >= LOGBUF_SLOT_SIZE) {
+		slot->heap = (char*)malloc(plen + len + 1);
+		if (slot->heap) {
+			memcpy(slot->heap, slot->text, plen);
+			vsnprintf(slot->heap + plen, len + 1, format, args2);
+		} else {
+			len = LOGBUF_SLOT_SIZE - 1 - plen;
+		}
+	}
+	va_end(args2);
+	slot->len = plen + len;
+	logbuf_commit(slot, pos);
+}
+
+/* returns once everything logged before the call is printed */
+void logbuf_flush(void)
+{
+	if (!__atomic_load_n(&logbuf_running, __ATOMIC_ACQUIRE)) {
+		return;
+	}
+	uint32_t target = __atomic_load_n(&logbuf_head, __ATOMIC_ACQUIRE);
+	mutex_lock(&logbuf_mutex);
+	while (logbuf_running && (int32_t)(__atomic_load_n(&logbuf_tail, __ATOMIC_ACQUIRE) - target) < 0) {
+		cond_signal(&logbuf_cond);
+		cond_wait_timeout(&logbuf_done_cond, &logbuf_mutex, LOGBUF_IDLE_MS);
+	}
+	mutex_unlock(&logbuf_mutex);
+}
@@ -0,0 +1,44 @@
+/*
+ * logbuf.h
+ * Log lines queued for a background writer
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef IDEVICERESTORE_LOGBUF_H
+#define IDEVICERESTORE_LOGBUF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdio.h>
+#include <stdarg.h>
+
+/* number of queued lines, a power of two */
+#define LOGBUF_SLOTS 1024
+/* lines longer than this are allocated */
+#define LOGBUF_SLOT_SIZE 256
+
+void logbuf_write(FILE* stream, const char* text, size_t len);
+void logbuf_vprintf(FILE* stream, const char* prefix, const char* format, va_list args);
+void logbuf_flush(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
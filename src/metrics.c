@@ -0,0 +1,495 @@
+/*
+ * metrics.c
+ * Restore counters and histograms served over a local socket
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <ctype.h>
+#ifndef WIN32
+#include <unistd.h>
+#include <signal.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#endif
+
+#include "metrics.h"
+#include "idevicerestore.h"
+#include "common.h"
+#include "socket.h"
+#include "thread.h"
+
+/* a scrape has to arrive within this many ms once connected */
+#define METRICS_REQUEST_TIMEOUT 1000
+#define METRICS_MAX_BUCKETS 12
+
+enum {
+	METRICS_COUNTER,
+	METRICS_GAUGE,
+	METRICS_HISTOGRAM
+};
+
+struct metrics_def {
+	const char* name;
+	const char* help;
+	int type;
+	const char* label;      /* name of the label, NULL if there is none */
+	const double* buckets;  /* upper bounds of histogram buckets, 0 terminated */
+};
+
+static const double metrics_seconds_buckets[] = { 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60, 0 };
+static const double metrics_duration_buckets[] = { 60, 120, 300, 600, 900, 1200, 1800, 2700, 3600, 0 };
+static const double metrics_throughput_buckets[] = { 1, 2, 5, 10, 15, 20, 30, 40, 60, 80, 120, 0 };
+
+static const struct metrics_def metrics_defs[METRIC_NUM] = {
+	{ "idevicerestore_restores_started_total", "Restores started.", METRICS_COUNTER, NULL, NULL },
+	{ "idevicerestore_restores_succeeded_total", "Restores that finished successfully.", METRICS_COUNTER, NULL, NULL },
+	{ "idevicerestore_restores_failed_total", "Restores that failed, by the last step they reached.", METRICS_COUNTER, "step", NULL },
+	{ "idevicerestore_restore_duration_seconds", "Wall time of whole restores.", METRICS_HISTOGRAM, "result", metrics_duration_buckets },
+	{ "idevicerestore_asr_bytes_total", "Filesystem bytes sent to ASR.", METRICS_COUNTER, NULL, NULL },
+	{ "idevicerestore_asr_throughput_megabytes_per_second", "Throughput of ASR filesystem payloads.", METRICS_HISTOGRAM, NULL, metrics_throughput_buckets },
+	{ "idevicerestore_tss_request_duration_seconds", "Latency of TSS request attempts.", METRICS_HISTOGRAM, "endpoint", metrics_seconds_buckets },
+	{ "idevicerestore_tss_request_failures_total", "TSS request attempts without a ticket.", METRICS_COUNTER, "endpoint", NULL },
+	{ "idevicerestore_cache_hits_total", "Lookups answered from a cache.", METRICS_COUNTER, "cache", NULL },
+	{ "idevicerestore_cache_misses_total", "Lookups a cache could not answer.", METRICS_COUNTER, "cache", NULL },
+	{ "idevicerestore_queue_depth", "Items waiting in a queue.", METRICS_GAUGE, "queue", NULL }
+};
+
+static const char* metrics_step_names[RESTORE_NUM_STEPS] = {
+	"detect",
+	"prepare",
+	"upload_filesystem",
+	"verify_filesystem",
+	"flash_firmware",
+	"flash_baseband"
+};
+
+struct metrics_series {
+	char* label;    /* value of the label, NULL if the metric has none */
+	double value;   /* counters and gauges */
+	uint64_t buckets[METRICS_MAX_BUCKETS];
+	uint64_t count;
+	double sum;
+	struct metrics_series* next;
+};
+
+static struct {
+	int enabled;
+	int stopping;
+	int fd;
+	char* path;     /* unix socket to remove again, NULL for TCP */
+	thread_t thread;
+	mutex_t mutex;
+	struct metrics_series* series[METRIC_NUM];
+} metrics = { 0, };
+
+struct metrics_buffer {
+	char* data;
+	size_t length;
+	size_t capacity;
+};
+
+const char* metrics_step_name(int step)
+{
+	if (step < 0 || step >= RESTORE_NUM_STEPS) {
+		return "unknown";
+	}
+	return metrics_step_names[step];
+}
+
+double metrics_time(void)
+{
+#ifdef WIN32
+	return (double)GetTickCount64() / 1000.0;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (double)tv.tv_sec + (double)tv.tv_usec / 1000000.0;
+#endif
+}
+
+/* called with the mutex held */
+static struct metrics_series* metrics_get_series(int metric, const char* label)
+{
+	struct metrics_series* series;
+
+	if (!metrics_defs[metric].label) {
+		label = NULL;
+	} else if (!label) {
+		label = "";
+	}
+	for (series = metrics.series[metric]; series; series = series->next) {
+		if ((!label && !series->label) || (label && series->label && !strcmp(series->label, label))) {
+			return series;
+		}
+	}
+	series = (struct metrics_series*)malloc(sizeof(struct metrics_series));
+	if (!series) {
+		return NULL;
+	}
+	memset(series, '\0', sizeof(struct metrics_series));
+	series->label = (label) ? strdup(label) : NULL;
+	series->next = metrics.series[metric];
+	metrics.series[metric] = series;
+	return series;
+}
+
+/* adds value to a counter or gauge, gauges may go down */
+void metrics_add(int metric, const char* label, double value)
+{
+	if (!metrics.enabled || metric < 0 || metric >= METRIC_NUM) {
+		return;
+	}
+	mutex_lock(&metrics.mutex);
+	struct metrics_series* series = metrics_get_series(metric, label);
+	if (series) {
+		series->value += value;
+	}
+	mutex_unlock(&metrics.mutex);
+}
+
+void metrics_observe(int metric, const char* label, double value)
+{
+	int i;
+
+	if (!metrics.enabled || metric < 0 || metric >= METRIC_NUM || !metrics_defs[metric].buckets) {
+		return;
+	}
+	mutex_lock(&metrics.mutex);
+	struct metrics_series* series = metrics_get_series(metric, label);
+	if (series) {
+		const double* buckets = metrics_defs[metric].buckets;
+		for (i = 0; buckets[i] > 0; i++) {
+			if (value <= buckets[i]) {
+				series->buckets[i]++;
+				break;
+			}
+		}
+		series->count++;
+		series->sum += value;
+	}
+	mutex_unlock(&metrics.mutex);
+}
+
+void metrics_cache_lookup(const char* cache, int hit)
+{
+	metrics_add((hit) ? METRIC_CACHE_HITS : METRIC_CACHE_MISSES, cache, 1);
+}
+
+static void metrics_printf(struct metrics_buffer* buf, const char* format, ...)
+{
+	va_list args;
+
+	while (1) {
+		size_t avail = buf->capacity - buf->length;
+		va_start(args, format);
+		int len = vsnprintf(buf->data + buf->length, avail, format, args);
+		va_end(args);
+		if (len < 0) {
+			return;
+		}
+		if ((size_t)len < avail) {
+			buf->length += len;
+			return;
+		}
+		size_t capacity = buf->capacity * 2 + len;
+		char* data = (char*)realloc(buf->data, capacity);
+		if (!data) {
+			return;
+		}
+		buf->data = data;
+		buf->capacity = capacity;
+	}
+}
+
+/* prints {label="value"} with the value escaped, or the extra label alone */
+static void metrics_print_labels(struct metrics_buffer* buf, const struct metrics_def* def, const char* value, const char* le)
+{
+	const char* p;
+
+	if (!def->label && !le) {
+		return;
+	}
+	metrics_printf(buf, "{");
+	if (def->label) {
+		metrics_printf(buf, "%s=\"", def->label);
+		for (p = value; p && *p; p++) {
+			if (*p == '\\' || *p == '"') {
+				metrics_printf(buf, "\\%c", *p);
+			} else if (*p == '\n') {
+				metrics_printf(buf, "\\n");
+			} else {
+				metrics_printf(buf, "%c", *p);
+			}
+		}
+		metrics_printf(buf, "\"%s", (le) ? "," : "");
+	}
+	if (le) {
+		metrics_printf(buf, "le=\"%s\"", le);
+	}
+	metrics_printf(buf, "}");
+}
+
+/* Prometheus text exposition format */
+static void metrics_format(struct metrics_buffer* buf)
+{
+	static const char* types[] = { "counter", "gauge", "histogram" };
+	struct metrics_series* series;
+	char le[32];
+	int m, i;
+
+	mutex_lock(&metrics.mutex);
+	for (m = 0; m < METRIC_NUM; m++) {
+		const struct metrics_def* def = &metrics_defs[m];
+		metrics_printf(buf, "# HELP %s %s\n", def->name, def->help);
+		metrics_printf(buf, "# TYPE %s %s\n", def->name, types[def->type]);
+		if (!def->label && !metrics.series[m]) {
+			/* unlabeled series are there from the start */
+			metrics_get_series(m, NULL);
+		}
+		for (series = metrics.series[m]; series; series = series->next) {
+			if (def->type != METRICS_HISTOGRAM) {
+				metrics_printf(buf, "%s", def->name);
+				metrics_print_labels(buf, def, series->label, NULL);
+				metrics_printf(buf, " %.15g\n", series->value);
+				continue;
+			}
+			uint64_t cumulative = 0;
+			for (i = 0; def->buckets[i] > 0; i++) {
+				cumulative += series->buckets[i];
+				snprintf(le, sizeof(le), "%g", def->buckets[i]);
+				metrics_printf(buf, "%s_bucket", def->name);
+				metrics_print_labels(buf, def, series->label, le);
+				metrics_printf(buf, " %llu\n", (unsigned long long)cumulative);
+			}
+			metrics_printf(buf, "%s_bucket", def->name);
+			metrics_print_labels(buf, def, series->label, "+Inf");
+			metrics_printf(buf, " %llu\n", (unsigned long long)series->count);
+			metrics_printf(buf, "%s_sum", def->name);
+			metrics_print_labels(buf, def, series->label, NULL);
+			metrics_printf(buf, " %.15g\n", series->sum);
+			metrics_printf(buf, "%s_count", def->name);
+			metrics_print_labels(buf, def, series->label, NULL);
+			metrics_printf(buf, " %llu\n", (unsigned long long)series->count);
+		}
+	}
+	mutex_unlock(&metrics.mutex);
+}
+
+static int metrics_send_all(int fd, const char* data, size_t length)
+{
+	while (length > 0) {
+		int sent = socket_send(fd, (void*)data, length);
+		if (sent <= 0) {
+			return -1;
+		}
+		data += sent;
+		length -= sent;
+	}
+	return 0;
+}
+
+static void metrics_handle_connection(int fd)
+{
+	char request[2048];
+	size_t length = 0;
+	const char* status = "200 OK";
+	struct metrics_buffer body = { NULL, 0, 0 };
+	char header[256];
+
+	/* only the request line matters, but read the whole header so the
+	 * client doesn't get a reset for unread data */
+	while (length < sizeof(request) - 1) {
+		int res = socket_receive_timeout(fd, request + length, sizeof(request) - 1 - length, 0, METRICS_REQUEST_TIMEOUT);
+		if (res <= 0) {
+			break;
+		}
+		length += res;
+		request[length] = '\0';
+		if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+			break;
+		}
+	}
+	request[length] = '\0';
+
+	body.capacity = 8192;
+	body.data = (char*)malloc(body.capacity);
+	if (!body.data) {
+		return;
+	}
+
+	if (strncmp(request, "GET ", 4) != 0) {
+		status = "405 Method Not Allowed";
+	} else if (strncmp(request + 4, "/ ", 2) != 0 && strncmp(request + 4, "/metrics ", 9) != 0 && strncmp(request + 4, "/metrics?", 9) != 0) {
+		status = "404 Not Found";
+	}
+	if (!strcmp(status, "200 OK")) {
+		metrics_format(&body);
+	} else {
+		metrics_printf(&body, "%s\n", status);
+	}
+
+	snprintf(header, sizeof(header), "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %u\r\nConnection: close\r\n\r\n", status, (unsigned int)body.length);
+	if (metrics_send_all(fd, header, strlen(header)) == 0) {
+		metrics_send_all(fd, body.data, body.length);
+	}
+	free(body.data);
+}
+
+static void* metrics_server_thread(void* arg)
+{
+	/* serves every restore in the process and outlives them */
+	thread_set_context(NULL);
+
+	while (1) {
+		mutex_lock(&metrics.mutex);
+		int stopping = metrics.stopping;
+		mutex_unlock(&metrics.mutex);
+		if (stopping) {
+			break;
+		}
+		/* wake up now and then to see if we are stopping */
+		if (socket_check_fd(metrics.fd, FDM_READ, 500) <= 0) {
+			continue;
+		}
+		int fd = socket_accept(metrics.fd, 0);
+		if (fd < 0) {
+			continue;
+		}
+		metrics_handle_connection(fd);
+		socket_close(fd);
+	}
+
+	return NULL;
+}
+
+#ifndef WIN32
+/* returns 1 if path is a socket, 0 if nothing is there and -1 otherwise.
+ * only sockets left behind may be replaced or removed, never a file that
+ * happens to be at the path */
+static int metrics_check_socket_path(const char* path)
+{
+	struct stat st;
+
+	if (lstat(path, &st) < 0) {
+		return 0;
+	}
+	return S_ISSOCK(st.st_mode) ? 1 : -1;
+}
+#endif
+
+/* address is a TCP port, which is bound on localhost only, or the path of a
+ * unix socket */
+int metrics_serve(const char* address)
+{
+	const char* p;
+
+	if (!address || !*address || metrics.enabled) {
+		return -1;
+	}
+
+	for (p = address; *p && isdigit((unsigned char)*p); p++);
+	if (*p == '\0') {
+		int port = atoi(address);
+		if (port <= 0 || port > 65535) {
+			error("ERROR: Invalid metrics port %s\n", address);
+			return -1;
+		}
+		metrics.fd = socket_create("127.0.0.1", (uint16_t)port);
+		metrics.path = NULL;
+	} else {
+#ifdef WIN32
+		error("ERROR: Metrics can only be served on a TCP port on this platform\n");
+		return -1;
+#else
+		if (metrics_check_socket_path(address) < 0) {
+			error("ERROR: Refusing to serve metrics on %s, it exists and is not a socket\n", address);
+			return -1;
+		}
+		metrics.fd = socket_create_unix(address);
+		metrics.path = strdup(address);
+#endif
+	}
+	if (metrics.fd < 0) {
+		error("ERROR: Unable to serve metrics on %s\n", address);
+		free(metrics.path);
+		metrics.path = NULL;
+		return -1;
+	}
+
+#ifndef WIN32
+	/* a scraper hanging up early must not take the restores down with it */
+	signal(SIGPIPE, SIG_IGN);
+#endif
+
+	mutex_init(&metrics.mutex);
+	metrics.stopping = 0;
+	metrics.enabled = 1;
+	if (thread_new(&metrics.thread, metrics_server_thread, NULL) != 0) {
+		error("ERROR: Unable to start metrics thread\n");
+		metrics.enabled = 0;
+		mutex_destroy(&metrics.mutex);
+		socket_close(metrics.fd);
+		free(metrics.path);
+		metrics.path = NULL;
+		return -1;
+	}
+	info("Serving metrics on %s\n", address);
+
+	return 0;
+}
+
+void metrics_stop(void)
+{
+	int m;
+
+	if (!metrics.enabled) {
+		return;
+	}
+
+	mutex_lock(&metrics.mutex);
+	metrics.stopping = 1;
+	mutex_unlock(&metrics.mutex);
+	thread_join(metrics.thread);
+	thread_free(metrics.thread);
+	socket_close(metrics.fd);
+	if (metrics.path) {
+		if (metrics_check_socket_path(metrics.path) > 0) {
+			unlink(metrics.path);
+		}
+		free(metrics.path);
+		metrics.path = NULL;
+	}
+
+	metrics.enabled = 0;
+	for (m = 0; m < METRIC_NUM; m++) {
+		while (metrics.series[m]) {
+			struct metrics_series* series = metrics.series[m];
+			metrics.series[m] = series->next;
+			free(series->label);
+			free(series);
+		}
+	}
+	mutex_destroy(&metrics.mutex);
+}
@@ -0,0 +1,57 @@
+/*
+ * metrics.h
+ * Restore counters and histograms served over a local socket
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_METRICS_H
+#define IDEVICERESTORE_METRICS_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* every metric has at most one label, see metrics_defs in metrics.c */
+enum {
+	METRIC_RESTORES_STARTED = 0,
+	METRIC_RESTORES_SUCCEEDED,
+	METRIC_RESTORES_FAILED,   /* by step, see metrics_step_name() */
+	METRIC_RESTORE_DURATION,  /* by result */
+	METRIC_ASR_BYTES,
+	METRIC_ASR_THROUGHPUT,
+	METRIC_TSS_LATENCY,       /* by endpoint */
+	METRIC_TSS_FAILURES,      /* by endpoint */
+	METRIC_CACHE_HITS,        /* by cache */
+	METRIC_CACHE_MISSES,      /* by cache */
+	METRIC_QUEUE_DEPTH,       /* by queue */
+	METRIC_NUM
+};
+
+/* all of these do nothing unless metrics_serve() was called */
+void metrics_add(int metric, const char* label, double value);
+void metrics_observe(int metric, const char* label, double value);
+void metrics_cache_lookup(const char* cache, int hit);
+const char* metrics_step_name(int step);
+double metrics_time(void);
+
+int metrics_serve(const char* address);
+void metrics_stop(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
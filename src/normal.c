@@ -31,18 +31,14 @@
 
 #include "common.h"
 #include "normal.h"
+#include "devwait.h"
 #include "recovery.h"
 
-static int normal_device_connected = 0;
-
 void normal_device_callback(const idevice_event_t* event, void* userdata) {
-	struct idevicerestore_client_t* client = (struct idevicerestore_client_t*) userdata;
+	device_wait_t* wait = (device_wait_t*)userdata;
 	if (event->event == IDEVICE_DEVICE_ADD) {
-		normal_device_connected = 1;
-
-	} else if (event->event == IDEVICE_DEVICE_REMOVE) {
-		normal_device_connected = 0;
-		client->flags &= FLAG_QUIT;
+		/* normal_open_with_timeout() checks if it is the device we are after */
+		device_wait_signal(wait);
 	}
 }
 
@@ -178,18 +174,27 @@ int normal_check_mode(struct idevicerestore_client_t* client) {
 	return 0;
 }
 
+struct normal_probe_args {
+	struct idevicerestore_client_t* client;
+	idevice_t device;
+};
+
+static int normal_probe_device(void* userdata)
+{
+	struct normal_probe_args* args = (struct normal_probe_args*)userdata;
+	normal_idevice_new(args->client, &args->device);
+	return (args->device) ? 0 : -1;
+}
+
 int normal_open_with_timeout(struct idevicerestore_client_t* client) {
-	int i = 0;
-	int attempts = 10;
-	idevice_t device = NULL;
+	unsigned int timeout = 20000;
+	struct normal_probe_args args = { client, NULL };
 
 	// no context exists so bail
 	if(client == NULL) {
 		return -1;
 	}
 
-	normal_device_connected = 0;
-
 	// create our normal client if it doesn't yet exist
 	if(client->normal == NULL) {
 		client->normal = (struct normal_client_t*) malloc(sizeof(struct normal_client_t));
@@ -199,21 +204,19 @@ int normal_open_with_timeout(struct idevicerestore_client_t* client) {
 		}
 	}
 
-	for (i = 1; i <= attempts; i++) {
-		normal_idevice_new(client, &device);
-		if (device) {
-			normal_device_connected = 1;
-			break;
-		}
+	device_wait_t wait;
+	device_wait_init(&wait);
+	device_event_subscribe(normal_device_callback, &wait);
+	int res = device_wait_probe(&wait, normal_probe_device, &args, timeout);
+	device_event_unsubscribe(normal_device_callback, &wait);
+	device_wait_destroy(&wait);
 
-		if (i == attempts) {
-			error("ERROR: Unable to connect to device in normal mode\n");
-			return -1;
-		}
-		sleep(2);
+	if (res < 0) {
+		error("ERROR: Unable to connect to device in normal mode\n");
+		return -1;
 	}
 
-	client->normal->device = device;
+	client->normal->device = args.device;
 
 	return 0;
 }
@@ -0,0 +1,472 @@
+/*
+ * personalize.c
+ * Background personalization of build identity components
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <plist/plist.h>
+
+#include "personalize.h"
+#include "idevicerestore.h"
+#include "common.h"
+#include "thread.h"
+#include "metrics.h"
+
+enum {
+	JOB_PENDING = 0,
+	JOB_RUNNING,
+	JOB_DONE,
+	JOB_FAILED,
+	JOB_TAKEN
+};
+
+struct personalize_job {
+	char* component;
+	char* path;
+	int raw;
+	int state;
+	unsigned char* data;
+	unsigned int size;
+};
+
+struct personalize_pool {
+	char* ipsw;
+	plist_t tss;    /* private copy used by the workers */
+	plist_t source; /* the TSS response the results are valid for, only compared */
+	struct personalize_job* jobs;
+	int* order;     /* indices into jobs, in the order workers pick them up */
+	int num_jobs;
+	int next_job;
+	int stopping;
+	mutex_t mutex;
+	cond_t cond;
+	thread_t threads[PERSONALIZE_POOL_THREADS];
+	int num_threads;
+};
+
+/* bytes held by all pools, concurrent restores share the budget */
+static struct {
+	uint64_t held;
+	mutex_t mutex;
+	cond_t cond;
+} personalize_budget;
+static thread_once_t personalize_budget_once = THREAD_ONCE_INIT;
+
+static void personalize_budget_init(void)
+{
+	personalize_budget.held = 0;
+	mutex_init(&personalize_budget.mutex);
+	cond_init(&personalize_budget.cond);
+}
+
+static int personalize_pool_stopping(struct personalize_pool* pool)
+{
+	mutex_lock(&pool->mutex);
+	int stopping = pool->stopping;
+	mutex_unlock(&pool->mutex);
+	return stopping;
+}
+
+/* waits until there is room for another result, returns -1 if the pool is
+ * stopping meanwhile */
+static int personalize_budget_wait(struct personalize_pool* pool)
+{
+	int res = 0;
+
+	mutex_lock(&personalize_budget.mutex);
+	while (personalize_budget.held >= PERSONALIZE_POOL_MAX_BYTES) {
+		if (personalize_pool_stopping(pool)) {
+			res = -1;
+			break;
+		}
+		cond_wait(&personalize_budget.cond, &personalize_budget.mutex);
+	}
+	mutex_unlock(&personalize_budget.mutex);
+
+	return res;
+}
+
+static void personalize_budget_add(int64_t bytes)
+{
+	mutex_lock(&personalize_budget.mutex);
+	personalize_budget.held += bytes;
+	if (bytes < 0) {
+		cond_broadcast(&personalize_budget.cond);
+	}
+	mutex_unlock(&personalize_budget.mutex);
+}
+
+/* components the device asks for first, in the order it asks for them */
+static const char* personalize_boot_order[] = {
+	"iBSS",
+	"iBEC",
+	"RestoreLogo",
+	"RestoreDeviceTree",
+	"RestoreRamDisk",
+	"RestoreKernelCache",
+	"LLB",
+	NULL
+};
+
+/* firmware updater payloads, restored gets their tickets in separate TSS requests */
+static const char* personalize_raw_prefixes[] = {
+	"SE,",
+	"Savage,",
+	"Yonkers,",
+	NULL
+};
+
+static int personalize_is_raw(const char* component)
+{
+	int i;
+	for (i = 0; personalize_raw_prefixes[i]; i++) {
+		if (!strncmp(component, personalize_raw_prefixes[i], strlen(personalize_raw_prefixes[i]))) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static char* personalize_get_path(plist_t tss, plist_t manifest, const char* component)
+{
+	char* path = NULL;
+	plist_t node = plist_access_path(tss, 2, component, "Path");
+	if (!node || plist_get_node_type(node) != PLIST_STRING) {
+		node = plist_access_path(manifest, 3, component, "Info", "Path");
+	}
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &path);
+	}
+	return path;
+}
+
+static int personalize_is_wanted(plist_t tss, const char* component, plist_t entry)
+{
+	/* the filesystem is streamed by ASR and never personalized */
+	if (!strcmp(component, "OS")) {
+		return 0;
+	}
+	plist_t node = plist_dict_get_item(entry, "Trusted");
+	if (node && plist_get_node_type(node) == PLIST_BOOLEAN) {
+		uint8_t trusted = 0;
+		plist_get_bool_val(node, &trusted);
+		if (trusted) {
+			return 1;
+		}
+	}
+	/* IMG3 responses carry a blob per component */
+	return (plist_access_path(tss, 2, component, "Blob") != NULL);
+}
+
+static void personalize_pool_add_job(struct personalize_pool* pool, plist_t manifest, const char* component)
+{
+	int i;
+	for (i = 0; i < pool->num_jobs; i++) {
+		if (!strcmp(pool->jobs[i].component, component)) {
+			return;
+		}
+	}
+	plist_t entry = plist_dict_get_item(manifest, component);
+	if (!entry || plist_get_node_type(entry) != PLIST_DICT) {
+		return;
+	}
+	int raw = personalize_is_raw(component);
+	if (!raw && !personalize_is_wanted(pool->tss, component, entry)) {
+		return;
+	}
+	char* path = personalize_get_path(pool->tss, manifest, component);
+	if (!path) {
+		return;
+	}
+	pool->order[pool->num_jobs] = pool->num_jobs;
+	struct personalize_job* job = &pool->jobs[pool->num_jobs++];
+	memset(job, '\0', sizeof(struct personalize_job));
+	job->component = strdup(component);
+	job->path = path;
+	job->raw = raw;
+	job->state = JOB_PENDING;
+}
+
+static void* personalize_worker(void* arg)
+{
+	struct personalize_pool* pool = (struct personalize_pool*)arg;
+
+	while (1) {
+		struct personalize_job* job = NULL;
+
+		/* results stay in memory until taken, don't run ahead too far */
+		if (personalize_budget_wait(pool) < 0) {
+			break;
+		}
+
+		mutex_lock(&pool->mutex);
+		while (!pool->stopping && pool->next_job < pool->num_jobs) {
+			job = &pool->jobs[pool->order[pool->next_job++]];
+			if (job->state == JOB_PENDING) {
+				job->state = JOB_RUNNING;
+				break;
+			}
+			job = NULL;
+		}
+		mutex_unlock(&pool->mutex);
+		if (!job) {
+			break;
+		}
+
+		unsigned char* component_data = NULL;
+		unsigned int component_size = 0;
+		unsigned char* data = NULL;
+		unsigned int size = 0;
+		int res = extract_component(pool->ipsw, job->path, &component_data, &component_size);
+		if (res == 0 && job->raw) {
+			data = component_data;
+			size = component_size;
+		} else if (res == 0) {
+			res = personalize_component(job->component, component_data, component_size, pool->tss, &data, &size);
+			free(component_data);
+		}
+
+		if (res == 0 && data) {
+			personalize_budget_add(size);
+		}
+
+		mutex_lock(&pool->mutex);
+		if (res == 0 && data) {
+			job->data = data;
+			job->size = size;
+			job->state = JOB_DONE;
+		} else {
+			debug("DEBUG: %s: could not personalize %s in background\n", __func__, job->component);
+			free(data);
+			job->state = JOB_FAILED;
+		}
+		cond_broadcast(&pool->cond);
+		mutex_unlock(&pool->mutex);
+	}
+
+	return NULL;
+}
+
+struct personalize_pool* personalize_pool_new(const char* ipsw, plist_t build_identity, plist_t tss)
+{
+	int i;
+
+	if (!ipsw || !build_identity || !tss) {
+		return NULL;
+	}
+	plist_t manifest = plist_dict_get_item(build_identity, "Manifest");
+	if (!manifest || plist_get_node_type(manifest) != PLIST_DICT) {
+		return NULL;
+	}
+
+	struct personalize_pool* pool = (struct personalize_pool*)malloc(sizeof(struct personalize_pool));
+	if (!pool) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	memset(pool, '\0', sizeof(struct personalize_pool));
+	mutex_init(&pool->mutex);
+	cond_init(&pool->cond);
+	thread_once(&personalize_budget_once, personalize_budget_init);
+
+	int max_jobs = plist_dict_get_size(manifest);
+	pool->jobs = (struct personalize_job*)malloc(sizeof(struct personalize_job) * (max_jobs + 1));
+	pool->order = (int*)malloc(sizeof(int) * (max_jobs + 1));
+	pool->ipsw = strdup(ipsw);
+	pool->tss = plist_copy(tss);
+	pool->source = tss;
+	if (!pool->jobs || !pool->order || !pool->ipsw) {
+		error("ERROR: Out of memory\n");
+		personalize_pool_free(pool);
+		return NULL;
+	}
+
+	for (i = 0; personalize_boot_order[i]; i++) {
+		personalize_pool_add_job(pool, manifest, personalize_boot_order[i]);
+	}
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(manifest, &iter);
+	if (iter) {
+		char* key = NULL;
+		plist_t node = NULL;
+		while (1) {
+			key = NULL;
+			plist_dict_next_item(manifest, iter, &key, &node);
+			if (!key) {
+				break;
+			}
+			personalize_pool_add_job(pool, manifest, key);
+			free(key);
+		}
+		free(iter);
+	}
+
+	if (pool->num_jobs == 0) {
+		personalize_pool_free(pool);
+		return NULL;
+	}
+
+	debug("DEBUG: %s: personalizing %d components in background\n", __func__, pool->num_jobs);
+	for (i = 0; i < PERSONALIZE_POOL_THREADS && i < pool->num_jobs; i++) {
+		if (thread_new(&pool->threads[pool->num_threads], personalize_worker, pool) != 0) {
+			break;
+		}
+		pool->num_threads++;
+	}
+
+	return pool;
+}
+
+static int personalize_pool_take_job(struct personalize_pool* pool, const char* component, const char* path, int raw, unsigned char** data, unsigned int* size)
+{
+	int i;
+	int res = -1;
+	unsigned int taken = 0;
+
+	mutex_lock(&pool->mutex);
+	struct personalize_job* job = NULL;
+	for (i = 0; i < pool->num_jobs; i++) {
+		if (pool->jobs[i].raw != raw || strcmp(pool->jobs[i].path, path) != 0) {
+			continue;
+		}
+		if (!component || !strcmp(pool->jobs[i].component, component)) {
+			job = &pool->jobs[i];
+			break;
+		}
+	}
+	if (job) {
+		if (job->state == JOB_PENDING) {
+			/* not started yet, the caller is quicker doing it right away */
+			job->state = JOB_TAKEN;
+		}
+		while (job->state == JOB_RUNNING) {
+			cond_wait(&pool->cond, &pool->mutex);
+		}
+		if (job->state == JOB_DONE) {
+			*data = job->data;
+			*size = job->size;
+			taken = job->size;
+			job->data = NULL;
+			job->size = 0;
+			job->state = JOB_TAKEN;
+			res = 0;
+		}
+	}
+	mutex_unlock(&pool->mutex);
+	if (taken > 0) {
+		personalize_budget_add(-(int64_t)taken);
+	}
+	metrics_cache_lookup("component", (res == 0));
+
+	return res;
+}
+
+/* moves the given components ahead of everything not started yet, in the
+ * order given, so they are ready in the order the device asks for them */
+void personalize_pool_stage(struct personalize_pool* pool, const char** components)
+{
+	int i, j, k;
+
+	if (!pool || !components) {
+		return;
+	}
+
+	mutex_lock(&pool->mutex);
+	int pos = pool->next_job;
+	for (i = 0; components[i]; i++) {
+		for (j = pos; j < pool->num_jobs; j++) {
+			struct personalize_job* job = &pool->jobs[pool->order[j]];
+			if (!job->raw && !strcmp(job->component, components[i])) {
+				break;
+			}
+		}
+		if (j >= pool->num_jobs) {
+			continue;
+		}
+		int index = pool->order[j];
+		for (k = j; k > pos; k--) {
+			pool->order[k] = pool->order[k-1];
+		}
+		pool->order[pos++] = index;
+	}
+	mutex_unlock(&pool->mutex);
+}
+
+int personalize_pool_take(struct personalize_pool* pool, plist_t tss, const char* component, const char* path, unsigned char** data, unsigned int* size)
+{
+	if (!pool || !tss || tss != pool->source || !component || !path) {
+		return -1;
+	}
+	return personalize_pool_take_job(pool, component, path, 0, data, size);
+}
+
+int personalize_pool_take_raw(struct personalize_pool* pool, const char* path, unsigned char** data, unsigned int* size)
+{
+	if (!pool || !path) {
+		return -1;
+	}
+	return personalize_pool_take_job(pool, NULL, path, 1, data, size);
+}
+
+void personalize_pool_free(struct personalize_pool* pool)
+{
+	int i;
+
+	if (!pool) {
+		return;
+	}
+
+	if (pool->num_threads > 0) {
+		mutex_lock(&pool->mutex);
+		pool->stopping = 1;
+		mutex_unlock(&pool->mutex);
+		/* wake up workers waiting for room in the budget */
+		mutex_lock(&personalize_budget.mutex);
+		cond_broadcast(&personalize_budget.cond);
+		mutex_unlock(&personalize_budget.mutex);
+		for (i = 0; i < pool->num_threads; i++) {
+			thread_join(pool->threads[i]);
+			thread_free(pool->threads[i]);
+		}
+	}
+	mutex_destroy(&pool->mutex);
+	cond_destroy(&pool->cond);
+	if (pool->jobs) {
+		for (i = 0; i < pool->num_jobs; i++) {
+			if (pool->jobs[i].data) {
+				personalize_budget_add(-(int64_t)pool->jobs[i].size);
+			}
+			free(pool->jobs[i].component);
+			free(pool->jobs[i].path);
+			free(pool->jobs[i].data);
+		}
+		free(pool->jobs);
+	}
+	free(pool->order);
+	if (pool->tss) {
+		plist_free(pool->tss);
+	}
+	free(pool->ipsw);
+	free(pool);
+}
@@ -0,0 +1,47 @@
+/*
+ * personalize.h
+ * Background personalization of build identity components
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_PERSONALIZE_H
+#define IDEVICERESTORE_PERSONALIZE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <plist/plist.h>
+
+/* number of worker threads extracting and stitching components */
+#define PERSONALIZE_POOL_THREADS 4
+/* personalized components waiting to be taken, over all pools in the
+ * process. workers stop picking up new ones while this much is held. */
+#define PERSONALIZE_POOL_MAX_BYTES (256 * 1024 * 1024)
+
+struct personalize_pool;
+
+struct personalize_pool* personalize_pool_new(const char* ipsw, plist_t build_identity, plist_t tss);
+void personalize_pool_stage(struct personalize_pool* pool, const char** components);
+int personalize_pool_take(struct personalize_pool* pool, plist_t tss, const char* component, const char* path, unsigned char** data, unsigned int* size);
+int personalize_pool_take_raw(struct personalize_pool* pool, const char* path, unsigned char** data, unsigned int* size);
+void personalize_pool_free(struct personalize_pool* pool);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,329 @@
+/*
+ * phase.c
+ * Timing the phases of a restore
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#ifndef WIN32
+#include <sys/time.h>
+#include <sys/resource.h>
+#endif
+
+#include "phase.h"
+#include "common.h"
+#include "thread.h"
+
+/* threads get their own row in the Chrome trace, later ones share the last */
+#define PHASE_MAX_THREADS 32
+
+/* process wide, concurrent phases overlap in everything but wall time */
+struct phase_usage {
+	uint64_t time;	/* usecs */
+	uint64_t cpu;	/* usecs, user and system */
+	uint64_t read_bytes;
+	uint64_t written_bytes;
+	uint64_t peak_rss;	/* KiB */
+};
+
+struct phase {
+	struct phase_log* log;
+	char* name;
+	int thread;
+	int done;
+	struct phase_usage begin;
+	struct phase_usage end;
+	struct phase* next;
+};
+
+struct phase_log {
+	mutex_t mutex;
+	uint64_t start;
+	struct phase* first;
+	struct phase* last;
+	unsigned long threads[PHASE_MAX_THREADS];
+	int num_threads;
+};
+
+static void phase_get_usage(struct phase_usage* usage)
+{
+	memset(usage, '\0', sizeof(struct phase_usage));
+#ifdef WIN32
+	FILETIME creation, exit, kernel, user;
+	IO_COUNTERS io;
+	usage->time = (uint64_t)GetTickCount64() * 1000;
+	if (GetProcessTimes(GetCurrentProcess(), &creation, &exit, &kernel, &user)) {
+		uint64_t k = ((uint64_t)kernel.dwHighDateTime << 32) | kernel.dwLowDateTime;
+		uint64_t u = ((uint64_t)user.dwHighDateTime << 32) | user.dwLowDateTime;
+		usage->cpu = (k + u) / 10;
+	}
+	if (GetProcessIoCounters(GetCurrentProcess(), &io)) {
+		usage->read_bytes = io.ReadTransferCount;
+		usage->written_bytes = io.WriteTransferCount;
+	}
+#else
+	struct timeval tv;
+	struct rusage ru;
+	gettimeofday(&tv, NULL);
+	usage->time = (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+	if (getrusage(RUSAGE_SELF, &ru) == 0) {
+		usage->cpu = (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 + ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+#ifdef __APPLE__
+		usage->peak_rss = ru.ru_maxrss / 1024;
+#else
+		usage->peak_rss = ru.ru_maxrss;
+#endif
+		usage->read_bytes = (uint64_t)ru.ru_inblock * 512;
+		usage->written_bytes = (uint64_t)ru.ru_oublock * 512;
+	}
+	/* on Linux this includes the sockets to usbmuxd, i.e. what goes over USB */
+	FILE* f = fopen("/proc/self/io", "r");
+	if (f) {
+		char line[64];
+		unsigned long long val = 0;
+		while (fgets(line, sizeof(line), f)) {
+			if (sscanf(line, "rchar: %llu", &val) == 1) {
+				usage->read_bytes = val;
+			} else if (sscanf(line, "wchar: %llu", &val) == 1) {
+				usage->written_bytes = val;
+			}
+		}
+		fclose(f);
+	}
+#endif
+}
+
+struct phase_log* phase_log_new(void)
+{
+	struct phase_usage usage;
+
+	struct phase_log* log = (struct phase_log*)malloc(sizeof(struct phase_log));
+	if (!log) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	memset(log, '\0', sizeof(struct phase_log));
+	mutex_init(&log->mutex);
+	phase_get_usage(&usage);
+	log->start = usage.time;
+	return log;
+}
+
+void phase_log_free(struct phase_log* log)
+{
+	if (!log) {
+		return;
+	}
+	struct phase* phase = log->first;
+	while (phase) {
+		struct phase* next = phase->next;
+		free(phase->name);
+		free(phase);
+		phase = next;
+	}
+	mutex_destroy(&log->mutex);
+	free(log);
+}
+
+static int phase_log_get_thread(struct phase_log* log)
+{
+	unsigned long id = (unsigned long)THREAD_ID;
+	int i;
+
+	for (i = 0; i < log->num_threads; i++) {
+		if (log->threads[i] == id) {
+			return i + 1;
+		}
+	}
+	if (log->num_threads == PHASE_MAX_THREADS) {
+		return PHASE_MAX_THREADS;
+	}
+	log->threads[log->num_threads++] = id;
+	return log->num_threads;
+}
+
+struct phase* phase_begin(const char* name)
+{
+	struct idevicerestore_client_t* client = idevicerestore_get_current_client();
+	if (!client || !client->phases) {
+		return NULL;
+	}
+	struct phase_log* log = client->phases;
+
+	struct phase* phase = (struct phase*)malloc(sizeof(struct phase));
+	if (!phase) {
+		return NULL;
+	}
+	memset(phase, '\0', sizeof(struct phase));
+	phase->log = log;
+	phase->name = strdup(name);
+
+	mutex_lock(&log->mutex);
+	phase->thread = phase_log_get_thread(log);
+	if (log->last) {
+		log->last->next = phase;
+	} else {
+		log->first = phase;
+	}
+	log->last = phase;
+	mutex_unlock(&log->mutex);
+
+	phase_get_usage(&phase->begin);
+
+	return phase;
+}
+
+void phase_end(struct phase* phase)
+{
+	struct phase_usage usage;
+
+	if (!phase) {
+		return;
+	}
+	phase_get_usage(&usage);
+	mutex_lock(&phase->log->mutex);
+	phase->end = usage;
+	phase->done = 1;
+	mutex_unlock(&phase->log->mutex);
+}
+
+static void phase_write_string(FILE* f, const char* str)
+{
+	fputc('"', f);
+	for (; *str; str++) {
+		if (*str == '"' || *str == '\\') {
+			fputc('\\', f);
+			fputc(*str, f);
+		} else if ((unsigned char)*str < 0x20) {
+			fprintf(f, "\\u%04x", (unsigned char)*str);
+		} else {
+			fputc(*str, f);
+		}
+	}
+	fputc('"', f);
+}
+
+/* phases still running are written as ending now */
+static void phase_get_end(struct phase* phase, struct phase_usage* now, struct phase_usage* end)
+{
+	*end = (phase->done) ? phase->end : *now;
+}
+
+static int phase_write_summary(struct phase_log* log, const char* path, struct phase_usage* now)
+{
+	struct phase* phase;
+	struct phase_usage end;
+
+	FILE* f = fopen(path, "w");
+	if (!f) {
+		error("ERROR: Unable to open '%s' for writing\n", path);
+		return -1;
+	}
+	fprintf(f, "{\n  \"wall_ms\": %.3f,\n  \"peak_rss_kb\": %llu,\n  \"phases\": [", (now->time - log->start) / 1000.0, (unsigned long long)now->peak_rss);
+	for (phase = log->first; phase; phase = phase->next) {
+		phase_get_end(phase, now, &end);
+		fprintf(f, "%s\n    { \"name\": ", (phase == log->first) ? "" : ",");
+		phase_write_string(f, phase->name);
+		fprintf(f, ", \"thread\": %d, \"start_ms\": %.3f, \"wall_ms\": %.3f, \"cpu_ms\": %.3f, \"read_bytes\": %llu, \"written_bytes\": %llu, \"peak_rss_kb\": %llu%s }",
+			phase->thread,
+			(phase->begin.time - log->start) / 1000.0,
+			(end.time - phase->begin.time) / 1000.0,
+			(end.cpu - phase->begin.cpu) / 1000.0,
+			(unsigned long long)(end.read_bytes - phase->begin.read_bytes),
+			(unsigned long long)(end.written_bytes - phase->begin.written_bytes),
+			(unsigned long long)end.peak_rss,
+			(phase->done) ? "" : ", \"unfinished\": true");
+	}
+	fprintf(f, "\n  ]\n}\n");
+	fclose(f);
+
+	return 0;
+}
+
+/* trace event format, loads in chrome://tracing and Perfetto */
+static int phase_write_trace(struct phase_log* log, const char* path, struct phase_usage* now)
+{
+	struct phase* phase;
+	struct phase_usage end;
+
+	FILE* f = fopen(path, "w");
+	if (!f) {
+		error("ERROR: Unable to open '%s' for writing\n", path);
+		return -1;
+	}
+	fprintf(f, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+	for (phase = log->first; phase; phase = phase->next) {
+		phase_get_end(phase, now, &end);
+		fprintf(f, "%s\n{\"name\":", (phase == log->first) ? "" : ",");
+		phase_write_string(f, phase->name);
+		fprintf(f, ",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%llu,\"dur\":%llu,\"args\":{\"cpu_ms\":%.3f,\"read_bytes\":%llu,\"written_bytes\":%llu,\"peak_rss_kb\":%llu}}",
+			phase->thread,
+			(unsigned long long)(phase->begin.time - log->start),
+			(unsigned long long)(end.time - phase->begin.time),
+			(end.cpu - phase->begin.cpu) / 1000.0,
+			(unsigned long long)(end.read_bytes - phase->begin.read_bytes),
+			(unsigned long long)(end.written_bytes - phase->begin.written_bytes),
+			(unsigned long long)end.peak_rss);
+	}
+	fprintf(f, "\n]}\n");
+	fclose(f);
+
+	return 0;
+}
+
+/* writes <prefix>.json with the phase timings and <prefix>.trace.json */
+int phase_log_write(struct phase_log* log, const char* prefix)
+{
+	struct phase_usage now;
+	int res = 0;
+
+	if (!log || !prefix) {
+		return -1;
+	}
+
+	size_t len = strlen(prefix) + 16;
+	char* path = (char*)malloc(len);
+	if (!path) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+
+	phase_get_usage(&now);
+	mutex_lock(&log->mutex);
+	snprintf(path, len, "%s.json", prefix);
+	if (phase_write_summary(log, path, &now) < 0) {
+		res = -1;
+	}
+	snprintf(path, len, "%s.trace.json", prefix);
+	if (phase_write_trace(log, path, &now) < 0) {
+		res = -1;
+	}
+	mutex_unlock(&log->mutex);
+	if (res == 0) {
+		info("Phase timings written to %s.json and %s.trace.json\n", prefix, prefix);
+	}
+	free(path);
+
+	return res;
+}
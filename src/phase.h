@@ -0,0 +1,45 @@
+/*
+ * phase.h
+ * Timing the phases of a restore
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef IDEVICERESTORE_PHASE_H
+#define IDEVICERESTORE_PHASE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include "idevicerestore.h"
+
+struct phase_log;
+struct phase;
+
+struct phase_log* phase_log_new(void);
+void phase_log_free(struct phase_log* log);
+int phase_log_write(struct phase_log* log, const char* prefix);
+
+/* both do nothing unless the current client has a phase log */
+struct phase* phase_begin(const char* name);
+void phase_end(struct phase* phase);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -32,6 +32,9 @@
 #include "idevicerestore.h"
 #include "tss.h"
 #include "img3.h"
+#include "devwait.h"
+#include "personalize.h"
+#include "usbtopo.h"
 #include "restore.h"
 #include "recovery.h"
 
@@ -57,11 +60,53 @@ void recovery_client_free(struct idevicerestore_client_t* client) {
 	}
 }
 
+struct recovery_probe_args {
+	uint64_t ecid;
+	irecv_client_t client;
+	int missing;	/* consecutive probes that did not find the device */
+};
+
+static int recovery_probe_open(void* userdata)
+{
+	struct recovery_probe_args* args = (struct recovery_probe_args*)userdata;
+	return (irecv_open_with_ecid(&args->client, args->ecid) == IRECV_E_SUCCESS) ? 0 : -1;
+}
+
+/* a failed open or claim doesn't mean the device is gone, only "no device"
+ * counts, and only twice in a row */
+static int recovery_probe_gone(void* userdata)
+{
+	struct recovery_probe_args* args = (struct recovery_probe_args*)userdata;
+	irecv_client_t recovery = NULL;
+	irecv_error_t err = irecv_open_with_ecid(&recovery, args->ecid);
+	if (err == IRECV_E_SUCCESS) {
+		irecv_close(recovery);
+		args->missing = 0;
+		return -1;
+	}
+	if (err != IRECV_E_UNABLE_TO_CONNECT && err != IRECV_E_NO_DEVICE) {
+		args->missing = 0;
+		return -1;
+	}
+	return (++args->missing >= 2) ? 0 : -1;
+}
+
+/* wait until the device dropped off the bus after being told to boot something.
+ * libirecovery does not report hotplug events, so this polls. */
+int recovery_wait_for_disconnect(struct idevicerestore_client_t* client, unsigned int timeout_ms)
+{
+	struct recovery_probe_args args = { client->ecid, NULL, 0 };
+	if (device_wait_probe(NULL, recovery_probe_gone, &args, timeout_ms) < 0) {
+		debug("DEBUG: Device still connected after %u ms\n", timeout_ms);
+		return -1;
+	}
+	return 0;
+}
+
 int recovery_client_new(struct idevicerestore_client_t* client) {
-	int i = 0;
-	int attempts = 20;
+	unsigned int timeout = 80000;
+	struct recovery_probe_args args = { client->ecid, NULL, 0 };
 	irecv_client_t recovery = NULL;
-	irecv_error_t recovery_error = IRECV_E_UNKNOWN_ERROR;
 
 	if(client->recovery == NULL) {
 		client->recovery = (struct recovery_client_t*)malloc(sizeof(struct recovery_client_t));
@@ -72,20 +117,11 @@ int recovery_client_new(struct idevicerestore_client_t* client) {
 		memset(client->recovery, 0, sizeof(struct recovery_client_t));
 	}
 
-	for (i = 1; i <= attempts; i++) {
-		recovery_error = irecv_open_with_ecid(&recovery, client->ecid);
-		if (recovery_error == IRECV_E_SUCCESS) {
-			break;
-		}
-
-		if (i >= attempts) {
-			error("ERROR: Unable to connect to device in recovery mode\n");
-			return -1;
-		}
-
-		sleep(4);
-		debug("Retrying connection...\n");
+	if (device_wait_probe(NULL, recovery_probe_open, &args, timeout) < 0) {
+		error("ERROR: Unable to connect to device in recovery mode\n");
+		return -1;
 	}
+	recovery = args.client;
 
 	if (client->srnm == NULL) {
 		const struct irecv_device_info *device_info = irecv_get_device_info(recovery);
@@ -143,12 +179,68 @@ int recovery_set_autoboot(struct idevicerestore_client_t* client, int enable) {
 	return 0;
 }
 
+/* have the personalization pool prepare everything sent below in the order
+ * iBoot gets it, so the next component is ready while one is uploading */
+static void recovery_stage_components(struct idevicerestore_client_t* client, plist_t build_identity)
+{
+	plist_t manifest_node = plist_dict_get_item(build_identity, "Manifest");
+	if (!client->personalize || !manifest_node || plist_get_node_type(manifest_node) != PLIST_DICT) {
+		return;
+	}
+
+	int num = 0;
+	const char** components = (const char**)malloc(sizeof(char*) * (plist_dict_get_size(manifest_node) + 5));
+	char** keys = (char**)malloc(sizeof(char*) * (plist_dict_get_size(manifest_node) + 1));
+	if (!components || !keys) {
+		free(components);
+		free(keys);
+		return;
+	}
+	int num_keys = 0;
+
+	components[num++] = "RestoreLogo";
+	plist_dict_iter iter = NULL;
+	plist_dict_new_iter(manifest_node, &iter);
+	while (iter) {
+		char *key = NULL;
+		plist_t node = NULL;
+		plist_dict_next_item(manifest_node, iter, &key, &node);
+		if (key == NULL)
+			break;
+		uint8_t b = 0;
+		plist_t iboot_node = plist_access_path(node, 2, "Info", "IsLoadedByiBoot");
+		if (iboot_node && plist_get_node_type(iboot_node) == PLIST_BOOLEAN) {
+			plist_get_bool_val(iboot_node, &b);
+		}
+		if (b) {
+			keys[num_keys++] = key;
+			components[num++] = key;
+		} else {
+			free(key);
+		}
+	}
+	free(iter);
+	components[num++] = "RestoreRamDisk";
+	components[num++] = "RestoreDeviceTree";
+	components[num++] = "RestoreKernelCache";
+	components[num] = NULL;
+
+	personalize_pool_stage(client->personalize, components);
+
+	while (num_keys > 0) {
+		free(keys[--num_keys]);
+	}
+	free(keys);
+	free(components);
+}
+
 int recovery_enter_restore(struct idevicerestore_client_t* client, plist_t build_identity) {
 	if (client->build_major >= 8) {
 		client->restore_boot_args = strdup("rd=md0 nand-enable-reformat=1 -progress");
 	}
 
 	/* upload data to make device boot restore mode */
+	recovery_stage_components(client, build_identity);
 
 	if(client->recovery == NULL) {
 		if (recovery_client_new(client) < 0) {
@@ -280,26 +372,25 @@ int recovery_send_component(struct idevicerestore_client_t* client, plist_t buil
 		}
 	}
 
-	unsigned char* component_data = NULL;
-	unsigned int component_size = 0;
-	int ret = extract_component(client->ipsw, path, &component_data, &component_size);
+	int ret = get_personalized_component(client, component, path, &data, &size);
 	free(path);
 	if (ret < 0) {
-		error("ERROR: Unable to extract component: %s\n", component);
-		return -1;
-	}
-
-	ret = personalize_component(component, component_data, component_size, client->tss, &data, &size);
-	free(component_data);
-	if (ret < 0) {
-		error("ERROR: Unable to get personalized component: %s\n", component);
 		return -1;
 	}
 
 	info("Sending %s (%d bytes)...\n", component, size);
 
+	/* only the big images need a slot on the USB hub, and only while they
+	 * are on the wire */
+	int bulk = (!strcmp(component, "RestoreRamDisk") || !strcmp(component, "RestoreKernelCache"));
+	if (bulk) {
+		usbtopo_bulk_begin(client, component);
+	}
 	// FIXME: Did I do this right????
 	err = irecv_send_buffer(client->recovery->client, data, size, 0);
+	if (bulk) {
+		usbtopo_bulk_end(client);
+	}
 	free(data);
 	if (err != IRECV_E_SUCCESS) {
 		error("ERROR: Unable to send %s component: %s\n", component, irecv_strerror(err));
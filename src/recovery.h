@@ -42,6 +42,7 @@ struct recovery_client_t {
 
 int recovery_check_mode(struct idevicerestore_client_t* client);
 int recovery_client_new(struct idevicerestore_client_t* client);
+int recovery_wait_for_disconnect(struct idevicerestore_client_t* client, unsigned int timeout_ms);
 void recovery_client_free(struct idevicerestore_client_t* client);
 int recovery_enter_restore(struct idevicerestore_client_t* client, plist_t build_identity);
 int recovery_send_component(struct idevicerestore_client_t* client, plist_t build_identity, const char* component);
@@ -0,0 +1,335 @@
+/*
+ * replay.c
+ * Replaying recorded restored sessions to time the message handlers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <plist/plist.h>
+#include <libirecovery.h>
+
+#include "replay.h"
+#include "trace.h"
+#include "restore.h"
+#include "common.h"
+
+#define REPLAY_MAX_NAME 64
+
+/* handler latency of one data type */
+struct replay_stat {
+	char name[REPLAY_MAX_NAME];
+	int count;
+	uint64_t total;
+	uint64_t min;
+	uint64_t max;
+};
+
+struct replay_stats {
+	struct replay_stat* stats;
+	int num_stats;
+};
+
+static void replay_stats_add(struct replay_stats* stats, const char* name, uint64_t usecs)
+{
+	struct replay_stat* stat = NULL;
+	int i;
+
+	for (i = 0; i < stats->num_stats; i++) {
+		if (!strcmp(stats->stats[i].name, name)) {
+			stat = &stats->stats[i];
+			break;
+		}
+	}
+	if (!stat) {
+		struct replay_stat* grown = (struct replay_stat*)realloc(stats->stats, sizeof(struct replay_stat) * (stats->num_stats + 1));
+		if (!grown) {
+			return;
+		}
+		stats->stats = grown;
+		stat = &stats->stats[stats->num_stats++];
+		memset(stat, '\0', sizeof(struct replay_stat));
+		snprintf(stat->name, REPLAY_MAX_NAME, "%s", name);
+		stat->min = usecs;
+	}
+	stat->count++;
+	stat->total += usecs;
+	if (usecs < stat->min) {
+		stat->min = usecs;
+	}
+	if (usecs > stat->max) {
+		stat->max = usecs;
+	}
+}
+
+/* DataType of a data request, firmware updater requests also by updater */
+static void replay_get_request_name(plist_t message, char* name, size_t size)
+{
+	char* type = NULL;
+	char* updater = NULL;
+
+	plist_t node = plist_dict_get_item(message, "DataType");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &type);
+	}
+	node = plist_access_path(message, 2, "Arguments", "MessageArgUpdaterName");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &updater);
+	}
+	if (updater) {
+		snprintf(name, size, "%s (%s)", (type) ? type : "(unknown)", updater);
+	} else {
+		snprintf(name, size, "%s", (type) ? type : "(unknown)");
+	}
+	free(type);
+	free(updater);
+}
+
+static int replay_is_data_request(plist_t message)
+{
+	char* type = NULL;
+	int res = 0;
+
+	plist_t node = plist_dict_get_item(message, "MsgType");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &type);
+		res = (type && !strcmp(type, "DataRequestMsg"));
+		free(type);
+	}
+
+	return res;
+}
+
+static int replay_compare(plist_t a, plist_t b)
+{
+	char* xa = NULL;
+	char* xb = NULL;
+	uint32_t size = 0;
+
+	plist_to_xml(a, &xa, &size);
+	plist_to_xml(b, &xb, &size);
+	int res = (xa && xb && !strcmp(xa, xb)) ? 0 : -1;
+	free(xa);
+	free(xb);
+
+	return res;
+}
+
+/* takes what the handlers need from the recorded context */
+static int replay_setup_client(struct idevicerestore_client_t* client, plist_t context, plist_t* build_identity)
+{
+	uint64_t uval = 0;
+	uint8_t bval = 0;
+	char* sval = NULL;
+
+	plist_t node = plist_dict_get_item(context, "BuildIdentity");
+	if (!node || plist_get_node_type(node) != PLIST_DICT) {
+		error("ERROR: Trace has no build identity\n");
+		return -1;
+	}
+	*build_identity = plist_copy(node);
+
+	node = plist_dict_get_item(context, "TSS");
+	if (node && plist_get_node_type(node) == PLIST_DICT) {
+		client->tss = plist_copy(node);
+	}
+	node = plist_dict_get_item(context, "PreflightInfo");
+	if (node && plist_get_node_type(node) == PLIST_DICT) {
+		client->preflight_info = plist_copy(node);
+	}
+	node = plist_dict_get_item(context, "ECID");
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &uval);
+		client->ecid = uval;
+	}
+	node = plist_dict_get_item(context, "BuildMajor");
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &uval);
+		client->build_major = (int)uval;
+	}
+	node = plist_dict_get_item(context, "Image4Supported");
+	if (node && plist_get_node_type(node) == PLIST_BOOLEAN) {
+		plist_get_bool_val(node, &bval);
+		client->image4supported = bval;
+	}
+	node = plist_dict_get_item(context, "Flags");
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &uval);
+		client->flags |= (int)uval & (FLAG_ERASE | FLAG_CUSTOM | FLAG_EXCLUDE);
+	}
+	node = plist_dict_get_item(context, "HardwareModel");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &sval);
+		irecv_devices_get_device_by_hardware_model(sval, &client->device);
+		free(sval);
+		sval = NULL;
+	}
+	if (!client->ipsw) {
+		node = plist_dict_get_item(context, "IPSW");
+		if (node && plist_get_node_type(node) == PLIST_STRING) {
+			plist_get_string_val(node, &client->ipsw);
+		}
+	}
+	if (!client->ipsw) {
+		error("ERROR: No IPSW given and none recorded in the trace\n");
+		return -1;
+	}
+
+	client->restore = (struct restore_client_t*)malloc(sizeof(struct restore_client_t));
+	if (!client->restore) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	memset(client->restore, '\0', sizeof(struct restore_client_t));
+
+	return 0;
+}
+
+static void replay_print_stats(struct replay_stats* stats)
+{
+	int i;
+
+	info("%-40s %6s %10s %10s %10s\n", "DataType", "Count", "Mean ms", "Min ms", "Max ms");
+	for (i = 0; i < stats->num_stats; i++) {
+		struct replay_stat* stat = &stats->stats[i];
+		info("%-40s %6d %10.3f %10.3f %10.3f\n", stat->name, stat->count,
+			(double)stat->total / stat->count / 1000.0,
+			(double)stat->min / 1000.0,
+			(double)stat->max / 1000.0);
+	}
+}
+
+/* feeds the messages restored sent in a recorded session to the message
+ * handlers again, with no device attached, and reports how long each data
+ * request took to answer. replies are compared to the recorded ones. */
+int replay_run(struct idevicerestore_client_t* client, const char* path)
+{
+	struct replay_stats stats;
+	plist_t context = NULL;
+	plist_t build_identity = NULL;
+	plist_t expected = NULL;
+	plist_t message = NULL;
+	uint32_t next_expected = 0;
+	uint64_t time = 0;
+	int type = 0;
+	int messages = 0;
+	int failed = 0;
+	int mismatched = 0;
+	int res = -1;
+	uint32_t i;
+
+	memset(&stats, '\0', sizeof(stats));
+
+	struct idevicerestore_client_t* previous = idevicerestore_get_current_client();
+	idevicerestore_set_current_client(client);
+
+	client->trace = trace_open(path);
+	if (!client->trace) {
+		goto leave;
+	}
+
+	expected = plist_new_array();
+	while (trace_read(client->trace, &type, &time, &message) == 0) {
+		if (type == TRACE_CONTEXT && !context) {
+			context = message;
+		} else if (type == TRACE_SENT) {
+			plist_array_append_item(expected, plist_copy(message));
+		}
+	}
+	if (!context) {
+		error("ERROR: %s has no restore context, was it recorded with --record?\n", path);
+		goto leave;
+	}
+	if (replay_setup_client(client, context, &build_identity) < 0) {
+		goto leave;
+	}
+
+	info("Replaying %s against %s\n", path, client->ipsw);
+
+	trace_rewind(client->trace);
+	while ((client->flags & FLAG_QUIT) == 0 && trace_read(client->trace, &type, &time, &message) == 0) {
+		if (type != TRACE_RECEIVED) {
+			continue;
+		}
+		messages++;
+
+		uint64_t start = trace_now();
+		int err = restore_handle_message(client, NULL, NULL, message, build_identity, NULL);
+		uint64_t elapsed = trace_now() - start;
+
+		if (replay_is_data_request(message)) {
+			char name[REPLAY_MAX_NAME];
+			replay_get_request_name(message, name, sizeof(name));
+			if (err < 0) {
+				error("ERROR: Handling %s failed\n", name);
+				failed++;
+			} else {
+				replay_stats_add(&stats, name, elapsed);
+			}
+		}
+
+		plist_t sent = trace_take_sent(client->trace);
+		for (i = 0; i < plist_array_get_size(sent); i++) {
+			plist_t reply = plist_array_get_item(sent, i);
+			if (next_expected >= plist_array_get_size(expected)) {
+				error("ERROR: Reply %d was not in the recording\n", next_expected);
+				mismatched++;
+			} else if (replay_compare(reply, plist_array_get_item(expected, next_expected)) < 0) {
+				error("ERROR: Reply %d differs from the recording\n", next_expected);
+				if (idevicerestore_debug_enabled()) {
+					debug_plist(plist_array_get_item(expected, next_expected));
+					debug_plist(reply);
+				}
+				mismatched++;
+			}
+			next_expected++;
+		}
+		plist_free(sent);
+	}
+	if (next_expected < plist_array_get_size(expected)) {
+		error("ERROR: %d recorded replies were not sent\n", plist_array_get_size(expected) - next_expected);
+		mismatched++;
+	}
+
+	info("Replayed %d messages, %d replies\n", messages, next_expected);
+	replay_print_stats(&stats);
+	if (failed || mismatched) {
+		error("ERROR: %d data requests failed, %d replies did not match the recording\n", failed, mismatched);
+	} else {
+		res = 0;
+	}
+
+leave:
+	restore_client_free(client);
+	trace_close(client->trace);
+	client->trace = NULL;
+	if (build_identity) {
+		plist_free(build_identity);
+	}
+	if (expected) {
+		plist_free(expected);
+	}
+	free(stats.stats);
+	idevicerestore_set_current_client(previous);
+
+	return res;
+}
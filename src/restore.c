@@ -26,8 +26,8 @@
 #include <string.h>
 #include <unistd.h>
 #include <libimobiledevice/restore.h>
-#include <zip.h>
 #include <libirecovery.h>
+#include <openssl/sha.h>
 
 #include "idevicerestore.h"
 #include "asr.h"
@@ -36,6 +36,13 @@
 #include "mbn.h"
 #include "tss.h"
 #include "ipsw.h"
+#include "zipbuf.h"
+#include "personalize.h"
+#include "devwait.h"
+#include "usbtopo.h"
+#include "trace.h"
+#include "phase.h"
+#include "metrics.h"
 #include "restore.h"
 #include "common.h"
 #include "endianness.h"
@@ -87,9 +94,7 @@
 #define UPDATE_SAVAGE                 60
 #define CERTIFY_SAVAGE                61
 
-static int restore_finished = 0;
 
-static int restore_device_connected = 0;
 
 int restore_client_new(struct idevicerestore_client_t* client) {
 	struct restore_client_t* restore = (struct restore_client_t*) malloc(sizeof(struct restore_client_t));
@@ -107,6 +112,21 @@ int restore_client_new(struct idevicerestore_client_t* client) {
 	return 0;
 }
 
+static void restore_bbfw_cache_clear(struct restore_bbfw_cache* cache)
+{
+	free(cache->data);
+	memset(cache, '\0', sizeof(struct restore_bbfw_cache));
+}
+
+static void restore_prefetch_join(struct restore_client_t* restore)
+{
+	if (restore->prefetch_thread) {
+		thread_join(restore->prefetch_thread);
+		thread_free(restore->prefetch_thread);
+		restore->prefetch_thread = (thread_t)NULL;
+	}
+}
+
 void restore_client_free(struct idevicerestore_client_t* client) {
 	if (client && client->restore) {
 		if(client->restore->client) {
@@ -121,6 +141,11 @@ void restore_client_free(struct idevicerestore_client_t* client) {
 			plist_free(client->restore->bbtss);
 			client->restore->bbtss = NULL;
 		}
+		restore_bbfw_cache_clear(&client->restore->bbfw_signed);
+		restore_bbfw_cache_clear(&client->restore->bbfw_ticketed);
+		restore_prefetch_join(client->restore);
+		free(client->restore->prefetch_bbfw_path);
+		free(client->restore->prefetch_bbfw);
 		free(client->restore);
 		client->restore = NULL;
 	}
@@ -280,15 +305,27 @@ irecv_device_t restore_get_irecv_device(struct idevicerestore_client_t* client)
 
 void restore_device_callback(const idevice_event_t* event, void* userdata) {
 	struct idevicerestore_client_t* client = (struct idevicerestore_client_t*) userdata;
+	if (!client->restore) {
+		return;
+	}
 	if (event->event == IDEVICE_DEVICE_ADD) {
-		restore_device_connected = 1;
+		client->restore->device_connected = 1;
 		client->udid = strdup(event->udid);
 	} else if (event->event == IDEVICE_DEVICE_REMOVE) {
-		restore_device_connected = 0;
+		client->restore->device_connected = 0;
 		client->flags |= FLAG_QUIT;
 	}
 }
 
+static void restore_device_removed_cb(const idevice_event_t* event, void* userdata)
+{
+	struct idevicerestore_client_t* client = (struct idevicerestore_client_t*)userdata;
+	if (event->event == IDEVICE_DEVICE_REMOVE && client->udid && !strcmp(event->udid, client->udid)) {
+		client->restore->device_connected = 0;
+		device_wait_signal(&client->restore->device_wait);
+	}
+}
+
 int restore_reboot(struct idevicerestore_client_t* client) {
 	if(client->restore == NULL) {
 		if (restore_open_with_timeout(client) < 0) {
@@ -297,13 +334,20 @@ int restore_reboot(struct idevicerestore_client_t* client) {
 		}
 	}
 
+	device_wait_init(&client->restore->device_wait);
+	device_event_subscribe(restore_device_removed_cb, client);
+
 	info("Rebooting restore mode device...\n");
 	restored_reboot(client->restore->client);
 
 	restored_client_free(client->restore->client);
+	client->restore->client = NULL;
 
-	// FIXME: wait for device disconnect here
-	sleep(10);
+	if (device_wait_for(&client->restore->device_wait, 10000) < 0) {
+		debug("DEBUG: Device did not disconnect after reboot request\n");
+	}
+	device_event_unsubscribe(restore_device_removed_cb, client);
+	device_wait_destroy(&client->restore->device_wait);
 
 	return 0;
 }
@@ -376,16 +420,16 @@ static void restore_device_event_cb(const idevice_event_t *event, void *user_dat
 {
 	if (event->event == IDEVICE_DEVICE_ADD) {
 		struct idevicerestore_client_t* client = (struct idevicerestore_client_t*)user_data;
-		if (!restore_device_connected && restore_is_current_device(client, event->udid)) {
-			restore_device_connected = 1;
+		if (!client->restore->device_connected && restore_is_current_device(client, event->udid)) {
+			client->restore->device_connected = 1;
 			client->udid = strdup(event->udid);
+			device_wait_signal(&client->restore->device_wait);
 		}
 	}
 }
 
 int restore_open_with_timeout(struct idevicerestore_client_t* client) {
-	int i = 0;
-	int attempts = 180;
+	unsigned int timeout = 180000;
 	char *type = NULL;
 	uint64_t version = 0;
 	idevice_t device = NULL;
@@ -413,25 +457,20 @@ int restore_open_with_timeout(struct idevicerestore_client_t* client) {
 		memset(client->restore, '\0', sizeof(struct restore_client_t));
 	}
 
-	restore_device_connected = 0;
+	client->restore->device_connected = 0;
+	device_wait_init(&client->restore->device_wait);
 
 	info("Waiting for device...\n");
-	idevice_event_subscribe(restore_device_event_cb, client);
-	i = 0;
-	while (i++ < attempts) {
-		debug("Attempt %d to connect to restore mode device...\n", i);
-		if (restore_device_connected) {
-			info("Device %s is now connected in restore mode...\n", client->udid);
-			break;
-		}
-		sleep(1);
-	}
-	idevice_event_unsubscribe();
+	device_event_subscribe(restore_device_event_cb, client);
+	int timed_out = (device_wait_for(&client->restore->device_wait, timeout) < 0);
+	device_event_unsubscribe(restore_device_event_cb, client);
+	device_wait_destroy(&client->restore->device_wait);
 
-	if (!restore_device_connected) {
+	if (!client->restore->device_connected) {
 		error("ERROR: Unable to connect to device in restore mode\n");
-		return (i == attempts ? -2:-1);
+		return (timed_out ? -2:-1);
 	}
+	info("Device %s is now connected in restore mode...\n", client->udid);
 
 	info("Connecting now...\n");
 	device_error = idevice_new(&device, client->udid);
@@ -561,8 +600,6 @@ const char* restore_progress_string(unsigned int operation)
 	}
 }
 
-static int lastop = 0;
-
 int restore_handle_previous_restore_log_msg(restored_client_t client, plist_t msg) {
 	plist_t node = NULL;
 	char* restorelog = NULL;
@@ -608,7 +645,7 @@ int restore_handle_progress_msg(struct idevicerestore_client_t* client, plist_t
 	}
 
 	if ((progress > 0) && (progress <= 100)) {
-		if ((int)operation != lastop) {
+		if ((int)operation != client->restore->lastop) {
 			info("%s (%d)\n", restore_progress_string(adapted_operation), (int)operation);
 		}
 		switch (adapted_operation) {
@@ -629,12 +666,12 @@ int restore_handle_progress_msg(struct idevicerestore_client_t* client, plist_t
 	} else {
 		info("%s (%d)\n", restore_progress_string(adapted_operation), (int)operation);
 	}
-	lastop = (int)operation;
+	client->restore->lastop = (int)operation;
 
 	return 0;
 }
 
-int restore_handle_status_msg(restored_client_t client, plist_t msg) {
+int restore_handle_status_msg(struct idevicerestore_client_t* client, plist_t msg) {
 	int result = 0;
 	uint64_t value = 0;
 	char* log = NULL;
@@ -647,7 +684,7 @@ int restore_handle_status_msg(restored_client_t client, plist_t msg) {
 	switch(value) {
 		case 0:
 			info("Status: Restore Finished\n");
-			restore_finished = 1;
+			client->restore->finished = 1;
 			break;
 		case 0xFFFFFFFFFFFFFFFFLL:
 			info("Status: Verification Error\n");
@@ -748,39 +785,92 @@ static void restore_asr_progress_cb(double progress, void* userdata)
 
 int restore_send_filesystem(struct idevicerestore_client_t* client, idevice_t device, const char* filesystem) {
 	asr_client_t asr = NULL;
+	struct phase* phase = NULL;
+	double start = 0;
+	int res = -1;
+
+	// the filesystem might still be extracting in the background
+	phase = phase_begin("filesystem wait");
+	res = filesystem_extraction_wait(client, &filesystem);
+	phase_end(phase);
+	phase = NULL;
+	if (res < 0) {
+		error("ERROR: Filesystem is not available\n");
+		return -1;
+	}
+	res = -1;
 
 	info("About to send filesystem...\n");
 
+	// wait for room on the USB hub before connecting, other devices behind
+	// it may be streaming too and ASR shouldn't sit idle meanwhile
+	usbtopo_bulk_begin(client, "filesystem");
+
 	if (asr_open_with_timeout(device, &asr) < 0) {
 		error("ERROR: Unable to connect to ASR\n");
+		usbtopo_bulk_end(client);
 		return -1;
 	}
 	info("Connected to ASR\n");
 
 	asr_set_progress_callback(asr, restore_asr_progress_cb, (void*)client);
 
+	// keep the image in the page cache while other restores stream it too
+	asr->cache = fscache_acquire(filesystem);
+
 	// this step sends requested chunks of data from various offsets to asr so
 	// it can validate the filesystem before installing it
 	info("Validating the filesystem\n");
+	phase = phase_begin("ASR validation");
 	if (asr_perform_validation(asr, filesystem) < 0) {
 		error("ERROR: ASR was unable to validate the filesystem\n");
-		asr_free(asr);
-		return -1;
+		goto leave;
 	}
+	phase_end(phase);
+	phase = NULL;
 	info("Filesystem validated\n");
 
 	// once the target filesystem has been validated, ASR then requests the
 	// entire filesystem to be sent.
 	info("Sending filesystem now...\n");
+	phase = phase_begin("ASR payload");
+	start = metrics_time();
 	if (asr_send_payload(asr, filesystem) < 0) {
 		error("ERROR: Unable to send payload to ASR\n");
-		asr_free(asr);
-		return -1;
+		goto leave;
+	}
+	double elapsed = metrics_time() - start;
+	if (asr->cache) {
+		uint64_t length = fscache_get_size(asr->cache);
+		metrics_add(METRIC_ASR_BYTES, NULL, (double)length);
+		if (elapsed > 0) {
+			metrics_observe(METRIC_ASR_THROUGHPUT, NULL, (double)length / elapsed / 1000000.0);
+		}
 	}
 	info("Done sending filesystem\n");
+	res = 0;
 
+leave:
+	phase_end(phase);
+	usbtopo_bulk_end(client);
+	fscache_release(asr->cache);
 	asr_free(asr);
-	return 0;
+	return res;
+}
+
+/* all replies to restored go through here so they can be recorded. when a
+ * trace is replayed there is no restored connection and they are only recorded */
+static restored_error_t restore_send_message(restored_client_t restore, plist_t message)
+{
+	struct idevicerestore_client_t* client = idevicerestore_get_current_client();
+
+	if (client && client->trace) {
+		trace_write(client->trace, TRACE_SENT, message);
+	}
+	if (!restore && client && trace_is_replay(client->trace)) {
+		return RESTORE_E_SUCCESS;
+	}
+	return restored_send(restore, message);
 }
 
 int restore_send_root_ticket(restored_client_t restore, struct idevicerestore_client_t* client)
@@ -817,7 +907,7 @@ int restore_send_root_ticket(restored_client_t restore, struct idevicerestore_cl
 	}
 
 	info("Sending RootTicket now...\n");
-	restore_error = restored_send(restore, dict);
+	restore_error = restore_send_message(restore, dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send RootTicket (%d)\n", restore_error);
 		plist_free(dict);
@@ -853,21 +943,10 @@ int restore_send_component(restored_client_t restore, struct idevicerestore_clie
 		}
 	}
 
-	unsigned char* component_data = NULL;
-	unsigned int component_size = 0;
-	int ret = extract_component(client->ipsw, path, &component_data, &component_size);
+	int ret = get_personalized_component(client, component, path, &data, &size);
 	free(path);
 	path = NULL;
 	if (ret < 0) {
-		error("ERROR: Unable to extract component %s\n", component);
-		return -1;
-	}
-
-	ret = personalize_component(component, component_data, component_size, client->tss, &data, &size);
-	free(component_data);
-	component_data = NULL;
-	if (ret < 0) {
-		error("ERROR: Unable to get personalized component %s\n", component);
 		return -1;
 	}
 
@@ -879,7 +958,7 @@ int restore_send_component(restored_client_t restore, struct idevicerestore_clie
 	free(data);
 
 	info("Sending %s now...\n", component);
-	restore_error = restored_send(restore, dict);
+	restore_error = restore_send_message(restore, dict);
 	plist_free(dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send kernelcache data\n");
@@ -988,21 +1067,9 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 	}
 
 	const char* component = "LLB";
-	unsigned char* component_data = NULL;
-	unsigned int component_size = 0;
-	int ret = extract_component(client->ipsw, llb_path, &component_data, &component_size);
+	int ret = get_personalized_component(client, component, llb_path, &llb_data, &llb_size);
 	free(llb_path);
 	if (ret < 0) {
-		error("ERROR: Unable to extract component: %s\n", component);
-		return -1;
-	}
-
-	ret = personalize_component(component, component_data, component_size, client->tss, &llb_data, &llb_size);
-	free(component_data);
-	component_data = NULL;
-	component_size = 0;
-	if (ret < 0) {
-		error("ERROR: Unable to get personalized component: %s\n", component);
 		return -1;
 	}
 
@@ -1036,28 +1103,12 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 			continue;
 		}
 
-		component_data = NULL;
-		unsigned int component_size = 0;
-
-		if (extract_component(client->ipsw, comppath, &component_data, &component_size) < 0) {
-			free(comppath);
-			free(componentbuf);
-			plist_free(firmware_files);
-			error("ERROR: Unable to extract component: %s\n", component);
-			return -1;
-		}
-
-		if (personalize_component(component, component_data, component_size, client->tss, &nor_data, &nor_size) < 0) {
+		if (get_personalized_component(client, component, comppath, &nor_data, &nor_size) < 0) {
 			free(comppath);
 			free(componentbuf);
-			free(component_data);
 			plist_free(firmware_files);
-			error("ERROR: Unable to get personalized component: %s\n", component);
 			return -1;
 		}
-		free(component_data);
-		component_data = NULL;
-		component_size = 0;
 
 		free(componentbuf);
 		component = NULL;
@@ -1083,19 +1134,9 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 	if (build_identity_has_component(build_identity, "RestoreSEP") &&
 	    build_identity_get_component_path(build_identity, "RestoreSEP", &restore_sep_path) == 0) {
 		component = "RestoreSEP";
-		ret = extract_component(client->ipsw, restore_sep_path, &component_data, &component_size);
+		ret = get_personalized_component(client, component, restore_sep_path, &personalized_data, &personalized_size);
 		free(restore_sep_path);
 		if (ret < 0) {
-			error("ERROR: Unable to extract component: %s\n", component);
-			return -1;
-		}
-
-		ret = personalize_component(component, component_data, component_size, client->tss, &personalized_data, &personalized_size);
-		free(component_data);
-		component_data = NULL;
-		component_size = 0;
-		if (ret < 0) {
-			error("ERROR: Unable to get personalized component: %s\n", component);
 			return -1;
 		}
 
@@ -1108,19 +1149,9 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 	if (build_identity_has_component(build_identity, "SEP") &&
 	    build_identity_get_component_path(build_identity, "SEP", &sep_path) == 0) {
 		component = "SEP";
-		ret = extract_component(client->ipsw, sep_path, &component_data, &component_size);
+		ret = get_personalized_component(client, component, sep_path, &personalized_data, &personalized_size);
 		free(sep_path);
 		if (ret < 0) {
-			error("ERROR: Unable to extract component: %s\n", component);
-			return -1;
-		}
-
-		ret = personalize_component(component, component_data, component_size, client->tss, &personalized_data, &personalized_size);
-		free(component_data);
-		component_data = NULL;
-		component_size = 0;
-		if (ret < 0) {
-			error("ERROR: Unable to get personalized component: %s\n", component);
 			return -1;
 		}
 
@@ -1130,11 +1161,11 @@ int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t*
 		personalized_size = 0;
 	}
 
-	if (idevicerestore_debug)
+	if (idevicerestore_debug_enabled())
 		debug_plist(dict);
 
 	info("Sending NORData now...\n");
-	if (restored_send(restore, dict) != RESTORE_E_SUCCESS) {
+	if (restore_send_message(restore, dict) != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send NORImageData data\n");
 		plist_free(dict);
 		return -1;
@@ -1180,16 +1211,28 @@ static const char* restore_get_bbfw_fn_for_element(const char* elem)
 	return NULL;
 }
 
-static int restore_sign_bbfw(const char* bbfwtmp, plist_t bbtss, const unsigned char* bb_nonce)
+static void restore_bbfw_cache_key(const void* prefix, size_t prefix_size, plist_t node, const void* suffix, size_t suffix_size, unsigned char key[20])
 {
-	int res = -1;
+	SHA_CTX sha1;
+	char* bin = NULL;
+	uint32_t bin_size = 0;
 
-	// check for BBTicket in result
-	plist_t bbticket = plist_dict_get_item(bbtss, "BBTicket");
-	if (!bbticket || plist_get_node_type(bbticket) != PLIST_DATA) {
-		error("ERROR: Could not find BBTicket in Baseband TSS response\n");
-		return -1;
+	SHA1_Init(&sha1);
+	SHA1_Update(&sha1, prefix, prefix_size);
+	if (node) {
+		plist_to_bin(node, &bin, &bin_size);
+		if (bin) {
+			SHA1_Update(&sha1, bin, bin_size);
+			free(bin);
+		}
 	}
+	SHA1_Update(&sha1, suffix, suffix_size);
+	SHA1_Final(key, &sha1);
+}
+
+static int restore_sign_bbfw(const unsigned char* bbfw, unsigned int bbfw_size, plist_t bbtss, const unsigned char* bb_nonce, unsigned char** signed_bbfw, unsigned int* signed_bbfw_size, int* bbfw_is_fls)
+{
+	int res = -1;
 
 	plist_t bbfw_dict = plist_dict_get_item(bbtss, "BasebandFirmware");
 	if (!bbfw_dict || plist_get_node_type(bbfw_dict) != PLIST_DICT) {
@@ -1198,29 +1241,26 @@ static int restore_sign_bbfw(const char* bbfwtmp, plist_t bbtss, const unsigned
 	}
 
 	unsigned char* buffer = NULL;
+	unsigned int buffer_size = 0;
 	unsigned char* blob = NULL;
-	unsigned char* fdata = NULL;
-	off_t fsize = 0;
 	uint64_t blob_size = 0;
-	int zerr = 0;
 	int zindex = -1;
-	struct zip_stat zstat;
-	struct zip_file* zfile = NULL;
-	struct zip* za = NULL;
-	struct zip_source* zs = NULL;
+	zipbuf* zb = NULL;
 	mbn_file* mbn = NULL;
 	fls_file* fls = NULL;
 
-	za = zip_open(bbfwtmp, 0, &zerr);
-	if (!za) {
-		error("ERROR: Could not open ZIP archive '%s': %d\n", bbfwtmp, zerr);
-		goto leave;
+	// unchanged members are copied over as-is, only signed ones get recompressed
+	zb = zipbuf_open(bbfw, bbfw_size);
+	if (!zb) {
+		error("ERROR: Could not open baseband firmware archive\n");
+		return -1;
 	}
 
 	plist_dict_iter iter = NULL;
 	plist_dict_new_iter(bbfw_dict, &iter);
 	if (!iter) {
 		error("ERROR: Could not create dict iter for BasebandFirmware Dictionary\n");
+		zipbuf_free(zb);
 		return -1;
 	}
 
@@ -1246,54 +1286,32 @@ static int restore_sign_bbfw(const char* bbfwtmp, plist_t bbtss, const unsigned
 				is_fls = 1;
 			}
 
-			zindex = zip_name_locate(za, signfn, 0);
+			zindex = zipbuf_name_locate(zb, signfn);
 			if (zindex < 0) {
-				error("ERROR: can't locate '%s' in '%s'\n", signfn, bbfwtmp);
-				goto leave;
-			}
-
-			zip_stat_init(&zstat);
-			if (zip_stat_index(za, zindex, 0, &zstat) != 0) {
-				error("ERROR: zip_stat_index failed for index %d\n", zindex);
+				error("ERROR: can't locate '%s' in baseband firmware\n", signfn);
 				goto leave;
 			}
 
-			zfile = zip_fopen_index(za, zindex, 0);
-			if (zfile == NULL) {
-				error("ERROR: zip_fopen_index failed for index %d\n", zindex);
+			if (zipbuf_read(zb, zindex, &buffer, &buffer_size) < 0) {
+				error("ERROR: could not read '%s' from baseband firmware\n", signfn);
 				goto leave;
 			}
 
-			buffer = (unsigned char*) malloc(zstat.size + 1);
-			if (buffer == NULL) {
-				error("ERROR: Out of memory\n");
-				goto leave;
-			}
-
-			if (zip_fread(zfile, buffer, zstat.size) != zstat.size) {
-				error("ERROR: zip_fread: failed\n");
-				goto leave;
-			}
-			buffer[zstat.size] = '\0';
-
-			zip_fclose(zfile);
-			zfile = NULL;
-
 			if (is_fls) {
-				fls = fls_parse(buffer, zstat.size);
+				fls = fls_parse(buffer, buffer_size);
 				if (!fls) {
 					error("ERROR: could not parse fls file\n");
 					goto leave;
 				}
 			} else {
-				mbn = mbn_parse(buffer, zstat.size);
+				mbn = mbn_parse(buffer, buffer_size);
 				if (!mbn) {
 					error("ERROR: could not parse mbn file\n");
 					goto leave;
 				}
+				free(buffer);
+				buffer = NULL;
 			}
-			free(buffer);
-			buffer = NULL;
 
 			blob = NULL;
 			blob_size = 0;
@@ -1314,36 +1332,33 @@ static int restore_sign_bbfw(const char* bbfwtmp, plist_t bbtss, const unsigned
 					goto leave;
 				}
 			}
-			free(blob);
-			blob = NULL;
 
-			fsize = (is_fls ? fls->size : mbn->size);
-			fdata = (unsigned char*)malloc(fsize);
-			if (fdata == NULL)  {
-				error("ERROR: out of memory\n");
-				goto leave;
-			}
 			if (is_fls) {
-				memcpy(fdata, fls->data, fsize);
+				// fls holds on to buffer and blob until the new file is laid out
+				unsigned char* fls_data = NULL;
+				unsigned int fls_size = 0;
+				if (fls_write(fls, &fls_data, &fls_size) != 0) {
+					error("ERROR: could not sign %s\n", signfn);
+					goto leave;
+				}
 				fls_free(fls);
 				fls = NULL;
+				res = zipbuf_replace(zb, zindex, fls_data, fls_size);
+				free(fls_data);
+				free(buffer);
+				buffer = NULL;
 			} else {
-				memcpy(fdata, mbn->data, fsize);
+				res = zipbuf_replace(zb, zindex, mbn->data, mbn->size);
 				mbn_free(mbn);
 				mbn = NULL;
 			}
-
-			zs = zip_source_buffer(za, fdata, fsize, 1);
-			if (!zs) {
-				error("ERROR: out of memory\n");
-				free(fdata);
-				goto leave;
-			}
-
-			if (zip_replace(za, zindex, zs) == -1) {
+			free(blob);
+			blob = NULL;
+			if (res < 0) {
 				error("ERROR: could not update signed '%s' in archive\n", signfn);
 				goto leave;
 			}
+			res = -1;
 
 			if (is_fls && !bb_nonce) {
 				if (strcmp(key, "RamPSI") == 0) {
@@ -1356,9 +1371,10 @@ static int restore_sign_bbfw(const char* bbfwtmp, plist_t bbtss, const unsigned
 		free(key);
 	}
 	free(iter);
+	iter = NULL;
 
 	// remove everything but required files
-	int i, j, keep, numf = zip_get_num_files(za);
+	int i, j, keep, numf = zb->num_entries;
 	for (i = 0; i < numf; i++) {
 		keep = 0;
 		// check for signed file index
@@ -1370,145 +1386,136 @@ static int restore_sign_bbfw(const char* bbfwtmp, plist_t bbtss, const unsigned
 		}
 		// check for anything but .mbn and .fls if bb_nonce is set
 		if (bb_nonce && !keep) {
-			const char* fn = zip_get_name(za, i, 0);
-			if (fn) {
-				char* ext = strrchr(fn, '.');
-				if (ext && (!strcmp(ext, ".fls") || !strcmp(ext, ".mbn") || !strcmp(ext, ".elf") || !strcmp(ext, ".bin"))) {
-					keep = 1;
-				}
+			const char* fn = zb->entries[i].name;
+			char* ext = strrchr(fn, '.');
+			if (ext && (!strcmp(ext, ".fls") || !strcmp(ext, ".mbn") || !strcmp(ext, ".elf") || !strcmp(ext, ".bin"))) {
+				keep = 1;
 			}
 		}
 		if (!keep) {
-			zip_delete(za, i);
+			zipbuf_delete(zb, i);
 		}
 	}
 
-	if (bb_nonce) {
-		if (is_fls) {
-			// add BBTicket to file ebl.fls
-			zindex = zip_name_locate(za, "ebl.fls", 0);
-			if (zindex < 0) {
-				error("ERROR: can't locate 'ebl.fls' in '%s'\n", bbfwtmp);
-				goto leave;
-			}
-
-			zip_stat_init(&zstat);
-			if (zip_stat_index(za, zindex, 0, &zstat) != 0) {
-				error("ERROR: zip_stat_index failed for index %d\n", zindex);
-				goto leave;
-			}
+	if (zipbuf_write(zb, signed_bbfw, signed_bbfw_size) < 0) {
+		error("ERROR: could not write modified baseband firmware archive\n");
+		goto leave;
+	}
+	*bbfw_is_fls = is_fls;
+	res = 0;
 
-			zfile = zip_fopen_index(za, zindex, 0);
-			if (zfile == NULL) {
-				error("ERROR: zip_fopen_index failed for index %d\n", zindex);
-				goto leave;
-			}
+leave:
+	free(iter);
+	zipbuf_free(zb);
+	mbn_free(mbn);
+	fls_free(fls);
+	free(buffer);
+	free(blob);
 
-			buffer = (unsigned char*) malloc(zstat.size + 1);
-			if (buffer == NULL) {
-				error("ERROR: Out of memory\n");
-				goto leave;
-			}
+	return res;
+}
 
-			if (zip_fread(zfile, buffer, zstat.size) != zstat.size) {
-				error("ERROR: zip_fread: failed\n");
-				goto leave;
-			}
-			buffer[zstat.size] = '\0';
+static int restore_bbfw_insert_ticket(const unsigned char* bbfw, unsigned int bbfw_size, plist_t bbtss, int is_fls, unsigned char** ticketed_bbfw, unsigned int* ticketed_bbfw_size)
+{
+	int res = -1;
+	unsigned char* buffer = NULL;
+	unsigned int buffer_size = 0;
+	unsigned char* blob = NULL;
+	uint64_t blob_size = 0;
+	int zindex = -1;
+	zipbuf* zb = NULL;
+	fls_file* fls = NULL;
 
-			zip_fclose(zfile);
-			zfile = NULL;
+	plist_t bbticket = plist_dict_get_item(bbtss, "BBTicket");
+	if (!bbticket || plist_get_node_type(bbticket) != PLIST_DATA) {
+		error("ERROR: Could not find BBTicket in Baseband TSS response\n");
+		return -1;
+	}
 
-			fls = fls_parse(buffer, zstat.size);
-			free(buffer);
-			buffer = NULL;
-			if (!fls) {
-				error("ERROR: could not parse fls file\n");
-				goto leave;
-			}
+	zb = zipbuf_open(bbfw, bbfw_size);
+	if (!zb) {
+		error("ERROR: Could not open signed baseband firmware archive\n");
+		return -1;
+	}
 
-			blob = NULL;
-			blob_size = 0;
-			plist_get_data_val(bbticket, (char**)&blob, &blob_size);
-			if (!blob) {
-				error("ERROR: could not get BBTicket data\n");
-				goto leave;
-			}
+	if (is_fls) {
+		// add BBTicket to file ebl.fls
+		zindex = zipbuf_name_locate(zb, "ebl.fls");
+		if (zindex < 0) {
+			error("ERROR: can't locate 'ebl.fls' in baseband firmware\n");
+			goto leave;
+		}
 
-			if (fls_insert_ticket(fls, blob, (unsigned int)blob_size) != 0) {
-				error("ERROR: could not insert BBTicket to ebl.fls\n");
-				goto leave;
-			}
-			free(blob);
-			blob = NULL;
+		if (zipbuf_read(zb, zindex, &buffer, &buffer_size) < 0) {
+			error("ERROR: could not read 'ebl.fls' from baseband firmware\n");
+			goto leave;
+		}
 
-			fsize = fls->size;
-			fdata = (unsigned char*)malloc(fsize);
-			if (!fdata) {
-				error("ERROR: out of memory\n");
-				goto leave;
-			}
-			memcpy(fdata, fls->data, fsize);
-			fls_free(fls);
-			fls = NULL;
-
-			zs = zip_source_buffer(za, fdata, fsize, 1);
-			if (!zs) {
-				error("ERROR: out of memory\n");
-				free(fdata);
-				goto leave;
-			}
+		fls = fls_parse(buffer, buffer_size);
+		if (!fls) {
+			error("ERROR: could not parse fls file\n");
+			goto leave;
+		}
 
-			if (zip_replace(za, zindex, zs) == -1) {
-				error("ERROR: could not update archive with ticketed ebl.fls\n");
-				goto leave;
-			}
-		} else {
-			// add BBTicket as bbticket.der
-			blob = NULL;
-			blob_size = 0;
-			plist_get_data_val(bbticket, (char**)&blob, &blob_size);
-			if (!blob) {
-				error("ERROR: could not get BBTicket data\n");
-				goto leave;
-			}
+		blob = NULL;
+		blob_size = 0;
+		plist_get_data_val(bbticket, (char**)&blob, &blob_size);
+		if (!blob) {
+			error("ERROR: could not get BBTicket data\n");
+			goto leave;
+		}
 
-			zs = zip_source_buffer(za, blob, blob_size, 1);
-			if (!zs) {
-				error("ERROR: out of memory\n");
-				goto leave;
-			}
-			blob = NULL;
+		if (fls_insert_ticket(fls, blob, (unsigned int)blob_size) != 0) {
+			error("ERROR: could not insert BBTicket to ebl.fls\n");
+			goto leave;
+		}
 
-			if (zip_add(za, "bbticket.der", zs) == -1) {
-				error("ERROR: could not add bbticket.der to archive\n");
-				goto leave;
-			}
+		unsigned char* fls_data = NULL;
+		unsigned int fls_size = 0;
+		if (fls_write(fls, &fls_data, &fls_size) != 0) {
+			error("ERROR: could not insert BBTicket to ebl.fls\n");
+			goto leave;
 		}
-	}
+		fls_free(fls);
+		fls = NULL;
+		free(blob);
+		blob = NULL;
+		free(buffer);
+		buffer = NULL;
 
-	// this will write out the modified zip
-	if (zip_close(za) == -1) {
-		error("ERROR: could not close and write modified archive: %s\n", zip_strerror(za));
+		res = zipbuf_replace(zb, zindex, fls_data, fls_size);
+		free(fls_data);
+		if (res < 0) {
+			error("ERROR: could not update archive with ticketed ebl.fls\n");
+			goto leave;
+		}
 		res = -1;
 	} else {
-		res = 0;
-	}
-	za = NULL;
-	zs = NULL;
+		// add BBTicket as bbticket.der
+		blob = NULL;
+		blob_size = 0;
+		plist_get_data_val(bbticket, (char**)&blob, &blob_size);
+		if (!blob) {
+			error("ERROR: could not get BBTicket data\n");
+			goto leave;
+		}
 
-leave:
-	if (zfile) {
-		zip_fclose(zfile);
-	}
-	if (zs) {
-		zip_source_free(zs);
+		if (zipbuf_add(zb, "bbticket.der", blob, (unsigned int)blob_size) < 0) {
+			error("ERROR: could not add bbticket.der to archive\n");
+			goto leave;
+		}
+		free(blob);
+		blob = NULL;
 	}
-	if (za) {
-		zip_unchange_all(za);
-		zip_close(za);
+
+	if (zipbuf_write(zb, ticketed_bbfw, ticketed_bbfw_size) < 0) {
+		error("ERROR: could not write modified baseband firmware archive\n");
+		goto leave;
 	}
-	mbn_free(mbn);
+	res = 0;
+
+leave:
+	zipbuf_free(zb);
 	fls_free(fls);
 	free(buffer);
 	free(blob);
@@ -1516,6 +1523,118 @@ leave:
 	return res;
 }
 
+static plist_t restore_create_baseband_tss_request(struct idevicerestore_client_t* client, plist_t build_identity, uint64_t bb_chip_id, uint64_t bb_cert_id, const unsigned char* bb_snum, uint64_t bb_snum_size, const unsigned char* bb_nonce, uint64_t bb_nonce_size)
+{
+	/* populate parameters */
+	plist_t parameters = plist_new_dict();
+	plist_dict_set_item(parameters, "ApECID", plist_new_uint(client->ecid));
+	if (bb_nonce) {
+		plist_dict_set_item(parameters, "BbNonce", plist_new_data((const char*)bb_nonce, bb_nonce_size));
+	}
+	plist_dict_set_item(parameters, "BbChipID", plist_new_uint(bb_chip_id));
+	plist_dict_set_item(parameters, "BbGoldCertId", plist_new_uint(bb_cert_id));
+	plist_dict_set_item(parameters, "BbSNUM", plist_new_data((const char*)bb_snum, bb_snum_size));
+
+	tss_parameters_add_from_manifest(parameters, build_identity);
+
+	/* create baseband request */
+	plist_t request = tss_request_new(NULL);
+	if (request == NULL) {
+		plist_free(parameters);
+		return NULL;
+	}
+
+	/* add baseband parameters */
+	tss_request_add_common_tags(request, parameters, NULL);
+	tss_request_add_baseband_tags(request, parameters, NULL);
+	plist_free(parameters);
+
+	plist_t node = plist_access_path(build_identity, 2, "Info", "FDRSupport");
+	if (node && plist_get_node_type(node) == PLIST_BOOLEAN) {
+		uint8_t b = 0;
+		plist_get_bool_val(node, &b);
+		if (b) {
+			plist_dict_set_item(request, "ApProductionMode", plist_new_bool(1));
+			plist_dict_set_item(request, "ApSecurityMode", plist_new_bool(1));
+		}
+	}
+	if (idevicerestore_debug_enabled())
+		debug_plist(request);
+
+	return request;
+}
+
+static int restore_bb_arguments_match(plist_t preflight_info, plist_t arguments)
+{
+	const char* keys[] = { "ChipID", "CertID", "ChipSerialNo", "Nonce", NULL };
+	int i;
+
+	if (!preflight_info || !arguments || plist_get_node_type(arguments) != PLIST_DICT) {
+		return 0;
+	}
+	for (i = 0; keys[i]; i++) {
+		plist_t a = plist_dict_get_item(preflight_info, keys[i]);
+		plist_t b = plist_dict_get_item(arguments, keys[i]);
+		if (!a || !b || plist_get_node_type(a) != plist_get_node_type(b) || !plist_compare_node_value(a, b)) {
+			debug("DEBUG: %s: %s differs from preflight info\n", __func__, keys[i]);
+			return 0;
+		}
+	}
+	return 1;
+}
+
+int restore_prefetch_baseband_tss(struct idevicerestore_client_t* client, plist_t build_identity)
+{
+	uint64_t bb_chip_id = 0;
+	uint64_t bb_cert_id = 0;
+	char* bb_snum = NULL;
+	uint64_t bb_snum_size = 0;
+	char* bb_nonce = NULL;
+	uint64_t bb_nonce_size = 0;
+	plist_t node;
+
+	if (!client->preflight_info || client->bbtss_prefetch) {
+		return 0;
+	}
+	if (!plist_access_path(build_identity, 2, "Manifest", "BasebandFirmware")) {
+		return 0;
+	}
+
+	node = plist_dict_get_item(client->preflight_info, "ChipID");
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &bb_chip_id);
+	}
+	node = plist_dict_get_item(client->preflight_info, "CertID");
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &bb_cert_id);
+	}
+	node = plist_dict_get_item(client->preflight_info, "ChipSerialNo");
+	if (node && plist_get_node_type(node) == PLIST_DATA) {
+		plist_get_data_val(node, &bb_snum, &bb_snum_size);
+	}
+	node = plist_dict_get_item(client->preflight_info, "Nonce");
+	if (node && plist_get_node_type(node) == PLIST_DATA) {
+		plist_get_data_val(node, &bb_nonce, &bb_nonce_size);
+	}
+	if (!bb_nonce) {
+		free(bb_snum);
+		return 0;
+	}
+
+	plist_t request = restore_create_baseband_tss_request(client, build_identity, bb_chip_id, bb_cert_id, (unsigned char*)bb_snum, bb_snum_size, (unsigned char*)bb_nonce, bb_nonce_size);
+	free(bb_snum);
+	free(bb_nonce);
+	if (!request) {
+		error("ERROR: Unable to create Baseband TSS request\n");
+		return -1;
+	}
+
+	info("Sending Baseband TSS request from preflight info...\n");
+	client->bbtss_prefetch = tss_request_send_async(request, client->tss_url);
+
+	return (client->bbtss_prefetch) ? 0 : -1;
+}
+
 int restore_send_baseband_data(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity, plist_t message)
 {
 	int res = -1;
@@ -1526,8 +1645,16 @@ int restore_send_baseband_data(restored_client_t restore, struct idevicerestore_
 	uint64_t bb_nonce_size = 0;
 	uint64_t bb_chip_id = 0;
 	plist_t response = NULL;
-	char* buffer = NULL;
-	char* bbfwtmp = NULL;
+	unsigned char* bbfw = NULL;
+	unsigned int bbfw_size = 0;
+	const unsigned char* data = NULL;
+	unsigned int data_size = 0;
+	unsigned char key[20];
+	unsigned char key2[20];
+	unsigned char has_nonce = 0;
+	char* bbfwpath = NULL;
+	struct restore_bbfw_cache* bbfw_signed = &client->restore->bbfw_signed;
+	struct restore_bbfw_cache* bbfw_ticketed = &client->restore->bbfw_ticketed;
 	plist_t dict = NULL;
 
 	info("About to send BasebandData...\n");
@@ -1555,54 +1682,45 @@ int restore_send_baseband_data(restored_client_t restore, struct idevicerestore_
 		}
 	}
 
-	if ((bb_nonce == NULL) || (client->restore->bbtss == NULL)) {
-		/* populate parameters */
-		plist_t parameters = plist_new_dict();
-		plist_dict_set_item(parameters, "ApECID", plist_new_uint(client->ecid));
-		if (bb_nonce) {
-			plist_dict_set_item(parameters, "BbNonce", plist_new_data((const char*)bb_nonce, bb_nonce_size));
+	if (bb_nonce && !client->restore->bbtss && client->bbtss_prefetch) {
+		// the request sent from preflight info is only good for the same baseband state
+		if (restore_bb_arguments_match(client->preflight_info, arguments)) {
+			response = tss_future_get(client->bbtss_prefetch);
+			if (response && plist_dict_get_item(response, "BBTicket")) {
+				info("Using Baseband SHSH blobs requested during preflight\n");
+			} else {
+				plist_free(response);
+				response = NULL;
+			}
+		} else {
+			info("Baseband state changed since preflight, requesting new Baseband SHSH blobs\n");
 		}
-		plist_dict_set_item(parameters, "BbChipID", plist_new_uint(bb_chip_id));
-		plist_dict_set_item(parameters, "BbGoldCertId", plist_new_uint(bb_cert_id));
-		plist_dict_set_item(parameters, "BbSNUM", plist_new_data((const char*)bb_snum, bb_snum_size));
-
-		tss_parameters_add_from_manifest(parameters, build_identity);
+		tss_future_free(client->bbtss_prefetch);
+		client->bbtss_prefetch = NULL;
+		metrics_cache_lookup("tss", (response != NULL));
+		if (response) {
+			client->restore->bbtss = response;
+			response = NULL;
+		}
+	}
 
-		/* create baseband request */
-		plist_t request = tss_request_new(NULL);
+	if ((bb_nonce == NULL) || (client->restore->bbtss == NULL)) {
+		plist_t request = restore_create_baseband_tss_request(client, build_identity, bb_chip_id, bb_cert_id, bb_snum, bb_snum_size, bb_nonce, bb_nonce_size);
 		if (request == NULL) {
 			error("ERROR: Unable to create Baseband TSS request\n");
-			plist_free(parameters);
 			return -1;
 		}
 
-		/* add baseband parameters */
-		tss_request_add_common_tags(request, parameters, NULL);
-		tss_request_add_baseband_tags(request, parameters, NULL);
-
-		plist_t node = plist_access_path(build_identity, 2, "Info", "FDRSupport");
-		if (node && plist_get_node_type(node) == PLIST_BOOLEAN) {
-			uint8_t b = 0;
-			plist_get_bool_val(node, &b);
-			if (b) {
-				plist_dict_set_item(request, "ApProductionMode", plist_new_bool(1));
-				plist_dict_set_item(request, "ApSecurityMode", plist_new_bool(1));
-			}
-		}
-		if (idevicerestore_debug)
-			debug_plist(request);
-
 		info("Sending Baseband TSS request...\n");
 		response = tss_request_send(request, client->tss_url);
 		plist_free(request);
-		plist_free(parameters);
 		if (response == NULL) {
 			error("ERROR: Unable to fetch Baseband TSS\n");
 			return -1;
 		}
 		info("Received Baseband SHSH blobs\n");
 
-		if (idevicerestore_debug)
+		if (idevicerestore_debug_enabled())
 			debug_plist(response);
 	}
 
@@ -1613,53 +1731,67 @@ int restore_send_baseband_data(restored_client_t restore, struct idevicerestore_
 		plist_free(response);
 		return -1;
 	}
-	char* bbfwpath = NULL;
-	plist_get_string_val(bbfw_path, &bbfwpath);	
+	plist_get_string_val(bbfw_path, &bbfwpath);
 	if (!bbfwpath) {
 		error("ERROR: Unable to get baseband path\n");
 		plist_free(response);
 		return -1;
 	}
 
-	// extract baseband firmware to temp file
-	bbfwtmp = tempnam(NULL, client->udid);
-	if (!bbfwtmp) {
-		error("WARNING: Could not generate temporary filename, using bbfw.tmp\n");
-		bbfwtmp = strdup("bbfw.tmp");
-	}
-	if (ipsw_extract_to_file(client->ipsw, bbfwpath, bbfwtmp) != 0) {
-		error("ERROR: Unable to extract baseband firmware from ipsw\n");
-		plist_free(response);
-		return -1;
-	}
-
 	if (bb_nonce && !client->restore->bbtss) {
 		// keep the response for later requests
 		client->restore->bbtss = response;
 		response = NULL;
 	}
-
-	res = restore_sign_bbfw(bbfwtmp, (client->restore->bbtss) ? client->restore->bbtss : response, bb_nonce);
-	if (res != 0) {
-		goto leave;
+	plist_t bbtss = (client->restore->bbtss) ? client->restore->bbtss : response;
+
+	// signing does not depend on the nonce, only the ticket does
+	has_nonce = (bb_nonce) ? 1 : 0;
+	restore_bbfw_cache_key(bbfwpath, strlen(bbfwpath), plist_dict_get_item(bbtss, "BasebandFirmware"), &has_nonce, 1, key);
+	if (!bbfw_signed->data || memcmp(bbfw_signed->key, key, sizeof(key)) != 0) {
+		// use the copy extracted while the filesystem was sent, if any
+		restore_prefetch_join(client->restore);
+		if (client->restore->prefetch_bbfw && !strcmp(client->restore->prefetch_bbfw_path, bbfwpath)) {
+			bbfw = client->restore->prefetch_bbfw;
+			bbfw_size = client->restore->prefetch_bbfw_size;
+			client->restore->prefetch_bbfw = NULL;
+			client->restore->prefetch_bbfw_size = 0;
+		} else if (ipsw_extract_to_memory(client->ipsw, bbfwpath, &bbfw, &bbfw_size) != 0) {
+			// extract baseband firmware into memory
+			error("ERROR: Unable to extract baseband firmware from ipsw\n");
+			goto leave;
+		}
+
+		restore_bbfw_cache_clear(bbfw_signed);
+		if (restore_sign_bbfw(bbfw, bbfw_size, bbtss, bb_nonce, &bbfw_signed->data, &bbfw_signed->size, &bbfw_signed->is_fls) != 0) {
+			goto leave;
+		}
+		memcpy(bbfw_signed->key, key, sizeof(key));
+	} else {
+		info("Reusing signed baseband firmware\n");
 	}
+	data = bbfw_signed->data;
+	data_size = bbfw_signed->size;
 
-	res = -1;
-	
-	size_t sz = 0;
-	if (read_file(bbfwtmp, (void**)&buffer, &sz) < 0) {
-		error("ERROR: could not read updated bbfw archive\n");
-		goto leave;
+	if (bb_nonce) {
+		restore_bbfw_cache_key(key, sizeof(key), plist_dict_get_item(bbtss, "BBTicket"), bb_nonce, bb_nonce_size, key2);
+		if (!bbfw_ticketed->data || memcmp(bbfw_ticketed->key, key2, sizeof(key2)) != 0) {
+			restore_bbfw_cache_clear(bbfw_ticketed);
+			if (restore_bbfw_insert_ticket(bbfw_signed->data, bbfw_signed->size, bbtss, bbfw_signed->is_fls, &bbfw_ticketed->data, &bbfw_ticketed->size) != 0) {
+				goto leave;
+			}
+			memcpy(bbfw_ticketed->key, key2, sizeof(key2));
+		}
+		data = bbfw_ticketed->data;
+		data_size = bbfw_ticketed->size;
 	}
 
 	// send file
 	dict = plist_new_dict();
-	plist_dict_set_item(dict, "BasebandData", plist_new_data(buffer, (uint64_t)sz));
-	free(buffer);
-	buffer = NULL;
+	plist_dict_set_item(dict, "BasebandData", plist_new_data((const char*)data, (uint64_t)data_size));
 
 	info("Sending BasebandData now...\n");
-	if (restored_send(restore, dict) != RESTORE_E_SUCCESS) {
+	if (restore_send_message(restore, dict) != RESTORE_E_SUCCESS) {
 		error("ERROR: Unable to send BasebandData data\n");
 		goto leave;
 	}
@@ -1669,11 +1801,8 @@ int restore_send_baseband_data(restored_client_t restore, struct idevicerestore_
 
 leave:
 	plist_free(dict);
-	free(buffer);
-	if (bbfwtmp) {
-		remove(bbfwtmp);
-		free(bbfwtmp);
-	}
+	free(bbfw);
+	free(bbfwpath);
 	plist_free(response);
 
 	return res;
@@ -1692,7 +1821,7 @@ int restore_send_fdr_trust_data(restored_client_t restore, idevice_t device)
 	dict = plist_new_dict();
 
 	info("Sending FDR Trust data now...\n");
-	restore_error = restored_send(restore, dict);
+	restore_error = restore_send_message(restore, dict);
 	plist_free(dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: During sending FDR Trust data (%d)\n", restore_error);
@@ -1737,25 +1866,16 @@ int restore_send_fud_data(restored_client_t restore, struct idevicerestore_clien
 					char *path = NULL;
 					unsigned char* data = NULL;
 					unsigned int size = 0;
-					unsigned char* component_data = NULL;
-					unsigned int component_size = 0;
 					int ret = -1;
 
 					info("Found FUD component '%s'\n", component);
 
 					build_identity_get_component_path(build_identity, component, &path);
 					if (path) {
-						ret = extract_component(client->ipsw, path, &component_data, &component_size);
+						ret = get_personalized_component(client, component, path, &data, &size);
 					}
 					free(path);
 					path = NULL;
-					if (ret < 0) {
-						error("ERROR: Unable to extract component: %s\n", component);
-					}
-
-					ret = personalize_component(component, component_data, component_size, client->tss, &data, &size);
-					free(component_data);
-					component_data = NULL;
 					if (ret < 0) {
 						error("ERROR: Unable to get personalized component: %s\n", component);
 						return -1;
@@ -1774,7 +1894,7 @@ int restore_send_fud_data(restored_client_t restore, struct idevicerestore_clien
 	plist_dict_set_item(dict, "FUDImageData", fud_dict);
 
 	info("Sending FUD data now...\n");
-	restore_error = restored_send(restore, dict);
+	restore_error = restore_send_message(restore, dict);
 	plist_free(dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: During sending FUD data (%d)\n", restore_error);
@@ -1786,6 +1906,16 @@ int restore_send_fud_data(restored_client_t restore, struct idevicerestore_clien
 	return 0;
 }
 
+static int restore_get_firmware_payload(struct idevicerestore_client_t* client, const char* comp_name, const char* comp_path, unsigned char** data, unsigned int* size)
+{
+	// usually extracted ahead of time by the personalization pool
+	if (personalize_pool_take_raw(client->personalize, comp_path, data, size) == 0) {
+		debug("DEBUG: Using prefetched %s\n", comp_name);
+		return 0;
+	}
+	return extract_component(client->ipsw, comp_path, data, size);
+}
+
 plist_t restore_get_se_firmware_data(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity, plist_t p_info)
 {
 	const char *comp_name = NULL;
@@ -1795,6 +1925,7 @@ plist_t restore_get_se_firmware_data(restored_client_t restore, struct idevicere
 	plist_t parameters = NULL;
 	plist_t request = NULL;
 	plist_t response = NULL;
+	tss_future_t future = NULL;
 	int ret;
 	uint64_t chip_id = 0;
 	plist_t node = plist_dict_get_item(p_info, "SE,ChipID");
@@ -1824,19 +1955,11 @@ plist_t restore_get_se_firmware_data(restored_client_t restore, struct idevicere
 		return NULL;
 	}
 
-	ret = extract_component(client->ipsw, comp_path, &component_data, &component_size);
-	free(comp_path);
-	comp_path = NULL;
-	if (ret < 0) {
-		error("ERROR: Unable to extract '%s' component\n", comp_name);
-		return NULL;
-	}
-
 	/* create SE request */
 	request = tss_request_new(NULL);
 	if (request == NULL) {
 		error("ERROR: Unable to create SE TSS request\n");
-		free(component_data);
+		free(comp_path);
 		return NULL;
 	}
 
@@ -1853,9 +1976,21 @@ plist_t restore_get_se_firmware_data(restored_client_t restore, struct idevicere
 
 	plist_free(parameters);
 
+	/* the firmware is prepared while the request is on the wire */
 	info("Sending SE TSS request...\n");
-	response = tss_request_send(request, client->tss_url);
-	plist_free(request);
+	future = tss_request_send_async(request, client->tss_url);
+
+	ret = restore_get_firmware_payload(client, comp_name, comp_path, &component_data, &component_size);
+	free(comp_path);
+	comp_path = NULL;
+
+	response = tss_future_get(future);
+	tss_future_free(future);
+	if (ret < 0) {
+		error("ERROR: Unable to extract '%s' component\n", comp_name);
+		plist_free(response);
+		return NULL;
+	}
 	if (response == NULL) {
 		error("ERROR: Unable to fetch SE ticket\n");
 		free(component_data);
@@ -1887,6 +2022,7 @@ plist_t restore_get_savage_firmware_data(restored_client_t restore, struct idevi
 	plist_t request = NULL;
 	plist_t response = NULL;
 	plist_t node = NULL;
+	tss_future_t future = NULL;
 	uint8_t isprod = 0;
 	int ret;
 
@@ -1906,19 +2042,11 @@ plist_t restore_get_savage_firmware_data(restored_client_t restore, struct idevi
 		return NULL;
 	}
 
-	ret = extract_component(client->ipsw, comp_path, &component_data, &component_size);
-	free(comp_path);
-	comp_path = NULL;
-	if (ret < 0) {
-		error("ERROR: Unable to extract '%s' component\n", comp_name);
-		return NULL;
-	}
-
 	/* create Savage request */
 	request = tss_request_new(NULL);
 	if (request == NULL) {
 		error("ERROR: Unable to create Savage TSS request\n");
-		free(component_data);
+		free(comp_path);
 		return NULL;
 	}
 
@@ -1936,8 +2064,19 @@ plist_t restore_get_savage_firmware_data(restored_client_t restore, struct idevi
 	plist_free(parameters);
 
 	info("Sending Savage TSS request...\n");
-	response = tss_request_send(request, client->tss_url);
-	plist_free(request);
+	future = tss_request_send_async(request, client->tss_url);
+
+	ret = restore_get_firmware_payload(client, comp_name, comp_path, &component_data, &component_size);
+	free(comp_path);
+	comp_path = NULL;
+
+	response = tss_future_get(future);
+	tss_future_free(future);
+	if (ret < 0) {
+		error("ERROR: Unable to extract '%s' component\n", comp_name);
+		plist_free(response);
+		return NULL;
+	}
 	if (response == NULL) {
 		error("ERROR: Unable to fetch Savage ticket\n");
 		free(component_data);
@@ -1980,6 +2119,7 @@ plist_t restore_get_yonkers_firmware_data(restored_client_t restore, struct idev
 	plist_t request = NULL;
 	plist_t response = NULL;
 	plist_t node = NULL;
+	tss_future_t future = NULL;
 	uint8_t isprod = 1;
 	uint64_t fabrevision = (uint64_t)-1;
 	int ret;
@@ -2043,20 +2183,11 @@ plist_t restore_get_yonkers_firmware_data(restored_client_t restore, struct idev
 		return NULL;
 	}
 
-	ret = extract_component(client->ipsw, comp_path, &component_data, &component_size);
-	free(comp_path);
-	comp_path = NULL;
-	if (ret < 0) {
-		error("ERROR: Unable to extract '%s' component\n", comp_name);
-		free(comp_name);
-		return NULL;
-	}
-
 	/* create Yonkers request */
 	request = tss_request_new(NULL);
 	if (request == NULL) {
 		error("ERROR: Unable to create Yonkers TSS request\n");
-		free(component_data);
+		free(comp_path);
 		free(comp_name);
 		return NULL;
 	}
@@ -2080,12 +2211,23 @@ plist_t restore_get_yonkers_firmware_data(restored_client_t restore, struct idev
 		plist_dict_set_item(request, comp_name, comp_dict);
 	}
 
+	info("Sending Yonkers TSS request...\n");
+	future = tss_request_send_async(request, client->tss_url);
+
+	ret = restore_get_firmware_payload(client, comp_name, comp_path, &component_data, &component_size);
+	free(comp_path);
+	comp_path = NULL;
+
+	response = tss_future_get(future);
+	tss_future_free(future);
+	if (ret < 0) {
+		error("ERROR: Unable to extract '%s' component\n", comp_name);
+		free(comp_name);
+		plist_free(response);
+		return NULL;
+	}
 	free(comp_name);
 	comp_name = NULL;
-
-	info("Sending Yonkers TSS request...\n");
-	response = tss_request_send(request, client->tss_url);
-	plist_free(request);
 	if (response == NULL) {
 		error("ERROR: Unable to fetch Yonkers ticket\n");
 		free(component_data);
@@ -2120,7 +2262,7 @@ int restore_send_firmware_updater_data(restored_client_t restore, struct idevice
 	char *s_updater_name = NULL;
 	int restore_error;
 
-	if (idevicerestore_debug) {
+	if (idevicerestore_debug_enabled()) {
 		debug("DEBUG: Got FirmwareUpdaterData request:\n", __func__);
 		debug_plist(message);
 	}
@@ -2193,7 +2335,7 @@ int restore_send_firmware_updater_data(restored_client_t restore, struct idevice
 	plist_dict_set_item(dict, "FirmwareResponseData", fwdict);
 
 	info("Sending FirmwareResponse data now...\n");
-	restore_error = restored_send(restore, dict);
+	restore_error = restore_send_message(restore, dict);
 	plist_free(dict);
 	if (restore_error != RESTORE_E_SUCCESS) {
 		error("ERROR: Couldn't send FirmwareResponse data (%d)\n", restore_error);
@@ -2211,7 +2353,188 @@ error_out:
 	return -1;
 }
 
-int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idevice_t device, restored_client_t restore, plist_t message, plist_t build_identity, const char* filesystem)
+struct restore_prefetch_args {
+	const char* ipsw;
+	struct restore_client_t* restore;
+};
+
+static void* restore_prefetch_thread(void* arg)
+{
+	struct restore_prefetch_args* args = (struct restore_prefetch_args*)arg;
+	struct restore_client_t* restore = args->restore;
+
+	struct phase* phase = phase_begin("baseband firmware prefetch");
+	if (ipsw_extract_to_memory(args->ipsw, restore->prefetch_bbfw_path, &restore->prefetch_bbfw, &restore->prefetch_bbfw_size) != 0) {
+		debug("DEBUG: %s: could not extract %s in background\n", __func__, restore->prefetch_bbfw_path);
+		restore->prefetch_bbfw = NULL;
+		restore->prefetch_bbfw_size = 0;
+	}
+	phase_end(phase);
+	free(args);
+
+	return NULL;
+}
+
+/* prepare what restored asks for after the filesystem while it is being sent.
+ * KernelCache, DeviceTree and NORData come from the personalization pool. */
+static void restore_prefetch_start(struct idevicerestore_client_t* client, plist_t build_identity)
+{
+	struct restore_client_t* restore = client->restore;
+	char* path = NULL;
+
+	if (restore->prefetch_thread || restore->prefetch_bbfw_path || restore->bbfw_signed.data) {
+		return;
+	}
+	plist_t node = plist_access_path(build_identity, 4, "Manifest", "BasebandFirmware", "Info", "Path");
+	if (!node || plist_get_node_type(node) != PLIST_STRING) {
+		return;
+	}
+	plist_get_string_val(node, &path);
+	if (!path) {
+		return;
+	}
+
+	struct restore_prefetch_args* args = (struct restore_prefetch_args*)malloc(sizeof(struct restore_prefetch_args));
+	if (!args) {
+		free(path);
+		return;
+	}
+	args->ipsw = client->ipsw;
+	args->restore = restore;
+	restore->prefetch_bbfw_path = path;
+	if (thread_new(&restore->prefetch_thread, restore_prefetch_thread, args) != 0) {
+		restore->prefetch_thread = (thread_t)NULL;
+		free(args);
+	}
+}
+
+struct restore_data_worker {
+	struct idevicerestore_client_t* client;
+	idevice_t device;
+	restored_client_t restore;
+	plist_t build_identity;
+	const char* filesystem;
+	plist_t queue;	/* DataRequestMsg dictionaries, handled in order */
+	int busy;
+	int err;
+	int stopping;
+	mutex_t mutex;
+	cond_t cond;
+	thread_t thread;
+};
+
+static void* restore_data_worker_thread(void* arg)
+{
+	struct restore_data_worker* worker = (struct restore_data_worker*)arg;
+
+	mutex_lock(&worker->mutex);
+	while (1) {
+		while (!worker->stopping && plist_array_get_size(worker->queue) == 0) {
+			cond_wait(&worker->cond, &worker->mutex);
+		}
+		if (worker->stopping || worker->err < 0) {
+			break;
+		}
+		plist_t message = plist_copy(plist_array_get_item(worker->queue, 0));
+		plist_array_remove_item(worker->queue, 0);
+		metrics_add(METRIC_QUEUE_DEPTH, "data_requests", -1);
+		worker->busy = 1;
+		mutex_unlock(&worker->mutex);
+
+		int err = restore_handle_data_request_msg(worker->client, worker->device, worker->restore, message, worker->build_identity, worker->filesystem);
+		plist_free(message);
+
+		mutex_lock(&worker->mutex);
+		worker->busy = 0;
+		if (err < 0) {
+			worker->err = err;
+		}
+		cond_broadcast(&worker->cond);
+	}
+	worker->busy = 0;
+	cond_broadcast(&worker->cond);
+	mutex_unlock(&worker->mutex);
+
+	return NULL;
+}
+
+static struct restore_data_worker* restore_data_worker_new(struct idevicerestore_client_t* client, idevice_t device, restored_client_t restore, plist_t build_identity, const char* filesystem)
+{
+	struct restore_data_worker* worker = (struct restore_data_worker*)malloc(sizeof(struct restore_data_worker));
+	if (!worker) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	memset(worker, '\0', sizeof(struct restore_data_worker));
+	worker->client = client;
+	worker->device = device;
+	worker->restore = restore;
+	worker->build_identity = build_identity;
+	worker->filesystem = filesystem;
+	worker->queue = plist_new_array();
+	mutex_init(&worker->mutex);
+	cond_init(&worker->cond);
+	if (thread_new(&worker->thread, restore_data_worker_thread, worker) != 0) {
+		error("ERROR: Failed to start data request thread\n");
+		mutex_destroy(&worker->mutex);
+		cond_destroy(&worker->cond);
+		plist_free(worker->queue);
+		free(worker);
+		return NULL;
+	}
+	return worker;
+}
+
+/* takes ownership of message */
+static void restore_data_worker_push(struct restore_data_worker* worker, plist_t message)
+{
+	mutex_lock(&worker->mutex);
+	plist_array_append_item(worker->queue, message);
+	metrics_add(METRIC_QUEUE_DEPTH, "data_requests", 1);
+	cond_broadcast(&worker->cond);
+	mutex_unlock(&worker->mutex);
+}
+
+static int restore_data_worker_get_error(struct restore_data_worker* worker)
+{
+	mutex_lock(&worker->mutex);
+	int err = worker->err;
+	mutex_unlock(&worker->mutex);
+	return err;
+}
+
+/* wait until all queued requests are answered, so later replies stay in order */
+static int restore_data_worker_drain(struct restore_data_worker* worker)
+{
+	mutex_lock(&worker->mutex);
+	while (worker->err == 0 && (worker->busy || plist_array_get_size(worker->queue) > 0)) {
+		cond_wait(&worker->cond, &worker->mutex);
+	}
+	int err = worker->err;
+	mutex_unlock(&worker->mutex);
+	return err;
+}
+
+static void restore_data_worker_free(struct restore_data_worker* worker)
+{
+	if (!worker) {
+		return;
+	}
+	mutex_lock(&worker->mutex);
+	worker->stopping = 1;
+	cond_broadcast(&worker->cond);
+	mutex_unlock(&worker->mutex);
+	thread_join(worker->thread);
+	thread_free(worker->thread);
+	/* requests left behind after an error */
+	metrics_add(METRIC_QUEUE_DEPTH, "data_requests", -(double)plist_array_get_size(worker->queue));
+	mutex_destroy(&worker->mutex);
+	cond_destroy(&worker->cond);
+	plist_free(worker->queue);
+	free(worker);
+}
+
+static int restore_handle_data_type(struct idevicerestore_client_t* client, idevice_t device, restored_client_t restore, plist_t message, plist_t build_identity, const char* filesystem)
 {
 	char* type = NULL;
 	plist_t node = NULL;
@@ -2224,7 +2547,11 @@ int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idev
 
 		// this request is sent when restored is ready to receive the filesystem
 		if (!strcmp(type, "SystemImageData")) {
-			if(restore_send_filesystem(client, device, filesystem) < 0) {
+			restore_prefetch_start(client, build_identity);
+			if (!restore && trace_is_replay(client->trace)) {
+				/* ASR has its own connection, nothing to replay it on */
+				debug("DEBUG: %s: not sending filesystem while replaying\n", __func__);
+			} else if(restore_send_filesystem(client, device, filesystem) < 0) {
 				error("ERROR: Unable to send filesystem\n");
 				return -2;
 			}
@@ -2295,17 +2622,114 @@ int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idev
 		else {
 			// Unknown DataType!!
 			error("Unknown data request '%s' received\n", type);
-			if (idevicerestore_debug)
+			if (idevicerestore_debug_enabled())
 				debug_plist(message);
 		}
 	}
 	return 0;
 }
 
-int restore_device(struct idevicerestore_client_t* client, plist_t build_identity, const char* filesystem) {
+int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idevice_t device, restored_client_t restore, plist_t message, plist_t build_identity, const char* filesystem)
+{
+	struct phase* phase = NULL;
+	char* type = NULL;
+	char name[64];
+
+	plist_t node = plist_dict_get_item(message, "DataType");
+	if (client->phases && node && plist_get_node_type(node) == PLIST_STRING) {
+		plist_get_string_val(node, &type);
+		snprintf(name, sizeof(name), "data request %s", type);
+		phase = phase_begin(name);
+		free(type);
+	}
+	int res = restore_handle_data_type(client, device, restore, message, build_identity, filesystem);
+	phase_end(phase);
+
+	return res;
+}
+
+/* handles one message received from restored. data requests go to the data
+ * worker of the restore client when there is one and are answered right away
+ * otherwise. restore may be NULL when a recorded session is replayed. */
+int restore_handle_message(struct idevicerestore_client_t* client, idevice_t device, restored_client_t restore, plist_t message, plist_t build_identity, const char* filesystem)
+{
 	int err = 0;
 	char* type = NULL;
 	plist_t node = NULL;
+
+	// discover what kind of message has been received
+	node = plist_dict_get_item(message, "MsgType");
+	if (!node || plist_get_node_type(node) != PLIST_STRING) {
+		debug("Unknown message received:\n");
+		//if (idevicerestore_debug_enabled())
+			debug_plist(message);
+		return 0;
+	}
+	plist_get_string_val(node, &type);
+
+	// data request messages are sent by restored whenever it requires
+	// files sent to the server by the client. these data requests include
+	// SystemImageData, RootTicket, KernelCache, NORData and BasebandData requests
+	if (!strcmp(type, "DataRequestMsg")) {
+		if (client->restore->data_worker) {
+			restore_data_worker_push(client->restore->data_worker, plist_copy(message));
+		} else {
+			err = restore_handle_data_request_msg(client, device, restore, message, build_identity, filesystem);
+		}
+	}
+
+	// restore logs are available if a previous restore failed
+	else if (!strcmp(type, "PreviousRestoreLogMsg")) {
+		err = restore_handle_previous_restore_log_msg(restore, message);
+	}
+
+	// progress notification messages sent by the restored inform the client
+	// of it's current operation and sometimes percent of progress is complete
+	else if (!strcmp(type, "ProgressMsg")) {
+		err = restore_handle_progress_msg(client, message);
+	}
+
+	// status messages usually indicate the current state of the restored
+	// process or often to signal an error has been encountered
+	else if (!strcmp(type, "StatusMsg")) {
+		err = restore_handle_status_msg(client, message);
+		if (client->restore->finished && client->restore->data_worker && err == 0) {
+			err = restore_data_worker_drain(client->restore->data_worker);
+		}
+		if (client->restore->finished) {
+			plist_t dict = plist_new_dict();
+			plist_dict_set_item(dict, "MsgType", plist_new_string("ReceivedFinalStatusMsg"));
+			restore_send_message(restore, dict);
+			plist_free(dict);
+			client->flags |= FLAG_QUIT;
+		}
+	}
+
+	// baseband update message
+	else if (!strcmp(type, "BBUpdateStatusMsg")) {
+		err = restore_handle_bb_update_status_msg(restore, message);
+	}
+
+	// hide checkpoint message
+	else if (!strcmp(type, "CheckpointMsg")) {
+		// empty
+	}
+
+	// there might be some other message types i'm not aware of, but I think
+	// at least the "previous error logs" messages usually end up here
+	else {
+		debug("Unknown message type received\n");
+		//if (idevicerestore_debug_enabled())
+			debug_plist(message);
+	}
+
+	free(type);
+	return err;
+}
+
+int restore_device(struct idevicerestore_client_t* client, plist_t build_identity, const char* filesystem) {
+	int err = 0;
+	plist_t node = NULL;
 	plist_t message = NULL;
 	plist_t hwinfo = NULL;
 	idevice_t device = NULL;
@@ -2313,14 +2737,13 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 	restored_error_t restore_error = RESTORE_E_SUCCESS;
 	thread_t fdr_thread = NULL;
 
-	restore_finished = 0;
-
 	// open our connection to the device and verify we're in restore mode
 	err = restore_open_with_timeout(client);
 	if (err < 0) {
 		error("ERROR: Unable to open device in restore mode\n");
 		return (err == -2) ? -1: -2;
 	}
+	client->restore->finished = 0;
 	info("Device %s has successfully entered restore mode\n", client->udid);
 
 	restore = client->restore->client;
@@ -2388,10 +2811,6 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 		plist_free(hwinfo);
 	}
 
-	if (plist_dict_get_item(client->tss, "BBTicket")) {
-		client->restore->bbtss = plist_copy(client->tss);
-	}
-
 	fdr_client_t fdr_control_channel = NULL;
 	info("Starting FDR listener thread\n");
 	if (!fdr_connect(device, FDR_CTRL, &fdr_control_channel)) {
@@ -2532,9 +2951,18 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 	plist_free(opts);
 	idevicerestore_progress(client, RESTORE_STEP_PREPARE, 1.0);
 
+	// data requests are answered on a separate thread so progress and status
+	// messages are still received while e.g. the filesystem is sent
+	client->restore->data_worker = restore_data_worker_new(client, device, restore, build_identity, filesystem);
+
+	trace_write_context(client, build_identity);
+
 	// this is the restore process loop, it reads each message in from
 	// restored and passes that data on to it's specific handler
 	while ((client->flags & FLAG_QUIT) == 0) {
+		if (err == 0 && client->restore->data_worker) {
+			err = restore_data_worker_get_error(client->restore->data_worker);
+		}
 		// finally, if any of these message handlers returned -1 then we encountered
 		// an unrecoverable error, so we need to bail.
 		if (err < 0) {
@@ -2549,72 +2977,18 @@ int restore_device(struct idevicerestore_client_t* client, plist_t build_identit
 			continue;
 		}
 
-		// discover what kind of message has been received
-		node = plist_dict_get_item(message, "MsgType");
-		if (!node || plist_get_node_type(node) != PLIST_STRING) {
-			debug("Unknown message received:\n");
-			//if (idevicerestore_debug)
-				debug_plist(message);
-			plist_free(message);
-			message = NULL;
-			continue;
-		}
-		plist_get_string_val(node, &type);
-
-		// data request messages are sent by restored whenever it requires
-		// files sent to the server by the client. these data requests include
-		// SystemImageData, RootTicket, KernelCache, NORData and BasebandData requests
-		if (!strcmp(type, "DataRequestMsg")) {
-			err = restore_handle_data_request_msg(client, device, restore, message, build_identity, filesystem);
-		}
-
-		// restore logs are available if a previous restore failed
-		else if (!strcmp(type, "PreviousRestoreLogMsg")) {
-			err = restore_handle_previous_restore_log_msg(restore, message);
-		}
-
-		// progress notification messages sent by the restored inform the client
-		// of it's current operation and sometimes percent of progress is complete
-		else if (!strcmp(type, "ProgressMsg")) {
-			err = restore_handle_progress_msg(client, message);
+		trace_write(client->trace, TRACE_RECEIVED, message);
+		int res = restore_handle_message(client, device, restore, message, build_identity, filesystem);
+		if (err == 0) {
+			err = res;
 		}
-
-		// status messages usually indicate the current state of the restored
-		// process or often to signal an error has been encountered
-		else if (!strcmp(type, "StatusMsg")) {
-			err = restore_handle_status_msg(restore, message);
-			if (restore_finished) {
-				plist_t dict = plist_new_dict();
-				plist_dict_set_item(dict, "MsgType", plist_new_string("ReceivedFinalStatusMsg"));
-				restored_send(restore, dict);
-				plist_free(dict);
-				client->flags |= FLAG_QUIT;
-			}
-		}
-
-		// baseband update message
-		else if (!strcmp(type, "BBUpdateStatusMsg")) {
-			err = restore_handle_bb_update_status_msg(restore, message);
-		}
-
-		// hide checkpoint message
-		else if (!strcmp(type, "CheckpointMsg")) {
-			// empty
-		}
-
-		// there might be some other message types i'm not aware of, but I think
-		// at least the "previous error logs" messages usually end up here
-		else {
-			debug("Unknown message type received\n");
-			//if (idevicerestore_debug)
-				debug_plist(message);
-		}
-
-		free(type);
 		plist_free(message);
 		message = NULL;
 	}
 
+	restore_data_worker_free(client->restore->data_worker);
+	client->restore->data_worker = NULL;
+
 	if (thread_alive(fdr_thread)) {
 		if (fdr_control_channel) {
 			fdr_disconnect(fdr_control_channel);
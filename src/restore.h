@@ -32,6 +32,18 @@ extern "C" {
 #include <libimobiledevice/restore.h>
 #include <libimobiledevice/libimobiledevice.h>
 
+#include "thread.h"
+#include "devwait.h"
+
+struct restore_bbfw_cache {
+	unsigned char key[20];
+	unsigned char* data;
+	unsigned int size;
+	int is_fls;
+};
+
+struct restore_data_worker;
+
 struct restore_client_t {
 	plist_t tss;
 	plist_t bbtss;
@@ -41,6 +53,20 @@ struct restore_client_t {
 	const char* filesystem;
 	uint64_t protocol_version;
 	restored_client_t client;
+	struct restore_bbfw_cache bbfw_signed;
+	struct restore_bbfw_cache bbfw_ticketed;
+	int finished;
+	int lastop;
+	/* updated from the usbmuxd event callbacks */
+	int device_connected;
+	device_wait_t device_wait;
+	/* baseband firmware extracted while the filesystem is sent */
+	thread_t prefetch_thread;
+	char* prefetch_bbfw_path;
+	unsigned char* prefetch_bbfw;
+	unsigned int prefetch_bbfw_size;
+	/* answers data requests while restore_device() keeps receiving */
+	struct restore_data_worker* data_worker;
 };
 
 int restore_check_mode(struct idevicerestore_client_t* client);
@@ -49,8 +75,9 @@ int restore_client_new(struct idevicerestore_client_t* client);
 void restore_client_free(struct idevicerestore_client_t* client);
 int restore_reboot(struct idevicerestore_client_t* client);
 const char* restore_progress_string(unsigned int operation);
-int restore_handle_status_msg(restored_client_t client, plist_t msg);
+int restore_handle_status_msg(struct idevicerestore_client_t* client, plist_t msg);
 int restore_handle_progress_msg(struct idevicerestore_client_t* client, plist_t msg);
+int restore_handle_message(struct idevicerestore_client_t* client, idevice_t device, restored_client_t restore, plist_t message, plist_t build_identity, const char* filesystem);
 int restore_handle_data_request_msg(struct idevicerestore_client_t* client, idevice_t device, restored_client_t restore, plist_t message, plist_t build_identity, const char* filesystem);
 int restore_send_nor(restored_client_t restore, struct idevicerestore_client_t* client, plist_t build_identity);
 int restore_send_root_ticket(restored_client_t restore, struct idevicerestore_client_t* client);
@@ -58,6 +85,7 @@ int restore_send_component(restored_client_t restore, struct idevicerestore_clie
 int restore_device(struct idevicerestore_client_t* client, plist_t build_identity, const char* filesystem);
 int restore_open_with_timeout(struct idevicerestore_client_t* client);
 int restore_send_filesystem(struct idevicerestore_client_t* client, idevice_t device, const char* filesystem);
+int restore_prefetch_baseband_tss(struct idevicerestore_client_t* client, plist_t build_identity);
 int restore_send_fdr_trust_data(restored_client_t restore, idevice_t device);
 
 #ifdef __cplusplus
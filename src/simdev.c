@@ -0,0 +1,1459 @@
+/*
+ * simdev.c
+ * Simulated device backend for offline restore runs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+/*
+ * Stands in for libirecovery and libimobiledevice when building
+ * idevicerestore-sim, so the whole host side of a restore can run and be
+ * profiled without hardware. Each simulated device goes through DFU,
+ * recovery and restore mode like a real one: uploads are accepted and
+ * counted, getenv, ECID and nonce queries are answered, and restored plays
+ * a scripted conversation ending with a successful StatusMsg.
+ *
+ * The devices are configured through the IDEVICERESTORE_SIM environment
+ * variable, e.g. IDEVICERESTORE_SIM="devices=2,product=iPhone8,1,mode=dfu":
+ *
+ *   devices=N        number of devices, ECIDs counting up from ecid=
+ *   ecid=ECID        ECID of the first device
+ *   product=TYPE     product type, e.g. iPhone9,1
+ *   model=MODEL      hardware model, e.g. d10ap
+ *   mode=MODE        dfu, recovery, normal or restore
+ *   script=A:B:...   data requests restored sends, in order
+ *   boot=MS          time a device is gone from the bus when rebooting
+ *   speed=KIB        USB throughput per device in KiB/s, 0 is unlimited
+ *
+ * Only IMG4 devices are simulated, their tickets are accepted unchecked.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#ifndef WIN32
+#include <unistd.h>
+#endif
+#include <libirecovery.h>
+#include <libimobiledevice/libimobiledevice.h>
+#include <libimobiledevice/lockdown.h>
+#include <libimobiledevice/restore.h>
+#include <plist/plist.h>
+
+#include "simdev.h"
+#include "devwait.h"
+#include "thread.h"
+#include "common.h"
+
+#define SIMDEV_MAX_DEVICES 64
+#define SIMDEV_MAX_SCRIPT 16
+#define SIMDEV_DEFAULT_ECID 0x1A2B3C4D5E60ULL
+#define SIMDEV_DEFAULT_BOOT_DELAY 200
+#define SIMDEV_RECEIVE_TIMEOUT 5000
+#define SIMDEV_RESTORED_TIMEOUT 1000
+#define SIMDEV_EVENT_INTERVAL 50
+#define SIMDEV_PROGRESS_CHUNK 0x8000
+
+#define SIMDEV_ASR_PORT 12345
+#define SIMDEV_FDR_PORT 0x43a
+#define SIMDEV_ASR_OOB_LENGTH 0x1000
+
+enum {
+	SIMDEV_OFF = 0, /* rebooting, gone from the bus */
+	SIMDEV_DFU,
+	SIMDEV_RECOVERY,
+	SIMDEV_RESTORE,
+	SIMDEV_NORMAL
+};
+
+enum {
+	SIMDEV_CONN_FDR = 0,
+	SIMDEV_CONN_ASR_INFO,
+	SIMDEV_CONN_ASR_OOB,
+	SIMDEV_CONN_ASR_PAYLOAD,
+	SIMDEV_CONN_ASR_DONE
+};
+
+static struct irecv_device simdev_device_table[] = {
+	{ "iPhone8,1",  "n71ap",   0x04, 0x8000 },
+	{ "iPhone8,1",  "n71map",  0x04, 0x8003 },
+	{ "iPhone8,2",  "n66ap",   0x06, 0x8000 },
+	{ "iPhone8,4",  "n69ap",   0x02, 0x8003 },
+	{ "iPhone9,1",  "d10ap",   0x08, 0x8010 },
+	{ "iPhone9,3",  "d101ap",  0x0C, 0x8010 },
+	{ "iPhone10,1", "d20ap",   0x02, 0x8015 },
+	{ "iPad6,11",   "j71sap",  0x10, 0x8000 },
+	{ "iPod9,1",    "n112ap",  0x16, 0x8010 },
+	{ NULL,         NULL,      -1,   -1     }
+};
+
+/* data requests restored can be scripted to send, and the key in the
+ * host's reply that satisfies them. the filesystem arrives through ASR. */
+static const struct {
+	const char* type;
+	const char* key;
+} simdev_steps[] = {
+	{ "SystemImageData", NULL },
+	{ "RootTicket", "RootTicketData" },
+	{ "KernelCache", "KernelCacheFile" },
+	{ "DeviceTree", "DeviceTreeFile" },
+	{ "NORData", "LlbImageData" },
+	{ "BasebandData", "BasebandData" },
+	{ NULL, NULL }
+};
+
+/* tickets aren't checked, this is just a well-formed IM4M header */
+static const unsigned char simdev_ticket[] = {
+	0x30, 0x0a, 0x16, 0x04, 'I', 'M', '4', 'M', 0x02, 0x01, 0x00, 0x31, 0x00
+};
+
+struct simdev_msg {
+	plist_t plist;
+	struct simdev_msg* next;
+};
+
+struct simdev {
+	uint64_t ecid;
+	char udid[41];
+	char srnm[13];
+	irecv_device_t device;
+	unsigned char ap_nonce[32];
+	unsigned char sep_nonce[20];
+	int state;
+	int next_state;
+	uint64_t ready_at;
+	unsigned int boots;   /* handles opened before a reboot are stale */
+	int announced;        /* reported to the idevice event callback */
+	unsigned long upload_size;
+	uint64_t bytes;       /* received from the host over all modes */
+	/* restored */
+	int script_pos;
+	int finished;
+	struct simdev_msg* messages;
+};
+
+struct irecv_client_private {
+	struct simdev* dev;
+	unsigned int boot;
+	struct irecv_device_info info;
+	irecv_event_cb_t progress_callback;
+	void* progress_data;
+};
+
+struct idevice_private {
+	struct simdev* dev;
+};
+
+struct idevice_connection_private {
+	struct simdev* dev;
+	unsigned int boot;
+	int type;
+	int closed;
+	int waiting;
+	char* out;
+	uint32_t out_size;
+	uint32_t out_offset;
+	char* in;
+	uint32_t in_size;
+	uint32_t sends;
+	uint64_t oob_left;
+	uint64_t payload_left;
+};
+
+struct lockdownd_client_private {
+	struct simdev* dev;
+	unsigned int boot;
+};
+
+struct restored_client_private {
+	struct simdev* dev;
+	unsigned int boot;
+};
+
+static struct simdev simdev_devices[SIMDEV_MAX_DEVICES];
+static int simdev_num_devices = 0;
+static int simdev_script[SIMDEV_MAX_SCRIPT];
+static int simdev_script_len = 0;
+static unsigned int simdev_boot_delay = SIMDEV_DEFAULT_BOOT_DELAY;
+static unsigned int simdev_speed = 0;
+
+static mutex_t simdev_mutex;
+static cond_t simdev_cond;
+static thread_once_t simdev_once = THREAD_ONCE_INIT;
+
+static idevice_event_cb_t simdev_event_callback = NULL;
+static void* simdev_event_data = NULL;
+static thread_t simdev_event_thread;
+static int simdev_event_running = 0;
+
+static void simdev_sleep(unsigned int ms)
+{
+#ifdef WIN32
+	Sleep(ms);
+#else
+	usleep(ms * 1000);
+#endif
+}
+
+static int simdev_find_step(const char* type, size_t len)
+{
+	int i;
+	for (i = 0; simdev_steps[i].type; i++) {
+		if (strlen(simdev_steps[i].type) == len && !strncmp(simdev_steps[i].type, type, len)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void simdev_parse_script(const char* script)
+{
+	simdev_script_len = 0;
+	while (*script && simdev_script_len < SIMDEV_MAX_SCRIPT) {
+		size_t len = strcspn(script, ":");
+		int step = simdev_find_step(script, len);
+		if (step < 0) {
+			error("ERROR: %s: unknown data request '%.*s' in script\n", __func__, (int)len, script);
+		} else {
+			simdev_script[simdev_script_len++] = step;
+		}
+		script += len;
+		if (*script == ':') {
+			script++;
+		}
+	}
+}
+
+static irecv_device_t simdev_lookup(const char* product, const char* model)
+{
+	int i;
+	for (i = 0; simdev_device_table[i].product_type; i++) {
+		if (product && strcmp(simdev_device_table[i].product_type, product) != 0) {
+			continue;
+		}
+		if (model && strcasecmp(simdev_device_table[i].hardware_model, model) != 0) {
+			continue;
+		}
+		return &simdev_device_table[i];
+	}
+	return NULL;
+}
+
+static void simdev_init(void)
+{
+	int i, j;
+	int count = 1;
+	int state = SIMDEV_DFU;
+	uint64_t ecid = SIMDEV_DEFAULT_ECID;
+	char* product = NULL;
+	char* model = NULL;
+
+	mutex_init(&simdev_mutex);
+	cond_init(&simdev_cond);
+
+	simdev_parse_script("SystemImageData:KernelCache:NORData:BasebandData");
+
+	const char* env = getenv(SIMDEV_ENV);
+	char* config = strdup((env) ? env : "");
+	char* p = config;
+	while (p && *p) {
+		/* values may contain commas themselves, like iPhone8,1 */
+		char* key = p;
+		char* next = strchr(p, '=');
+		if (!next) {
+			error("ERROR: %s: ignoring '%s' in %s\n", __func__, p, SIMDEV_ENV);
+			break;
+		}
+		*next++ = '\0';
+		char* val = next;
+		p = NULL;
+		while ((next = strchr(next, ',')) != NULL) {
+			char* eq = strchr(next + 1, '=');
+			char* comma = strchr(next + 1, ',');
+			if (eq && (!comma || eq < comma)) {
+				*next = '\0';
+				p = next + 1;
+				break;
+			}
+			next++;
+		}
+
+		if (!strcmp(key, "devices")) {
+			count = atoi(val);
+		} else if (!strcmp(key, "ecid")) {
+			ecid = strtoull(val, NULL, 0);
+		} else if (!strcmp(key, "product")) {
+			product = val;
+		} else if (!strcmp(key, "model")) {
+			model = val;
+		} else if (!strcmp(key, "mode")) {
+			if (!strcmp(val, "dfu")) {
+				state = SIMDEV_DFU;
+			} else if (!strcmp(val, "recovery")) {
+				state = SIMDEV_RECOVERY;
+			} else if (!strcmp(val, "normal")) {
+				state = SIMDEV_NORMAL;
+			} else if (!strcmp(val, "restore")) {
+				state = SIMDEV_RESTORE;
+			} else {
+				error("ERROR: %s: unknown mode '%s'\n", __func__, val);
+			}
+		} else if (!strcmp(key, "script")) {
+			simdev_parse_script(val);
+		} else if (!strcmp(key, "boot")) {
+			simdev_boot_delay = (unsigned int)strtoul(val, NULL, 0);
+		} else if (!strcmp(key, "speed")) {
+			simdev_speed = (unsigned int)strtoul(val, NULL, 0);
+		} else {
+			error("ERROR: %s: unknown key '%s' in %s\n", __func__, key, SIMDEV_ENV);
+		}
+	}
+
+	irecv_device_t device = simdev_lookup(product, model);
+	if (!device) {
+		error("ERROR: %s: no simulated device matches %s %s, using %s\n", __func__, (product) ? product : "", (model) ? model : "", simdev_device_table[0].hardware_model);
+		device = &simdev_device_table[0];
+	}
+
+	if (count < 1) {
+		count = 1;
+	} else if (count > SIMDEV_MAX_DEVICES) {
+		count = SIMDEV_MAX_DEVICES;
+	}
+	for (i = 0; i < count; i++) {
+		struct simdev* dev = &simdev_devices[i];
+		memset(dev, '\0', sizeof(struct simdev));
+		dev->ecid = ecid + i;
+		dev->device = device;
+		dev->state = state;
+		snprintf(dev->udid, sizeof(dev->udid), "%08x%08x%08x%08x%08x", 0x51d0e000, device->chip_id, device->board_id, (uint32_t)(dev->ecid >> 32), (uint32_t)dev->ecid);
+		snprintf(dev->srnm, sizeof(dev->srnm), "SIM%09u", (unsigned int)(dev->ecid % 1000000000));
+		for (j = 0; j < (int)sizeof(dev->ap_nonce); j++) {
+			dev->ap_nonce[j] = (unsigned char)((dev->ecid >> ((j % 8) * 8)) ^ j);
+		}
+		for (j = 0; j < (int)sizeof(dev->sep_nonce); j++) {
+			dev->sep_nonce[j] = (unsigned char)((dev->ecid >> ((j % 8) * 8)) ^ (j * 7));
+		}
+	}
+	simdev_num_devices = count;
+	free(config);
+
+	info("NOTE: Simulating %d %s (%s) device%s, no hardware will be used\n", count, device->product_type, device->hardware_model, (count > 1) ? "s" : "");
+}
+
+static void simdev_setup(void)
+{
+	thread_once(&simdev_once, simdev_init);
+}
+
+/* must hold simdev_mutex */
+static void simdev_update(struct simdev* dev)
+{
+	if (dev->state == SIMDEV_OFF && device_wait_now() >= dev->ready_at) {
+		dev->state = dev->next_state;
+		debug("DEBUG: simulated device " FMT_qu " is up in mode %d\n", (long long unsigned int)dev->ecid, dev->state);
+		cond_broadcast(&simdev_cond);
+	}
+}
+
+/* must hold simdev_mutex */
+static void simdev_reboot(struct simdev* dev, int next_state)
+{
+	struct simdev_msg* msg;
+
+	dev->state = SIMDEV_OFF;
+	dev->next_state = next_state;
+	dev->ready_at = device_wait_now() + simdev_boot_delay;
+	dev->boots++;
+	dev->upload_size = 0;
+	dev->script_pos = 0;
+	dev->finished = 0;
+	while (dev->messages) {
+		msg = dev->messages;
+		dev->messages = msg->next;
+		plist_free(msg->plist);
+		free(msg);
+	}
+	cond_broadcast(&simdev_cond);
+}
+
+/* must hold simdev_mutex */
+static struct simdev* simdev_get(uint64_t ecid, const char* udid)
+{
+	int i;
+	for (i = 0; i < simdev_num_devices; i++) {
+		struct simdev* dev = &simdev_devices[i];
+		if ((udid && strcmp(dev->udid, udid) != 0) || (ecid && dev->ecid != ecid)) {
+			continue;
+		}
+		simdev_update(dev);
+		return dev;
+	}
+	return NULL;
+}
+
+/* must hold simdev_mutex */
+static int simdev_alive(struct simdev* dev, unsigned int boot, int state)
+{
+	simdev_update(dev);
+	return (dev->boots == boot && dev->state == state);
+}
+
+/* must hold simdev_mutex */
+static int simdev_irecv_alive(irecv_client_t client)
+{
+	return simdev_alive(client->dev, client->boot, SIMDEV_DFU) || simdev_alive(client->dev, client->boot, SIMDEV_RECOVERY);
+}
+
+/* stands in for the time the data would take over USB */
+static void simdev_transfer(uint64_t size)
+{
+	if (simdev_speed > 0 && size > 0) {
+		simdev_sleep((unsigned int)((size * 1000) / ((uint64_t)simdev_speed * 1024)));
+	}
+}
+
+/* must hold simdev_mutex */
+static void simdev_restored_queue(struct simdev* dev, plist_t plist)
+{
+	struct simdev_msg** tail = &dev->messages;
+	struct simdev_msg* msg = (struct simdev_msg*)malloc(sizeof(struct simdev_msg));
+	if (!msg) {
+		plist_free(plist);
+		return;
+	}
+	msg->plist = plist;
+	msg->next = NULL;
+	while (*tail) {
+		tail = &(*tail)->next;
+	}
+	*tail = msg;
+	cond_broadcast(&simdev_cond);
+}
+
+/* must hold simdev_mutex */
+static void simdev_restored_next(struct simdev* dev)
+{
+	plist_t msg = plist_new_dict();
+	if (dev->script_pos < simdev_script_len) {
+		const char* type = simdev_steps[simdev_script[dev->script_pos]].type;
+		plist_dict_set_item(msg, "MsgType", plist_new_string("DataRequestMsg"));
+		plist_dict_set_item(msg, "DataType", plist_new_string(type));
+		if (!strcmp(type, "BasebandData")) {
+			unsigned char snum[4] = { 0x5e, 0x1a, 0x71, 0x00 };
+			plist_t args = plist_new_dict();
+			plist_dict_set_item(args, "ChipID", plist_new_uint(0x1F0E1));
+			plist_dict_set_item(args, "CertID", plist_new_uint(0x0D96A4B2));
+			plist_dict_set_item(args, "ChipSerialNo", plist_new_data((const char*)snum, sizeof(snum)));
+			plist_dict_set_item(args, "Nonce", plist_new_data((const char*)dev->sep_nonce, sizeof(dev->sep_nonce)));
+			plist_dict_set_item(msg, "Arguments", args);
+		}
+	} else {
+		debug("DEBUG: simulated device " FMT_qu " finished restore after receiving " FMT_qu " bytes\n", (long long unsigned int)dev->ecid, (long long unsigned int)dev->bytes);
+		plist_dict_set_item(msg, "MsgType", plist_new_string("StatusMsg"));
+		plist_dict_set_item(msg, "Status", plist_new_uint(0));
+	}
+	simdev_restored_queue(dev, msg);
+}
+
+/* must hold simdev_mutex */
+static void simdev_restored_step_done(struct simdev* dev, int step)
+{
+	if (dev->script_pos < simdev_script_len && simdev_script[dev->script_pos] == step) {
+		dev->script_pos++;
+		simdev_restored_next(dev);
+	}
+}
+
+plist_t simdev_tss_response(plist_t request)
+{
+	plist_t response = plist_new_dict();
+	plist_dict_iter iter = NULL;
+
+	plist_dict_set_item(response, "@ServerVersion", plist_new_string("2.1.0"));
+
+	/* every requested ticket gets one, e.g. @ApImg4Ticket, @BBTicket */
+	plist_dict_new_iter(request, &iter);
+	while (iter) {
+		char* key = NULL;
+		plist_t node = NULL;
+		plist_dict_next_item(request, iter, &key, &node);
+		if (!key) {
+			break;
+		}
+		if (key[0] == '@' && plist_get_node_type(node) == PLIST_BOOLEAN) {
+			uint8_t wanted = 0;
+			plist_get_bool_val(node, &wanted);
+			if (wanted) {
+				plist_dict_set_item(response, key + 1, plist_new_data((const char*)simdev_ticket, sizeof(simdev_ticket)));
+			}
+		}
+		free(key);
+	}
+	free(iter);
+
+	if (plist_dict_get_item(response, "BBTicket")) {
+		plist_dict_set_item(response, "BasebandFirmware", plist_new_dict());
+	}
+
+	return response;
+}
+
+/* libirecovery */
+
+void irecv_init(void)
+{
+	simdev_setup();
+}
+
+void irecv_set_debug_level(int level)
+{
+}
+
+const char* irecv_strerror(irecv_error_t error)
+{
+	switch (error) {
+	case IRECV_E_SUCCESS:
+		return "Command completed successfully";
+	case IRECV_E_NO_DEVICE:
+		return "Unable to find device";
+	default:
+		break;
+	}
+	return "Unknown error";
+}
+
+irecv_error_t irecv_open_with_ecid(irecv_client_t* pclient, unsigned long long ecid)
+{
+	int i;
+
+	simdev_setup();
+	*pclient = NULL;
+
+	mutex_lock(&simdev_mutex);
+	struct simdev* dev = NULL;
+	for (i = 0; i < simdev_num_devices; i++) {
+		if (ecid && simdev_devices[i].ecid != ecid) {
+			continue;
+		}
+		simdev_update(&simdev_devices[i]);
+		if (simdev_devices[i].state == SIMDEV_DFU || simdev_devices[i].state == SIMDEV_RECOVERY) {
+			dev = &simdev_devices[i];
+			break;
+		}
+	}
+	if (!dev) {
+		mutex_unlock(&simdev_mutex);
+		return IRECV_E_NO_DEVICE;
+	}
+
+	irecv_client_t client = (irecv_client_t)malloc(sizeof(struct irecv_client_private));
+	if (!client) {
+		mutex_unlock(&simdev_mutex);
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	memset(client, '\0', sizeof(struct irecv_client_private));
+	client->dev = dev;
+	client->boot = dev->boots;
+	client->info.cpid = dev->device->chip_id;
+	client->info.cprv = 0x11;
+	client->info.cpfm = 0x03;
+	client->info.scep = 0x01;
+	client->info.bdid = dev->device->board_id;
+	client->info.ecid = dev->ecid;
+	client->info.ibfl = IBOOT_FLAG_IMAGE4_AWARE | IBOOT_FLAG_EFFECTIVE_SECURITY_MODE | IBOOT_FLAG_EFFECTIVE_PRODUCTION_MODE;
+	client->info.srnm = dev->srnm;
+	client->info.ap_nonce = dev->ap_nonce;
+	client->info.ap_nonce_size = sizeof(dev->ap_nonce);
+	client->info.sep_nonce = dev->sep_nonce;
+	client->info.sep_nonce_size = sizeof(dev->sep_nonce);
+	mutex_unlock(&simdev_mutex);
+
+	*pclient = client;
+	return IRECV_E_SUCCESS;
+}
+
+irecv_error_t irecv_close(irecv_client_t client)
+{
+	free(client);
+	return IRECV_E_SUCCESS;
+}
+
+irecv_client_t irecv_reconnect(irecv_client_t client, int initial_pause)
+{
+	irecv_client_t new_client = NULL;
+	uint64_t ecid = client->dev->ecid;
+
+	irecv_close(client);
+	if (initial_pause > 0) {
+		simdev_sleep(initial_pause * 1000);
+	}
+	irecv_open_with_ecid(&new_client, ecid);
+	return new_client;
+}
+
+irecv_error_t irecv_reset(irecv_client_t client)
+{
+	return IRECV_E_SUCCESS;
+}
+
+irecv_error_t irecv_reset_counters(irecv_client_t client)
+{
+	return IRECV_E_SUCCESS;
+}
+
+irecv_error_t irecv_finish_transfer(irecv_client_t client)
+{
+	return IRECV_E_SUCCESS;
+}
+
+irecv_error_t irecv_usb_set_configuration(irecv_client_t client, int configuration)
+{
+	return IRECV_E_SUCCESS;
+}
+
+int irecv_usb_control_transfer(irecv_client_t client, uint8_t bm_request_type, uint8_t b_request, uint16_t w_value, uint16_t w_index, unsigned char *data, uint16_t w_length, unsigned int timeout)
+{
+	return w_length;
+}
+
+irecv_error_t irecv_event_subscribe(irecv_client_t client, irecv_event_type type, irecv_event_cb_t callback, void* user_data)
+{
+	if (type == IRECV_PROGRESS) {
+		client->progress_callback = callback;
+		client->progress_data = user_data;
+	}
+	return IRECV_E_SUCCESS;
+}
+
+irecv_error_t irecv_get_mode(irecv_client_t client, int* mode)
+{
+	irecv_error_t res = IRECV_E_SUCCESS;
+
+	mutex_lock(&simdev_mutex);
+	if (simdev_alive(client->dev, client->boot, SIMDEV_DFU)) {
+		*mode = IRECV_K_DFU_MODE;
+	} else if (simdev_alive(client->dev, client->boot, SIMDEV_RECOVERY)) {
+		*mode = IRECV_K_RECOVERY_MODE_2;
+	} else {
+		res = IRECV_E_NO_DEVICE;
+	}
+	mutex_unlock(&simdev_mutex);
+
+	return res;
+}
+
+const struct irecv_device_info* irecv_get_device_info(irecv_client_t client)
+{
+	return (client) ? &client->info : NULL;
+}
+
+irecv_error_t irecv_devices_get_device_by_client(irecv_client_t client, irecv_device_t* device)
+{
+	*device = client->dev->device;
+	return IRECV_E_SUCCESS;
+}
+
+irecv_error_t irecv_devices_get_device_by_product_type(const char* product_type, irecv_device_t* device)
+{
+	*device = simdev_lookup(product_type, NULL);
+	return (*device) ? IRECV_E_SUCCESS : IRECV_E_NO_DEVICE;
+}
+
+irecv_error_t irecv_devices_get_device_by_hardware_model(const char* hardware_model, irecv_device_t* device)
+{
+	*device = simdev_lookup(NULL, hardware_model);
+	return (*device) ? IRECV_E_SUCCESS : IRECV_E_NO_DEVICE;
+}
+
+irecv_error_t irecv_send_buffer(irecv_client_t client, unsigned char* buffer, unsigned long length, int dfu_notify_finished)
+{
+	unsigned long offset = 0;
+
+	mutex_lock(&simdev_mutex);
+	int alive = simdev_irecv_alive(client);
+	mutex_unlock(&simdev_mutex);
+	if (!alive) {
+		return IRECV_E_NO_DEVICE;
+	}
+
+	while (offset < length) {
+		unsigned long size = length - offset;
+		if (size > SIMDEV_PROGRESS_CHUNK) {
+			size = SIMDEV_PROGRESS_CHUNK;
+		}
+		simdev_transfer(size);
+		offset += size;
+		if (client->progress_callback) {
+			irecv_event_t event;
+			memset(&event, '\0', sizeof(event));
+			event.type = IRECV_PROGRESS;
+			event.size = (int)size;
+			event.progress = ((double)offset / (double)length) * 100.0;
+			client->progress_callback(client, &event);
+		}
+	}
+
+	mutex_lock(&simdev_mutex);
+	struct simdev* dev = client->dev;
+	if (!simdev_irecv_alive(client)) {
+		mutex_unlock(&simdev_mutex);
+		return IRECV_E_NO_DEVICE;
+	}
+	dev->upload_size = length;
+	dev->bytes += length;
+	if (dfu_notify_finished) {
+		/* the uploaded iBSS or iBEC takes over */
+		simdev_reboot(dev, SIMDEV_RECOVERY);
+	}
+	mutex_unlock(&simdev_mutex);
+
+	return IRECV_E_SUCCESS;
+}
+
+irecv_error_t irecv_send_command(irecv_client_t client, const char* command)
+{
+	irecv_error_t res = IRECV_E_SUCCESS;
+	size_t len = strcspn(command, " ");
+
+	mutex_lock(&simdev_mutex);
+	struct simdev* dev = client->dev;
+	if (!simdev_alive(dev, client->boot, SIMDEV_RECOVERY)) {
+		res = IRECV_E_NO_DEVICE;
+	} else if (!strncmp(command, "go", len)) {
+		simdev_reboot(dev, SIMDEV_RECOVERY);
+	} else if (!strncmp(command, "bootx", len)) {
+		simdev_reboot(dev, SIMDEV_RESTORE);
+	} else if (!strncmp(command, "reset", len) || !strncmp(command, "reboot", len)) {
+		simdev_reboot(dev, SIMDEV_NORMAL);
+	} else if (!strncmp(command, "ramdisk", len) || !strncmp(command, "devicetree", len) || !strncmp(command, "firmware", len) || !strncmp(command, "ticket", len)) {
+		dev->upload_size = 0;
+	}
+	mutex_unlock(&simdev_mutex);
+
+	return res;
+}
+
+irecv_error_t irecv_getenv(irecv_client_t client, const char* variable, char** value)
+{
+	const char* val = NULL;
+
+	*value = NULL;
+	if (!strcmp(variable, "build-version")) {
+		val = "iBoot-2817.60.2";
+	} else if (!strcmp(variable, "build-style")) {
+		val = "RELEASE";
+	} else if (!strcmp(variable, "ramdisk-size")) {
+		val = "0x10000000";
+	}
+	if (!val) {
+		return IRECV_E_UNKNOWN_ERROR;
+	}
+	*value = strdup(val);
+	return IRECV_E_SUCCESS;
+}
+
+/* libimobiledevice */
+
+void idevice_set_debug_level(int level)
+{
+}
+
+static void* simdev_event_thread_func(void* arg)
+{
+	int i;
+	idevice_event_t events[SIMDEV_MAX_DEVICES];
+
+	mutex_lock(&simdev_mutex);
+	while (simdev_event_running) {
+		int count = 0;
+		for (i = 0; i < simdev_num_devices; i++) {
+			struct simdev* dev = &simdev_devices[i];
+			simdev_update(dev);
+			int visible = (dev->state == SIMDEV_NORMAL || dev->state == SIMDEV_RESTORE);
+			if (visible != dev->announced) {
+				dev->announced = visible;
+				events[count].event = (visible) ? IDEVICE_DEVICE_ADD : IDEVICE_DEVICE_REMOVE;
+				events[count].udid = dev->udid;
+				events[count].conn_type = 1;
+				count++;
+			}
+		}
+		idevice_event_cb_t callback = simdev_event_callback;
+		void* data = simdev_event_data;
+		mutex_unlock(&simdev_mutex);
+		for (i = 0; i < count; i++) {
+			callback(&events[i], data);
+		}
+		mutex_lock(&simdev_mutex);
+		if (simdev_event_running) {
+			cond_wait_timeout(&simdev_cond, &simdev_mutex, SIMDEV_EVENT_INTERVAL);
+		}
+	}
+	mutex_unlock(&simdev_mutex);
+
+	return NULL;
+}
+
+idevice_error_t idevice_event_subscribe(idevice_event_cb_t callback, void* user_data)
+{
+	int i;
+
+	simdev_setup();
+
+	mutex_lock(&simdev_mutex);
+	if (simdev_event_running) {
+		mutex_unlock(&simdev_mutex);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	simdev_event_callback = callback;
+	simdev_event_data = user_data;
+	/* like usbmuxd, report the devices already connected first */
+	for (i = 0; i < simdev_num_devices; i++) {
+		simdev_devices[i].announced = 0;
+	}
+	simdev_event_running = 1;
+	mutex_unlock(&simdev_mutex);
+
+	if (thread_new(&simdev_event_thread, simdev_event_thread_func, NULL) != 0) {
+		mutex_lock(&simdev_mutex);
+		simdev_event_running = 0;
+		mutex_unlock(&simdev_mutex);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t idevice_event_unsubscribe(void)
+{
+	mutex_lock(&simdev_mutex);
+	int running = simdev_event_running;
+	simdev_event_running = 0;
+	cond_broadcast(&simdev_cond);
+	mutex_unlock(&simdev_mutex);
+
+	if (running) {
+		thread_join(simdev_event_thread);
+		thread_free(simdev_event_thread);
+	}
+
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t idevice_get_device_list(char*** devices, int* count)
+{
+	int i;
+
+	simdev_setup();
+
+	*count = 0;
+	*devices = (char**)malloc(sizeof(char*) * (simdev_num_devices + 1));
+	if (!*devices) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	mutex_lock(&simdev_mutex);
+	for (i = 0; i < simdev_num_devices; i++) {
+		struct simdev* dev = &simdev_devices[i];
+		simdev_update(dev);
+		if (dev->state == SIMDEV_NORMAL || dev->state == SIMDEV_RESTORE) {
+			(*devices)[(*count)++] = strdup(dev->udid);
+		}
+	}
+	(*devices)[*count] = NULL;
+	mutex_unlock(&simdev_mutex);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t idevice_device_list_free(char** devices)
+{
+	int i;
+
+	if (devices) {
+		for (i = 0; devices[i]; i++) {
+			free(devices[i]);
+		}
+		free(devices);
+	}
+
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t idevice_new(idevice_t* device, const char* udid)
+{
+	simdev_setup();
+
+	*device = NULL;
+	mutex_lock(&simdev_mutex);
+	struct simdev* dev = simdev_get(0, udid);
+	if (!dev || (dev->state != SIMDEV_NORMAL && dev->state != SIMDEV_RESTORE)) {
+		mutex_unlock(&simdev_mutex);
+		return IDEVICE_E_NO_DEVICE;
+	}
+	mutex_unlock(&simdev_mutex);
+
+	idevice_t dev_loc = (idevice_t)malloc(sizeof(struct idevice_private));
+	if (!dev_loc) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	dev_loc->dev = dev;
+	*device = dev_loc;
+
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t idevice_free(idevice_t device)
+{
+	free(device);
+	return IDEVICE_E_SUCCESS;
+}
+
+/* must hold simdev_mutex */
+static void simdev_conn_queue(idevice_connection_t connection, const char* data, uint32_t size)
+{
+	char* out = (char*)realloc(connection->out, connection->out_size + size);
+	if (!out) {
+		return;
+	}
+	memcpy(out + connection->out_size, data, size);
+	connection->out = out;
+	connection->out_size += size;
+	cond_broadcast(&simdev_cond);
+}
+
+/* must hold simdev_mutex */
+static void simdev_conn_queue_asr(idevice_connection_t connection, plist_t plist)
+{
+	char* xml = NULL;
+	uint32_t size = 0;
+
+	plist_to_xml(plist, &xml, &size);
+	plist_free(plist);
+	if (xml) {
+		simdev_conn_queue(connection, xml, size);
+		free(xml);
+	}
+}
+
+/* must hold simdev_mutex. plays ASR: packet info, one OOB request, payload */
+static void simdev_asr_handle(idevice_connection_t connection, const char* data, uint32_t size)
+{
+	plist_t msg;
+
+	while (size > 0) {
+		uint32_t n = size;
+		switch (connection->type) {
+		case SIMDEV_CONN_ASR_INFO: {
+			char* in = (char*)realloc(connection->in, connection->in_size + size + 1);
+			if (!in) {
+				return;
+			}
+			memcpy(in + connection->in_size, data, size);
+			connection->in = in;
+			connection->in_size += size;
+			in[connection->in_size] = '\0';
+			if (!strstr(in, "</plist>")) {
+				return;
+			}
+			plist_t info = NULL;
+			uint64_t fs_size = 0;
+			uint64_t chunk_size = 0;
+			plist_from_xml(in, connection->in_size, &info);
+			plist_t node = plist_access_path(info, 2, "Payload", "Size");
+			if (node && plist_get_node_type(node) == PLIST_UINT) {
+				plist_get_uint_val(node, &fs_size);
+			}
+			node = plist_dict_get_item(info, "Checksum Chunk Size");
+			if (node && plist_get_node_type(node) == PLIST_UINT) {
+				plist_get_uint_val(node, &chunk_size);
+			}
+			plist_free(info);
+			free(connection->in);
+			connection->in = NULL;
+			connection->in_size = 0;
+
+			connection->payload_left = fs_size;
+			if (chunk_size > 0) {
+				connection->payload_left += 20 * ((fs_size + chunk_size - 1) / chunk_size);
+			}
+			connection->oob_left = (fs_size < SIMDEV_ASR_OOB_LENGTH) ? fs_size : SIMDEV_ASR_OOB_LENGTH;
+			msg = plist_new_dict();
+			if (connection->oob_left > 0) {
+				plist_dict_set_item(msg, "Command", plist_new_string("OOBData"));
+				plist_dict_set_item(msg, "OOB Length", plist_new_uint(connection->oob_left));
+				plist_dict_set_item(msg, "OOB Offset", plist_new_uint(0));
+				connection->type = SIMDEV_CONN_ASR_OOB;
+			} else {
+				plist_dict_set_item(msg, "Command", plist_new_string("Payload"));
+				connection->type = SIMDEV_CONN_ASR_PAYLOAD;
+			}
+			simdev_conn_queue_asr(connection, msg);
+			return;
+		}
+		case SIMDEV_CONN_ASR_OOB:
+			if (n > connection->oob_left) {
+				n = (uint32_t)connection->oob_left;
+			}
+			connection->oob_left -= n;
+			if (connection->oob_left == 0) {
+				msg = plist_new_dict();
+				plist_dict_set_item(msg, "Command", plist_new_string("Payload"));
+				simdev_conn_queue_asr(connection, msg);
+				connection->type = SIMDEV_CONN_ASR_PAYLOAD;
+			}
+			break;
+		case SIMDEV_CONN_ASR_PAYLOAD:
+			if (n > connection->payload_left) {
+				n = (uint32_t)connection->payload_left;
+			}
+			connection->payload_left -= n;
+			if (connection->payload_left == 0) {
+				connection->type = SIMDEV_CONN_ASR_DONE;
+				simdev_restored_step_done(connection->dev, simdev_find_step("SystemImageData", strlen("SystemImageData")));
+			}
+			break;
+		default:
+			return;
+		}
+		data += n;
+		size -= n;
+	}
+}
+
+/* must hold simdev_mutex. answers the FDR control handshake, then stays quiet */
+static void simdev_fdr_handle(idevice_connection_t connection)
+{
+	/* BeginCtrl, then the length and body of the Begin plist */
+	if (++connection->sends == 3) {
+		plist_t reply = plist_new_dict();
+		char* bin = NULL;
+		uint32_t len = 0;
+		plist_dict_set_item(reply, "ConnPort", plist_new_uint(SIMDEV_FDR_PORT + 1));
+		plist_to_bin(reply, &bin, &len);
+		plist_free(reply);
+		if (bin) {
+			simdev_conn_queue(connection, (const char*)&len, sizeof(len));
+			simdev_conn_queue(connection, bin, len);
+			free(bin);
+		}
+	}
+}
+
+idevice_error_t idevice_connect(idevice_t device, uint16_t port, idevice_connection_t* connection)
+{
+	int type;
+
+	*connection = NULL;
+	if (port == SIMDEV_ASR_PORT) {
+		type = SIMDEV_CONN_ASR_INFO;
+	} else if (port == SIMDEV_FDR_PORT) {
+		type = SIMDEV_CONN_FDR;
+	} else {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+
+	idevice_connection_t conn = (idevice_connection_t)malloc(sizeof(struct idevice_connection_private));
+	if (!conn) {
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	memset(conn, '\0', sizeof(struct idevice_connection_private));
+	conn->dev = device->dev;
+	conn->type = type;
+
+	mutex_lock(&simdev_mutex);
+	simdev_update(device->dev);
+	if (device->dev->state != SIMDEV_RESTORE) {
+		mutex_unlock(&simdev_mutex);
+		free(conn);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	conn->boot = device->dev->boots;
+	if (type == SIMDEV_CONN_ASR_INFO) {
+		plist_t msg = plist_new_dict();
+		plist_dict_set_item(msg, "Command", plist_new_string("Initiate"));
+		plist_dict_set_item(msg, "Checksum Chunks", plist_new_bool(1));
+		simdev_conn_queue_asr(conn, msg);
+	}
+	mutex_unlock(&simdev_mutex);
+
+	*connection = conn;
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t idevice_disconnect(idevice_connection_t connection)
+{
+	if (!connection) {
+		return IDEVICE_E_INVALID_ARG;
+	}
+
+	/* wake up and wait out a receive blocked on another thread */
+	mutex_lock(&simdev_mutex);
+	connection->closed = 1;
+	cond_broadcast(&simdev_cond);
+	while (connection->waiting > 0) {
+		cond_wait(&simdev_cond, &simdev_mutex);
+	}
+	mutex_unlock(&simdev_mutex);
+
+	free(connection->out);
+	free(connection->in);
+	free(connection);
+
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t idevice_connection_send(idevice_connection_t connection, const char* data, uint32_t len, uint32_t* sent_bytes)
+{
+	*sent_bytes = 0;
+	simdev_transfer(len);
+
+	mutex_lock(&simdev_mutex);
+	if (connection->closed || !simdev_alive(connection->dev, connection->boot, SIMDEV_RESTORE)) {
+		mutex_unlock(&simdev_mutex);
+		return IDEVICE_E_UNKNOWN_ERROR;
+	}
+	connection->dev->bytes += len;
+	if (connection->type == SIMDEV_CONN_FDR) {
+		simdev_fdr_handle(connection);
+	} else {
+		simdev_asr_handle(connection, data, len);
+	}
+	mutex_unlock(&simdev_mutex);
+
+	*sent_bytes = len;
+	return IDEVICE_E_SUCCESS;
+}
+
+idevice_error_t idevice_connection_receive_timeout(idevice_connection_t connection, char* data, uint32_t len, uint32_t* recv_bytes, unsigned int timeout)
+{
+	idevice_error_t res = IDEVICE_E_SUCCESS;
+	uint64_t deadline = device_wait_now() + timeout;
+
+	*recv_bytes = 0;
+
+	mutex_lock(&simdev_mutex);
+	connection->waiting++;
+	while (!connection->closed && connection->out_offset >= connection->out_size) {
+		uint64_t now = device_wait_now();
+		if (now >= deadline || !simdev_alive(connection->dev, connection->boot, SIMDEV_RESTORE)) {
+			break;
+		}
+		cond_wait_timeout(&simdev_cond, &simdev_mutex, (unsigned int)(deadline - now));
+	}
+	if (connection->closed || !simdev_alive(connection->dev, connection->boot, SIMDEV_RESTORE)) {
+		res = IDEVICE_E_UNKNOWN_ERROR;
+	} else if (connection->out_offset < connection->out_size) {
+		uint32_t n = connection->out_size - connection->out_offset;
+		if (n > len) {
+			n = len;
+		}
+		memcpy(data, connection->out + connection->out_offset, n);
+		connection->out_offset += n;
+		if (connection->out_offset == connection->out_size) {
+			free(connection->out);
+			connection->out = NULL;
+			connection->out_size = 0;
+			connection->out_offset = 0;
+		}
+		*recv_bytes = n;
+	}
+	connection->waiting--;
+	cond_broadcast(&simdev_cond);
+	mutex_unlock(&simdev_mutex);
+
+	return res;
+}
+
+idevice_error_t idevice_connection_receive(idevice_connection_t connection, char* data, uint32_t len, uint32_t* recv_bytes)
+{
+	return idevice_connection_receive_timeout(connection, data, len, recv_bytes, SIMDEV_RECEIVE_TIMEOUT);
+}
+
+/* lockdownd, only in normal mode */
+
+static lockdownd_error_t simdev_lockdownd_new(idevice_t device, lockdownd_client_t* client)
+{
+	*client = NULL;
+
+	mutex_lock(&simdev_mutex);
+	simdev_update(device->dev);
+	if (device->dev->state != SIMDEV_NORMAL) {
+		mutex_unlock(&simdev_mutex);
+		return LOCKDOWN_E_UNKNOWN_ERROR;
+	}
+	unsigned int boot = device->dev->boots;
+	mutex_unlock(&simdev_mutex);
+
+	lockdownd_client_t client_loc = (lockdownd_client_t)malloc(sizeof(struct lockdownd_client_private));
+	if (!client_loc) {
+		return LOCKDOWN_E_UNKNOWN_ERROR;
+	}
+	client_loc->dev = device->dev;
+	client_loc->boot = boot;
+	*client = client_loc;
+
+	return LOCKDOWN_E_SUCCESS;
+}
+
+lockdownd_error_t lockdownd_client_new(idevice_t device, lockdownd_client_t* client, const char* label)
+{
+	return simdev_lockdownd_new(device, client);
+}
+
+lockdownd_error_t lockdownd_client_new_with_handshake(idevice_t device, lockdownd_client_t* client, const char* label)
+{
+	return simdev_lockdownd_new(device, client);
+}
+
+lockdownd_error_t lockdownd_client_free(lockdownd_client_t client)
+{
+	free(client);
+	return LOCKDOWN_E_SUCCESS;
+}
+
+lockdownd_error_t lockdownd_query_type(lockdownd_client_t client, char** type)
+{
+	*type = strdup("com.apple.mobile.lockdown");
+	return LOCKDOWN_E_SUCCESS;
+}
+
+lockdownd_error_t lockdownd_get_value(lockdownd_client_t client, const char* domain, const char* key, plist_t* value)
+{
+	struct simdev* dev = client->dev;
+
+	*value = NULL;
+	if (domain || !key) {
+		return LOCKDOWN_E_UNKNOWN_ERROR;
+	}
+
+	mutex_lock(&simdev_mutex);
+	int alive = simdev_alive(dev, client->boot, SIMDEV_NORMAL);
+	mutex_unlock(&simdev_mutex);
+	if (!alive) {
+		return LOCKDOWN_E_UNKNOWN_ERROR;
+	}
+
+	if (!strcmp(key, "UniqueChipID")) {
+		*value = plist_new_uint(dev->ecid);
+	} else if (!strcmp(key, "UniqueDeviceID")) {
+		*value = plist_new_string(dev->udid);
+	} else if (!strcmp(key, "SerialNumber")) {
+		*value = plist_new_string(dev->srnm);
+	} else if (!strcmp(key, "ProductType")) {
+		*value = plist_new_string(dev->device->product_type);
+	} else if (!strcmp(key, "HardwareModel")) {
+		*value = plist_new_string(dev->device->hardware_model);
+	} else if (!strcmp(key, "ApNonce")) {
+		*value = plist_new_data((const char*)dev->ap_nonce, sizeof(dev->ap_nonce));
+	} else if (!strcmp(key, "SEPNonce")) {
+		*value = plist_new_data((const char*)dev->sep_nonce, sizeof(dev->sep_nonce));
+	} else if (!strcmp(key, "Image4Supported")) {
+		*value = plist_new_bool(1);
+	}
+
+	return (*value) ? LOCKDOWN_E_SUCCESS : LOCKDOWN_E_UNKNOWN_ERROR;
+}
+
+lockdownd_error_t lockdownd_enter_recovery(lockdownd_client_t client)
+{
+	lockdownd_error_t res = LOCKDOWN_E_SUCCESS;
+
+	mutex_lock(&simdev_mutex);
+	if (simdev_alive(client->dev, client->boot, SIMDEV_NORMAL)) {
+		simdev_reboot(client->dev, SIMDEV_RECOVERY);
+	} else {
+		res = LOCKDOWN_E_UNKNOWN_ERROR;
+	}
+	mutex_unlock(&simdev_mutex);
+
+	return res;
+}
+
+/* restored, only in restore mode */
+
+restored_error_t restored_client_new(idevice_t device, restored_client_t* client, const char* label)
+{
+	*client = NULL;
+
+	mutex_lock(&simdev_mutex);
+	simdev_update(device->dev);
+	if (device->dev->state != SIMDEV_RESTORE) {
+		mutex_unlock(&simdev_mutex);
+		return RESTORE_E_MUX_ERROR;
+	}
+	unsigned int boot = device->dev->boots;
+	mutex_unlock(&simdev_mutex);
+
+	restored_client_t client_loc = (restored_client_t)malloc(sizeof(struct restored_client_private));
+	if (!client_loc) {
+		return RESTORE_E_UNKNOWN_ERROR;
+	}
+	client_loc->dev = device->dev;
+	client_loc->boot = boot;
+	*client = client_loc;
+
+	return RESTORE_E_SUCCESS;
+}
+
+restored_error_t restored_client_free(restored_client_t client)
+{
+	free(client);
+	return RESTORE_E_SUCCESS;
+}
+
+restored_error_t restored_query_type(restored_client_t client, char** type, uint64_t* version)
+{
+	*type = strdup("com.apple.mobile.restored");
+	if (version) {
+		*version = 15;
+	}
+	return RESTORE_E_SUCCESS;
+}
+
+restored_error_t restored_query_value(restored_client_t client, const char* key, plist_t* value)
+{
+	struct simdev* dev = client->dev;
+
+	*value = NULL;
+	if (!strcmp(key, "HardwareInfo")) {
+		*value = plist_new_dict();
+		plist_dict_set_item(*value, "BoardID", plist_new_uint(dev->device->board_id));
+		plist_dict_set_item(*value, "ChipID", plist_new_uint(dev->device->chip_id));
+		plist_dict_set_item(*value, "UniqueChipID", plist_new_uint(dev->ecid));
+		plist_dict_set_item(*value, "ProductionMode", plist_new_bool(1));
+	}
+
+	return (*value) ? RESTORE_E_SUCCESS : RESTORE_E_DICT_ERROR;
+}
+
+restored_error_t restored_get_value(restored_client_t client, const char* key, plist_t* value)
+{
+	struct simdev* dev = client->dev;
+
+	*value = NULL;
+	if (!strcmp(key, "SerialNumber")) {
+		*value = plist_new_string(dev->srnm);
+	} else if (!strcmp(key, "HardwareModel")) {
+		*value = plist_new_string(dev->device->hardware_model);
+	}
+
+	return (*value) ? RESTORE_E_SUCCESS : RESTORE_E_DICT_ERROR;
+}
+
+restored_error_t restored_start_restore(restored_client_t client, plist_t options, uint64_t version)
+{
+	restored_error_t res = RESTORE_E_SUCCESS;
+
+	mutex_lock(&simdev_mutex);
+	if (simdev_alive(client->dev, client->boot, SIMDEV_RESTORE)) {
+		client->dev->script_pos = 0;
+		client->dev->finished = 0;
+		simdev_restored_next(client->dev);
+	} else {
+		res = RESTORE_E_START_RESTORE_FAILED;
+	}
+	mutex_unlock(&simdev_mutex);
+
+	return res;
+}
+
+restored_error_t restored_send(restored_client_t client, plist_t plist)
+{
+	char* bin = NULL;
+	uint32_t size = 0;
+
+	/* account for what would go over the wire */
+	plist_to_bin(plist, &bin, &size);
+	free(bin);
+	simdev_transfer(size);
+
+	mutex_lock(&simdev_mutex);
+	struct simdev* dev = client->dev;
+	if (!simdev_alive(dev, client->boot, SIMDEV_RESTORE)) {
+		mutex_unlock(&simdev_mutex);
+		return RESTORE_E_MUX_ERROR;
+	}
+	dev->bytes += size;
+	plist_t node = plist_dict_get_item(plist, "MsgType");
+	if (node && plist_get_node_type(node) == PLIST_STRING) {
+		char* type = NULL;
+		plist_get_string_val(node, &type);
+		if (type && !strcmp(type, "ReceivedFinalStatusMsg")) {
+			dev->finished = 1;
+		}
+		free(type);
+	} else if (dev->script_pos < simdev_script_len) {
+		int step = simdev_script[dev->script_pos];
+		if (simdev_steps[step].key && plist_dict_get_item(plist, simdev_steps[step].key)) {
+			simdev_restored_step_done(dev, step);
+		}
+	}
+	mutex_unlock(&simdev_mutex);
+
+	return RESTORE_E_SUCCESS;
+}
+
+restored_error_t restored_receive(restored_client_t client, plist_t* plist)
+{
+	restored_error_t res = RESTORE_E_NOT_ENOUGH_DATA;
+	uint64_t deadline = device_wait_now() + SIMDEV_RESTORED_TIMEOUT;
+	struct simdev* dev = client->dev;
+
+	*plist = NULL;
+
+	mutex_lock(&simdev_mutex);
+	while (simdev_alive(dev, client->boot, SIMDEV_RESTORE) && !dev->messages) {
+		uint64_t now = device_wait_now();
+		if (now >= deadline) {
+			break;
+		}
+		cond_wait_timeout(&simdev_cond, &simdev_mutex, (unsigned int)(deadline - now));
+	}
+	if (!simdev_alive(dev, client->boot, SIMDEV_RESTORE)) {
+		res = RESTORE_E_MUX_ERROR;
+	} else if (dev->messages) {
+		struct simdev_msg* msg = dev->messages;
+		dev->messages = msg->next;
+		*plist = msg->plist;
+		free(msg);
+		res = RESTORE_E_SUCCESS;
+	}
+	mutex_unlock(&simdev_mutex);
+
+	return res;
+}
+
+restored_error_t restored_reboot(restored_client_t client)
+{
+	restored_error_t res = RESTORE_E_SUCCESS;
+
+	mutex_lock(&simdev_mutex);
+	if (simdev_alive(client->dev, client->boot, SIMDEV_RESTORE)) {
+		simdev_reboot(client->dev, SIMDEV_NORMAL);
+	} else {
+		res = RESTORE_E_MUX_ERROR;
+	}
+	mutex_unlock(&simdev_mutex);
+
+	return res;
+}
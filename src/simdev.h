@@ -0,0 +1,39 @@
+/*
+ * simdev.h
+ * Simulated device backend for offline restore runs
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef IDEVICERESTORE_SIMDEV_H
+#define IDEVICERESTORE_SIMDEV_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <plist/plist.h>
+
+/* comma separated key=value list configuring the simulated devices */
+#define SIMDEV_ENV "IDEVICERESTORE_SIM"
+
+plist_t simdev_tss_response(plist_t request);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
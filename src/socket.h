@@ -45,7 +45,7 @@ typedef enum fd_mode fd_mode;
 int socket_create_unix(const char *filename);
 int socket_connect_unix(const char *filename);
 #endif
-int socket_create(uint16_t port);
+int socket_create(const char *addr, uint16_t port);
 int socket_connect(const char *addr, uint16_t port);
 int socket_check_fd(int fd, fd_mode fdm, unsigned int timeout);
 int socket_accept(int fd, uint16_t port);
@@ -19,19 +19,97 @@
  * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
  */
 
+#ifndef WIN32
+#include <errno.h>
+#include <sys/time.h>
+#endif
+
+#include <stdlib.h>
+
 #include "thread.h"
 
+#ifdef WIN32
+static DWORD thread_context_key = TLS_OUT_OF_INDEXES;
+#else
+static pthread_key_t thread_context_key;
+#endif
+static thread_once_t thread_context_once = THREAD_ONCE_INIT;
+
+static void thread_context_init(void)
+{
+#ifdef WIN32
+	thread_context_key = TlsAlloc();
+#else
+	pthread_key_create(&thread_context_key, NULL);
+#endif
+}
+
+void thread_set_context(void* context)
+{
+	thread_once(&thread_context_once, thread_context_init);
+#ifdef WIN32
+	TlsSetValue(thread_context_key, context);
+#else
+	pthread_setspecific(thread_context_key, context);
+#endif
+}
+
+void* thread_get_context(void)
+{
+	thread_once(&thread_context_once, thread_context_init);
+#ifdef WIN32
+	return TlsGetValue(thread_context_key);
+#else
+	return pthread_getspecific(thread_context_key);
+#endif
+}
+
+struct thread_start {
+	thread_func_t func;
+	void* data;
+	void* context;
+};
+
+/* new threads run with the context of the thread that created them */
+#ifdef WIN32
+static DWORD WINAPI thread_start_routine(LPVOID arg)
+#else
+static void* thread_start_routine(void* arg)
+#endif
+{
+	struct thread_start start = *(struct thread_start*)arg;
+	free(arg);
+	thread_set_context(start.context);
+#ifdef WIN32
+	start.func(start.data);
+	return 0;
+#else
+	return start.func(start.data);
+#endif
+}
+
 int thread_new(thread_t *thread, thread_func_t thread_func, void* data)
 {
+	struct thread_start* start = (struct thread_start*)malloc(sizeof(struct thread_start));
+	if (!start) {
+		return -1;
+	}
+	start->func = thread_func;
+	start->data = data;
+	start->context = thread_get_context();
 #ifdef WIN32
-	HANDLE th = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE)thread_func, data, 0, NULL);
+	HANDLE th = CreateThread(NULL, 0, thread_start_routine, start, 0, NULL);
 	if (th == NULL) {
+		free(start);
 		return -1;
 	}
 	*thread = th;
 	return 0;
 #else
-	int res = pthread_create(thread, NULL, thread_func, data);
+	int res = pthread_create(thread, NULL, thread_start_routine, start);
+	if (res != 0) {
+		free(start);
+	}
 	return res;
 #endif
 }
@@ -100,6 +178,74 @@ void mutex_unlock(mutex_t* mutex)
 #endif
 }
 
+void cond_init(cond_t* cond)
+{
+#ifdef WIN32
+	InitializeConditionVariable(cond);
+#else
+	pthread_cond_init(cond, NULL);
+#endif
+}
+
+void cond_destroy(cond_t* cond)
+{
+#ifndef WIN32
+	pthread_cond_destroy(cond);
+#endif
+}
+
+void cond_wait(cond_t* cond, mutex_t* mutex)
+{
+#ifdef WIN32
+	SleepConditionVariableCS(cond, mutex, INFINITE);
+#else
+	pthread_cond_wait(cond, mutex);
+#endif
+}
+
+/* returns 0 when woken up, -1 when timeout_ms passed first */
+int cond_wait_timeout(cond_t* cond, mutex_t* mutex, unsigned int timeout_ms)
+{
+#ifdef WIN32
+	if (!SleepConditionVariableCS(cond, mutex, timeout_ms)) {
+		return -1;
+	}
+	return 0;
+#else
+	struct timeval now;
+	struct timespec abstime;
+	gettimeofday(&now, NULL);
+	abstime.tv_sec = now.tv_sec + timeout_ms / 1000;
+	abstime.tv_nsec = (now.tv_usec + (timeout_ms % 1000) * 1000) * 1000;
+	if (abstime.tv_nsec >= 1000000000) {
+		abstime.tv_sec++;
+		abstime.tv_nsec -= 1000000000;
+	}
+	if (pthread_cond_timedwait(cond, mutex, &abstime) == ETIMEDOUT) {
+		return -1;
+	}
+	return 0;
+#endif
+}
+
+void cond_signal(cond_t* cond)
+{
+#ifdef WIN32
+	WakeConditionVariable(cond);
+#else
+	pthread_cond_signal(cond);
+#endif
+}
+
+void cond_broadcast(cond_t* cond)
+{
+#ifdef WIN32
+	WakeAllConditionVariable(cond);
+#else
+	pthread_cond_broadcast(cond);
+#endif
+}
+
 void thread_once(thread_once_t *once_control, void (*init_routine)(void))
 {
 #ifdef WIN32
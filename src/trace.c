@@ -0,0 +1,489 @@
+/*
+ * trace.c
+ * Recording and replaying restored sessions
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifndef WIN32
+#include <sys/time.h>
+#endif
+#include <openssl/sha.h>
+#include <plist/plist.h>
+
+#include "trace.h"
+#include "common.h"
+#include "endianness.h"
+#include "thread.h"
+
+#define TRACE_MAGIC "IDRTRACE"
+#define TRACE_MAGIC_SIZE 8
+
+/* a trace file is the magic followed by records, each a 32 bit big endian
+ * length and a binary plist { Type, Time, Message } */
+
+struct trace_record {
+	int type;
+	uint64_t time;
+	plist_t message;
+	int used;
+};
+
+struct restore_trace {
+	FILE* file;	/* only when recording */
+	uint64_t start;
+	int replay;
+	struct trace_record* records;
+	int num_records;
+	int pos;
+	plist_t sent;	/* replies while replaying, see trace_take_sent() */
+	mutex_t mutex;
+};
+
+static const char* trace_type_names[] = {
+	"Context",
+	"Received",
+	"Sent",
+	"TSS",
+	NULL
+};
+
+uint64_t trace_now(void)
+{
+#ifdef WIN32
+	return (uint64_t)GetTickCount64() * 1000;
+#else
+	struct timeval tv;
+	gettimeofday(&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static struct restore_trace* trace_new(void)
+{
+	struct restore_trace* trace = (struct restore_trace*)malloc(sizeof(struct restore_trace));
+	if (!trace) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	memset(trace, '\0', sizeof(struct restore_trace));
+	mutex_init(&trace->mutex);
+	trace->start = trace_now();
+	return trace;
+}
+
+struct restore_trace* trace_create(const char* path)
+{
+	FILE* f = fopen(path, "wb");
+	if (!f) {
+		error("ERROR: Unable to open '%s' for writing\n", path);
+		return NULL;
+	}
+	if (fwrite(TRACE_MAGIC, 1, TRACE_MAGIC_SIZE, f) != TRACE_MAGIC_SIZE) {
+		error("ERROR: Unable to write to '%s'\n", path);
+		fclose(f);
+		return NULL;
+	}
+	struct restore_trace* trace = trace_new();
+	if (!trace) {
+		fclose(f);
+		return NULL;
+	}
+	trace->file = f;
+	return trace;
+}
+
+static int trace_add_record(struct restore_trace* trace, plist_t dict)
+{
+	char* name = NULL;
+	uint64_t time = 0;
+	int type;
+
+	plist_t node = plist_dict_get_item(dict, "Type");
+	if (!node || plist_get_node_type(node) != PLIST_STRING) {
+		return -1;
+	}
+	plist_get_string_val(node, &name);
+	for (type = 0; trace_type_names[type]; type++) {
+		if (!strcmp(name, trace_type_names[type])) {
+			break;
+		}
+	}
+	free(name);
+	if (!trace_type_names[type]) {
+		return -1;
+	}
+	node = plist_dict_get_item(dict, "Time");
+	if (node && plist_get_node_type(node) == PLIST_UINT) {
+		plist_get_uint_val(node, &time);
+	}
+	node = plist_dict_get_item(dict, "Message");
+	if (!node) {
+		return -1;
+	}
+
+	struct trace_record* records = (struct trace_record*)realloc(trace->records, sizeof(struct trace_record) * (trace->num_records + 1));
+	if (!records) {
+		return -1;
+	}
+	trace->records = records;
+	records[trace->num_records].type = type;
+	records[trace->num_records].time = time;
+	records[trace->num_records].message = plist_copy(node);
+	records[trace->num_records].used = 0;
+	trace->num_records++;
+
+	return 0;
+}
+
+struct restore_trace* trace_open(const char* path)
+{
+	char magic[TRACE_MAGIC_SIZE];
+	uint32_t len = 0;
+
+	FILE* f = fopen(path, "rb");
+	if (!f) {
+		error("ERROR: Unable to open '%s'\n", path);
+		return NULL;
+	}
+	if (fread(magic, 1, TRACE_MAGIC_SIZE, f) != TRACE_MAGIC_SIZE || memcmp(magic, TRACE_MAGIC, TRACE_MAGIC_SIZE) != 0) {
+		error("ERROR: '%s' is not a restore trace\n", path);
+		fclose(f);
+		return NULL;
+	}
+	struct restore_trace* trace = trace_new();
+	if (!trace) {
+		fclose(f);
+		return NULL;
+	}
+	trace->replay = 1;
+	trace->sent = plist_new_array();
+
+	while (fread(&len, 1, sizeof(len), f) == sizeof(len)) {
+		len = be32toh(len);
+		char* buf = (char*)malloc(len);
+		if (!buf) {
+			error("ERROR: Out of memory\n");
+			break;
+		}
+		if (fread(buf, 1, len, f) != len) {
+			error("ERROR: Trace '%s' is truncated, using the first %d records\n", path, trace->num_records);
+			free(buf);
+			break;
+		}
+		plist_t dict = NULL;
+		plist_from_bin(buf, len, &dict);
+		free(buf);
+		if (!dict || plist_get_node_type(dict) != PLIST_DICT || trace_add_record(trace, dict) < 0) {
+			error("ERROR: Trace '%s' has an invalid record\n", path);
+			plist_free(dict);
+			trace_close(trace);
+			trace = NULL;
+			break;
+		}
+		plist_free(dict);
+	}
+	fclose(f);
+
+	return trace;
+}
+
+void trace_close(struct restore_trace* trace)
+{
+	int i;
+
+	if (!trace) {
+		return;
+	}
+	if (trace->file) {
+		fclose(trace->file);
+	}
+	for (i = 0; i < trace->num_records; i++) {
+		plist_free(trace->records[i].message);
+	}
+	free(trace->records);
+	if (trace->sent) {
+		plist_free(trace->sent);
+	}
+	mutex_destroy(&trace->mutex);
+	free(trace);
+}
+
+int trace_is_replay(struct restore_trace* trace)
+{
+	return (trace && trace->replay) ? 1 : 0;
+}
+
+/* copy of node with large data replaced by { TraceDataSize, TraceDataSHA1 },
+ * enough to tell whether a reply changed without keeping whole images */
+plist_t trace_summarize(plist_t node)
+{
+	plist_t copy = NULL;
+	uint32_t i;
+
+	switch (plist_get_node_type(node)) {
+	case PLIST_DATA: {
+		char* data = NULL;
+		uint64_t size = 0;
+		plist_get_data_val(node, &data, &size);
+		if (size > TRACE_MAX_DATA_SIZE) {
+			unsigned char digest[SHA_DIGEST_LENGTH];
+			SHA1((const unsigned char*)data, (size_t)size, digest);
+			copy = plist_new_dict();
+			plist_dict_set_item(copy, "TraceDataSize", plist_new_uint(size));
+			plist_dict_set_item(copy, "TraceDataSHA1", plist_new_data((const char*)digest, SHA_DIGEST_LENGTH));
+		} else {
+			copy = plist_new_data(data, size);
+		}
+		free(data);
+		break;
+	}
+	case PLIST_DICT: {
+		plist_dict_iter iter = NULL;
+		copy = plist_new_dict();
+		plist_dict_new_iter(node, &iter);
+		if (iter) {
+			char* key = NULL;
+			plist_t item = NULL;
+			while (1) {
+				key = NULL;
+				plist_dict_next_item(node, iter, &key, &item);
+				if (!key) {
+					break;
+				}
+				plist_dict_set_item(copy, key, trace_summarize(item));
+				free(key);
+			}
+			free(iter);
+		}
+		break;
+	}
+	case PLIST_ARRAY:
+		copy = plist_new_array();
+		for (i = 0; i < plist_array_get_size(node); i++) {
+			plist_array_append_item(copy, trace_summarize(plist_array_get_item(node, i)));
+		}
+		break;
+	default:
+		copy = plist_copy(node);
+		break;
+	}
+
+	return copy;
+}
+
+void trace_write(struct restore_trace* trace, int type, plist_t message)
+{
+	char* bin = NULL;
+	uint32_t size = 0;
+
+	if (!trace || !message) {
+		return;
+	}
+
+	/* tickets and build identity are needed in full to answer requests again */
+	plist_t copy = (type == TRACE_RECEIVED || type == TRACE_SENT) ? trace_summarize(message) : plist_copy(message);
+
+	if (trace->replay) {
+		if (type == TRACE_SENT) {
+			mutex_lock(&trace->mutex);
+			plist_array_append_item(trace->sent, copy);
+			mutex_unlock(&trace->mutex);
+		} else {
+			plist_free(copy);
+		}
+		return;
+	}
+
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "Type", plist_new_string(trace_type_names[type]));
+	plist_dict_set_item(dict, "Time", plist_new_uint(trace_now() - trace->start));
+	plist_dict_set_item(dict, "Message", copy);
+	plist_to_bin(dict, &bin, &size);
+	plist_free(dict);
+	if (!bin) {
+		return;
+	}
+
+	uint32_t len = htobe32(size);
+	mutex_lock(&trace->mutex);
+	if (fwrite(&len, 1, sizeof(len), trace->file) != sizeof(len) || fwrite(bin, 1, size, trace->file) != size) {
+		error("ERROR: Unable to write trace record\n");
+	}
+	/* keep what was recorded so far when the restore crashes */
+	fflush(trace->file);
+	mutex_unlock(&trace->mutex);
+	free(bin);
+}
+
+void trace_write_context(struct idevicerestore_client_t* client, plist_t build_identity)
+{
+	if (!client->trace || client->trace->replay) {
+		return;
+	}
+
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "ECID", plist_new_uint(client->ecid));
+	if (client->device) {
+		plist_dict_set_item(dict, "ProductType", plist_new_string(client->device->product_type));
+		plist_dict_set_item(dict, "HardwareModel", plist_new_string(client->device->hardware_model));
+	}
+	plist_dict_set_item(dict, "BuildMajor", plist_new_uint(client->build_major));
+	plist_dict_set_item(dict, "Image4Supported", plist_new_bool(client->image4supported));
+	plist_dict_set_item(dict, "Flags", plist_new_uint(client->flags));
+	if (client->ipsw) {
+		plist_dict_set_item(dict, "IPSW", plist_new_string(client->ipsw));
+	}
+	if (build_identity) {
+		plist_dict_set_item(dict, "BuildIdentity", plist_copy(build_identity));
+	}
+	if (client->tss) {
+		plist_dict_set_item(dict, "TSS", plist_copy(client->tss));
+	}
+	if (client->preflight_info) {
+		plist_dict_set_item(dict, "PreflightInfo", plist_copy(client->preflight_info));
+	}
+	trace_write(client->trace, TRACE_CONTEXT, dict);
+	plist_free(dict);
+}
+
+/* the @...Ticket keys tell which tickets a request asks for */
+static plist_t trace_get_ticket_keys(plist_t request)
+{
+	plist_t keys = plist_new_array();
+	plist_dict_iter iter = NULL;
+
+	plist_dict_new_iter(request, &iter);
+	if (iter) {
+		char* key = NULL;
+		plist_t node = NULL;
+		while (1) {
+			key = NULL;
+			plist_dict_next_item(request, iter, &key, &node);
+			if (!key) {
+				break;
+			}
+			if (key[0] == '@' && plist_get_node_type(node) == PLIST_BOOLEAN) {
+				plist_array_append_item(keys, plist_new_string(key));
+			}
+			free(key);
+		}
+		free(iter);
+	}
+
+	return keys;
+}
+
+void trace_write_tss(struct restore_trace* trace, plist_t request, plist_t response)
+{
+	if (!trace || trace->replay || !request || !response) {
+		return;
+	}
+
+	plist_t dict = plist_new_dict();
+	plist_dict_set_item(dict, "Tickets", trace_get_ticket_keys(request));
+	plist_dict_set_item(dict, "Response", plist_copy(response));
+	trace_write(trace, TRACE_TSS, dict);
+	plist_free(dict);
+}
+
+static int trace_keys_match(plist_t a, plist_t b)
+{
+	char* xa = NULL;
+	char* xb = NULL;
+	uint32_t size = 0;
+
+	plist_to_xml(a, &xa, &size);
+	plist_to_xml(b, &xb, &size);
+	int res = (xa && xb && !strcmp(xa, xb));
+	free(xa);
+	free(xb);
+
+	return res;
+}
+
+/* the first recorded response not handed out yet that was requested for the
+ * same tickets, in place of asking the signing server */
+plist_t trace_replay_tss(struct restore_trace* trace, plist_t request)
+{
+	plist_t response = NULL;
+	int i;
+
+	plist_t keys = trace_get_ticket_keys(request);
+	mutex_lock(&trace->mutex);
+	for (i = 0; i < trace->num_records; i++) {
+		struct trace_record* record = &trace->records[i];
+		if (record->type != TRACE_TSS || record->used) {
+			continue;
+		}
+		plist_t tickets = plist_dict_get_item(record->message, "Tickets");
+		if (tickets && trace_keys_match(tickets, keys)) {
+			plist_t node = plist_dict_get_item(record->message, "Response");
+			if (node) {
+				response = plist_copy(node);
+				record->used = 1;
+				break;
+			}
+		}
+	}
+	mutex_unlock(&trace->mutex);
+	plist_free(keys);
+
+	if (!response) {
+		error("ERROR: No recorded TSS response matches this request\n");
+	}
+
+	return response;
+}
+
+/* returns 0 and the next record, the message belongs to the trace */
+int trace_read(struct restore_trace* trace, int* type, uint64_t* time, plist_t* message)
+{
+	if (!trace || trace->pos >= trace->num_records) {
+		return -1;
+	}
+	struct trace_record* record = &trace->records[trace->pos++];
+	*type = record->type;
+	if (time) {
+		*time = record->time;
+	}
+	*message = record->message;
+	return 0;
+}
+
+void trace_rewind(struct restore_trace* trace)
+{
+	if (trace) {
+		trace->pos = 0;
+	}
+}
+
+/* replies written since the last call, as an array the caller frees */
+plist_t trace_take_sent(struct restore_trace* trace)
+{
+	mutex_lock(&trace->mutex);
+	plist_t sent = trace->sent;
+	trace->sent = plist_new_array();
+	mutex_unlock(&trace->mutex);
+	return sent;
+}
@@ -0,0 +1,65 @@
+/*
+ * trace.h
+ * Recording and replaying restored sessions
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef IDEVICERESTORE_TRACE_H
+#define IDEVICERESTORE_TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <plist/plist.h>
+
+#include "idevicerestore.h"
+
+/* data nodes larger than this are recorded as their size and SHA1 only */
+#define TRACE_MAX_DATA_SIZE 0x1000
+
+enum {
+	TRACE_CONTEXT = 0,	/* what the handlers need to answer the requests again */
+	TRACE_RECEIVED,		/* message received from restored */
+	TRACE_SENT,		/* our reply to restored */
+	TRACE_TSS		/* TSS response, with the ticket keys it was requested for */
+};
+
+struct restore_trace;
+
+struct restore_trace* trace_create(const char* path);
+struct restore_trace* trace_open(const char* path);
+void trace_close(struct restore_trace* trace);
+int trace_is_replay(struct restore_trace* trace);
+
+void trace_write(struct restore_trace* trace, int type, plist_t message);
+void trace_write_context(struct idevicerestore_client_t* client, plist_t build_identity);
+void trace_write_tss(struct restore_trace* trace, plist_t request, plist_t response);
+
+int trace_read(struct restore_trace* trace, int* type, uint64_t* time, plist_t* message);
+void trace_rewind(struct restore_trace* trace);
+plist_t trace_take_sent(struct restore_trace* trace);
+plist_t trace_replay_tss(struct restore_trace* trace, plist_t request);
+plist_t trace_summarize(plist_t node);
+uint64_t trace_now(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
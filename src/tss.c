@@ -31,7 +31,15 @@
 #include "tss.h"
 #include "img3.h"
 #include "common.h"
+#include "download.h"
+#include "thread.h"
 #include "idevicerestore.h"
+#include "trace.h"
+#include "phase.h"
+#include "metrics.h"
+#ifdef IDEVICERESTORE_SIMULATOR
+#include "simdev.h"
+#endif
 
 #define TSS_CLIENT_VERSION_STRING "libauthinstall-293.1.16"
 #define ECID_STRSIZE 0x20
@@ -1001,6 +1009,12 @@ int tss_request_add_yonkers_tags(plist_t request, plist_t parameters, plist_t ov
 	return 0;
 }
 
+#ifdef IDEVICERESTORE_SIMULATOR
+static plist_t tss_request_send_remote(plist_t tss_request, const char* server_url_string) {
+	/* simulated devices take any ticket, keep the signing server out of it */
+	return simdev_tss_response(tss_request);
+}
+#else
 static size_t tss_write_callback(char* data, size_t size, size_t nmemb, tss_response* response) {
 	size_t total = size * nmemb;
 	if (total != 0) {
@@ -1013,12 +1027,7 @@ static size_t tss_write_callback(char* data, size_t size, size_t nmemb, tss_resp
 	return total;
 }
 
-plist_t tss_request_send(plist_t tss_request, const char* server_url_string) {
-
-	if (idevicerestore_debug) {
-		debug_plist(tss_request);
-	}
-
+static plist_t tss_request_send_remote(plist_t tss_request, const char* server_url_string) {
 	char* request = NULL;
 	int status_code = -1;
 	int retry = 0;
@@ -1071,17 +1080,20 @@ plist_t tss_request_send(plist_t tss_request, const char* server_url_string) {
 		curl_easy_setopt(handle, CURLOPT_POSTFIELDS, request);
 		curl_easy_setopt(handle, CURLOPT_USERAGENT, USER_AGENT_STRING);
 		curl_easy_setopt(handle, CURLOPT_POSTFIELDSIZE, strlen(request));
-		if (server_url_string) {
-			curl_easy_setopt(handle, CURLOPT_URL, server_url_string);
-		} else {
-			int url_index = (retry - 1) % 6;
-			curl_easy_setopt(handle, CURLOPT_URL, urls[url_index]);
-			info("Request URL set to %s\n", urls[url_index]);
+		const char* url = server_url_string;
+		if (!url) {
+			url = urls[(retry - 1) % 6];
+			info("Request URL set to %s\n", url);
 		}
+		curl_easy_setopt(handle, CURLOPT_URL, url);
+
+		download_share_handle(handle);
 
 		info("Sending TSS request attempt %d... ", retry);
 
+		double start = metrics_time();
 		curl_easy_perform(handle);
+		metrics_observe(METRIC_TSS_LATENCY, url, metrics_time() - start);
 		curl_slist_free_all(header);
 		curl_easy_cleanup(handle);
 	
@@ -1090,6 +1102,7 @@ plist_t tss_request_send(plist_t tss_request, const char* server_url_string) {
 			info("response successfully received\n");
 			break;
 		}
+		metrics_add(METRIC_TSS_FAILURES, url, 1);
 
 		if (response->length > 0) {
 			error("TSS server returned: %s\n", response->content);
@@ -1155,7 +1168,7 @@ plist_t tss_request_send(plist_t tss_request, const char* server_url_string) {
 	free(response->content);
 	free(response);
 
-	if (idevicerestore_debug) {
+	if (idevicerestore_debug_enabled()) {
 		debug_plist(tss_response);
 	}
 
@@ -1163,6 +1176,98 @@ plist_t tss_request_send(plist_t tss_request, const char* server_url_string) {
 
 	return tss_response;
 }
+#endif
+
+plist_t tss_request_send(plist_t tss_request, const char* server_url_string) {
+	struct idevicerestore_client_t* client = idevicerestore_get_current_client();
+	plist_t tss_response = NULL;
+
+	if (idevicerestore_debug_enabled()) {
+		debug_plist(tss_request);
+	}
+
+	/* replayed sessions get the responses that were recorded with them */
+	if (client && trace_is_replay(client->trace)) {
+		return trace_replay_tss(client->trace, tss_request);
+	}
+
+	struct phase* phase = phase_begin("TSS request");
+	tss_response = tss_request_send_remote(tss_request, server_url_string);
+	phase_end(phase);
+	if (client && client->trace) {
+		trace_write_tss(client->trace, tss_request, tss_response);
+	}
+
+	return tss_response;
+}
+
+struct tss_future {
+	thread_t thread;
+	plist_t request;
+	char* server_url;
+	plist_t response;
+	int joined;
+};
+
+static void* tss_future_thread(void* arg)
+{
+	struct tss_future* future = (struct tss_future*)arg;
+	future->response = tss_request_send(future->request, future->server_url);
+	return NULL;
+}
+
+tss_future_t tss_request_send_async(plist_t request, const char* server_url_string)
+{
+	struct tss_future* future = (struct tss_future*)malloc(sizeof(struct tss_future));
+	if (!future) {
+		error("ERROR: Out of memory\n");
+		plist_free(request);
+		return NULL;
+	}
+	memset(future, '\0', sizeof(struct tss_future));
+	future->request = request;
+	future->server_url = (server_url_string) ? strdup(server_url_string) : NULL;
+
+	if (thread_new(&future->thread, tss_future_thread, future) != 0) {
+		error("ERROR: Unable to start TSS request thread\n");
+		plist_free(future->request);
+		free(future->server_url);
+		free(future);
+		return NULL;
+	}
+
+	return future;
+}
+
+plist_t tss_future_get(tss_future_t future)
+{
+	if (!future) {
+		return NULL;
+	}
+	if (!future->joined) {
+		thread_join(future->thread);
+		thread_free(future->thread);
+		future->joined = 1;
+	}
+	/* the response is handed out once */
+	plist_t response = future->response;
+	future->response = NULL;
+	return response;
+}
+
+void tss_future_free(tss_future_t future)
+{
+	if (!future) {
+		return;
+	}
+	plist_t response = tss_future_get(future);
+	if (response) {
+		plist_free(response);
+	}
+	plist_free(future->request);
+	free(future->server_url);
+	free(future);
+}
 
 static int tss_response_get_data_by_key(plist_t response, const char* name, unsigned char** buffer, unsigned int* length) {
 
@@ -1277,7 +1382,7 @@ int tss_response_get_blob_by_path(plist_t tss, const char* path, unsigned char**
 	return 0;
 }
 
-int tss_response_get_blob_by_entry(plist_t response, const char* entry, unsigned char** blob) {
+int tss_response_get_blob_by_entry(plist_t response, const char* entry, unsigned char** blob, unsigned int* size) {
 	uint64_t blob_size = 0;
 	char* blob_data = NULL;
 	plist_t blob_node = NULL;
@@ -1299,5 +1404,6 @@ int tss_response_get_blob_by_entry(plist_t response, const char* entry, unsigned
 	plist_get_data_val(blob_node, &blob_data, &blob_size);
 
 	*blob = (unsigned char*)blob_data;
+	*size = (unsigned int)blob_size;
 	return 0;
 }
@@ -49,13 +49,20 @@ int tss_request_add_ap_img3_tags(plist_t request, plist_t parameters);
 /* i/o */
 plist_t tss_request_send(plist_t request, const char* server_url_string);
 
+/* the request is sent on its own thread, tss_future_get() waits for it */
+typedef struct tss_future *tss_future_t;
+
+tss_future_t tss_request_send_async(plist_t request, const char* server_url_string);
+plist_t tss_future_get(tss_future_t future);
+void tss_future_free(tss_future_t future);
+
 /* response */
 int tss_response_get_ap_img4_ticket(plist_t response, unsigned char** ticket, unsigned int* length);
 int tss_response_get_ap_ticket(plist_t response, unsigned char** ticket, unsigned int* length);
 int tss_response_get_baseband_ticket(plist_t response, unsigned char** ticket, unsigned int* length);
 int tss_response_get_path_by_entry(plist_t response, const char* entry, char** path);
 int tss_response_get_blob_by_path(plist_t response, const char* path, unsigned char** blob);
-int tss_response_get_blob_by_entry(plist_t response, const char* entry, unsigned char** blob);
+int tss_response_get_blob_by_entry(plist_t response, const char* entry, unsigned char** blob, unsigned int* size);
 
 /* helpers */
 char* ecid_to_string(uint64_t ecid);
@@ -0,0 +1,368 @@
+/*
+ * usbtopo.c
+ * USB topology lookup and per hub admission of bulk transfers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <ctype.h>
+#include <errno.h>
+#ifdef __linux__
+#include <dirent.h>
+#endif
+
+#include "usbtopo.h"
+#include "common.h"
+#include "thread.h"
+#include "metrics.h"
+
+#define USBTOPO_SYSFS_PATH "/sys/bus/usb/devices"
+#define USBTOPO_APPLE_VID "05ac"
+
+/* a device from a topology file, used instead of sysfs */
+struct usbtopo_entry {
+	uint64_t ecid;
+	char* udid;
+	usb_location_t location;
+	struct usbtopo_entry* next;
+};
+
+static struct usbtopo_entry* usbtopo_entries = NULL;
+static int usbtopo_loaded = 0;
+
+/* devices behind one hub share its upstream port, admission is per hub */
+struct usbtopo_hub {
+	int bus;
+	char path[64];  /* port path of the hub, empty for the root hub */
+	int active;
+	struct usbtopo_hub* next;
+};
+
+static struct {
+	int enabled;
+	int limit;
+	struct usbtopo_hub* hubs;
+	mutex_t mutex;
+	cond_t cond;
+} usbtopo_admission;
+
+/* compares UDIDs ignoring case and dashes, USB serials of newer devices lack the dash */
+static int usbtopo_udid_equal(const char* a, const char* b)
+{
+	while (*a || *b) {
+		if (*a == '-') {
+			a++;
+			continue;
+		}
+		if (*b == '-') {
+			b++;
+			continue;
+		}
+		if (tolower((unsigned char)*a) != tolower((unsigned char)*b)) {
+			return 0;
+		}
+		a++;
+		b++;
+	}
+	return 1;
+}
+
+static int usbtopo_matches(uint64_t entry_ecid, const char* entry_udid, uint64_t ecid, const char* udid)
+{
+	if (ecid && entry_ecid == ecid) {
+		return 1;
+	}
+	if (udid && entry_udid && usbtopo_udid_equal(entry_udid, udid)) {
+		return 1;
+	}
+	return 0;
+}
+
+/* reads a topology description with one "<ECID or UDID> <bus> <port path>"
+ * line per device, which is then used instead of sysfs */
+int usbtopo_load(const char* path)
+{
+	char line[512];
+	char device[128];
+	char port_path[64];
+	int bus = 0;
+	int lineno = 0;
+
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		error("ERROR: Unable to open USB topology %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+
+	usbtopo_unload();
+	while (fgets(line, sizeof(line), f)) {
+		lineno++;
+		char* comment = strchr(line, '#');
+		if (comment) {
+			*comment = '\0';
+		}
+		if (line[strspn(line, " \t\r\n")] == '\0') {
+			continue;
+		}
+		if (sscanf(line, "%127s %d %63s", device, &bus, port_path) != 3 || bus <= 0) {
+			error("ERROR: %s:%d: expected '<ECID or UDID> <bus> <port path>'\n", path, lineno);
+			fclose(f);
+			usbtopo_unload();
+			return -1;
+		}
+		struct usbtopo_entry* entry = (struct usbtopo_entry*)malloc(sizeof(struct usbtopo_entry));
+		if (!entry) {
+			error("ERROR: Out of memory\n");
+			fclose(f);
+			usbtopo_unload();
+			return -1;
+		}
+		memset(entry, '\0', sizeof(struct usbtopo_entry));
+		if (strlen(device) >= 24 || strchr(device, '-')) {
+			entry->udid = strdup(device);
+		} else {
+			entry->ecid = strtoull(device, NULL, 16);
+		}
+		entry->location.bus = bus;
+		strcpy(entry->location.port_path, port_path);
+		entry->next = usbtopo_entries;
+		usbtopo_entries = entry;
+	}
+	fclose(f);
+	usbtopo_loaded = 1;
+
+	return 0;
+}
+
+void usbtopo_unload(void)
+{
+	while (usbtopo_entries) {
+		struct usbtopo_entry* entry = usbtopo_entries;
+		usbtopo_entries = entry->next;
+		free(entry->udid);
+		free(entry);
+	}
+	usbtopo_loaded = 0;
+}
+
+#ifdef __linux__
+static int usbtopo_read_attr(const char* device, const char* attr, char* buf, size_t size)
+{
+	char path[512];
+	snprintf(path, sizeof(path), "%s/%s/%s", USBTOPO_SYSFS_PATH, device, attr);
+	FILE* f = fopen(path, "r");
+	if (!f) {
+		return -1;
+	}
+	if (!fgets(buf, size, f)) {
+		fclose(f);
+		return -1;
+	}
+	fclose(f);
+	buf[strcspn(buf, "\r\n")] = '\0';
+	return 0;
+}
+
+static int usbtopo_locate_sysfs(uint64_t ecid, const char* udid, usb_location_t* location)
+{
+	char buf[256];
+	struct dirent* ent = NULL;
+	int res = -1;
+
+	DIR* dir = opendir(USBTOPO_SYSFS_PATH);
+	if (!dir) {
+		return -1;
+	}
+	while ((ent = readdir(dir)) != NULL) {
+		/* interfaces have a ':' in their name, we want the devices */
+		if (ent->d_name[0] == '.' || strchr(ent->d_name, ':')) {
+			continue;
+		}
+		if (usbtopo_read_attr(ent->d_name, "idVendor", buf, sizeof(buf)) < 0 || strcmp(buf, USBTOPO_APPLE_VID) != 0) {
+			continue;
+		}
+		if (usbtopo_read_attr(ent->d_name, "serial", buf, sizeof(buf)) < 0) {
+			continue;
+		}
+		/* iBoot puts the ECID into the serial, in normal mode it is the UDID */
+		uint64_t serial_ecid = 0;
+		char* p = strstr(buf, "ECID:");
+		if (p) {
+			serial_ecid = strtoull(p + 5, NULL, 16);
+		}
+		if (!usbtopo_matches(serial_ecid, (p) ? NULL : buf, ecid, udid)) {
+			continue;
+		}
+		if (usbtopo_read_attr(ent->d_name, "busnum", buf, sizeof(buf)) < 0) {
+			continue;
+		}
+		location->bus = atoi(buf);
+		if (usbtopo_read_attr(ent->d_name, "devpath", buf, sizeof(buf)) == 0) {
+			snprintf(location->port_path, sizeof(location->port_path), "%s", buf);
+		}
+		res = 0;
+		break;
+	}
+	closedir(dir);
+
+	return res;
+}
+#endif
+
+/* returns 0 and fills location if the device was found */
+int usbtopo_locate(uint64_t ecid, const char* udid, usb_location_t* location)
+{
+	memset(location, '\0', sizeof(usb_location_t));
+	if (!ecid && !udid) {
+		return -1;
+	}
+
+	if (usbtopo_loaded) {
+		struct usbtopo_entry* entry = NULL;
+		for (entry = usbtopo_entries; entry; entry = entry->next) {
+			if (usbtopo_matches(entry->ecid, entry->udid, ecid, udid)) {
+				*location = entry->location;
+				return 0;
+			}
+		}
+		return -1;
+	}
+
+#ifdef __linux__
+	return usbtopo_locate_sysfs(ecid, udid, location);
+#else
+	return -1;
+#endif
+}
+
+void usbtopo_admission_enable(int bus_limit)
+{
+	if (usbtopo_admission.enabled) {
+		return;
+	}
+	memset(&usbtopo_admission, '\0', sizeof(usbtopo_admission));
+	mutex_init(&usbtopo_admission.mutex);
+	cond_init(&usbtopo_admission.cond);
+	usbtopo_admission.limit = (bus_limit > 0) ? bus_limit : USBTOPO_DEFAULT_BUS_LIMIT;
+	usbtopo_admission.enabled = 1;
+}
+
+void usbtopo_admission_disable(void)
+{
+	if (!usbtopo_admission.enabled) {
+		return;
+	}
+	usbtopo_admission.enabled = 0;
+	while (usbtopo_admission.hubs) {
+		struct usbtopo_hub* hub = usbtopo_admission.hubs;
+		usbtopo_admission.hubs = hub->next;
+		free(hub);
+	}
+	cond_destroy(&usbtopo_admission.cond);
+	mutex_destroy(&usbtopo_admission.mutex);
+}
+
+/* the hub a device is plugged into is its port path without the last port */
+static void usbtopo_hub_path(const char* port_path, char* hub_path, size_t size)
+{
+	const char* last = strrchr(port_path, '.');
+	size_t len = (last) ? (size_t)(last - port_path) : 0;
+	if (len >= size) {
+		len = size - 1;
+	}
+	memcpy(hub_path, port_path, len);
+	hub_path[len] = '\0';
+}
+
+/* waits until the hub the device is plugged into has room for another bulk
+ * transfer. lightweight exchanges don't need this. devices that can't be
+ * located are let through right away. */
+void usbtopo_bulk_begin(struct idevicerestore_client_t* client, const char* what)
+{
+	struct usbtopo_hub* hub = NULL;
+	char hub_path[64];
+	char hub_name[80];
+
+	if (!usbtopo_admission.enabled || client->usb_bulk_hub) {
+		return;
+	}
+
+	if (!client->usb_bus) {
+		usb_location_t location;
+		if (usbtopo_locate(client->ecid, client->udid, &location) < 0) {
+			debug("DEBUG: %s: device not found in USB topology, not limiting %s\n", __func__, what);
+			return;
+		}
+		client->usb_bus = location.bus;
+		strcpy(client->usb_port_path, location.port_path);
+	}
+	usbtopo_hub_path(client->usb_port_path, hub_path, sizeof(hub_path));
+
+	mutex_lock(&usbtopo_admission.mutex);
+	for (hub = usbtopo_admission.hubs; hub; hub = hub->next) {
+		if (hub->bus == client->usb_bus && !strcmp(hub->path, hub_path)) {
+			break;
+		}
+	}
+	if (!hub) {
+		hub = (struct usbtopo_hub*)malloc(sizeof(struct usbtopo_hub));
+		if (!hub) {
+			mutex_unlock(&usbtopo_admission.mutex);
+			return;
+		}
+		hub->bus = client->usb_bus;
+		strcpy(hub->path, hub_path);
+		hub->active = 0;
+		hub->next = usbtopo_admission.hubs;
+		usbtopo_admission.hubs = hub;
+	}
+	if (hub->active >= usbtopo_admission.limit) {
+		if (hub->path[0]) {
+			snprintf(hub_name, sizeof(hub_name), "hub %d-%s", hub->bus, hub->path);
+		} else {
+			snprintf(hub_name, sizeof(hub_name), "root hub of bus %d", hub->bus);
+		}
+		info("Waiting for USB %s to send %s...\n", hub_name, what);
+		metrics_add(METRIC_QUEUE_DEPTH, "usb_hub", 1);
+		while (hub->active >= usbtopo_admission.limit) {
+			cond_wait(&usbtopo_admission.cond, &usbtopo_admission.mutex);
+		}
+		metrics_add(METRIC_QUEUE_DEPTH, "usb_hub", -1);
+	}
+	hub->active++;
+	client->usb_bulk_hub = hub;
+	mutex_unlock(&usbtopo_admission.mutex);
+}
+
+void usbtopo_bulk_end(struct idevicerestore_client_t* client)
+{
+	if (!usbtopo_admission.enabled || !client->usb_bulk_hub) {
+		return;
+	}
+
+	mutex_lock(&usbtopo_admission.mutex);
+	client->usb_bulk_hub->active--;
+	client->usb_bulk_hub = NULL;
+	cond_broadcast(&usbtopo_admission.cond);
+	mutex_unlock(&usbtopo_admission.mutex);
+}
@@ -0,0 +1,54 @@
+/*
+ * usbtopo.h
+ * USB topology lookup and per hub admission of bulk transfers
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+
+#ifndef IDEVICERESTORE_USBTOPO_H
+#define IDEVICERESTORE_USBTOPO_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#include "idevicerestore.h"
+
+/* bulk transfers allowed at the same time behind one hub unless told otherwise */
+#define USBTOPO_DEFAULT_BUS_LIMIT 2
+
+/* where a device is plugged in, devices behind the same hub share its bandwidth */
+typedef struct {
+	int bus;             /* 0 if unknown */
+	char port_path[64];  /* hub ports from the root hub, e.g. "1.3" */
+} usb_location_t;
+
+int usbtopo_load(const char* path);
+void usbtopo_unload(void);
+int usbtopo_locate(uint64_t ecid, const char* udid, usb_location_t* location);
+
+void usbtopo_admission_enable(int bus_limit);
+void usbtopo_admission_disable(void);
+void usbtopo_bulk_begin(struct idevicerestore_client_t* client, const char* what);
+void usbtopo_bulk_end(struct idevicerestore_client_t* client);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
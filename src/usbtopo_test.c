@@ -0,0 +1,138 @@
+/*
+ * usbtopo_test.c
+ * Checks that bulk transfers are admitted per USB hub of a fake topology
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "usbtopo.h"
+#include "common.h"
+#include "thread.h"
+
+/* two ports on hub 1-1, one port on hub 1-2 of the same bus */
+static const char* usbtopo_test_topology =
+	"# fake rack\n"
+	"1111 1 1.1\n"
+	"2222 1 1.2\n"
+	"3333 1 2.1\n";
+
+static struct idevicerestore_client_t clients[3];
+static int second_admitted = 0;
+
+static void* usbtopo_test_second(void* arg)
+{
+	struct idevicerestore_client_t* client = (struct idevicerestore_client_t*)arg;
+
+	usbtopo_bulk_begin(client, "filesystem");
+	__atomic_store_n(&second_admitted, 1, __ATOMIC_RELEASE);
+	usbtopo_bulk_end(client);
+
+	return NULL;
+}
+
+int main(void)
+{
+	char path[] = "/tmp/usbtopo_test.XXXXXX";
+	thread_t thread;
+	int started = 0;
+	int res = 1;
+
+	/* the test hangs instead of failing if a hub is never admitted */
+	alarm(10);
+
+	int fd = mkstemp(path);
+	if (fd < 0) {
+		fprintf(stderr, "Unable to create a temporary file\n");
+		return 1;
+	}
+	if (write(fd, usbtopo_test_topology, strlen(usbtopo_test_topology)) != (ssize_t)strlen(usbtopo_test_topology)) {
+		fprintf(stderr, "Unable to write %s\n", path);
+		close(fd);
+		unlink(path);
+		return 1;
+	}
+	close(fd);
+
+	if (usbtopo_load(path) < 0) {
+		fprintf(stderr, "Unable to load %s\n", path);
+		unlink(path);
+		return 1;
+	}
+	unlink(path);
+
+	clients[0].ecid = 0x1111;
+	clients[1].ecid = 0x2222;
+	clients[2].ecid = 0x3333;
+	usbtopo_admission_enable(1);
+
+	usbtopo_bulk_begin(&clients[0], "filesystem");
+	if (!clients[0].usb_bulk_hub) {
+		fprintf(stderr, "FAIL: device on port 1.1 was not admitted\n");
+		goto leave;
+	}
+
+	/* the other port on the same hub has to wait for the first one */
+	if (thread_new(&thread, usbtopo_test_second, &clients[1]) != 0) {
+		fprintf(stderr, "Unable to start thread\n");
+		goto leave;
+	}
+	started = 1;
+	usleep(200000);
+	if (__atomic_load_n(&second_admitted, __ATOMIC_ACQUIRE)) {
+		fprintf(stderr, "FAIL: port 1.2 was admitted while port 1.1 on the same hub was busy\n");
+		goto leave;
+	}
+
+	/* a different hub on the same bus is not affected */
+	usbtopo_bulk_begin(&clients[2], "filesystem");
+	if (!clients[2].usb_bulk_hub) {
+		fprintf(stderr, "FAIL: device on port 2.1 was not admitted\n");
+		goto leave;
+	}
+	usbtopo_bulk_end(&clients[2]);
+
+	usbtopo_bulk_end(&clients[0]);
+	thread_join(thread);
+	thread_free(thread);
+	started = 0;
+	if (!__atomic_load_n(&second_admitted, __ATOMIC_ACQUIRE)) {
+		fprintf(stderr, "FAIL: port 1.2 was not admitted after port 1.1 finished\n");
+		goto leave;
+	}
+
+	printf("PASS: ports 1.1 and 1.2 on one hub were serialized\n");
+	res = 0;
+
+leave:
+	if (started) {
+		/* let the waiting thread through so we can exit */
+		usbtopo_bulk_end(&clients[0]);
+		thread_join(thread);
+		thread_free(thread);
+	}
+	usbtopo_admission_disable();
+	usbtopo_unload();
+
+	return res;
+}
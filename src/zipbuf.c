@@ -0,0 +1,459 @@
+/*
+ * zipbuf.c
+ * Functions for editing small ZIP archives in memory
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <zlib.h>
+
+#include "zipbuf.h"
+#include "common.h"
+
+#define ZIP_LOCAL_HEADER_SIG 0x04034b50
+#define ZIP_CENTRAL_HEADER_SIG 0x02014b50
+#define ZIP_END_OF_CENTRAL_DIR_SIG 0x06054b50
+
+#define ZIP_LOCAL_HEADER_SIZE 30
+#define ZIP_CENTRAL_HEADER_SIZE 46
+#define ZIP_END_OF_CENTRAL_DIR_SIZE 22
+
+#define ZIP_METHOD_STORE 0
+#define ZIP_METHOD_DEFLATE 8
+
+static uint16_t get16(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const unsigned char* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static unsigned char* put16(unsigned char* p, uint16_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	return p + 2;
+}
+
+static unsigned char* put32(unsigned char* p, uint32_t v)
+{
+	p[0] = v & 0xFF;
+	p[1] = (v >> 8) & 0xFF;
+	p[2] = (v >> 16) & 0xFF;
+	p[3] = (v >> 24) & 0xFF;
+	return p + 4;
+}
+
+static int zipbuf_grow(zipbuf* zb)
+{
+	if (zb->num_entries < zb->max_entries) {
+		return 0;
+	}
+	int max = (zb->max_entries) ? zb->max_entries * 2 : 16;
+	zipbuf_entry* entries = (zipbuf_entry*)realloc(zb->entries, max * sizeof(zipbuf_entry));
+	if (!entries) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	zb->entries = entries;
+	zb->max_entries = max;
+	return 0;
+}
+
+zipbuf* zipbuf_open(const unsigned char* data, unsigned int size)
+{
+	unsigned int eocd = 0;
+	unsigned int off, cd_off, cd_size;
+	int i, count;
+
+	if (!data || size < ZIP_END_OF_CENTRAL_DIR_SIZE) {
+		return NULL;
+	}
+
+	// the end of central directory record is followed by at most 64k of comment
+	for (off = size - ZIP_END_OF_CENTRAL_DIR_SIZE; ; off--) {
+		if (get32(data + off) == ZIP_END_OF_CENTRAL_DIR_SIG) {
+			eocd = off;
+			break;
+		}
+		if (off == 0 || size - off > ZIP_END_OF_CENTRAL_DIR_SIZE + 0xFFFF) {
+			error("ERROR: %s: could not find end of central directory\n", __func__);
+			return NULL;
+		}
+	}
+
+	count = get16(data + eocd + 10);
+	cd_size = get32(data + eocd + 12);
+	cd_off = get32(data + eocd + 16);
+	if (cd_off > eocd || cd_size > eocd - cd_off) {
+		error("ERROR: %s: invalid central directory\n", __func__);
+		return NULL;
+	}
+
+	zipbuf* zb = (zipbuf*)malloc(sizeof(zipbuf));
+	if (!zb) {
+		error("ERROR: Out of memory\n");
+		return NULL;
+	}
+	memset(zb, '\0', sizeof(zipbuf));
+	zb->data = data;
+	zb->size = size;
+
+	off = cd_off;
+	for (i = 0; i < count; i++) {
+		const unsigned char* p = data + off;
+		if (off + ZIP_CENTRAL_HEADER_SIZE > eocd || get32(p) != ZIP_CENTRAL_HEADER_SIG) {
+			error("ERROR: %s: invalid central directory entry %d\n", __func__, i);
+			goto error_out;
+		}
+		uint16_t name_len = get16(p + 28);
+		uint16_t extra_len = get16(p + 30);
+		uint16_t comment_len = get16(p + 32);
+		uint32_t local_off = get32(p + 42);
+		if (off + ZIP_CENTRAL_HEADER_SIZE + name_len > eocd) {
+			error("ERROR: %s: invalid central directory entry %d\n", __func__, i);
+			goto error_out;
+		}
+
+		if (zipbuf_grow(zb) < 0) {
+			goto error_out;
+		}
+		zipbuf_entry* entry = &zb->entries[zb->num_entries];
+		memset(entry, '\0', sizeof(zipbuf_entry));
+		entry->version_made = get16(p + 4);
+		entry->method = get16(p + 10);
+		entry->time = get16(p + 12);
+		entry->date = get16(p + 14);
+		entry->crc32 = get32(p + 16);
+		entry->comp_size = get32(p + 20);
+		entry->size = get32(p + 24);
+		entry->int_attr = get16(p + 36);
+		entry->ext_attr = get32(p + 38);
+
+		// the compressed data follows the local header
+		const unsigned char* lh = data + local_off;
+		if (local_off > cd_off || cd_off - local_off < ZIP_LOCAL_HEADER_SIZE || get32(lh) != ZIP_LOCAL_HEADER_SIG) {
+			error("ERROR: %s: invalid local header for entry %d\n", __func__, i);
+			goto error_out;
+		}
+		uint32_t data_off = local_off + ZIP_LOCAL_HEADER_SIZE + get16(lh + 26) + get16(lh + 28);
+		if (data_off > cd_off || entry->comp_size > cd_off - data_off) {
+			error("ERROR: %s: invalid data range for entry %d\n", __func__, i);
+			goto error_out;
+		}
+		entry->comp_data = data + data_off;
+
+		entry->name = (char*)malloc(name_len + 1);
+		if (!entry->name) {
+			error("ERROR: Out of memory\n");
+			goto error_out;
+		}
+		memcpy(entry->name, p + ZIP_CENTRAL_HEADER_SIZE, name_len);
+		entry->name[name_len] = '\0';
+		zb->num_entries++;
+
+		off += ZIP_CENTRAL_HEADER_SIZE + name_len + extra_len + comment_len;
+	}
+
+	return zb;
+
+error_out:
+	zipbuf_free(zb);
+	return NULL;
+}
+
+void zipbuf_free(zipbuf* zb)
+{
+	int i;
+
+	if (!zb) {
+		return;
+	}
+	for (i = 0; i < zb->num_entries; i++) {
+		free(zb->entries[i].name);
+		free(zb->entries[i].new_data);
+	}
+	free(zb->entries);
+	free(zb);
+}
+
+int zipbuf_name_locate(zipbuf* zb, const char* name)
+{
+	int i;
+
+	if (!zb || !name) {
+		return -1;
+	}
+	for (i = 0; i < zb->num_entries; i++) {
+		if (!zb->entries[i].deleted && !strcmp(zb->entries[i].name, name)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+int zipbuf_read(zipbuf* zb, int index, unsigned char** data, unsigned int* size)
+{
+	if (!zb || index < 0 || index >= zb->num_entries || !data || !size) {
+		return -1;
+	}
+	zipbuf_entry* entry = &zb->entries[index];
+	const unsigned char* src = (entry->new_data) ? entry->new_data : entry->comp_data;
+
+	unsigned char* buf = (unsigned char*)malloc(entry->size + 1);
+	if (!buf) {
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+
+	if (entry->method == ZIP_METHOD_STORE) {
+		if (entry->comp_size != entry->size) {
+			error("ERROR: %s: size mismatch for stored entry %s\n", __func__, entry->name);
+			free(buf);
+			return -1;
+		}
+		memcpy(buf, src, entry->size);
+	} else if (entry->method == ZIP_METHOD_DEFLATE) {
+		z_stream strm;
+		memset(&strm, '\0', sizeof(z_stream));
+		if (inflateInit2(&strm, -MAX_WBITS) != Z_OK) {
+			error("ERROR: %s: inflateInit2 failed\n", __func__);
+			free(buf);
+			return -1;
+		}
+		strm.next_in = (Bytef*)src;
+		strm.avail_in = entry->comp_size;
+		strm.next_out = buf;
+		strm.avail_out = entry->size;
+		int zr = inflate(&strm, Z_FINISH);
+		inflateEnd(&strm);
+		if (zr != Z_STREAM_END || strm.total_out != entry->size) {
+			error("ERROR: %s: could not inflate %s\n", __func__, entry->name);
+			free(buf);
+			return -1;
+		}
+	} else {
+		error("ERROR: %s: unsupported compression method %d for %s\n", __func__, entry->method, entry->name);
+		free(buf);
+		return -1;
+	}
+
+	if (crc32(crc32(0L, Z_NULL, 0), buf, entry->size) != entry->crc32) {
+		error("ERROR: %s: CRC mismatch for %s\n", __func__, entry->name);
+		free(buf);
+		return -1;
+	}
+	buf[entry->size] = '\0';
+
+	*data = buf;
+	*size = entry->size;
+	return 0;
+}
+
+static int zipbuf_set_data(zipbuf_entry* entry, const unsigned char* data, unsigned int size)
+{
+	z_stream strm;
+	uLong bound;
+	unsigned char* buf;
+
+	memset(&strm, '\0', sizeof(z_stream));
+	if (deflateInit2(&strm, Z_DEFAULT_COMPRESSION, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		error("ERROR: %s: deflateInit2 failed\n", __func__);
+		return -1;
+	}
+	bound = deflateBound(&strm, size);
+	buf = (unsigned char*)malloc(bound);
+	if (!buf) {
+		deflateEnd(&strm);
+		error("ERROR: Out of memory\n");
+		return -1;
+	}
+	strm.next_in = (Bytef*)data;
+	strm.avail_in = size;
+	strm.next_out = buf;
+	strm.avail_out = bound;
+	if (deflate(&strm, Z_FINISH) != Z_STREAM_END) {
+		deflateEnd(&strm);
+		free(buf);
+		error("ERROR: %s: deflate failed\n", __func__);
+		return -1;
+	}
+	deflateEnd(&strm);
+
+	free(entry->new_data);
+	entry->new_data = buf;
+	entry->comp_data = NULL;
+	entry->comp_size = strm.total_out;
+	entry->size = size;
+	entry->method = ZIP_METHOD_DEFLATE;
+	entry->crc32 = crc32(crc32(0L, Z_NULL, 0), data, size);
+
+	return 0;
+}
+
+int zipbuf_replace(zipbuf* zb, int index, const unsigned char* data, unsigned int size)
+{
+	if (!zb || index < 0 || index >= zb->num_entries || !data) {
+		return -1;
+	}
+	return zipbuf_set_data(&zb->entries[index], data, size);
+}
+
+int zipbuf_add(zipbuf* zb, const char* name, const unsigned char* data, unsigned int size)
+{
+	time_t now = time(NULL);
+#ifdef WIN32
+	/* thread-local in the Windows C runtime */
+	struct tm* tm = localtime(&now);
+#else
+	struct tm tm_buf;
+	struct tm* tm = localtime_r(&now, &tm_buf);
+#endif
+
+	if (!zb || !name || !data) {
+		return -1;
+	}
+	if (zipbuf_grow(zb) < 0) {
+		return -1;
+	}
+	zipbuf_entry* entry = &zb->entries[zb->num_entries];
+	memset(entry, '\0', sizeof(zipbuf_entry));
+	entry->name = strdup(name);
+	entry->version_made = 20;
+	if (tm) {
+		entry->time = (tm->tm_hour << 11) | (tm->tm_min << 5) | (tm->tm_sec >> 1);
+		entry->date = ((tm->tm_year - 80) << 9) | ((tm->tm_mon + 1) << 5) | tm->tm_mday;
+	}
+	if (!entry->name || zipbuf_set_data(entry, data, size) < 0) {
+		free(entry->name);
+		return -1;
+	}
+	return zb->num_entries++;
+}
+
+void zipbuf_delete(zipbuf* zb, int index)
+{
+	if (!zb || index < 0 || index >= zb->num_entries) {
+		return;
+	}
+	zb->entries[index].deleted = 1;
+}
+
+int zipbuf_write(zipbuf* zb, unsigned char** data, unsigned int* size)
+{
+	unsigned int total = ZIP_END_OF_CENTRAL_DIR_SIZE;
+	unsigned int count = 0;
+	uint32_t* offsets = NULL;
+	int i;
+
+	if (!zb || !data || !size) {
+		return -1;
+	}
+
+	for (i = 0; i < zb->num_entries; i++) {
+		zipbuf_entry* entry = &zb->entries[i];
+		if (entry->deleted) {
+			continue;
+		}
+		total += ZIP_LOCAL_HEADER_SIZE + ZIP_CENTRAL_HEADER_SIZE + 2*strlen(entry->name) + entry->comp_size;
+		count++;
+	}
+
+	unsigned char* buf = (unsigned char*)malloc(total);
+	offsets = (uint32_t*)malloc((zb->num_entries + 1) * sizeof(uint32_t));
+	if (!buf || !offsets) {
+		error("ERROR: Out of memory\n");
+		free(buf);
+		free(offsets);
+		return -1;
+	}
+
+	// local headers and (raw) compressed data, without data descriptors
+	unsigned char* p = buf;
+	for (i = 0; i < zb->num_entries; i++) {
+		zipbuf_entry* entry = &zb->entries[i];
+		if (entry->deleted) {
+			continue;
+		}
+		uint16_t name_len = strlen(entry->name);
+		offsets[i] = p - buf;
+		p = put32(p, ZIP_LOCAL_HEADER_SIG);
+		p = put16(p, 20);
+		p = put16(p, 0);
+		p = put16(p, entry->method);
+		p = put16(p, entry->time);
+		p = put16(p, entry->date);
+		p = put32(p, entry->crc32);
+		p = put32(p, entry->comp_size);
+		p = put32(p, entry->size);
+		p = put16(p, name_len);
+		p = put16(p, 0);
+		memcpy(p, entry->name, name_len);
+		p += name_len;
+		memcpy(p, (entry->new_data) ? entry->new_data : entry->comp_data, entry->comp_size);
+		p += entry->comp_size;
+	}
+
+	unsigned int cd_off = p - buf;
+	for (i = 0; i < zb->num_entries; i++) {
+		zipbuf_entry* entry = &zb->entries[i];
+		if (entry->deleted) {
+			continue;
+		}
+		uint16_t name_len = strlen(entry->name);
+		p = put32(p, ZIP_CENTRAL_HEADER_SIG);
+		p = put16(p, entry->version_made);
+		p = put16(p, 20);
+		p = put16(p, 0);
+		p = put16(p, entry->method);
+		p = put16(p, entry->time);
+		p = put16(p, entry->date);
+		p = put32(p, entry->crc32);
+		p = put32(p, entry->comp_size);
+		p = put32(p, entry->size);
+		p = put16(p, name_len);
+		p = put16(p, 0);
+		p = put16(p, 0);
+		p = put16(p, 0);
+		p = put16(p, entry->int_attr);
+		p = put32(p, entry->ext_attr);
+		p = put32(p, offsets[i]);
+		memcpy(p, entry->name, name_len);
+		p += name_len;
+	}
+	unsigned int cd_size = (p - buf) - cd_off;
+
+	p = put32(p, ZIP_END_OF_CENTRAL_DIR_SIG);
+	p = put16(p, 0);
+	p = put16(p, 0);
+	p = put16(p, count);
+	p = put16(p, count);
+	p = put32(p, cd_size);
+	p = put32(p, cd_off);
+	p = put16(p, 0);
+
+	free(offsets);
+
+	*data = buf;
+	*size = p - buf;
+	return 0;
+}
@@ -0,0 +1,67 @@
+/*
+ * zipbuf.h
+ * Functions for editing small ZIP archives in memory
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or (at your option) any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301  USA
+ */
+
+#ifndef IDEVICERESTORE_ZIPBUF_H
+#define IDEVICERESTORE_ZIPBUF_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+typedef struct {
+	char* name;
+	uint16_t version_made;
+	uint16_t method;
+	uint16_t time;
+	uint16_t date;
+	uint32_t crc32;
+	uint32_t comp_size;
+	uint32_t size;
+	uint16_t int_attr;
+	uint32_t ext_attr;
+	const unsigned char* comp_data;
+	unsigned char* new_data;
+	int deleted;
+} zipbuf_entry;
+
+/* unchanged members are written back as their raw compressed bytes */
+typedef struct {
+	const unsigned char* data;
+	unsigned int size;
+	int num_entries;
+	int max_entries;
+	zipbuf_entry* entries;
+} zipbuf;
+
+zipbuf* zipbuf_open(const unsigned char* data, unsigned int size);
+void zipbuf_free(zipbuf* zb);
+int zipbuf_name_locate(zipbuf* zb, const char* name);
+int zipbuf_read(zipbuf* zb, int index, unsigned char** data, unsigned int* size);
+int zipbuf_replace(zipbuf* zb, int index, const unsigned char* data, unsigned int size);
+int zipbuf_add(zipbuf* zb, const char* name, const unsigned char* data, unsigned int size);
+void zipbuf_delete(zipbuf* zb, int index);
+int zipbuf_write(zipbuf* zb, unsigned char** data, unsigned int* size);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif